@@ -0,0 +1,66 @@
+#include <BinaryFrame.h>
+
+uint16_t binlogCrc(const uint8_t *data, size_t length) {
+    uint16_t crc = 0xFFFF;
+
+    // Bitwise, a table would cost 512 bytes of flash for a few bytes per frame
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+size_t binlogEncode(const uint8_t *data, size_t length, uint8_t *encoded) {
+    size_t code = 0;
+    size_t out = 1;
+    uint8_t run = 1;
+
+    // Each block starts with the distance to the next 0x00, which it replaces
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == 0) {
+            encoded[code] = run;
+            code = out++;
+            run = 1;
+        } else {
+            encoded[out++] = data[i];
+            run++;
+            if (run == 0xFF) {
+                encoded[code] = run;
+                code = out++;
+                run = 1;
+            }
+        }
+    }
+    encoded[code] = run;
+    return out;
+}
+
+size_t binlogDecode(const uint8_t *encoded, size_t length, uint8_t *data, size_t maxLength) {
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < length) {
+        uint8_t run = encoded[in++];
+        if ((run == 0) || (in + run - 1 > length)) {
+            return 0;
+        }
+        for (uint8_t i = 1; i < run; i++) {
+            if ((encoded[in] == 0) || (out >= maxLength)) {
+                return 0;
+            }
+            data[out++] = encoded[in++];
+        }
+
+        // A block shorter than 254 bytes stood for a 0x00, except at the end
+        if ((run < 0xFF) && (in < length)) {
+            if (out >= maxLength) {
+                return 0;
+            }
+            data[out++] = 0;
+        }
+    }
+    return out;
+}
@@ -0,0 +1,118 @@
+/**
+ *   Binary Frame
+ *   Framing and record layout of the binary log. Free of any Arduino
+ *   dependency, so the host side decoder shares it with the device.
+ *
+ *   A frame on the wire is the COBS encoded packet enclosed by 0x00
+ *   delimiters. The packet is a binlogHeader, the payload of the record type
+ *   and a CRC-16/CCITT-FALSE over header and payload, all little endian.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BINLOG_MAX_PAYLOAD      48      // Largest payload of a record in bytes
+#define BINLOG_MODBUS_DATA      32      // Bytes of a Modbus message which are logged, the rest is cut
+#define BINLOG_MAX_PACKET       (sizeof(binlogHeader) + BINLOG_MAX_PAYLOAD + 2)
+#define BINLOG_MAX_FRAME        (BINLOG_MAX_PACKET + BINLOG_MAX_PACKET / 254 + 3)
+
+/**************************************************************************/
+/*!
+  @brief  Types of records.
+*/
+/**************************************************************************/
+typedef enum {
+  BINLOG_STATE = 1,         //!< State machine of the StrokeEngine changed
+  BINLOG_MOTION = 2,        //!< Move commanded by the StrokeEngine
+  BINLOG_CLIPPING = 3,      //!< Move which had to be replanned to stay within the limits
+  BINLOG_MODBUS = 4,        //!< Response or error of the servo over Modbus
+  BINLOG_ESPNOW = 5,        //!< Message from or to the M5 remote
+  BINLOG_TEXT = 6           //!< Reply to a T-Code command
+} binlogType;
+
+/**************************************************************************/
+/*!
+  @brief  Header of every record. The timestamp wraps after 71 minutes, the
+  decoder unwraps it. Gaps in the sequence tell about lost frames.
+*/
+/**************************************************************************/
+typedef struct __attribute__((packed)) {
+  uint8_t type;               /*> binlogType */
+  uint8_t sequence;           /*> Incremented with every frame */
+  uint32_t timestamp;         /*> Lower 32 bit of esp_timer_get_time() in µs */
+} binlogHeader;
+
+typedef struct __attribute__((packed)) {
+  uint8_t state;              /*> New ServoState */
+} binlogState;
+
+typedef struct __attribute__((packed)) {
+  float target;               /*> Target position in mm */
+  float speed;                /*> Maximum speed in mm/s */
+  float acceleration;         /*> Acceleration in mm/s² */
+  float deficit;              /*> Time the move takes longer than requested in s */
+  int32_t index;              /*> Stroke index of the pattern, -1 for manual moves */
+  int8_t pattern;             /*> Index of the pattern, -1 for manual moves */
+  uint8_t clipping;           /*> 1 if the move had to be replanned */
+} binlogMotion;
+
+typedef struct __attribute__((packed)) {
+  int32_t index;              /*> Stroke index of the pattern */
+  int8_t pattern;             /*> Index of the pattern */
+  float speed;                /*> Speed after replanning in mm/s */
+  float acceleration;         /*> Acceleration after replanning in mm/s² */
+  float deficit;              /*> Time the move takes longer than requested in s */
+} binlogClipping;
+
+typedef struct __attribute__((packed)) {
+  uint32_t token;             /*> Token of the request */
+  uint8_t server;             /*> Server ID */
+  uint8_t function;           /*> Function code */
+  uint8_t error;              /*> Error code, 0 for a response */
+  uint8_t length;             /*> Length of the message, data holds at most BINLOG_MODBUS_DATA bytes */
+  uint8_t data[BINLOG_MODBUS_DATA]; /*> Raw message, only the logged bytes are sent */
+} binlogModbus;
+
+typedef struct __attribute__((packed)) {
+  uint8_t direction;          /*> 0 received, 1 sent */
+  uint8_t status;             /*> Result of sending, 0 for success */
+  int32_t command;            /*> Command of the message */
+  float value;                /*> Value of the message */
+  int32_t target;             /*> Receiver ID of the message */
+} binlogEspNow;
+
+typedef struct __attribute__((packed)) {
+  char text[BINLOG_MAX_PAYLOAD]; /*> Text without terminator, only the characters are sent */
+} binlogText;
+
+/*!
+  @brief CRC-16/CCITT-FALSE
+  @param data bytes to protect
+  @param length number of bytes
+  @return CRC
+*/
+uint16_t binlogCrc(const uint8_t *data, size_t length);
+
+/*!
+  @brief Consistent overhead byte stuffing. The encoded data holds no 0x00.
+  @param data bytes to encode
+  @param length number of bytes, at most BINLOG_MAX_PACKET
+  @param encoded receives length + length / 254 + 1 bytes, without delimiter
+  @return number of encoded bytes
+*/
+size_t binlogEncode(const uint8_t *data, size_t length, uint8_t *encoded);
+
+/*!
+  @brief Reverse of binlogEncode().
+  @param encoded bytes between two delimiters
+  @param length number of bytes
+  @param data receives the decoded bytes
+  @param maxLength size of data
+  @return number of decoded bytes, 0 if the frame is malformed
+*/
+size_t binlogDecode(const uint8_t *encoded, size_t length, uint8_t *data, size_t maxLength);
@@ -0,0 +1,109 @@
+#include <BinaryLog.h>
+
+void BinaryLog::begin(HardwareSerial *serial) {
+    if (_mutex == NULL) {
+        _mutex = xSemaphoreCreateMutex();
+    }
+    _serial = serial;
+}
+
+bool BinaryLog::write(uint8_t type, int64_t timestamp, const void *payload, size_t length) {
+    if ((_serial == NULL) || (length > BINLOG_MAX_PAYLOAD)) {
+        _dropped = _dropped + 1;
+        return false;
+    }
+
+    // Never hold up a time critical caller for long
+    if (xSemaphoreTake(_mutex, BINLOG_LOCK_TICKS) != pdTRUE) {
+        _dropped = _dropped + 1;
+        return false;
+    }
+
+    binlogHeader header;
+    header.type = type;
+    header.sequence = _sequence++;
+    header.timestamp = (uint32_t)timestamp;
+    memcpy(_packet, &header, sizeof(header));
+    memcpy(&_packet[sizeof(header)], payload, length);
+    size_t packetLength = sizeof(header) + length;
+
+    uint16_t crc = binlogCrc(_packet, packetLength);
+    _packet[packetLength++] = crc & 0xFF;
+    _packet[packetLength++] = crc >> 8;
+
+    // Delimiters on both sides keep text printed in between out of the frame
+    _frame[0] = 0;
+    size_t frameLength = 1 + binlogEncode(_packet, packetLength, &_frame[1]);
+    _frame[frameLength++] = 0;
+    _serial->write(_frame, frameLength);
+    _frames = _frames + 1;
+
+    xSemaphoreGive(_mutex);
+    return true;
+}
+
+bool BinaryLog::logState(uint8_t state) {
+    binlogState record;
+    record.state = state;
+    return write(BINLOG_STATE, esp_timer_get_time(), &record, sizeof(record));
+}
+
+bool BinaryLog::logMotion(int64_t timestamp, float target, float speed, float acceleration, float deficit,
+    int32_t index, int8_t pattern, bool clipping) {
+    binlogMotion record;
+    record.target = target;
+    record.speed = speed;
+    record.acceleration = acceleration;
+    record.deficit = deficit;
+    record.index = index;
+    record.pattern = pattern;
+    record.clipping = clipping ? 1 : 0;
+    return write(BINLOG_MOTION, timestamp, &record, sizeof(record));
+}
+
+bool BinaryLog::logClipping(int64_t timestamp, float speed, float acceleration, float deficit,
+    int32_t index, int8_t pattern) {
+    binlogClipping record;
+    record.index = index;
+    record.pattern = pattern;
+    record.speed = speed;
+    record.acceleration = acceleration;
+    record.deficit = deficit;
+    return write(BINLOG_CLIPPING, timestamp, &record, sizeof(record));
+}
+
+bool BinaryLog::logModbus(uint32_t token, uint8_t server, uint8_t function, uint8_t error,
+    const uint8_t *data, size_t length) {
+    binlogModbus record;
+    size_t logged = (data != NULL) ? min(length, (size_t)BINLOG_MODBUS_DATA) : 0;
+    record.token = token;
+    record.server = server;
+    record.function = function;
+    record.error = error;
+    record.length = min(length, (size_t)0xFF);
+    if (logged > 0) {
+        memcpy(record.data, data, logged);
+    }
+
+    // Only the bytes of the message go over the wire
+    return write(BINLOG_MODBUS, esp_timer_get_time(), &record, sizeof(record) - BINLOG_MODBUS_DATA + logged);
+}
+
+bool BinaryLog::logEspNow(uint8_t direction, uint8_t status, int32_t command, float value, int32_t target) {
+    binlogEspNow record;
+    record.direction = direction;
+    record.status = status;
+    record.command = command;
+    record.value = value;
+    record.target = target;
+    return write(BINLOG_ESPNOW, esp_timer_get_time(), &record, sizeof(record));
+}
+
+bool BinaryLog::logText(const char *text) {
+    binlogText record;
+    size_t length = strnlen(text, BINLOG_MAX_PAYLOAD);
+    memcpy(record.text, text, length);
+
+    // Only the characters go over the wire
+    return write(BINLOG_TEXT, esp_timer_get_time(), &record, length);
+}
@@ -0,0 +1,99 @@
+/**
+ *   Binary Log
+ *   Writes typed records as COBS framed packets with CRC to a serial port.
+ *   Records are copied as binary structs, nothing is formatted into text on
+ *   the device. tools/BinaryLogDecoder turns a capture into CSV.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <BinaryFrame.h>
+
+#define BINLOG_LOCK_TICKS       1       // Ticks a writer waits for another one to finish, then the record is dropped
+
+/**************************************************************************/
+/*!
+  @class BinaryLog
+  @brief  Encoder of the binary log. May be called from any task, but not
+          from an ISR. Writers are serialized by a mutex, so a frame is never
+          interleaved with another. Text printed to the same port in between
+          frames is discarded by the decoder as it fails the CRC.
+*/
+/**************************************************************************/
+class BinaryLog {
+
+    public:
+        /*!
+          @brief Start logging to a serial port. Nothing is written before.
+          @param serial port to write the frames to, e.g. &Serial
+        */
+        void begin(HardwareSerial *serial);
+
+        /*!
+          @brief Write a record of any type.
+          @param type binlogType of the record
+          @param timestamp time of the event in µs of esp_timer_get_time()
+          @param payload record struct of the type
+          @param length size of the payload, at most BINLOG_MAX_PAYLOAD
+          @return false if the record was dropped
+        */
+        bool write(uint8_t type, int64_t timestamp, const void *payload, size_t length);
+
+        //! Log a new state of the StrokeEngine
+        bool logState(uint8_t state);
+
+        //! Log a move, positions in mm and time in s
+        bool logMotion(int64_t timestamp, float target, float speed, float acceleration, float deficit,
+            int32_t index, int8_t pattern, bool clipping);
+
+        //! Log a move which had to be replanned, positions in mm and time in s
+        bool logClipping(int64_t timestamp, float speed, float acceleration, float deficit,
+            int32_t index, int8_t pattern);
+
+        /*!
+          @brief Log a Modbus response or error.
+          @param token token of the request
+          @param server server ID
+          @param function function code
+          @param error error code, 0 for a response
+          @param data raw message, NULL for an error
+          @param length length of the message, only BINLOG_MODBUS_DATA bytes are logged
+        */
+        bool logModbus(uint32_t token, uint8_t server, uint8_t function, uint8_t error,
+            const uint8_t *data, size_t length);
+
+        /*!
+          @brief Log an ESP-NOW message.
+          @param direction 0 received, 1 sent
+          @param status result of sending, 0 for success
+          @param command command of the message
+          @param value value of the message
+          @param target receiver ID of the message
+        */
+        bool logEspNow(uint8_t direction, uint8_t status, int32_t command, float value, int32_t target);
+
+        /*!
+          @brief Log a line of text, e.g. the reply to a T-Code command.
+          @param text string, only the first BINLOG_MAX_PAYLOAD characters are logged
+        */
+        bool logText(const char *text);
+
+        //! Number of frames written
+        unsigned long getFrames() { return _frames; }
+
+        //! Number of records dropped because logging wasn't started, the record was too large or the port was busy
+        unsigned long getDropped() { return _dropped; }
+
+    protected:
+        HardwareSerial *_serial = NULL;
+        SemaphoreHandle_t _mutex = NULL;
+        uint8_t _sequence = 0;
+        uint8_t _packet[BINLOG_MAX_PACKET];
+        uint8_t _frame[BINLOG_MAX_FRAME];
+        volatile unsigned long _frames = 0;
+        volatile unsigned long _dropped = 0;
+};
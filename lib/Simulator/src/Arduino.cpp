@@ -0,0 +1,242 @@
+#include <Arduino.h>
+#include <Simulator.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define SIMULATOR_PINS  64
+
+HardwareSerial Serial;
+
+static uint8_t _pinState[SIMULATOR_PINS];
+
+unsigned long millis() {
+    return (unsigned long)(esp_timer_get_time() / 1000);
+}
+
+unsigned long micros() {
+    return (unsigned long)esp_timer_get_time();
+}
+
+void delay(uint32_t ms) {
+    vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+void delayMicroseconds(uint32_t us) {
+    // Busy waiting on the ESP32 as well
+    Simulator.spend(us);
+}
+
+void yield() {
+    vTaskDelay(0);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if ((pin < SIMULATOR_PINS) && (mode == INPUT_PULLUP)) {
+        _pinState[pin] = HIGH;
+    }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    if (pin < SIMULATOR_PINS) {
+        _pinState[pin] = value;
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    int value;
+    Simulator.charge();
+    if (Simulator.readPin(pin, &value) == true) {
+        return value;
+    }
+    return (pin < SIMULATOR_PINS) ? _pinState[pin] : LOW;
+}
+
+uint16_t analogRead(uint8_t pin) {
+    int value;
+    Simulator.charge();
+    if (Simulator.readAnalog(pin, &value) == true) {
+        return value;
+    }
+    return 0;
+}
+
+int8_t digitalPinToAnalogChannel(uint8_t pin) {
+    // ADC1 channels are 0 - 7, ADC2 channels 10 - 19 like on the ESP32
+    static const uint8_t pins[] = {36, 37, 38, 39, 32, 33, 34, 35, 0, 0, 4, 0, 2, 15, 13, 12, 14, 27, 25, 26};
+    for (int8_t channel = 0; channel < (int8_t)sizeof(pins); channel++) {
+        if ((pins[channel] == pin) && ((channel < 8) || (channel >= 10))) {
+            return channel;
+        }
+    }
+    return -1;
+}
+
+long map(long x, long inMin, long inMax, long outMin, long outMax) {
+    if (inMax == inMin) {
+        return outMin;
+    }
+    return (x - inMin) * (outMax - outMin) / (inMax - inMin) + outMin;
+}
+
+long random(long max) {
+    return (max > 0) ? rand() % max : 0;
+}
+
+long random(long min, long max) {
+    return (max > min) ? min + random(max - min) : min;
+}
+
+void randomSeed(unsigned long seed) {
+    srand(seed);
+}
+
+/**************************************************************************/
+/*
+  String
+*/
+/**************************************************************************/
+
+std::string String::_format(long value, unsigned char base) {
+    if (base == DEC) {
+        return std::to_string(value);
+    }
+    return ((value < 0) ? "-" : "") + _format((unsigned long)labs(value), base);
+}
+
+std::string String::_format(unsigned long value, unsigned char base) {
+    if (base == DEC) {
+        return std::to_string(value);
+    }
+    std::string digits;
+    do {
+        digits.insert(digits.begin(), "0123456789ABCDEF"[value % base]);
+        value /= base;
+    } while (value > 0);
+    return digits;
+}
+
+std::string String::_format(double value, unsigned char decimals) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    return buffer;
+}
+
+int String::indexOf(char c, unsigned int from) const {
+    size_t index = _string.find(c, from);
+    return (index == std::string::npos) ? -1 : (int)index;
+}
+
+int String::indexOf(const String &string, unsigned int from) const {
+    size_t index = _string.find(string._string, from);
+    return (index == std::string::npos) ? -1 : (int)index;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+    if (from > to) {
+        std::swap(from, to);
+    }
+    if (from >= _string.length()) {
+        return String();
+    }
+    return String(_string.substr(from, to - from));
+}
+
+void String::trim() {
+    size_t first = _string.find_first_not_of(" \t\r\n");
+    size_t last = _string.find_last_not_of(" \t\r\n");
+    _string = (first == std::string::npos) ? "" : _string.substr(first, last - first + 1);
+}
+
+void String::toUpperCase() {
+    for (char &c : _string) {
+        c = toupper(c);
+    }
+}
+
+void String::toLowerCase() {
+    for (char &c : _string) {
+        c = tolower(c);
+    }
+}
+
+/**************************************************************************/
+/*
+  Serial
+*/
+/**************************************************************************/
+
+int HardwareSerial::available() {
+    if (_peeked >= 0) {
+        return 1;
+    }
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    if ((poll(&input, 1, 0) > 0) && (input.revents & POLLIN)) {
+        uint8_t c;
+        if (::read(STDIN_FILENO, &c, 1) == 1) {
+            _peeked = c;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int HardwareSerial::read() {
+    if (available() == 0) {
+        return -1;
+    }
+    int c = _peeked;
+    _peeked = -1;
+    return c;
+}
+
+int HardwareSerial::peek() {
+    return (available() > 0) ? _peeked : -1;
+}
+
+void HardwareSerial::flush() {
+    if (_output != NULL) {
+        fflush(_output);
+    }
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    return (_output != NULL) ? fwrite(&c, 1, 1, _output) : 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+    return (_output != NULL) ? fwrite(buffer, 1, size, _output) : size;
+}
+
+size_t HardwareSerial::printf(const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = (_output != NULL) ? vfprintf(_output, format, arguments) : vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    return (length > 0) ? length : 0;
+}
+
+size_t HardwareSerial::_print(const char *string) {
+    if (_output == NULL) {
+        return strlen(string);
+    }
+    return fputs(string, _output) >= 0 ? strlen(string) : 0;
+}
+
+/**************************************************************************/
+/*
+  Entry point: setup() and loop() run in the loop task like on the ESP32
+*/
+/**************************************************************************/
+
+int main(int argc, char **argv) {
+    Simulator.argc = argc;
+    Simulator.argv = argv;
+
+    setup();
+    while (true) {
+        loop();
+        yield();
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+/**
+ *   Arduino shim of the Simulator
+ *   The parts of the Arduino core for the ESP32 the StrokeEngine depends on:
+ *   time, pins, String and Serial. Time runs on the virtual clock of the
+ *   Simulator, Serial prints to stdout.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <string>
+#include <algorithm>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+using std::min;
+using std::max;
+using std::abs;
+
+#define HIGH            0x1
+#define LOW             0x0
+#define INPUT           0x01
+#define OUTPUT          0x02
+#define INPUT_PULLUP    0x05
+#define INPUT_PULLDOWN  0x09
+
+#define PI              3.1415926535897932384626433832795
+#define DEC             10
+#define HEX             16
+
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+#define PROGMEM
+#define F(string)       (string)
+
+#define constrain(amt, low, high)   ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define radians(deg)                ((deg) * PI / 180.0)
+#define degrees(rad)                ((rad) * 180.0 / PI)
+#define sq(x)                       ((x) * (x))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+int8_t digitalPinToAnalogChannel(uint8_t pin);
+
+long map(long x, long inMin, long inMax, long outMin, long outMax);
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+/**************************************************************************/
+/*!
+  @brief  Arduino String on top of std::string.
+*/
+/**************************************************************************/
+class String {
+    public:
+        String(const char *string = "") : _string((string != NULL) ? string : "") {}
+        String(const std::string &string) : _string(string) {}
+        String(char c) : _string(1, c) {}
+        String(int value, unsigned char base = DEC) : _string(_format((long)value, base)) {}
+        String(unsigned int value, unsigned char base = DEC) : _string(_format((unsigned long)value, base)) {}
+        String(long value, unsigned char base = DEC) : _string(_format(value, base)) {}
+        String(unsigned long value, unsigned char base = DEC) : _string(_format(value, base)) {}
+        String(long long value) : _string(std::to_string(value)) {}
+        String(unsigned long long value) : _string(std::to_string(value)) {}
+        String(float value, unsigned char decimals = 2) : _string(_format((double)value, decimals)) {}
+        String(double value, unsigned char decimals = 2) : _string(_format(value, decimals)) {}
+
+        const char *c_str() const { return _string.c_str(); }
+        unsigned int length() const { return _string.length(); }
+        char charAt(unsigned int index) const { return (index < _string.length()) ? _string[index] : 0; }
+        char operator[](unsigned int index) const { return charAt(index); }
+        int indexOf(char c, unsigned int from = 0) const;
+        int indexOf(const String &string, unsigned int from = 0) const;
+        String substring(unsigned int from) const { return substring(from, length()); }
+        String substring(unsigned int from, unsigned int to) const;
+        long toInt() const { return atol(_string.c_str()); }
+        float toFloat() const { return atof(_string.c_str()); }
+        void trim();
+        void toUpperCase();
+        void toLowerCase();
+        bool startsWith(const String &prefix) const { return _string.compare(0, prefix._string.length(), prefix._string) == 0; }
+
+        String &operator+=(const String &string) { _string += string._string; return *this; }
+        String &operator+=(const char *string) { _string += string; return *this; }
+        String &operator+=(char c) { _string += c; return *this; }
+        bool operator==(const String &string) const { return _string == string._string; }
+        bool operator!=(const String &string) const { return _string != string._string; }
+        bool operator<(const String &string) const { return _string < string._string; }
+
+        friend String operator+(const String &a, const String &b) { return String(a._string + b._string); }
+        friend String operator+(const String &a, const char *b) { return String(a._string + b); }
+        friend String operator+(const char *a, const String &b) { return String(a + b._string); }
+
+    protected:
+        std::string _string;
+        static std::string _format(long value, unsigned char base);
+        static std::string _format(unsigned long value, unsigned char base);
+        static std::string _format(double value, unsigned char decimals);
+};
+
+/**************************************************************************/
+/*!
+  @brief  Serial port printing to stdout with Unix line endings. Input is
+  read from stdin without blocking.
+*/
+/**************************************************************************/
+class HardwareSerial {
+    public:
+        void begin(unsigned long baud) {}
+        void end() {}
+        int available();
+        int read();
+        int peek();
+        void flush();
+        size_t write(uint8_t c);
+        size_t write(const uint8_t *buffer, size_t size);
+        size_t print(const String &string) { return _print(string.c_str()); }
+        size_t print(const char *string) { return _print(string); }
+        size_t print(char c) { return write((uint8_t)c); }
+        size_t print(int value, int base = DEC) { return print(String(value, base)); }
+        size_t print(unsigned int value, int base = DEC) { return print(String(value, base)); }
+        size_t print(long value, int base = DEC) { return print(String(value, base)); }
+        size_t print(unsigned long value, int base = DEC) { return print(String(value, base)); }
+        size_t print(double value, int decimals = 2) { return print(String(value, decimals)); }
+        size_t println() { return _print("\n"); }
+        template <typename T> size_t println(T value) { return print(value) + println(); }
+        template <typename T> size_t println(T value, int format) { return print(value, format) + println(); }
+        size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+        operator bool() { return true; }
+
+        // Simulator extension, not available on the real Serial
+
+        //! Redirect the output, e.g. to stderr. NULL discards it.
+        void setOutput(FILE *stream) { _output = stream; }
+
+    protected:
+        size_t _print(const char *string);
+        int _peeked = -1;
+        FILE *_output = stdout;
+};
+
+extern HardwareSerial Serial;
+
+// Provided by the application like on the ESP32
+void setup();
+void loop();
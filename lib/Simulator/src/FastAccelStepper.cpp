@@ -0,0 +1,316 @@
+#include <FastAccelStepper.h>
+#include <Simulator.h>
+#include <esp_timer.h>
+#include <math.h>
+
+#define TICKS_PER_US    (TICKS_PER_S / 1.0e6)
+#define RUN_DISTANCE    ((int64_t)1 << 40)   // Target of runForward() and runBackward() in steps
+
+FastAccelStepper::FastAccelStepper(uint8_t stepPin) {
+    _stepPin = stepPin;
+}
+
+void FastAccelStepper::setDirectionPin(uint8_t dirPin, bool dirHighCountsUp) {
+    _dirHighCountsUp = dirHighCountsUp;
+}
+
+void FastAccelStepper::setEnablePin(uint8_t enablePin, bool lowActiveEnablesStepper) {
+}
+
+void FastAccelStepper::setAutoEnable(bool autoEnable) {
+}
+
+bool FastAccelStepper::enableOutputs() {
+    _enabled = true;
+    return true;
+}
+
+bool FastAccelStepper::disableOutputs() {
+    _enabled = false;
+    return true;
+}
+
+int32_t FastAccelStepper::getCurrentPosition() {
+    _update(_now());
+    return _position;
+}
+
+void FastAccelStepper::setCurrentPosition(int32_t position) {
+    _update(_now());
+    _position = position;
+}
+
+int32_t FastAccelStepper::getPositionAfterCommandsCompleted() {
+    _update(_now());
+    if (_rampActive == true) {
+        return (int32_t)_rampTarget;
+    }
+    int32_t position = _position;
+    for (unsigned int i = 0; i < _queueCount; i++) {
+        const queueEntry *entry = &_queue[(_queueHead + i) % QUEUE_LEN];
+        int steps = entry->steps - ((i == 0) ? _entryDone : 0);
+        position += entry->countUp ? steps : -steps;
+    }
+    return position;
+}
+
+int8_t FastAccelStepper::setSpeedInHz(uint32_t speed) {
+    if (speed == 0) {
+        return -1;
+    }
+    _setSpeed = speed;
+    return 0;
+}
+
+int8_t FastAccelStepper::setSpeedInUs(uint32_t micros) {
+    if (micros == 0) {
+        return -1;
+    }
+    _setSpeed = 1.0e6 / micros;
+    return 0;
+}
+
+int32_t FastAccelStepper::getCurrentSpeedInMilliHz() {
+    _update(_now());
+    if (_rampActive == true) {
+        return (int32_t)(_direction * _speed * 1000.0);
+    }
+    if ((_queueCount > 0) && (_queue[_queueHead].steps > 0)) {
+        const queueEntry *entry = &_queue[_queueHead];
+        int32_t speed = (int32_t)(TICKS_PER_S * 1000.0 / entry->ticks);
+        return entry->countUp ? speed : -speed;
+    }
+    return 0;
+}
+
+int8_t FastAccelStepper::setAcceleration(int32_t acceleration) {
+    if (acceleration <= 0) {
+        return -1;
+    }
+    _setAcceleration = acceleration;
+    return 0;
+}
+
+void FastAccelStepper::applySpeedAcceleration() {
+    _update(_now());
+    _maxSpeed = _setSpeed;
+    _acceleration = _setAcceleration;
+}
+
+int8_t FastAccelStepper::moveTo(int32_t position, bool blocking) {
+    return _moveTo(position, blocking);
+}
+
+int8_t FastAccelStepper::move(int32_t steps, bool blocking) {
+    _update(_now());
+    // Relative to the target of a running move like the real ramp generator
+    return _moveTo((_rampActive ? _rampTarget : _position) + steps, blocking);
+}
+
+int8_t FastAccelStepper::runForward() {
+    _update(_now());
+    return _moveTo(_position + RUN_DISTANCE, false);
+}
+
+int8_t FastAccelStepper::runBackward() {
+    _update(_now());
+    return _moveTo(_position - RUN_DISTANCE, false);
+}
+
+void FastAccelStepper::stopMove() {
+    _update(_now());
+    if (_rampActive == true) {
+        // Decelerate with the current acceleration
+        int64_t steps = (int64_t)ceil(_stoppingSteps());
+        _rampTarget = _position + _direction * ((steps > 0) ? steps : 1);
+    }
+}
+
+void FastAccelStepper::forceStop() {
+    int64_t now = _now();
+    _update(now);
+    _rampActive = false;
+    _speed = 0.0;
+    _queueCount = 0;
+    _entryDone = 0;
+    _queueEnd = now;
+}
+
+void FastAccelStepper::forceStopAndNewPosition(int32_t position) {
+    forceStop();
+    _position = position;
+}
+
+bool FastAccelStepper::isRunning() {
+    _update(_now());
+    return (_rampActive == true) || (_queueCount > 0);
+}
+
+bool FastAccelStepper::isRampGeneratorActive() {
+    _update(_now());
+    return _rampActive;
+}
+
+int8_t FastAccelStepper::addQueueEntry(const struct stepper_command_s *command, bool start) {
+    int64_t now = _now();
+    _update(now);
+
+    if (_rampActive == true) {
+        return AQE_DEVICE_NOT_READY;
+    }
+    if ((command->steps > 0) && (command->ticks < MIN_DELTA_TICKS)) {
+        return AQE_ERROR_TICKS_TOO_LOW;
+    }
+    if (_queueCount >= QUEUE_LEN) {
+        _queueOverflows++;
+        return AQE_QUEUE_FULL;
+    }
+
+    // Commands execute back to back, an empty queue starts right away
+    queueEntry *entry = &_queue[(_queueHead + _queueCount) % QUEUE_LEN];
+    entry->ticks = command->ticks;
+    entry->steps = command->steps;
+    entry->countUp = command->count_up;
+    entry->start = (_queueCount > 0) ? _queueEnd : fmax(_queueEnd, (double)now);
+    _queueEnd = entry->start + ((command->steps > 0) ? command->steps : 1) * command->ticks / TICKS_PER_US;
+    _queueCount++;
+
+    queueRecord *record = &_history[(_historyHead + _historyCount) % SIMULATOR_QUEUE_HISTORY];
+    record->added = now;
+    record->start = (int64_t)entry->start;
+    if (_historyCount < SIMULATOR_QUEUE_HISTORY) {
+        _historyCount++;
+    } else {
+        _historyHead = (_historyHead + 1) % SIMULATOR_QUEUE_HISTORY;
+    }
+    return AQE_OK;
+}
+
+bool FastAccelStepper::isQueueEmpty() {
+    _update(_now());
+    return _queueCount == 0;
+}
+
+bool FastAccelStepper::isQueueFull() {
+    _update(_now());
+    return _queueCount >= QUEUE_LEN;
+}
+
+int64_t FastAccelStepper::getQueueEndMicros() {
+    int64_t now = _now();
+    _update(now);
+    return (_queueCount > 0) ? (int64_t)_queueEnd : now;
+}
+
+int64_t FastAccelStepper::getQueueStartAfter(int64_t micros) {
+    for (unsigned int i = 0; i < _historyCount; i++) {
+        const queueRecord *record = &_history[(_historyHead + i) % SIMULATOR_QUEUE_HISTORY];
+        if (record->added >= micros) {
+            return record->start;
+        }
+    }
+    return -1;
+}
+
+int8_t FastAccelStepper::_moveTo(int64_t position, bool blocking) {
+    int64_t now = _now();
+    _update(now);
+
+    if (_setSpeed <= 0.0) {
+        return MOVE_ERR_SPEED_IS_UNDEFINED;
+    }
+    if (_setAcceleration <= 0.0) {
+        return MOVE_ERR_ACCELERATION_IS_UNDEFINED;
+    }
+
+    _maxSpeed = _setSpeed;
+    _acceleration = _setAcceleration;
+    _rampTarget = position;
+
+    // Start from standstill, a running ramp follows the new target
+    if ((_rampActive == false) && (position != _position)) {
+        _rampActive = true;
+        _direction = (position > _position) ? 1 : -1;
+        _speed = sqrt(2.0 * _acceleration);
+        _nextStep = now + sqrt(2.0 / _acceleration) * 1.0e6;
+    }
+
+    while ((blocking == true) && (isRunning() == true)) {
+        Simulator.spend(100);
+    }
+    return MOVE_OK;
+}
+
+int64_t FastAccelStepper::_now() {
+    // Reading the clock costs CPU time, tasks waiting in a busy loop advance the clock
+    return esp_timer_get_time();
+}
+
+void FastAccelStepper::_update(int64_t now) {
+    // Execute the step queue
+    while (_queueCount > 0) {
+        const queueEntry *entry = &_queue[_queueHead];
+        double period = entry->ticks / TICKS_PER_US;
+        while ((_entryDone < entry->steps) && (entry->start + _entryDone * period <= now)) {
+            _step(entry->countUp ? 1 : -1, (int64_t)(entry->start + _entryDone * period));
+            _entryDone++;
+        }
+        if (entry->start + ((entry->steps > 0) ? entry->steps : 1) * period > now) {
+            break;
+        }
+        _queueHead = (_queueHead + 1) % QUEUE_LEN;
+        _queueCount--;
+        _entryDone = 0;
+    }
+
+    // Run the ramp generator
+    while ((_rampActive == true) && (_nextStep <= now)) {
+        _rampStep();
+    }
+}
+
+void FastAccelStepper::_step(int direction, int64_t micros) {
+    _position += direction;
+    _stepCount++;
+    Simulator.moved(this, _dirHighCountsUp ? direction : -direction, micros);
+}
+
+void FastAccelStepper::_rampStep() {
+    _step(_direction, (int64_t)_nextStep);
+
+    // Speed for the next step: accelerate, coast or brake in time to stop at the target
+    double v = _speed;
+    double remaining = (double)(_rampTarget - _position) * _direction;
+    double v2;
+    if ((remaining <= 0.0) || (remaining <= _stoppingSteps()) || (v > _maxSpeed)) {
+        v2 = v * v - 2.0 * _acceleration;
+    } else {
+        v2 = fmin(v * v + 2.0 * _acceleration, _maxSpeed * _maxSpeed);
+    }
+
+    // Came to a halt: done or start over towards the target
+    if (v2 <= 0.0) {
+        if (_position == _rampTarget) {
+            _rampActive = false;
+            _speed = 0.0;
+            return;
+        }
+        _direction = (_rampTarget > _position) ? 1 : -1;
+        _speed = sqrt(2.0 * _acceleration);
+        _nextStep += sqrt(2.0 / _acceleration) * 1.0e6;
+        return;
+    }
+
+    double vNext = sqrt(v2);
+    _nextStep += 2.0 / (v + vNext) * 1.0e6;
+    _speed = vNext;
+}
+
+void FastAccelStepperEngine::init() {
+}
+
+FastAccelStepper *FastAccelStepperEngine::stepperConnectToPin(uint8_t stepPin) {
+    FastAccelStepper *stepper = new FastAccelStepper(stepPin);
+    Simulator.registerStepper(stepper, stepPin);
+    return stepper;
+}
@@ -0,0 +1,156 @@
+/**
+ *   FastAccelStepper shim of the Simulator
+ *   Mimics the API of FastAccelStepper 0.23 on the ESP32. Every step is
+ *   integrated on the virtual clock, both for the ramp generator (moveTo,
+ *   speed and acceleration) and for raw commands in the step queue.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define TICKS_PER_S             16000000L
+#define MIN_DELTA_TICKS         (TICKS_PER_S / 200000)
+#define MIN_CMD_TICKS           (TICKS_PER_S / 5000)
+#define QUEUE_LEN               32
+
+#define MOVE_OK                             0
+#define MOVE_ERR_NO_DIRECTION_PIN           -1
+#define MOVE_ERR_SPEED_IS_UNDEFINED         -2
+#define MOVE_ERR_ACCELERATION_IS_UNDEFINED  -3
+
+#define AQE_OK                              0
+#define AQE_QUEUE_FULL                      1
+#define AQE_DEVICE_NOT_READY                4
+#define AQE_ERROR_TICKS_TOO_LOW             -1
+
+#define SIMULATOR_QUEUE_HISTORY 64      // Number of step queue entries remembered for latency measurements
+
+struct stepper_command_s {
+    uint16_t ticks;
+    uint8_t steps;
+    bool count_up;
+};
+
+/**************************************************************************/
+/*!
+  @brief  Simulated stepper. State is brought up to the virtual clock lazily
+  on each call. The ramp generator accelerates and decelerates step by step
+  like the real one, commands in the step queue execute back to back.
+*/
+/**************************************************************************/
+class FastAccelStepper {
+    public:
+        FastAccelStepper(uint8_t stepPin);
+
+        void setDirectionPin(uint8_t dirPin, bool dirHighCountsUp = true);
+        void setEnablePin(uint8_t enablePin, bool lowActiveEnablesStepper = true);
+        void setAutoEnable(bool autoEnable);
+        bool enableOutputs();
+        bool disableOutputs();
+        uint8_t getStepPin() { return _stepPin; }
+
+        int32_t getCurrentPosition();
+        void setCurrentPosition(int32_t position);
+        int32_t getPositionAfterCommandsCompleted();
+
+        int8_t setSpeedInHz(uint32_t speed);
+        int8_t setSpeedInUs(uint32_t micros);
+        uint32_t getSpeedInMilliHz() { return (uint32_t)(_setSpeed * 1000.0); }
+        int32_t getCurrentSpeedInMilliHz();
+        int8_t setAcceleration(int32_t acceleration);
+        int32_t getAcceleration() { return (int32_t)_setAcceleration; }
+        void applySpeedAcceleration();
+
+        int8_t moveTo(int32_t position, bool blocking = false);
+        int8_t move(int32_t steps, bool blocking = false);
+        int8_t runForward();
+        int8_t runBackward();
+        void stopMove();
+        void forceStop();
+        void forceStopAndNewPosition(int32_t position);
+        bool isRunning();
+        bool isRampGeneratorActive();
+
+        int8_t addQueueEntry(const struct stepper_command_s *command, bool start = true);
+        bool isQueueEmpty();
+        bool isQueueFull();
+        bool isQueueRunning() { return !isQueueEmpty(); }
+
+        // Simulator extensions, not available on the real stepper
+
+        //! Virtual time in µs when all commands in the step queue are executed
+        int64_t getQueueEndMicros();
+
+        /*!
+          @brief Find out when a command of the step queue starts to execute.
+          @param micros virtual time in [µs]
+          @return start time of the first command added at or after micros.
+                        -1 if there is none.
+        */
+        int64_t getQueueStartAfter(int64_t micros);
+
+        //! Number of commands rejected because the step queue was full
+        uint32_t getQueueOverflows() { return _queueOverflows; }
+
+        //! Number of steps executed, regardless of direction
+        uint32_t getStepCount() { return _stepCount; }
+
+        //! True while the outputs are enabled
+        bool isEnabled() { return _enabled; }
+
+    protected:
+        typedef struct {
+          uint16_t ticks;
+          uint8_t steps;
+          bool countUp;
+          double start;         // Virtual time of the first step in µs
+        } queueEntry;
+        typedef struct {
+          int64_t added;
+          int64_t start;
+        } queueRecord;
+        uint8_t _stepPin;
+        bool _enabled = false;
+        bool _dirHighCountsUp = true;
+        int32_t _position = 0;
+        uint32_t _stepCount = 0;
+        double _setSpeed = 0.0;
+        double _setAcceleration = 0.0;
+        double _maxSpeed = 0.0;
+        double _acceleration = 0.0;
+        bool _rampActive = false;
+        int64_t _rampTarget = 0;
+        int _direction = 1;
+        double _speed = 0.0;            // Speed at the next pending step in steps/s
+        double _nextStep = 0.0;         // Virtual time of the next step in µs
+        queueEntry _queue[QUEUE_LEN];
+        unsigned int _queueHead = 0;
+        unsigned int _queueCount = 0;
+        unsigned int _entryDone = 0;    // Steps of the oldest entry already executed
+        double _queueEnd = 0.0;
+        uint32_t _queueOverflows = 0;
+        queueRecord _history[SIMULATOR_QUEUE_HISTORY];
+        unsigned int _historyHead = 0;
+        unsigned int _historyCount = 0;
+        int64_t _now();
+        void _update(int64_t now);
+        void _step(int direction, int64_t micros);
+        void _rampStep();
+        int8_t _moveTo(int64_t position, bool blocking);
+        double _stoppingSteps() { return (_acceleration > 0.0) ? _speed * _speed / (2.0 * _acceleration) : 0.0; }
+};
+
+/**************************************************************************/
+/*!
+  @brief  Simulated stepper engine handing out steppers.
+*/
+/**************************************************************************/
+class FastAccelStepperEngine {
+    public:
+        void init();
+        FastAccelStepper *stepperConnectToPin(uint8_t stepPin);
+};
@@ -0,0 +1,118 @@
+#include <Preferences.h>
+#include <map>
+#include <pthread.h>
+#include <string.h>
+
+// All namespaces share one store, a key is prefixed with its namespace
+static std::map<std::string, std::string> storage;
+static pthread_mutex_t storageLock = PTHREAD_MUTEX_INITIALIZER;
+
+bool Preferences::begin(const char *name, bool readOnly) {
+    // NVS limits namespaces and keys to 15 characters
+    if ((name == NULL) || (strlen(name) > 15)) {
+        return false;
+    }
+    _namespace = std::string(name) + "/";
+    _readOnly = readOnly;
+    _open = true;
+    return true;
+}
+
+void Preferences::end() {
+    _open = false;
+}
+
+bool Preferences::clear() {
+    if ((_open == false) || (_readOnly == true)) {
+        return false;
+    }
+    pthread_mutex_lock(&storageLock);
+    auto entry = storage.lower_bound(_namespace);
+    while ((entry != storage.end()) && (entry->first.compare(0, _namespace.length(), _namespace) == 0)) {
+        entry = storage.erase(entry);
+    }
+    pthread_mutex_unlock(&storageLock);
+    return true;
+}
+
+bool Preferences::remove(const char *key) {
+    if ((_open == false) || (_readOnly == true)) {
+        return false;
+    }
+    pthread_mutex_lock(&storageLock);
+    bool removed = (storage.erase(_namespace + key) > 0);
+    pthread_mutex_unlock(&storageLock);
+    return removed;
+}
+
+size_t Preferences::putFloat(const char *key, float value) {
+    return _put(key, &value, sizeof(value));
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value) {
+    return _put(key, &value, sizeof(value));
+}
+
+float Preferences::getFloat(const char *key, float defaultValue) {
+    float value;
+    return _get(key, &value, sizeof(value)) ? value : defaultValue;
+}
+
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue) {
+    uint32_t value;
+    return _get(key, &value, sizeof(value)) ? value : defaultValue;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t length) {
+    return _put(key, value, length);
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+    if ((_open == false) || (key == NULL)) {
+        return 0;
+    }
+    pthread_mutex_lock(&storageLock);
+    auto entry = storage.find(_namespace + key);
+    size_t length = (entry != storage.end()) ? entry->second.length() : 0;
+    pthread_mutex_unlock(&storageLock);
+    return length;
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t maxLength) {
+    if ((_open == false) || (key == NULL)) {
+        return 0;
+    }
+    pthread_mutex_lock(&storageLock);
+    auto entry = storage.find(_namespace + key);
+    size_t length = 0;
+    if ((entry != storage.end()) && (entry->second.length() <= maxLength)) {
+        length = entry->second.length();
+        memcpy(buffer, entry->second.data(), length);
+    }
+    pthread_mutex_unlock(&storageLock);
+    return length;
+}
+
+size_t Preferences::_put(const char *key, const void *value, size_t length) {
+    if ((_open == false) || (_readOnly == true) || (key == NULL) || (strlen(key) > 15)) {
+        return 0;
+    }
+    pthread_mutex_lock(&storageLock);
+    storage[_namespace + key] = std::string((const char *)value, length);
+    pthread_mutex_unlock(&storageLock);
+    return length;
+}
+
+bool Preferences::_get(const char *key, void *value, size_t length) {
+    if ((_open == false) || (key == NULL)) {
+        return false;
+    }
+    pthread_mutex_lock(&storageLock);
+    auto entry = storage.find(_namespace + key);
+    bool found = (entry != storage.end()) && (entry->second.length() == length);
+    if (found == true) {
+        memcpy(value, entry->second.data(), length);
+    }
+    pthread_mutex_unlock(&storageLock);
+    return found;
+}
@@ -0,0 +1,38 @@
+/**
+ *   Preferences shim of the Simulator
+ *   Mimics the NVS backed Preferences of the Arduino core for the ESP32.
+ *   The key value pairs are kept in memory for the lifetime of the process,
+ *   so they survive a restart of whatever uses them, but not the program.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+class Preferences {
+    public:
+        bool begin(const char *name, bool readOnly = false);
+        void end();
+        bool clear();
+        bool remove(const char *key);
+
+        size_t putFloat(const char *key, float value);
+        size_t putUInt(const char *key, uint32_t value);
+        float getFloat(const char *key, float defaultValue = 0.0);
+        uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+        size_t putBytes(const char *key, const void *value, size_t length);
+        size_t getBytesLength(const char *key);
+        size_t getBytes(const char *key, void *buffer, size_t maxLength);
+
+    protected:
+        std::string _namespace;
+        bool _open = false;
+        bool _readOnly = false;
+        size_t _put(const char *key, const void *value, size_t length);
+        bool _get(const char *key, void *value, size_t length);
+};
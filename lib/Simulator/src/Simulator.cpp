@@ -0,0 +1,783 @@
+#include <Simulator.h>
+#include <FastAccelStepper.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <driver/i2s.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+SimulatorClass Simulator;
+
+/**************************************************************************/
+/*!
+  @brief  A simulated FreeRTOS task backed by a pthread.
+*/
+/**************************************************************************/
+typedef struct simTask {
+    const char *name;
+    UBaseType_t priority;
+    TaskFunction_t function;
+    void *parameter;
+    pthread_t thread;
+    bool ready;                 // Not blocked, may run
+    bool suspended;
+    bool deleted;
+    int64_t wakeMicros;         // Timeout of a blocking call, -1 waits forever
+    uint32_t notification;
+    bool waitNotification;
+    struct simSemaphore *waitSemaphore;
+    unsigned int holdMicros;    // CPU time a mutex stays taken before it is given back
+} simTask;
+
+typedef struct simSemaphore {
+    simTask *owner;
+} simSemaphore;
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    const char *name;
+    int64_t deadline;           // -1 if not armed
+    uint64_t period;            // 0 for one-shot timers
+};
+
+// State of the scheduler. Everything is guarded by _lock, which a task only
+// holds while it is inside the Simulator. It is recursive, as timer callbacks
+// call back into the Simulator from within the scheduler.
+static pthread_mutex_t _lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_cond_t _switch = PTHREAD_COND_INITIALIZER;
+static std::vector<simTask *> *_tasks = NULL;
+static std::vector<esp_timer *> *_timers = NULL;
+static simTask *_running = NULL;
+static thread_local simTask *_self = NULL;
+static int64_t _now = 0;
+static bool _inCallback = false;
+static float _timeScale = 0.0;
+static unsigned int _callCost = SIMULATOR_CALL_COST_US;
+static esp_reset_reason_t _resetReason = ESP_RST_POWERON;
+
+static void _enter() {
+    pthread_mutex_lock(&_lock);
+
+    // The first thread calling into the Simulator becomes the task running setup() and loop()
+    if (_self == NULL) {
+        if (_running != NULL) {
+            fprintf(stderr, "Simulator: called from a thread which is no task\n");
+            abort();
+        }
+        _tasks = new std::vector<simTask *>();
+        _timers = new std::vector<esp_timer *>();
+        _self = new simTask{"loopTask", 1, NULL, NULL, pthread_self(), true, false, false, -1, 0, false, NULL, 0};
+        _tasks->push_back(_self);
+        _running = _self;
+    }
+}
+
+static void _leave() {
+    pthread_mutex_unlock(&_lock);
+}
+
+static void _wakeDue() {
+    // Fire timers, callbacks may arm timers again
+    bool fired = true;
+    while (fired == true) {
+        fired = false;
+        for (esp_timer *timer : *_timers) {
+            if ((timer->deadline >= 0) && (timer->deadline <= _now)) {
+                timer->deadline = (timer->period > 0) ? timer->deadline + timer->period : -1;
+                _inCallback = true;
+                timer->callback(timer->arg);
+                _inCallback = false;
+                fired = true;
+                break;
+            }
+        }
+    }
+
+    // Time out blocking calls
+    for (simTask *task : *_tasks) {
+        if ((task->ready == false) && (task->wakeMicros >= 0) && (task->wakeMicros <= _now)) {
+            task->ready = true;
+        }
+    }
+}
+
+static simTask *_pick() {
+    // Highest priority wins, equal priorities take turns starting after the running task
+    simTask *best = NULL;
+    size_t count = _tasks->size();
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((*_tasks)[i] == _running) {
+            start = i + 1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        simTask *task = (*_tasks)[(start + i) % count];
+        if ((task->ready == true) && (task->suspended == false) && (task->deleted == false)) {
+            if ((best == NULL) || (task->priority > best->priority)) {
+                best = task;
+            }
+        }
+    }
+    return best;
+}
+
+static void _switchTo(simTask *next) {
+    simTask *self = _self;
+    _running = next;
+    pthread_cond_broadcast(&_switch);
+
+    // A deleted task leaves the CPU for good
+    while ((_running != self) && (self->deleted == false)) {
+        pthread_cond_wait(&_switch, &_lock);
+    }
+}
+
+static void _advance() {
+    int64_t next = INT64_MAX;
+    for (esp_timer *timer : *_timers) {
+        if ((timer->deadline >= 0) && (timer->deadline < next)) {
+            next = timer->deadline;
+        }
+    }
+    for (simTask *task : *_tasks) {
+        if ((task->ready == false) && (task->deleted == false) && (task->wakeMicros >= 0) && (task->wakeMicros < next)) {
+            next = task->wakeMicros;
+        }
+    }
+
+    if (next == INT64_MAX) {
+        fprintf(stderr, "Simulator: all tasks are blocked forever at %lld µs\n", (long long)_now);
+        exit(1);
+    }
+
+    // Optionally pace the virtual clock against the wall clock
+    if ((_timeScale > 0.0) && (next > _now)) {
+        double seconds = (next - _now) / 1.0e6 / _timeScale;
+        struct timespec pause = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1.0e9)};
+        nanosleep(&pause, NULL);
+    }
+    _now = next;
+}
+
+// The running task gave up the CPU: continue with the best ready task, advance the clock if there is none
+static void _schedule() {
+    while (true) {
+        _wakeDue();
+        simTask *next = _pick();
+        if (next != NULL) {
+            if (next != _self) {
+                _switchTo(next);
+            }
+            return;
+        }
+        _advance();
+    }
+}
+
+// The running task stays ready, but hands over to tasks with a higher priority
+static void _preempt() {
+    if (_inCallback == true) {
+        return;
+    }
+    _wakeDue();
+    simTask *next = _pick();
+    if ((next != NULL) && ((_self->ready == false) || (_self->suspended == true) || (next->priority > _self->priority))) {
+        _switchTo(next);
+    }
+}
+
+// Block the running task until it is made ready again or the timeout expires
+static void _block(int64_t timeoutMicros) {
+    _self->ready = false;
+    _self->wakeMicros = (timeoutMicros < 0) ? -1 : _now + timeoutMicros;
+    _schedule();
+    _self->wakeMicros = -1;
+}
+
+static int64_t _ticksToMicros(TickType_t ticks) {
+    return (ticks == portMAX_DELAY) ? -1 : (int64_t)ticks * portTICK_PERIOD_MS * 1000;
+}
+
+static void *_taskEntry(void *argument) {
+    simTask *task = (simTask *)argument;
+
+    // Wait until the scheduler hands over the CPU for the first time
+    pthread_mutex_lock(&_lock);
+    _self = task;
+    while (_running != task) {
+        pthread_cond_wait(&_switch, &_lock);
+    }
+    pthread_mutex_unlock(&_lock);
+
+    task->function(task->parameter);
+
+    // Returning from a task function is not allowed on FreeRTOS, treat it like deleting the task
+    vTaskDelete(NULL);
+    return NULL;
+}
+
+/**************************************************************************/
+/*
+  SimulatorClass
+*/
+/**************************************************************************/
+
+void SimulatorClass::setTimeScale(float scale) {
+    _enter();
+    _timeScale = scale;
+    _leave();
+}
+
+void SimulatorClass::setCallCost(unsigned int micros) {
+    _enter();
+    _callCost = micros;
+    _leave();
+}
+
+void SimulatorClass::setMutexHold(unsigned int micros) {
+    _enter();
+    _self->holdMicros = micros;
+    _leave();
+}
+
+int64_t SimulatorClass::getTime() {
+    _enter();
+    int64_t now = _now;
+    _leave();
+    return now;
+}
+
+void SimulatorClass::spend(unsigned int micros) {
+    _enter();
+    _now += micros;
+    _preempt();
+    _leave();
+}
+
+void SimulatorClass::charge() {
+    _enter();
+    _now += _callCost;
+    _preempt();
+    _leave();
+}
+
+bool SimulatorClass::attachAxis(const simulatedAxis *axis) {
+    axisState *state = _find(axis->stepPin);
+    if (state == NULL) {
+        if (_axes >= SIMULATOR_MAX_AXES) {
+            return false;
+        }
+        state = &_axis[_axes++];
+        state->stepPin = axis->stepPin;
+    }
+    state->axis = axis;
+    state->position = axis->startPosition;
+    state->lostSteps = 0;
+    state->stallMicros = -1;
+    state->stallStart = -1;
+    return true;
+}
+
+int32_t SimulatorClass::getPhysicalPosition(int stepPin) {
+    axisState *state = _find(stepPin);
+    if ((state == NULL) || (state->axis == NULL)) {
+        return 0;
+    }
+    if (state->stepper != NULL) {
+        state->stepper->getCurrentPosition();
+    }
+    return state->position;
+}
+
+uint32_t SimulatorClass::getLostSteps(int stepPin) {
+    axisState *state = _find(stepPin);
+    return (state != NULL) ? state->lostSteps : 0;
+}
+
+void SimulatorClass::setResetReason(esp_reset_reason_t reason) {
+    _enter();
+    _resetReason = reason;
+    _leave();
+}
+
+esp_reset_reason_t esp_reset_reason() {
+    _enter();
+    esp_reset_reason_t reason = _resetReason;
+    _leave();
+    return reason;
+}
+
+FastAccelStepper *SimulatorClass::getStepper(int stepPin) {
+    axisState *state = _find(stepPin);
+    return (state != NULL) ? state->stepper : NULL;
+}
+
+void SimulatorClass::registerStepper(FastAccelStepper *stepper, int stepPin) {
+    axisState *state = _find(stepPin);
+    if ((state == NULL) && (_axes < SIMULATOR_MAX_AXES)) {
+        state = &_axis[_axes++];
+        state->stepPin = stepPin;
+        state->stallMicros = -1;
+        state->stallStart = -1;
+    }
+    if (state != NULL) {
+        state->stepper = stepper;
+    }
+}
+
+bool SimulatorClass::readPin(int pin, int *value) {
+    for (unsigned int i = 0; i < _axes; i++) {
+        axisState *state = &_axis[i];
+        if ((state->axis != NULL) && (state->axis->endstopPin == pin)) {
+            // Bring the carriage up to date
+            if (state->stepper != NULL) {
+                state->stepper->getCurrentPosition();
+            }
+            bool closed = (state->axis->endstopAtFront == true)
+                ? (state->position >= state->axis->railLength - state->axis->endstopTravel)
+                : (state->position <= state->axis->endstopTravel);
+            *value = (closed == state->axis->endstopActiveLow) ? 0 : 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SimulatorClass::readAnalog(int pin, int *value) {
+    return readAnalog(pin, value, getTime());
+}
+
+bool SimulatorClass::readAnalog(int pin, int *value, int64_t micros) {
+    // Noise and spikes are pseudo random, but the same in every run
+    static uint32_t noise = 1;
+
+    for (unsigned int i = 0; i < _axes; i++) {
+        axisState *state = &_axis[i];
+        if ((state->axis != NULL) && (state->axis->currentPin == pin)) {
+            if (state->stepper != NULL) {
+                state->stepper->getCurrentPosition();
+            }
+            bool stalled = (state->stallStart >= 0) && (micros >= state->stallStart)
+                && (micros - state->stallMicros < SIMULATOR_STALL_MS * 1000);
+            noise = noise * 1664525 + 1013904223;
+            if ((noise >> 8) % SIMULATOR_CURRENT_SPIKE == 0) {
+                *value = 4095;
+            } else {
+                int reading = stalled ? SIMULATOR_STALL_CURRENT : SIMULATOR_IDLE_CURRENT;
+                *value = reading + int((noise >> 16) % (2 * SIMULATOR_CURRENT_NOISE + 1)) - SIMULATOR_CURRENT_NOISE;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void SimulatorClass::moved(FastAccelStepper *stepper, int direction, int64_t micros) {
+    for (unsigned int i = 0; i < _axes; i++) {
+        axisState *state = &_axis[i];
+        if ((state->stepper == stepper) && (state->axis != NULL)) {
+            int32_t position = state->position + direction;
+
+            // The carriage can't pass the hard stops, the motor loses the step
+            if ((position < 0) || (position > state->axis->railLength)) {
+                state->lostSteps++;
+                if ((state->stallMicros < 0) || (micros - state->stallMicros >= SIMULATOR_STALL_MS * 1000)) {
+                    state->stallStart = micros;
+                }
+                state->stallMicros = micros;
+            } else {
+                state->position = position;
+            }
+            return;
+        }
+    }
+}
+
+SimulatorClass::axisState *SimulatorClass::_find(int stepPin) {
+    for (unsigned int i = 0; i < _axes; i++) {
+        if (_axis[i].stepPin == stepPin) {
+            return &_axis[i];
+        }
+    }
+    return NULL;
+}
+
+/**************************************************************************/
+/*
+  FreeRTOS tasks
+*/
+/**************************************************************************/
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth,
+        void *parameter, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+    _enter();
+    simTask *task = new simTask{name, priority, function, parameter, pthread_t(), true, false, false, -1, 0, false, NULL, 0};
+    _tasks->push_back(task);
+
+    // The handle is valid before the task runs for the first time
+    if (handle != NULL) {
+        *handle = task;
+    }
+
+    if (pthread_create(&task->thread, NULL, _taskEntry, task) != 0) {
+        task->deleted = true;
+        _leave();
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+
+    _preempt();
+    _leave();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stackDepth,
+        void *parameter, UBaseType_t priority, TaskHandle_t *handle) {
+    return xTaskCreatePinnedToCore(function, name, stackDepth, parameter, priority, handle, 0);
+}
+
+void vTaskDelete(TaskHandle_t handle) {
+    _enter();
+    simTask *task = (handle == NULL) ? _self : (simTask *)handle;
+    task->deleted = true;
+    if (task == _self) {
+        _schedule();
+        _leave();
+        pthread_exit(NULL);
+    }
+    _leave();
+}
+
+void vTaskDelay(TickType_t ticks) {
+    _enter();
+    if (ticks == 0) {
+        // Yield to tasks of the same priority
+        _schedule();
+    } else {
+        _block(_ticksToMicros(ticks));
+    }
+    _leave();
+}
+
+void vTaskSuspend(TaskHandle_t handle) {
+    _enter();
+    simTask *task = (handle == NULL) ? _self : (simTask *)handle;
+    task->suspended = true;
+    if (task == _self) {
+        _schedule();
+    }
+    _leave();
+}
+
+void vTaskResume(TaskHandle_t handle) {
+    _enter();
+    ((simTask *)handle)->suspended = false;
+    _preempt();
+    _leave();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    _enter();
+    simTask *task = _self;
+    _leave();
+    return task;
+}
+
+TickType_t xTaskGetTickCount() {
+    _enter();
+    TickType_t ticks = _now / 1000 / portTICK_PERIOD_MS;
+    _leave();
+    return ticks;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t handle) {
+    _enter();
+    simTask *task = (simTask *)handle;
+    task->notification++;
+    if (task->waitNotification == true) {
+        task->ready = true;
+    }
+    _preempt();
+    _leave();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t handle, BaseType_t *higherPriorityTaskWoken) {
+    xTaskNotifyGive(handle);
+    if (higherPriorityTaskWoken != NULL) {
+        *higherPriorityTaskWoken = pdFALSE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+    _enter();
+    if ((_self->notification == 0) && (ticksToWait > 0)) {
+        _self->waitNotification = true;
+        _block(_ticksToMicros(ticksToWait));
+        _self->waitNotification = false;
+    }
+    uint32_t value = _self->notification;
+    if (value > 0) {
+        _self->notification = (clearCountOnExit == pdTRUE) ? 0 : value - 1;
+    }
+    _leave();
+    return value;
+}
+
+/**************************************************************************/
+/*
+  FreeRTOS semaphores
+*/
+/**************************************************************************/
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    // May be called by static constructors before the scheduler exists
+    return new simSemaphore{NULL};
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticksToWait) {
+    _enter();
+    simSemaphore *semaphore = (simSemaphore *)handle;
+    int64_t timeout = _ticksToMicros(ticksToWait);
+    int64_t deadline = (timeout < 0) ? -1 : _now + timeout;
+
+    while (semaphore->owner != NULL) {
+        if ((deadline >= 0) && (_now >= deadline)) {
+            _leave();
+            return pdFALSE;
+        }
+        _self->waitSemaphore = semaphore;
+        _block((deadline < 0) ? -1 : deadline - _now);
+        _self->waitSemaphore = NULL;
+    }
+    semaphore->owner = _self;
+    _leave();
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    _enter();
+    simSemaphore *semaphore = (simSemaphore *)handle;
+    if (semaphore->owner == NULL) {
+        _leave();
+        return pdFALSE;
+    }
+
+    // Preempted inside the critical section, tasks waiting for the mutex wait longer
+    if (semaphore->owner == _self) {
+        for (unsigned int held = 0; held < _self->holdMicros; held += SIMULATOR_HOLD_SLICE_US) {
+            unsigned int slice = _self->holdMicros - held;
+            _now += (slice < SIMULATOR_HOLD_SLICE_US) ? slice : SIMULATOR_HOLD_SLICE_US;
+            _preempt();
+        }
+    }
+    semaphore->owner = NULL;
+    for (simTask *task : *_tasks) {
+        if (task->waitSemaphore == semaphore) {
+            task->ready = true;
+        }
+    }
+    _preempt();
+    _leave();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    delete (simSemaphore *)handle;
+}
+
+/**************************************************************************/
+/*
+  esp_timer
+*/
+/**************************************************************************/
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle) {
+    _enter();
+    esp_timer *timer = new esp_timer{args->callback, args->arg, args->name, -1, 0};
+    _timers->push_back(timer);
+    *handle = timer;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout) {
+    _enter();
+    if (timer->deadline >= 0) {
+        _leave();
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->deadline = _now + timeout;
+    timer->period = 0;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period) {
+    _enter();
+    if (timer->deadline >= 0) {
+        _leave();
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->deadline = _now + period;
+    timer->period = period;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    _enter();
+    bool armed = (timer->deadline >= 0);
+    timer->deadline = -1;
+    _leave();
+    return armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    _enter();
+    for (size_t i = 0; i < _timers->size(); i++) {
+        if ((*_timers)[i] == timer) {
+            _timers->erase(_timers->begin() + i);
+            break;
+        }
+    }
+    delete timer;
+    _leave();
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time() {
+    _enter();
+    _now += _callCost;
+    _preempt();
+    int64_t now = _now;
+    _leave();
+    return now;
+}
+
+/**************************************************************************/
+/*
+  I2S in built-in ADC mode
+*/
+/**************************************************************************/
+
+// ADC1 channels of the ESP32 and the pins they sample
+static const int _adc1Pin[ADC1_CHANNEL_MAX] = {36, 37, 38, 39, 32, 33, 34, 35};
+
+static struct {
+    bool installed;
+    bool enabled;
+    int64_t period;             // Time between two samples in µs
+    int64_t capacity;           // Samples the DMA buffers hold
+    int channel;
+    int64_t next;               // Time of the next sample the reader gets
+} _i2s = {false, false, 50, 0, -1, 0};
+
+esp_err_t adc1_config_width(adc_bits_width_t width) {
+    return ESP_OK;
+}
+
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten) {
+    return ESP_OK;
+}
+
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t *config, int queueSize, void *queue) {
+    if ((port != I2S_NUM_0) || ((config->mode & I2S_MODE_ADC_BUILT_IN) == 0) || (config->sample_rate == 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    _enter();
+    if (_i2s.installed == true) {
+        _leave();
+        return ESP_FAIL;
+    }
+    _i2s.installed = true;
+    _i2s.enabled = false;
+    _i2s.period = 1000000 / config->sample_rate;
+    _i2s.capacity = (int64_t)config->dma_buf_count * config->dma_buf_len;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t i2s_driver_uninstall(i2s_port_t port) {
+    _enter();
+    _i2s.installed = false;
+    _i2s.enabled = false;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t i2s_set_adc_mode(adc_unit_t unit, adc1_channel_t channel) {
+    if ((unit != ADC_UNIT_1) || (channel < 0) || (channel >= ADC1_CHANNEL_MAX)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    _enter();
+    _i2s.channel = channel;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t i2s_adc_enable(i2s_port_t port) {
+    _enter();
+    if ((_i2s.installed == false) || (_i2s.channel < 0)) {
+        _leave();
+        return ESP_ERR_INVALID_STATE;
+    }
+    _i2s.enabled = true;
+    _i2s.next = _now;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t i2s_adc_disable(i2s_port_t port) {
+    _enter();
+    _i2s.enabled = false;
+    _leave();
+    return ESP_OK;
+}
+
+esp_err_t i2s_read(i2s_port_t port, void *dest, size_t size, size_t *bytesRead, TickType_t ticksToWait) {
+    uint16_t *samples = (uint16_t *)dest;
+    size_t count = (size / sizeof(uint16_t)) & ~(size_t)1;
+    *bytesRead = 0;
+
+    _enter();
+    if ((_i2s.enabled == false) || (count == 0)) {
+        _leave();
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // The DMA overwrites samples the reader didn't fetch in time
+    if (_i2s.next < _now - _i2s.capacity * _i2s.period) {
+        _i2s.next = _now - _i2s.capacity * _i2s.period;
+    }
+
+    // Wait until the DMA took the last sample
+    int64_t last = _i2s.next + (int64_t)(count - 1) * _i2s.period;
+    if (last > _now) {
+        int64_t timeout = _ticksToMicros(ticksToWait);
+        if ((timeout >= 0) && (last - _now > timeout)) {
+            _block(timeout);
+            _leave();
+            return ESP_ERR_TIMEOUT;
+        }
+        _block(last - _now);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        int value = 0;
+        Simulator.readAnalog(_adc1Pin[_i2s.channel], &value, _i2s.next + (int64_t)i * _i2s.period);
+        value = (value < 0) ? 0 : ((value > 4095) ? 4095 : value);
+        samples[i ^ 1] = (_i2s.channel << 12) | value;
+    }
+    _i2s.next += (int64_t)count * _i2s.period;
+    *bytesRead = count * sizeof(uint16_t);
+    _leave();
+    return ESP_OK;
+}
@@ -0,0 +1,159 @@
+/**
+ *   Simulator
+ *   Runs the StrokeEngine on a PC. Provides a virtual clock, a FreeRTOS task
+ *   shim on top of pthreads, a simulated FastAccelStepper and the machine I/O
+ *   like the homing switch and the current sensor with the DMA sampling it.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_system.h"
+
+class FastAccelStepper;
+
+#define SIMULATOR_MAX_AXES      4       // Number of steppers which can be attached to a simulated axis
+#define SIMULATOR_CALL_COST_US  1       // Default CPU time in µs accounted for each call into the Simulator
+#define SIMULATOR_HOLD_SLICE_US 100     // A task holding a mutex longer may be preempted after each slice of this many µs
+#define SIMULATOR_STALL_MS      20      // Current sensor reads high for this long after the carriage hit a hard stop
+#define SIMULATOR_IDLE_CURRENT  100     // Reading of the current sensor while moving freely
+#define SIMULATOR_STALL_CURRENT 2000    // Reading of the current sensor while pushing against a hard stop
+#define SIMULATOR_CURRENT_NOISE 30      // Peak noise of the current sensor reading
+#define SIMULATOR_CURRENT_SPIKE 1000    // One in this many readings of the current sensor is a spike to full scale
+
+/**************************************************************************/
+/*!
+  @brief  Struct defining the mechanics of a simulated axis. Positions are
+  physical positions in steps measured from the rear hard stop, regardless
+  of what the firmware considers to be home.
+*/
+/**************************************************************************/
+typedef struct {
+  int stepPin;                /*> STEP pin of the stepper driving this axis */
+  int32_t railLength;         /*> Travel between the rear and the front hard stop in steps */
+  int32_t startPosition;      /*> Position of the carriage at power up in steps */
+  int endstopPin;             /*> Pin of the homing switch, -1 if there is none */
+  bool endstopActiveLow;      /*> Polarity of the homing switch */
+  bool endstopAtFront;        /*> Homing switch closes at the front hard stop instead of the rear one */
+  int32_t endstopTravel;      /*> Homing switch closes this many steps before the hard stop */
+  int currentPin;             /*> Analog pin of the current sensor for sensorless homing, -1 if there is none */
+} simulatedAxis;
+
+/**************************************************************************/
+/*!
+  @brief  Virtual clock and cooperative scheduler of the simulation. Tasks
+  are pthreads, but only one of them holds the CPU at a time. Whenever the
+  running task blocks the ready task with the highest priority continues.
+  If no task is ready the virtual clock jumps to the next timeout or timer
+  deadline, so a simulation runs as fast as the PC allows. Calls into the
+  Simulator cost a little virtual CPU time, so busy waiting loops advance
+  the clock and higher priority tasks preempt them.
+
+  ESP32 has two cores, the Simulator has one. Timing between tasks on
+  different cores is approximated by the priorities.
+*/
+/**************************************************************************/
+class SimulatorClass {
+    public:
+        /*!
+          @brief Pace the virtual clock against the wall clock.
+          @param scale 0 runs as fast as possible, 1.0 in real time, 2.0 twice as fast
+        */
+        void setTimeScale(float scale);
+
+        /*!
+          @brief Set the CPU time accounted for each call into the Simulator.
+          @param micros virtual time in [µs] a call takes
+        */
+        void setCallCost(unsigned int micros);
+
+        /*!
+          @brief Replay the calling task losing the CPU inside its critical 
+          sections. Each mutex it gives back stays taken for this much longer.
+          @param micros CPU time in [µs] a mutex is held longer, 0 to stop
+        */
+        void setMutexHold(unsigned int micros);
+
+        /*!
+          @brief Time of the virtual clock.
+          @return µs since the simulation started
+        */
+        int64_t getTime();
+
+        /*!
+          @brief Account CPU time to the running task. Higher priority tasks
+          and timers which become due meanwhile preempt it.
+          @param micros CPU time in [µs]
+        */
+        void spend(unsigned int micros);
+
+        //! Account the CPU time of one call into the Simulator to the running task
+        void charge();
+
+        /*!
+          @brief Attach mechanics to the stepper connected to axis->stepPin.
+          Can be called before or after the stepper is connected.
+          @param axis pointer to the mechanics. Must stay valid.
+          @return false if all axes are in use
+        */
+        bool attachAxis(const simulatedAxis *axis);
+
+        /*!
+          @brief Physical position of the carriage.
+          @param stepPin STEP pin of the axis
+          @return position in steps from the rear hard stop
+        */
+        int32_t getPhysicalPosition(int stepPin);
+
+        /*!
+          @brief Number of steps lost against the hard stops.
+          @param stepPin STEP pin of the axis
+          @return lost steps since start
+        */
+        uint32_t getLostSteps(int stepPin);
+
+        /*!
+          @brief Access the simulated stepper, e.g. to find out about the step queue.
+          @param stepPin STEP pin of the stepper
+          @return pointer to the stepper, NULL if no stepper is connected to this pin
+        */
+        FastAccelStepper *getStepper(int stepPin);
+
+        /*!
+          @brief Reason esp_reset_reason() reports, e.g. ESP_RST_SW to replay a
+          restart by calling begin() of the application again. Variables with
+          RTC_NOINIT_ATTR keep their value anyway. Defaults to ESP_RST_POWERON.
+          @param reason reason of the last reset
+        */
+        void setResetReason(esp_reset_reason_t reason);
+
+        //! Arguments of the command line
+        int argc = 0;
+        char **argv = nullptr;
+
+        // Interface for the simulated peripherals, not meant for applications
+        void registerStepper(FastAccelStepper *stepper, int stepPin);
+        bool readPin(int pin, int *value);
+        bool readAnalog(int pin, int *value);
+        bool readAnalog(int pin, int *value, int64_t micros);
+        void moved(FastAccelStepper *stepper, int direction, int64_t micros);
+
+    protected:
+        typedef struct {
+          const simulatedAxis *axis;
+          FastAccelStepper *stepper;
+          int stepPin;
+          int32_t position;
+          uint32_t lostSteps;
+          int64_t stallMicros;
+          int64_t stallStart;
+        } axisState;
+        axisState _axis[SIMULATOR_MAX_AXES] = {};
+        unsigned int _axes = 0;
+        axisState *_find(int stepPin);
+};
+
+extern SimulatorClass Simulator;
@@ -0,0 +1,46 @@
+/**
+ *   ADC shim of the Simulator
+ *   Configuration of the ADC as used on the ESP32. The simulated ADC reads
+ *   the current sensor of the Simulator and needs no configuration.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include "../esp_timer.h"
+
+typedef enum {
+    ADC_UNIT_1 = 1,
+    ADC_UNIT_2 = 2
+} adc_unit_t;
+
+typedef enum {
+    ADC1_CHANNEL_0 = 0,
+    ADC1_CHANNEL_1,
+    ADC1_CHANNEL_2,
+    ADC1_CHANNEL_3,
+    ADC1_CHANNEL_4,
+    ADC1_CHANNEL_5,
+    ADC1_CHANNEL_6,
+    ADC1_CHANNEL_7,
+    ADC1_CHANNEL_MAX
+} adc1_channel_t;
+
+typedef enum {
+    ADC_ATTEN_DB_0 = 0,
+    ADC_ATTEN_DB_2_5,
+    ADC_ATTEN_DB_6,
+    ADC_ATTEN_DB_11
+} adc_atten_t;
+
+typedef enum {
+    ADC_WIDTH_BIT_9 = 0,
+    ADC_WIDTH_BIT_10,
+    ADC_WIDTH_BIT_11,
+    ADC_WIDTH_BIT_12
+} adc_bits_width_t;
+
+esp_err_t adc1_config_width(adc_bits_width_t width);
+esp_err_t adc1_config_channel_atten(adc1_channel_t channel, adc_atten_t atten);
@@ -0,0 +1,78 @@
+/**
+ *   I2S shim of the Simulator
+ *   Only the built-in ADC mode of I2S0 is simulated: the DMA samples the
+ *   current sensor of the Simulator at the sample rate on the virtual clock.
+ *   Like on the ESP32 the upper 4 bit of a sample hold the channel and the
+ *   two samples of a 32 bit word are swapped.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "../freertos/FreeRTOS.h"
+#include "adc.h"
+
+#define ESP_FAIL                -1
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_TIMEOUT         0x107
+
+typedef enum {
+    I2S_NUM_0 = 0,
+    I2S_NUM_1 = 1,
+    I2S_NUM_MAX
+} i2s_port_t;
+
+typedef enum {
+    I2S_MODE_MASTER = 1,
+    I2S_MODE_SLAVE = 2,
+    I2S_MODE_TX = 4,
+    I2S_MODE_RX = 8,
+    I2S_MODE_DAC_BUILT_IN = 16,
+    I2S_MODE_ADC_BUILT_IN = 32,
+    I2S_MODE_PDM = 64
+} i2s_mode_t;
+
+typedef enum {
+    I2S_BITS_PER_SAMPLE_8BIT = 8,
+    I2S_BITS_PER_SAMPLE_16BIT = 16,
+    I2S_BITS_PER_SAMPLE_24BIT = 24,
+    I2S_BITS_PER_SAMPLE_32BIT = 32
+} i2s_bits_per_sample_t;
+
+typedef enum {
+    I2S_CHANNEL_FMT_RIGHT_LEFT = 0,
+    I2S_CHANNEL_FMT_ALL_RIGHT,
+    I2S_CHANNEL_FMT_ALL_LEFT,
+    I2S_CHANNEL_FMT_ONLY_RIGHT,
+    I2S_CHANNEL_FMT_ONLY_LEFT
+} i2s_channel_fmt_t;
+
+typedef enum {
+    I2S_COMM_FORMAT_I2S = 0x01,
+    I2S_COMM_FORMAT_I2S_MSB = 0x02,
+    I2S_COMM_FORMAT_I2S_LSB = 0x04
+} i2s_comm_format_t;
+
+typedef struct {
+    i2s_mode_t mode;
+    uint32_t sample_rate;
+    i2s_bits_per_sample_t bits_per_sample;
+    i2s_channel_fmt_t channel_format;
+    i2s_comm_format_t communication_format;
+    int intr_alloc_flags;
+    int dma_buf_count;
+    int dma_buf_len;
+    bool use_apll;
+    bool tx_desc_auto_clear;
+    int fixed_mclk;
+} i2s_config_t;
+
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t *config, int queueSize, void *queue);
+esp_err_t i2s_driver_uninstall(i2s_port_t port);
+esp_err_t i2s_set_adc_mode(adc_unit_t unit, adc1_channel_t channel);
+esp_err_t i2s_adc_enable(i2s_port_t port);
+esp_err_t i2s_adc_disable(i2s_port_t port);
+esp_err_t i2s_read(i2s_port_t port, void *dest, size_t size, size_t *bytesRead, TickType_t ticksToWait);
@@ -0,0 +1,39 @@
+/**
+ *   esp_timer shim of the Simulator
+ *   High resolution timers running on the virtual clock. Callbacks are 
+ *   dispatched by the scheduler the moment the virtual clock passes their 
+ *   deadline.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_ERR_INVALID_STATE   0x103
+
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+    ESP_TIMER_TASK
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+} esp_timer_create_args_t;
+
+typedef struct esp_timer *esp_timer_handle_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+esp_err_t esp_timer_delete(esp_timer_handle_t timer);
+int64_t esp_timer_get_time();
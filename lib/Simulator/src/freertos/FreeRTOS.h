@@ -0,0 +1,37 @@
+/**
+ *   FreeRTOS shim of the Simulator
+ *   Types and macros of FreeRTOS as used on the ESP32, backed by the 
+ *   cooperative task scheduler of the Simulator.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  pdTRUE
+#define pdFAIL                  pdFALSE
+#define portMAX_DELAY           ((TickType_t)0xFFFFFFFF)
+#define configTICK_RATE_HZ      1000
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(ms) * configTICK_RATE_HZ / 1000)
+
+// Only one simulated task runs at a time, critical sections need no lock
+typedef struct {
+    int dummy;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    {0}
+#define portENTER_CRITICAL(mux)         ((void)(mux))
+#define portEXIT_CRITICAL(mux)          ((void)(mux))
+#define portENTER_CRITICAL_ISR(mux)     ((void)(mux))
+#define portEXIT_CRITICAL_ISR(mux)      ((void)(mux))
+#define portYIELD_FROM_ISR()
+#define xPortGetCoreID()                0
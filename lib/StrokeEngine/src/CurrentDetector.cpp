@@ -0,0 +1,84 @@
+#include <CurrentDetector.h>
+#include <math.h>
+
+void CurrentDetector::begin(float sampleRate) {
+    float period = 1.0e6 / sampleRate;
+    _alpha = 1.0 - expf(-period / CURRENT_IIR_TAU_US);
+
+    // Slope over CURRENT_SLOPE_US, but at least one and at most CURRENT_SLOPE_WINDOW - 1 samples back
+    _slopeSamples = (unsigned int)(CURRENT_SLOPE_US / period + 0.5);
+    if (_slopeSamples < 1) {
+        _slopeSamples = 1;
+    } else if (_slopeSamples > CURRENT_SLOPE_WINDOW - 1) {
+        _slopeSamples = CURRENT_SLOPE_WINDOW - 1;
+    }
+
+    _samples = 0;
+    _armed = false;
+    _triggered = false;
+    _early = false;
+    reset(_offset);
+}
+
+void CurrentDetector::reset(float value) {
+    uint16_t raw = (value > 0.0) ? (uint16_t)(value + 0.5) : 0;
+    for (unsigned int i = 0; i < CURRENT_MEDIAN_TAPS; i++) {
+        _median[i] = raw;
+    }
+    for (unsigned int i = 0; i < CURRENT_SLOPE_WINDOW; i++) {
+        _history[i] = value;
+    }
+    _filtered = value;
+}
+
+void CurrentDetector::arm(float limit, uint32_t blanking) {
+    _limit = limit;
+    _blanking = blanking;
+    _triggered = false;
+    _early = false;
+    _armed = true;
+}
+
+bool CurrentDetector::add(uint16_t raw) {
+    _median[_medianIndex] = raw;
+    _medianIndex = (_medianIndex + 1) % CURRENT_MEDIAN_TAPS;
+    _filtered += _alpha * (_medianOf() - _filtered);
+
+    // Rise since _slopeSamples ago, the history keeps the filtered values
+    float *slot = &_history[_samples % CURRENT_SLOPE_WINDOW];
+    float rise = _filtered - _history[(_samples - _slopeSamples) % CURRENT_SLOPE_WINDOW];
+    *slot = _filtered;
+    _samples++;
+
+    if ((_armed == false) || (_triggered == true)) {
+        return false;
+    }
+    if (_blanking > 0) {
+        _blanking--;
+        return false;
+    }
+
+    float current = _filtered - _offset;
+    if (current >= _limit) {
+        _triggered = true;
+    } else if ((current >= CURRENT_EARLY_LEVEL * _limit) && (rise >= CURRENT_EARLY_RISE * _limit)) {
+        _triggered = true;
+        _early = true;
+    }
+    return _triggered;
+}
+
+uint16_t CurrentDetector::_medianOf() {
+    uint16_t sorted[CURRENT_MEDIAN_TAPS];
+    for (unsigned int i = 0; i < CURRENT_MEDIAN_TAPS; i++) {
+        // Insertion sort, the taps are only a handful
+        uint16_t value = _median[i];
+        unsigned int j = i;
+        while ((j > 0) && (sorted[j - 1] > value)) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+    return sorted[CURRENT_MEDIAN_TAPS / 2];
+}
@@ -0,0 +1,105 @@
+/**
+ *   Current Detector of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ *   Filter and detector of the current sensor used for sensorless homing.
+ *   Free of any Arduino dependency, so tools/CurrentReplay runs the very
+ *   same code on recorded traces.
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define CURRENT_FULL_SCALE          4096    // Readings of the 12 bit ADC
+#define CURRENT_MEDIAN_TAPS         5       // Length of the median filter removing single spikes, must be odd
+#define CURRENT_IIR_TAU_US          500     // Time constant of the low pass after the median in µs
+#define CURRENT_SLOPE_US            1000    // Window the rise of the current is measured over in µs
+#define CURRENT_SLOPE_WINDOW        64      // Longest slope window in samples, must be a power of 2
+#define CURRENT_EARLY_LEVEL         0.5     // Fraction of the limit the current must exceed for the slope to count
+#define CURRENT_EARLY_RISE          0.5     // Fraction of the limit the current must rise within CURRENT_SLOPE_US
+
+/**************************************************************************/
+/*!
+  @brief  Detects the current rise of a motor pushing against a hard stop.
+  Each raw sample passes a median filter, which removes single spikes, and
+  a first order low pass. An event is detected if the filtered current
+  exceeds the limit, or early if it exceeds CURRENT_EARLY_LEVEL of the limit
+  while rising by CURRENT_EARLY_RISE of the limit within CURRENT_SLOPE_US.
+  The slope criterion catches the steep rise of a stall before the low pass
+  has settled, a slow drift must reach the full limit.
+
+  Currents are in ADC counts above the offset of the sensor.
+*/
+/**************************************************************************/
+class CurrentDetector {
+    public:
+        /*!
+          @brief Set up the filters for a sample rate. Resets the detector.
+          @param sampleRate samples per second
+        */
+        void begin(float sampleRate);
+
+        /*!
+          @brief Start over with the filters settled at a value, e.g. the offset.
+          @param value raw reading in counts
+        */
+        void reset(float value);
+
+        //! Reading of the sensor without current in counts
+        void setOffset(float offset) { _offset = offset; }
+
+        //! Offset in counts
+        float getOffset() { return _offset; }
+
+        /*!
+          @brief Arm the detection. A former event is cleared.
+          @param limit current above the offset in counts
+          @param blanking samples ignored after arming, e.g. while the motor accelerates
+        */
+        void arm(float limit, uint32_t blanking);
+
+        //! Stop detecting. Filtering goes on.
+        void disarm() { _armed = false; }
+
+        /*!
+          @brief Filter a raw sample and check for an event.
+          @param raw reading of the ADC in counts
+          @return true for the sample an event is detected on, only once per arming
+        */
+        bool add(uint16_t raw);
+
+        //! Filtered current above the offset in counts
+        float getCurrent() { return _filtered - _offset; }
+
+        //! True if an event was detected since arming
+        bool isTriggered() { return _triggered; }
+
+        //! True if the event was detected by the slope before the current reached the limit
+        bool isEarly() { return _early; }
+
+        //! Samples filtered since begin()
+        uint32_t getSamples() { return _samples; }
+
+    protected:
+        uint16_t _median[CURRENT_MEDIAN_TAPS] = {};
+        unsigned int _medianIndex = 0;
+        float _history[CURRENT_SLOPE_WINDOW] = {};
+        unsigned int _slopeSamples = 1;
+        float _alpha = 1.0;
+        float _filtered = 0.0;
+        float _offset = 0.0;
+        float _limit = 0.0;
+        uint32_t _samples = 0;
+        uint32_t _blanking = 0;
+        bool _armed = false;
+        bool _triggered = false;
+        bool _early = false;
+        uint16_t _medianOf();
+};
@@ -0,0 +1,202 @@
+#include <Arduino.h>
+#include <CurrentSensor.h>
+
+bool CurrentSensor::start(int pin) {
+    stop();
+
+    // Only ADC1 can be sampled by the DMA
+    int channel = digitalPinToAnalogChannel(pin);
+    if ((channel < 0) || (channel >= ADC1_CHANNEL_MAX)) {
+        return false;
+    }
+    _pin = pin;
+
+    i2s_config_t config = {};
+    config.mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+    config.sample_rate = CURRENT_SAMPLE_RATE;
+    config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format = I2S_CHANNEL_FMT_ONLY_LEFT;
+    config.communication_format = I2S_COMM_FORMAT_I2S_MSB;
+    config.intr_alloc_flags = 0;
+    config.dma_buf_count = CURRENT_DMA_BUFFERS;
+    config.dma_buf_len = CURRENT_DMA_SAMPLES;
+    config.use_apll = false;
+    if (i2s_driver_install(CURRENT_I2S_PORT, &config, 0, NULL) != ESP_OK) {
+        return false;
+    }
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten((adc1_channel_t)channel, ADC_ATTEN_DB_11);
+    i2s_set_adc_mode(ADC_UNIT_1, (adc1_channel_t)channel);
+    i2s_adc_enable(CURRENT_I2S_PORT);
+
+    // Until calibrated the raw reading is the current
+    _detector.setOffset(0.0);
+    _detector.begin(CURRENT_SAMPLE_RATE);
+    _armRequest = false;
+    _disarmRequest = false;
+    _triggered = false;
+    _calibrationRequest = 0;
+    _current = 0.0;
+    _events = 0;
+    _latencyMicros = 0;
+    _traceHead = 0;
+    _tracePost = -1;
+    _running = true;
+
+    xTaskCreatePinnedToCore(
+        this->_sensorImpl,              // Function that should be called
+        "CurrentSensor",                // Name of the task (for debugging)
+        2048,                           // Stack size (bytes)
+        this,                           // Pass reference to this class instance
+        15,                             // High priority, a late event pushes the carriage into the hard stop
+        &_taskSensorHandle,             // Task handle
+        0                               // Keep it off the application core
+    );
+    return true;
+}
+
+void CurrentSensor::stop() {
+    if (_running == false) {
+        return;
+    }
+
+    // The task ends after the buffer it waits for
+    _running = false;
+    while (_taskSensorHandle != NULL) {
+        vTaskDelay(1);
+    }
+    i2s_adc_disable(CURRENT_I2S_PORT);
+    i2s_driver_uninstall(CURRENT_I2S_PORT);
+}
+
+float CurrentSensor::calibrate() {
+    if (_running == false) {
+        return 0.0;
+    }
+
+    _calibrationSum = 0.0;
+    _calibrationCount = 0;
+    __sync_synchronize();
+    _calibrationRequest = CURRENT_CALIBRATION_MS * CURRENT_SAMPLE_RATE / 1000;
+
+    // The sensor task clears the request once it has taken all samples
+    unsigned long timeout = millis() + 2 * CURRENT_CALIBRATION_MS + CURRENT_READ_MS;
+    while ((_calibrationRequest > 0) && (long(timeout - millis()) > 0)) {
+        vTaskDelay(CURRENT_CALIBRATION_MS / 5 / portTICK_PERIOD_MS);
+    }
+    return 100.0 * _detector.getOffset() / CURRENT_FULL_SCALE;
+}
+
+void CurrentSensor::arm(float limit, unsigned long blankingMicros) {
+    // Drop a notification left over from a former event
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    _notify = xTaskGetCurrentTaskHandle();
+    _limit = limit * CURRENT_FULL_SCALE / 100.0;
+    _blanking = (uint64_t)blankingMicros * CURRENT_SAMPLE_RATE / 1000000;
+    _triggered = false;
+    __sync_synchronize();
+    _armRequest = true;
+}
+
+void CurrentSensor::disarm() {
+    _disarmRequest = true;
+}
+
+currentSensorStatistics CurrentSensor::getStatistics() {
+    currentSensorStatistics statistics;
+    statistics.rate = _running ? CURRENT_SAMPLE_RATE : 0.0;
+    statistics.samples = _detector.getSamples();
+    statistics.events = _events;
+    statistics.offset = 100.0 * _detector.getOffset() / CURRENT_FULL_SCALE;
+    statistics.current = getCurrent();
+    statistics.latencyMicros = _latencyMicros;
+    statistics.early = _detector.isEarly();
+    return statistics;
+}
+
+void CurrentSensor::printTrace() {
+    uint32_t head = _traceHead;
+    uint32_t count = min(head, (uint32_t)CURRENT_TRACE_SAMPLES);
+    unsigned long period = 1000000 / CURRENT_SAMPLE_RATE;
+    int64_t first = _traceTime - (int64_t)count * period + period;
+    long trigger = (_triggered == true) ? long(_triggerTime - first) : -1;
+
+    // Settings of the detector for the replay, times relative to the first sample
+    Serial.printf("# rate %d buffer %d offset %.1f limit %.1f trigger %ld\n", CURRENT_SAMPLE_RATE,
+        CURRENT_DMA_SAMPLES, _detector.getOffset(), _limit, trigger);
+    Serial.println("micros,raw");
+    for (uint32_t i = 0; i < count; i++) {
+        Serial.printf("%lu,%u\n", i * period, _trace[(head - count + i) % CURRENT_TRACE_SAMPLES]);
+    }
+}
+
+void CurrentSensor::_sensorTask() {
+    uint16_t buffer[CURRENT_DMA_SAMPLES];
+
+    while (_running == true) {
+        size_t bytes = 0;
+        i2s_read(CURRENT_I2S_PORT, buffer, sizeof(buffer), &bytes, CURRENT_READ_MS / portTICK_PERIOD_MS);
+        if (bytes >= 2 * sizeof(uint16_t)) {
+            // The buffer just completed, its last sample is the newest. Samples come in pairs.
+            _process(buffer, (bytes / sizeof(uint16_t)) & ~1U, esp_timer_get_time());
+        }
+    }
+
+    _taskSensorHandle = NULL;
+    vTaskDelete(NULL);
+}
+
+void CurrentSensor::_process(const uint16_t *buffer, size_t count, int64_t timestamp) {
+    int64_t period = 1000000 / CURRENT_SAMPLE_RATE;
+
+    // Requests of other tasks are taken over in between buffers
+    if (_armRequest == true) {
+        _detector.arm(_limit, _blanking);
+        _tracePost = -1;
+        _armRequest = false;
+    }
+    if (_disarmRequest == true) {
+        _detector.disarm();
+        _disarmRequest = false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        // The I2S delivers the 16 bit samples of a 32 bit word swapped, the upper 4 bit are the channel
+        uint16_t raw = buffer[i ^ 1] & 0x0FFF;
+        int64_t time = timestamp - (int64_t)(count - 1 - i) * period;
+
+        // The trace stops CURRENT_TRACE_POST samples after the event, the history before stays
+        if (_tracePost != 0) {
+            _trace[_traceHead % CURRENT_TRACE_SAMPLES] = raw;
+            _traceHead++;
+            _traceTime = time;
+            if (_tracePost > 0) {
+                _tracePost--;
+            }
+        }
+
+        if (_calibrationRequest > 0) {
+            _calibrationSum += raw;
+            _calibrationCount++;
+            if (_calibrationCount >= _calibrationRequest) {
+                float offset = _calibrationSum / _calibrationCount;
+                _detector.setOffset(offset);
+                _detector.reset(offset);
+                _calibrationRequest = 0;
+            }
+        }
+
+        if (_detector.add(raw) == true) {
+            _triggerTime = time;
+            _triggered = true;
+            _events++;
+            _tracePost = CURRENT_TRACE_POST;
+            if (_notify != NULL) {
+                xTaskNotifyGive(_notify);
+            }
+            _latencyMicros = esp_timer_get_time() - time;
+        }
+    }
+    _current = _detector.getCurrent();
+}
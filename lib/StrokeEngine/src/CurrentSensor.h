@@ -0,0 +1,134 @@
+/**
+ *   Current Sensor of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <driver/i2s.h>
+#include <driver/adc.h>
+#include <CurrentDetector.h>
+
+#define CURRENT_SAMPLE_RATE         20000   // Samples per second taken by the DMA
+#define CURRENT_DMA_SAMPLES         32      // Samples per DMA buffer, a buffer completes every 1.6 ms
+#define CURRENT_DMA_BUFFERS         4       // DMA buffers, the sensor task may fall behind by this many
+#define CURRENT_READ_MS             10      // Longest time the sensor task waits for a buffer
+#define CURRENT_CALIBRATION_MS      50      // Time the offset is averaged over
+#define CURRENT_TRACE_SAMPLES       1024    // Raw samples kept around the last event for printTrace()
+#define CURRENT_TRACE_POST          (CURRENT_TRACE_SAMPLES / 4)  // Samples of the trace after the event
+#define CURRENT_I2S_PORT            I2S_NUM_0   // Only I2S0 can sample the built-in ADC
+
+/**************************************************************************/
+/*!
+  @brief  Statistics about the current sensor and its last event.
+*/
+/**************************************************************************/
+typedef struct {
+  float rate;                 /*> Sample rate in Hz, 0 if stopped */
+  unsigned long samples;      /*> Samples filtered since start */
+  unsigned long events;       /*> Events detected since start */
+  float offset;               /*> Reading without current in % of full scale */
+  float current;              /*> Filtered current above the offset in % of full scale */
+  unsigned long latencyMicros; /*> Time from the sample of the last event until the notification in µs */
+  bool early;                 /*> Last event was detected by the slope before reaching the limit */
+} currentSensorStatistics;
+
+/**************************************************************************/
+/*!
+  @brief  Samples the current sensor of the motor continuously with the ADC
+  and DMA through I2S0. No CPU time is spent per sample until a buffer
+  completes, then a task at high priority runs each sample through the
+  CurrentDetector. On an event the task waiting for it gets a notification,
+  so it reacts within a DMA buffer instead of polling analogRead().
+
+  The DMA needs ADC1, which is the pins 32 - 39. While the sensor runs,
+  ADC1 belongs to the DMA and analogRead() of other ADC1 pins must wait
+  until stop().
+
+  The raw samples around the last event are kept as trace. printTrace()
+  prints them as CSV, tools/CurrentReplay replays such a trace through the
+  same detector to tune it and measure its latency on the PC.
+*/
+/**************************************************************************/
+class CurrentSensor {
+    public:
+        /*!
+          @brief Start sampling. Restarts if already running.
+          @param pin analog pin of the current sensor, must be an ADC1 pin
+          @return false if the pin can't be sampled by the DMA
+        */
+        bool start(int pin);
+
+        //! Stop sampling and give ADC1 back. The trace stays available.
+        void stop();
+
+        /*!
+          @brief Measure the offset of the sensor. The motor must not move meanwhile.
+          Blocks for about CURRENT_CALIBRATION_MS.
+          @return offset in % of full scale
+        */
+        float calibrate();
+
+        /*!
+          @brief Detect the next event and notify the calling task with
+          xTaskNotifyGive(). Wait for it with ulTaskNotifyTake().
+          @param limit current above the offset in % of full scale
+          @param blankingMicros time after arming without detection, e.g. while accelerating
+        */
+        void arm(float limit, unsigned long blankingMicros);
+
+        //! Stop detecting
+        void disarm();
+
+        //! True if an event was detected since arming
+        bool isTriggered() { return _triggered; }
+
+        //! Time of the sample the last event was detected on in µs of esp_timer_get_time()
+        int64_t getTriggerTime() { return _triggerTime; }
+
+        //! Filtered current above the offset in % of full scale
+        float getCurrent() { return 100.0 * _current / CURRENT_FULL_SCALE; }
+
+        //! Statistics about samples and the last event
+        currentSensorStatistics getStatistics();
+
+        /*!
+          @brief Print the trace of raw samples around the last event as CSV
+          to Serial, oldest first. A comment line with the settings of the
+          detector precedes the columns micros and raw.
+        */
+        void printTrace();
+
+    protected:
+        CurrentDetector _detector;
+        TaskHandle_t _taskSensorHandle = NULL;
+        TaskHandle_t _notify = NULL;
+        int _pin = -1;
+        volatile bool _running = false;
+        volatile bool _armRequest = false;
+        volatile bool _disarmRequest = false;
+        volatile bool _triggered = false;
+        volatile uint32_t _calibrationRequest = 0;  // Samples still to average for the offset
+        float _calibrationSum = 0.0;
+        uint32_t _calibrationCount = 0;
+        float _limit = 0.0;
+        uint32_t _blanking = 0;
+        volatile float _current = 0.0;
+        volatile int64_t _triggerTime = 0;
+        unsigned long _events = 0;
+        unsigned long _latencyMicros = 0;
+        uint16_t _trace[CURRENT_TRACE_SAMPLES];
+        uint32_t _traceHead = 0;            // Samples written to the trace, the newest is at _traceHead - 1
+        int32_t _tracePost = -1;            // Samples still to record after the event, -1 before the event
+        int64_t _traceTime = 0;             // Time of the newest sample of the trace
+        static void _sensorImpl(void* _this) { static_cast<CurrentSensor*>(_this)->_sensorTask(); }
+        void _sensorTask();
+        void _process(const uint16_t *buffer, size_t count, int64_t timestamp);
+};
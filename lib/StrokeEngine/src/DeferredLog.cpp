@@ -0,0 +1,158 @@
+#include <Arduino.h>
+#include <DeferredLog.h>
+
+DeferredLog Logger;
+
+static const char levelLetter[] = {' ', 'E', 'W', 'I', 'D'};
+
+void DeferredLog::begin() {
+    if (_initialized == false) {
+        // Every slot is ready for its first lap
+        for (unsigned int core = 0; core < LOG_CORES; core++) {
+            for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+                _ring[core][i].sequence = i;
+            }
+        }
+        _initialized = true;
+    }
+
+    if (_taskLogHandle == NULL) {
+        xTaskCreatePinnedToCore(
+            this->_logImpl,             // Function that should be called
+            "Log",                      // Name of the task (for debugging)
+            3072,                       // Stack size (bytes)
+            this,                       // Pass reference to this class instance
+            1,                          // Lowest priority, must never delay motion
+            &_taskLogHandle,            // Task handle
+            0                           // Keep it off the application core
+        );
+    }
+}
+
+logEntry *DeferredLog::_reserve(uint32_t *position) {
+    // Nothing can be logged before the slots are prepared
+    if (_initialized == false) {
+        _dropped = _dropped + 1;
+        return NULL;
+    }
+
+    // Tasks of the same core may still preempt each other, so claim the slot atomically
+    unsigned int core = xPortGetCoreID() % LOG_CORES;
+    uint32_t head = _head[core];
+    while (true) {
+        logEntry *entry = &_ring[core][head % LOG_RING_SIZE];
+        int32_t lap = (int32_t)(entry->sequence - head);
+        if (lap < 0) {
+            // Slot still holds a message of the previous lap, the ring is full
+            _dropped = _dropped + 1;
+            return NULL;
+        }
+        if (lap == 0) {
+            if (__atomic_compare_exchange_n(&_head[core], &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                *position = head;
+                return entry;
+            }
+        } else {
+            head = _head[core];
+        }
+    }
+}
+
+void DeferredLog::_commit(logEntry *entry, uint32_t position) {
+    // Hand the slot over to the logging task only after it is completely written
+    __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+void DeferredLog::_logTask() {
+    logEntry entry;
+
+    while (true) {
+        bool printed = false;
+        for (unsigned int core = 0; core < LOG_CORES; core++) {
+            logEntry *slot = &_ring[core][_tail[core] % LOG_RING_SIZE];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == _tail[core] + 1) {
+                entry = *slot;
+
+                // Free the slot for the next lap before the slow part
+                __atomic_store_n(&slot->sequence, _tail[core] + LOG_RING_SIZE, __ATOMIC_RELEASE);
+                _tail[core]++;
+                _print(&entry);
+                printed = true;
+            }
+        }
+
+        if (printed == false) {
+            vTaskDelay(LOG_POLL_MS / portTICK_PERIOD_MS);
+        }
+    }
+}
+
+void DeferredLog::_print(const logEntry *entry) {
+    char line[LOG_LINE_LENGTH];
+    char spec[16];
+    size_t length = snprintf(line, sizeof(line), "[%lu %c] ", (unsigned long)entry->timestamp, levelLetter[entry->level % sizeof(levelLetter)]);
+    const char *f = entry->format;
+    unsigned int argument = 0;
+
+    // Format one conversion at a time with the type the argument was stored with
+    while ((*f != '\0') && (length < sizeof(line) - 1)) {
+        if ((*f != '%') || (f[1] == '%')) {
+            line[length++] = *f;
+            f += (*f == '%') ? 2 : 1;
+            continue;
+        }
+
+        // Flags, width and precision are kept, length modifiers are dropped
+        size_t s = 0;
+        spec[s++] = *f++;
+        while ((*f != '\0') && (strchr("-+ #0123456789.", *f) != NULL) && (s < sizeof(spec) - 2)) {
+            spec[s++] = *f++;
+        }
+        while ((*f == 'l') || (*f == 'h') || (*f == 'z')) {
+            f++;
+        }
+        if (*f == '\0') {
+            break;
+        }
+        char conversion = *f++;
+        size_t room = sizeof(line) - length;
+
+        if (argument >= entry->count) {
+            length += snprintf(&line[length], room, "?");
+            continue;
+        }
+        uint8_t type = entry->type[argument];
+        logArgument value = entry->argument[argument++];
+        double number = value.i;
+        if (type == LOG_ARGUMENT_FLOAT) {
+            number = value.f;
+        } else if (type == LOG_ARGUMENT_UNSIGNED) {
+            number = value.u;
+        }
+
+        if (strchr("fFeEgG", conversion) != NULL) {
+            spec[s++] = conversion;
+            spec[s] = '\0';
+            length += snprintf(&line[length], room, spec, (type == LOG_ARGUMENT_STRING) ? 0.0 : number);
+        } else if (strchr("diouxXc", conversion) != NULL) {
+            spec[s++] = conversion;
+            spec[s] = '\0';
+            if (type == LOG_ARGUMENT_UNSIGNED) {
+                length += snprintf(&line[length], room, spec, (unsigned int)value.u);
+            } else {
+                length += snprintf(&line[length], room, spec, (type == LOG_ARGUMENT_STRING) ? 0 : (int)number);
+            }
+        } else if (conversion == 's') {
+            spec[s++] = 's';
+            spec[s] = '\0';
+            length += snprintf(&line[length], room, spec, ((type == LOG_ARGUMENT_STRING) && (value.s != NULL)) ? value.s : "?");
+        } else {
+            length += snprintf(&line[length], room, "?");
+        }
+    }
+    length = min(length, sizeof(line) - 1);
+    line[length] = '\0';
+
+    Serial.println(line);
+    _printed++;
+}
@@ -0,0 +1,172 @@
+/**
+ *   Deferred Log of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define LOG_RING_SIZE           64      // Messages buffered per core, must be a power of 2
+#define LOG_MAX_ARGS            6       // Arguments a message may have
+#define LOG_LINE_LENGTH         160     // Longest formatted line, longer ones are cut
+#define LOG_POLL_MS             20      // Logging task checks for new messages this often
+#define LOG_CORES               2       // Each core of the ESP32 has its own ring
+
+/**************************************************************************/
+/*!
+  @brief  Levels of the log. A message is logged if its level is at most
+  the level set with Logger.setLevel().
+*/
+/**************************************************************************/
+typedef enum {
+  LOG_LEVEL_NONE,           //!< Log nothing
+  LOG_LEVEL_ERROR,          //!< Something failed
+  LOG_LEVEL_WARNING,        //!< Something is off, but the machine keeps working
+  LOG_LEVEL_INFO,           //!< State changes worth knowing about
+  LOG_LEVEL_DEBUG           //!< Details of every move, for debugging only
+} logLevel;
+
+/**************************************************************************/
+/*!
+  @brief  Argument of a message, tagged by logArgumentType.
+*/
+/**************************************************************************/
+typedef union {
+  int32_t i;
+  uint32_t u;
+  float f;
+  const char *s;
+} logArgument;
+
+typedef enum {
+  LOG_ARGUMENT_INT,
+  LOG_ARGUMENT_UNSIGNED,
+  LOG_ARGUMENT_FLOAT,
+  LOG_ARGUMENT_STRING
+} logArgumentType;
+
+/**************************************************************************/
+/*!
+  @brief  A message as it waits in the ring. The format string is the ID of
+  the message, it is only read when the message gets formatted.
+*/
+/**************************************************************************/
+typedef struct {
+  volatile uint32_t sequence; /*> Position in the ring this slot is ready for */
+  const char *format;         /*> printf style format, must be a string literal */
+  uint32_t timestamp;         /*> millis() at the time of logging */
+  uint8_t level;              /*> logLevel */
+  uint8_t count;              /*> Number of arguments */
+  uint8_t type[LOG_MAX_ARGS]; /*> logArgumentType of each argument */
+  logArgument argument[LOG_MAX_ARGS];
+} logEntry;
+
+/**************************************************************************/
+/*!
+  @brief  Allocation free logging for time critical code. A call only copies
+  the pointer to the format string and the arguments into a lock-free ring
+  of the core it runs on and never blocks. A low priority task formats the
+  messages later and prints them to Serial. If the ring is full the message
+  is dropped and counted. Messages above the level are discarded right away,
+  so logging can stay in production code.
+
+  Arguments are integers, floats and strings. Strings are printed later,
+  they must outlive the call, e.g. string literals or names of patterns.
+  The conversions of the format are matched against the type of the
+  arguments, a %d of a float prints the float truncated, not garbage.
+*/
+/**************************************************************************/
+class DeferredLog {
+    public:
+        /*!
+          @brief Start the task printing the messages. Can be called more than once.
+        */
+        void begin();
+
+        /*!
+          @brief Select which messages are logged.
+          @param level messages up to this level are logged
+        */
+        void setLevel(logLevel level) { _level = level; }
+
+        //! Current level
+        logLevel getLevel() { return (logLevel)_level; }
+
+        //! True if messages of this level are logged
+        bool isEnabled(logLevel level) { return level <= _level; }
+
+        /*!
+          @brief Log a message. Safe to call from any task on any core, but not from an ISR.
+          @param level logLevel of the message
+          @param format printf style format, must be a string literal
+          @param args up to LOG_MAX_ARGS integers, floats or strings
+          @return false if the message was discarded or dropped
+        */
+        template <typename... Args>
+        bool log(logLevel level, const char *format, Args... args) {
+            static_assert(sizeof...(args) <= LOG_MAX_ARGS, "Too many arguments for a log message");
+            if (level > _level) {
+                return false;
+            }
+            uint32_t position;
+            logEntry *entry = _reserve(&position);
+            if (entry == NULL) {
+                return false;
+            }
+            entry->format = format;
+            entry->timestamp = millis();
+            entry->level = level;
+            entry->count = sizeof...(args);
+            _store(entry, 0, args...);
+            _commit(entry, position);
+            return true;
+        }
+
+        //! Number of messages dropped because a ring was full
+        unsigned long getDropped() { return _dropped; }
+
+        //! Number of messages printed
+        unsigned long getPrinted() { return _printed; }
+
+    protected:
+        logEntry _ring[LOG_CORES][LOG_RING_SIZE];
+        volatile uint32_t _head[LOG_CORES] = {};    // Next position to reserve, shared by the producers of a core
+        uint32_t _tail[LOG_CORES] = {};             // Next position to print, only changed by the logging task
+        volatile uint8_t _level = LOG_LEVEL_INFO;
+        volatile unsigned long _dropped = 0;
+        unsigned long _printed = 0;
+        TaskHandle_t _taskLogHandle = NULL;
+        bool _initialized = false;
+
+        logEntry *_reserve(uint32_t *position);
+        void _commit(logEntry *entry, uint32_t position);
+        void _print(const logEntry *entry);
+        static void _logImpl(void* _this) { static_cast<DeferredLog*>(_this)->_logTask(); }
+        void _logTask();
+
+        // Copy each argument with its type
+        void _store(logEntry *entry, unsigned int i) {}
+        template <typename T, typename... Rest>
+        void _store(logEntry *entry, unsigned int i, T first, Rest... rest) {
+            _storeArgument(entry, i, first);
+            _store(entry, i + 1, rest...);
+        }
+        void _storeArgument(logEntry *entry, unsigned int i, int value) { entry->type[i] = LOG_ARGUMENT_INT; entry->argument[i].i = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, long value) { entry->type[i] = LOG_ARGUMENT_INT; entry->argument[i].i = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, bool value) { entry->type[i] = LOG_ARGUMENT_INT; entry->argument[i].i = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, char value) { entry->type[i] = LOG_ARGUMENT_INT; entry->argument[i].i = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, unsigned int value) { entry->type[i] = LOG_ARGUMENT_UNSIGNED; entry->argument[i].u = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, unsigned long value) { entry->type[i] = LOG_ARGUMENT_UNSIGNED; entry->argument[i].u = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, float value) { entry->type[i] = LOG_ARGUMENT_FLOAT; entry->argument[i].f = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, double value) { entry->type[i] = LOG_ARGUMENT_FLOAT; entry->argument[i].f = value; }
+        void _storeArgument(logEntry *entry, unsigned int i, const char *value) { entry->type[i] = LOG_ARGUMENT_STRING; entry->argument[i].s = value; }
+};
+
+extern DeferredLog Logger;
@@ -0,0 +1,524 @@
+#include <Arduino.h>
+#include <MotionPlanner.h>
+
+void MotionPlanner::reset(float position) {
+    _head = 0;
+    _count = 0;
+    _time = 0.0;
+    _startPosition = position;
+    _startVelocity = 0.0;
+    _position = position;
+    _velocity = 0.0;
+}
+
+void MotionPlanner::setLimits(float maxSpeed, float maxAcceleration) {
+    _maxSpeed = maxSpeed;
+    _maxAcceleration = maxAcceleration;
+}
+
+void MotionPlanner::setTravel(float minPosition, float maxPosition) {
+    _minPosition = minPosition;
+    _maxPosition = maxPosition;
+}
+
+void MotionPlanner::setRetargetTime(float retargetTime) {
+    _retargetTime = max(0.0f, retargetTime);
+}
+
+bool MotionPlanner::addMove(float target, float speed, float acceleration, float jerk, int index, bool clipping, float deficit) {
+    // Find out where the new move starts and whether the speed at this point is already fixed
+    float start = _startPosition;
+    float velocity = _startVelocity;
+    bool fixed = true;
+    plannerBlock *previous = NULL;
+
+    if (_count > 0) {
+        previous = _at(_count - 1);
+        start = previous->target;
+        velocity = (previous->target >= previous->start) ? previous->exitSpeed : -previous->exitSpeed;
+        fixed = previous->locked;
+    }
+
+    if (isFull() || (speed <= 0.0) || (acceleration <= 0.0)) {
+        return false;
+    }
+
+    float distance = target - start;
+
+    // The executing move ends with a fixed speed. Check if the new target can be reached from there.
+    if ((fixed == true) && (velocity != 0.0)) {
+        float stoppingDistance = _rampDistance(abs(velocity), 0.0, acceleration, jerk);
+
+        // Brake as gently as the new move, unless this takes longer than the retarget time allows
+        float braking = acceleration;
+        float brakingJerk = jerk;
+        if (abs(velocity) > acceleration * _retargetTime) {
+            braking = (_retargetTime > 0.0) ? min(abs(velocity) / _retargetTime, _maxAcceleration) : _maxAcceleration;
+            braking = max(braking, acceleration);
+            brakingJerk = 0.0;
+        }
+
+        if ((distance * velocity > 0.0) && (stoppingDistance > abs(distance))) {
+            // Crash avoidance: Same direction, but too close. Brake harder without jerk limit, if this 
+            // is within the retarget time. Otherwise overshoot and come back.
+            float requiredAcceleration = velocity * velocity / (2.0 * abs(distance));
+            if (requiredAcceleration <= braking) {
+                acceleration = max(acceleration, requiredAcceleration);
+                jerk = 0.0;
+                stoppingDistance = 0.0;
+            }
+        }
+
+        if ((distance * velocity <= 0.0) || (stoppingDistance > abs(distance))) {
+            // Moving away from target or overshooting it: come to a halt first
+            if (_count + 2 > PLANNER_BUFFER_SIZE) {
+                return false;
+            }
+
+            // Never overshoot the travel
+            float room = (velocity > 0.0) ? _maxPosition - start : start - _minPosition;
+            if (_rampDistance(abs(velocity), 0.0, braking, brakingJerk) > room) {
+                braking = (room > 0.0) ? max(braking, min(velocity * velocity / (2.0f * room), _maxAcceleration)) : _maxAcceleration;
+                brakingJerk = 0.0;
+            }
+            start = _addStop(start, velocity, index, braking, brakingJerk);
+            previous = _at(_count - 1);
+            distance = target - start;
+        }
+    }
+
+    // Nothing to do for a move without distance
+    if (abs(distance) < 0.5) {
+        return true;
+    }
+
+    plannerBlock *block = _append();
+    block->start = start;
+    block->target = target;
+    block->speed = speed;
+    block->acceleration = acceleration;
+    block->jerk = jerk;
+    block->index = index;
+    block->dwell = false;
+    block->clipping = clipping;
+    block->deficit = deficit;
+
+    // Moves in the same direction may be joined without stopping
+    block->maxEntrySpeed = 0.0;
+    if ((previous != NULL) && (previous->dwell == false)
+        && ((previous->target - previous->start) * distance > 0.0)) {
+        block->maxEntrySpeed = min(previous->speed, speed);
+    }
+
+    _plan();
+    return true;
+}
+
+bool MotionPlanner::addDwell(float duration, int index) {
+    // Come to a halt first, should the executing move end with speed
+    plannerBlock *previous = (_count > 0) ? _at(_count - 1) : NULL;
+    float start = (previous != NULL) ? previous->target : _startPosition;
+    float velocity = _startVelocity;
+    if (previous != NULL) {
+        velocity = (previous->locked == false) ? 0.0 :
+            ((previous->target >= previous->start) ? previous->exitSpeed : -previous->exitSpeed);
+    }
+
+    if (_count + ((velocity != 0.0) ? 2 : 1) > PLANNER_BUFFER_SIZE) {
+        return false;
+    }
+
+    if (velocity != 0.0) {
+        start = _addStop(start, velocity, index, _maxAcceleration, 0.0);
+    }
+
+    plannerBlock *block = _append();
+    block->start = start;
+    block->target = start;
+    block->speed = 0.0;
+    block->acceleration = 0.0;
+    block->jerk = 0.0;
+    block->maxEntrySpeed = 0.0;
+    block->duration = duration;
+    block->index = index;
+    block->dwell = true;
+    block->clipping = false;
+    block->deficit = 0.0;
+
+    _plan();
+    return true;
+}
+
+unsigned int MotionPlanner::stretch(int firstIndex, int lastIndex, float factor) {
+    unsigned int stretched = 0;
+
+    if (factor <= 1.0) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < _count; i++) {
+        plannerBlock *block = _at(i);
+        if ((block->locked == true) || (block->dwell == true) 
+                || (block->index < firstIndex) || (block->index > lastIndex)) {
+            continue;
+        }
+
+        // A move joined to the executing one enters at its fixed exit speed, slowed down it would overshoot
+        if ((i > 0) && (_at(i - 1)->locked == true) && (_at(i - 1)->exitSpeed > 0.0)) {
+            continue;
+        }
+        block->deficit += block->duration * (factor - 1.0);
+        block->speed /= factor;
+        block->acceleration /= factor * factor;
+        block->jerk /= factor * factor * factor;
+        stretched++;
+
+        // Junctions to the neighbours can't be faster than the slowed down move
+        block->maxEntrySpeed = min(block->maxEntrySpeed, block->speed);
+        if ((i + 1 < _count) && (_at(i + 1)->maxEntrySpeed > block->speed)) {
+            _at(i + 1)->maxEntrySpeed = block->speed;
+        }
+    }
+
+    if (stretched > 0) {
+        _plan();
+    }
+    return stretched;
+}
+
+void MotionPlanner::invalidate(bool keepCurrent) {
+    if (_count == 0) {
+        return;
+    }
+
+    // Nothing executed yet, so everything can go
+    if (_at(0)->locked == false) {
+        _count = 0;
+        return;
+    }
+
+    // Keep the executing move if it comes to a halt anyway
+    if ((keepCurrent == true) && (_at(0)->exitSpeed == 0.0)) {
+        _count = 1;
+        return;
+    }
+
+    _truncate();
+}
+
+void MotionPlanner::stop() {
+    invalidate(false);
+
+    if (_count == 0 && _startVelocity != 0.0) {
+        _addStop(_startPosition, _startVelocity, -1, _maxAcceleration, 0.0);
+        _plan();
+    }
+}
+
+const plannerBlock *MotionPlanner::nextSlice(float dt) {
+    plannerBlock *started = NULL;
+
+    // Never leave the machine running without a plan
+    if (_count == 0 && _startVelocity != 0.0) {
+        stop();
+    }
+
+    if (_count == 0) {
+        _time = 0.0;
+        _position = _startPosition;
+        _velocity = 0.0;
+        return NULL;
+    }
+
+    if (_at(0)->locked == false) {
+        _at(0)->locked = true;
+        started = _at(0);
+    }
+
+    _time += dt;
+
+    // Step over all moves that ended during this slice
+    while ((_count > 0) && (_time >= _at(0)->duration)) {
+        plannerBlock *block = _at(0);
+        _time -= block->duration;
+        _startPosition = block->target;
+        _startVelocity = (block->target >= block->start) ? block->exitSpeed : -block->exitSpeed;
+        _head = (_head + 1) % PLANNER_BUFFER_SIZE;
+        _count--;
+
+        if (_count > 0) {
+            _at(0)->locked = true;
+            started = _at(0);
+        }
+    }
+
+    if (_count == 0) {
+        _time = 0.0;
+        _position = _startPosition;
+        _velocity = _startVelocity;
+    } else {
+        _evaluate(_at(0), _time, &_position, &_velocity);
+    }
+
+    return started;
+}
+
+float MotionPlanner::bufferedTime() {
+    float time = -_time;
+    for (unsigned int i = 0; i < _count; i++) {
+        time += _at(i)->duration;
+    }
+    return max(0.0f, time);
+}
+
+plannerBlock *MotionPlanner::_append() {
+    plannerBlock *block = _at(_count);
+    _count++;
+    block->locked = false;
+    block->entrySpeed = 0.0;
+    block->exitSpeed = 0.0;
+    block->duration = 0.0;
+    block->phases = 0;
+    return block;
+}
+
+float MotionPlanner::_addStop(float start, float velocity, int index, float acceleration, float jerk) {
+    float distance = _rampDistance(abs(velocity), 0.0, acceleration, jerk);
+    float target = (velocity > 0.0) ? start + distance : start - distance;
+
+    plannerBlock *block = _append();
+    block->start = start;
+    block->target = target;
+    block->speed = abs(velocity);
+    block->acceleration = acceleration;
+    block->jerk = jerk;
+    block->maxEntrySpeed = abs(velocity);
+    block->index = index;
+    block->dwell = false;
+    block->clipping = false;
+    block->deficit = 0.0;
+
+    return target;
+}
+
+void MotionPlanner::_truncate() {
+    // Cut the executing move at the current state and forget everything else
+    _evaluate(_at(0), _time, &_startPosition, &_startVelocity);
+    _count = 0;
+    _time = 0.0;
+}
+
+void MotionPlanner::_plan() {
+    unsigned int first = 0;
+    float entrySpeed = abs(_startVelocity);
+
+    // The executing move is fixed. Planning starts with its exit speed.
+    if ((_count > 0) && (_at(0)->locked == true)) {
+        first = 1;
+        entrySpeed = _at(0)->exitSpeed;
+    }
+
+    if (first >= _count) {
+        return;
+    }
+
+    // Backward pass: Each move must be able to come to a halt at the end of the buffer
+    float exitSpeed = 0.0;
+    for (unsigned int i = _count; i-- > first; ) {
+        plannerBlock *block = _at(i);
+        block->exitSpeed = exitSpeed;
+        if (block->dwell == true) {
+            block->entrySpeed = 0.0;
+        } else {
+            block->entrySpeed = min(block->maxEntrySpeed,
+                _reachableSpeed(exitSpeed, abs(block->target - block->start), block->acceleration, block->jerk));
+        }
+        exitSpeed = block->entrySpeed;
+    }
+
+    // Forward pass: Each move must be able to reach its exit speed from its entry speed
+    for (unsigned int i = first; i < _count; i++) {
+        plannerBlock *block = _at(i);
+        block->entrySpeed = entrySpeed;
+        if (block->dwell == true) {
+            block->exitSpeed = 0.0;
+        } else {
+            block->exitSpeed = min(block->exitSpeed,
+                _reachableSpeed(entrySpeed, abs(block->target - block->start), block->acceleration, block->jerk));
+        }
+        entrySpeed = block->exitSpeed;
+        _calculateProfile(block);
+    }
+}
+
+void MotionPlanner::_calculateProfile(plannerBlock *block) {
+    // A pause is a single phase standing still
+    if (block->dwell == true) {
+        block->phases = 1;
+        block->phase[0].duration = block->duration;
+        block->phase[0].position = block->start;
+        block->phase[0].velocity = 0.0;
+        block->phase[0].acceleration = 0.0;
+        block->phase[0].jerk = 0.0;
+        return;
+    }
+
+    float distance = abs(block->target - block->start);
+    float direction = (block->target >= block->start) ? 1.0 : -1.0;
+    float a = block->acceleration;
+    float j = block->jerk;
+    float v0 = block->entrySpeed;
+    float v1 = block->exitSpeed;
+    float speed = max(block->speed, v0);
+
+    // Peak speed of the profile, limited by the speed of the move
+    float peakSpeed = speed;
+    if (j <= 0.0) {
+        peakSpeed = min(speed, sqrtf(a * distance + 0.5 * (v0 * v0 + v1 * v1)));
+    } else if (_rampDistance(v0, speed, a, j) + _rampDistance(speed, v1, a, j) > distance) {
+        // No closed form with limited jerk: Bisect the peak speed that exactly covers the distance
+        float low = max(v0, v1);
+        float high = speed;
+        for (int i = 0; i < PLANNER_ITERATIONS; i++) {
+            float middle = 0.5 * (low + high);
+            if (_rampDistance(v0, middle, a, j) + _rampDistance(middle, v1, a, j) > distance) {
+                high = middle;
+            } else {
+                low = middle;
+            }
+        }
+        peakSpeed = low;
+    }
+
+    // Ramp from entry to peak speed, coast and ramp down to exit speed
+    float duration[PLANNER_MAX_PHASES];
+    float acceleration[PLANNER_MAX_PHASES];
+    float jerk[PLANNER_MAX_PHASES];
+    int count = _rampPhases(v0, peakSpeed, a, j, duration, acceleration, jerk);
+    float coastDistance = max(0.0f, distance - _rampDistance(v0, peakSpeed, a, j) - _rampDistance(peakSpeed, v1, a, j));
+    duration[count] = (peakSpeed > 0.0) ? coastDistance / peakSpeed : 0.0;
+    acceleration[count] = 0.0;
+    jerk[count] = 0.0;
+    count++;
+    count += _rampPhases(peakSpeed, v1, a, j, &duration[count], &acceleration[count], &jerk[count]);
+
+    float position = block->start;
+    float velocity = v0;
+    block->phases = 0;
+    block->duration = 0.0;
+    for (int i = 0; i < count; i++) {
+        if (duration[i] <= 0.0) {
+            continue;
+        }
+        float t = duration[i];
+        plannerPhase *phase = &block->phase[block->phases++];
+        phase->duration = t;
+        phase->position = position;
+        phase->velocity = direction * velocity;
+        phase->acceleration = direction * acceleration[i];
+        phase->jerk = direction * jerk[i];
+        position += direction * (velocity * t + 0.5 * acceleration[i] * t * t + jerk[i] * t * t * t / 6.0);
+        velocity += acceleration[i] * t + 0.5 * jerk[i] * t * t;
+        block->duration += t;
+    }
+}
+
+float MotionPlanner::_rampTime(float deltaSpeed, float acceleration, float jerk) {
+    // Trapezoid: constant acceleration
+    if (jerk <= 0.0) {
+        return deltaSpeed / acceleration;
+    }
+
+    // S-curve reaching full acceleration, or a triangular acceleration profile
+    if (deltaSpeed * jerk >= acceleration * acceleration) {
+        return deltaSpeed / acceleration + acceleration / jerk;
+    }
+    return 2.0 * sqrtf(deltaSpeed / jerk);
+}
+
+float MotionPlanner::_rampDistance(float fromSpeed, float toSpeed, float acceleration, float jerk) {
+    // Symmetric ramps travel with the mean of both speeds
+    return 0.5 * (fromSpeed + toSpeed) * _rampTime(abs(toSpeed - fromSpeed), acceleration, jerk);
+}
+
+float MotionPlanner::_reachableSpeed(float speed, float distance, float acceleration, float jerk) {
+    float limit = sqrtf(speed * speed + 2.0 * acceleration * distance);
+    if (jerk <= 0.0) {
+        return limit;
+    }
+
+    // Limited jerk is always slower than the trapezoid. Bisect between both.
+    float low = speed;
+    float high = limit;
+    for (int i = 0; i < PLANNER_ITERATIONS; i++) {
+        float middle = 0.5 * (low + high);
+        if (_rampDistance(speed, middle, acceleration, jerk) > distance) {
+            high = middle;
+        } else {
+            low = middle;
+        }
+    }
+    return low;
+}
+
+int MotionPlanner::_rampPhases(float fromSpeed, float toSpeed, float acceleration, float jerk, float *duration, float *startAcceleration, float *phaseJerk) {
+    float deltaSpeed = abs(toSpeed - fromSpeed);
+    float sign = (toSpeed >= fromSpeed) ? 1.0 : -1.0;
+
+    if (deltaSpeed <= 0.0) {
+        return 0;
+    }
+
+    // Trapezoid: a single phase of constant acceleration
+    if (jerk <= 0.0) {
+        duration[0] = deltaSpeed / acceleration;
+        startAcceleration[0] = sign * acceleration;
+        phaseJerk[0] = 0.0;
+        return 1;
+    }
+
+    // Triangular acceleration profile: full acceleration is never reached
+    if (deltaSpeed * jerk < acceleration * acceleration) {
+        float rampTime = sqrtf(deltaSpeed / jerk);
+        duration[0] = rampTime;
+        startAcceleration[0] = 0.0;
+        phaseJerk[0] = sign * jerk;
+        duration[1] = rampTime;
+        startAcceleration[1] = sign * jerk * rampTime;
+        phaseJerk[1] = -sign * jerk;
+        return 2;
+    }
+
+    // Build up acceleration, hold it and reduce it again
+    float rampTime = acceleration / jerk;
+    duration[0] = rampTime;
+    startAcceleration[0] = 0.0;
+    phaseJerk[0] = sign * jerk;
+    duration[1] = deltaSpeed / acceleration - rampTime;
+    startAcceleration[1] = sign * acceleration;
+    phaseJerk[1] = 0.0;
+    duration[2] = rampTime;
+    startAcceleration[2] = sign * acceleration;
+    phaseJerk[2] = -sign * jerk;
+    return 3;
+}
+
+void MotionPlanner::_evaluate(const plannerBlock *block, float time, float *position, float *velocity) {
+    // Snap to the target once the move is done to avoid accumulating rounding errors
+    if (time >= block->duration || block->phases == 0) {
+        *position = block->target;
+        *velocity = (block->target >= block->start) ? block->exitSpeed : -block->exitSpeed;
+        return;
+    }
+
+    for (uint8_t i = 0; i < block->phases; i++) {
+        const plannerPhase *phase = &block->phase[i];
+        if ((time < phase->duration) || (i == block->phases - 1)) {
+            *position = phase->position + phase->velocity * time + 0.5 * phase->acceleration * time * time
+                + phase->jerk * time * time * time / 6.0;
+            *velocity = phase->velocity + phase->acceleration * time + 0.5 * phase->jerk * time * time;
+            return;
+        }
+        time -= phase->duration;
+    }
+}
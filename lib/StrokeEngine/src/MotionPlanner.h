@@ -0,0 +1,203 @@
+/**
+ *   Motion Planner of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define PLANNER_LOOKAHEAD_DEPTH     4       // Number of pre-planned moves kept in the lookahead buffer
+#define PLANNER_BUFFER_SIZE         (PLANNER_LOOKAHEAD_DEPTH + 2) // Room for additional stopping moves
+#define PLANNER_MAX_PHASES          7       // Jerk-limited acceleration, coasting & deceleration
+#define PLANNER_ITERATIONS          16      // Bisection steps when solving jerk-limited profiles
+
+/**************************************************************************/
+/*!
+  @brief  One phase of a motion profile with constant jerk. Position, velocity
+  and acceleration are given at the start of the phase in absolute coordinates.
+*/
+/**************************************************************************/
+typedef struct {
+    float duration;         //!< Duration of the phase in [s]
+    float position;         //!< Position at the start of the phase in [steps]
+    float velocity;         //!< Signed velocity at the start of the phase in [steps/s]
+    float acceleration;     //!< Signed acceleration at the start of the phase in [steps/s²]
+    float jerk;             //!< Signed jerk during the phase in [steps/s³]
+} plannerPhase;
+
+/**************************************************************************/
+/*!
+  @brief  A move inside the lookahead buffer. Speeds at the junctions are
+  magnitudes along the direction of the move.
+*/
+/**************************************************************************/
+typedef struct {
+    float start;            //!< Position at the start of the move in [steps]
+    float target;           //!< Target position of the move in [steps]
+    float speed;            //!< Maximum speed of the move in [steps/s]
+    float acceleration;     //!< Acceleration and deceleration of the move in [steps/s²]
+    float jerk;             //!< Jerk limit of the move in [steps/s³], 0 for a trapezoidal profile
+    float maxEntrySpeed;    //!< Highest speed allowed at the junction to the previous move
+    float entrySpeed;       //!< Planned speed at the start of the move
+    float exitSpeed;        //!< Planned speed at the end of the move
+    float duration;         //!< Duration of the planned move in [s]
+    int index;              //!< Stroke index of the pattern this move belongs to
+    bool dwell;             //!< Move without motion, pauses for duration
+    bool clipping;          //!< Speed or acceleration had to be limited
+    float deficit;          //!< Time the move takes longer than the pattern requested in [s]
+    bool locked;            //!< Move is executing, its profile must not change anymore
+    uint8_t phases;         //!< Number of valid phases
+    plannerPhase phase[PLANNER_MAX_PHASES];
+} plannerBlock;
+
+/**************************************************************************/
+/*!
+  @brief  Lookahead motion planner. It buffers a small number of moves, plans
+  the speeds at their junctions so that consecutive moves in the same
+  direction flow without stopping and samples the resulting motion profile
+  into short time slices. Works entirely in steps and seconds and knows
+  nothing about the stepper hardware.
+*/
+/**************************************************************************/
+class MotionPlanner {
+    public:
+        /*!
+          @brief Forget all moves and start planning from standstill.
+          @param position current position in [steps]
+        */
+        void reset(float position);
+
+        /*!
+          @brief Set the machine limits used for unplanned stopping moves.
+          @param maxSpeed maximum speed in [steps/s]
+          @param maxAcceleration maximum acceleration in [steps/s²]
+        */
+        void setLimits(float maxSpeed, float maxAcceleration);
+
+        /*!
+          @brief Set the travel moves coming to a halt must not overshoot.
+          @param minPosition lowest position in [steps]
+          @param maxPosition highest position in [steps]
+        */
+        void setTravel(float minPosition, float maxPosition);
+
+        /*!
+          @brief Set the time a move appended to a cut motion may take to come to 
+          a halt before it heads for a target behind it or in the opposite direction. 
+          Brakes with the acceleration of the new move if this is fast enough, 
+          otherwise harder up to the machine limit.
+          @param retargetTime time in [s], 0 brakes with the machine limit
+        */
+        void setRetargetTime(float retargetTime);
+
+        /*!
+          @brief Append a move to the lookahead buffer and replan all moves
+          that are not executing yet.
+          @param target target position in [steps]
+          @param speed maximum speed in [steps/s]
+          @param acceleration acceleration in [steps/s²]
+          @param jerk jerk limit in [steps/s³] for an S-curve profile, 0 for a trapezoidal profile
+          @param index stroke index of the pattern
+          @param clipping true if the move was limited by the machine physics
+          @param deficit time in [s] the move takes longer than requested because of the limits
+          @return false if the buffer is full
+        */
+        bool addMove(float target, float speed, float acceleration, float jerk, int index, bool clipping, float deficit);
+
+        /*!
+          @brief Slow down moves that are not executing yet by stretching their
+          motion profile in time. The shape of the profile is kept: speed is
+          divided by factor, acceleration by factor² and jerk by factor³.
+          @param firstIndex stroke index of the first move to stretch
+          @param lastIndex stroke index of the last move to stretch
+          @param factor time factor, > 1.0 slows down
+          @return number of moves stretched
+        */
+        unsigned int stretch(int firstIndex, int lastIndex, float factor);
+
+        /*!
+          @brief Append a pause to the lookahead buffer.
+          @param duration duration of the pause in [s]
+          @param index stroke index of the last move of the pattern
+          @return false if the buffer is full
+        */
+        bool addDwell(float duration, int index);
+
+        /*!
+          @brief Drop pre-planned moves because their parameters are outdated.
+          @param keepCurrent if true the executing move runs to its target if it
+                        ends in standstill. Otherwise the motion is cut at the
+                        current state and new moves continue from there with
+                        continuous velocity.
+        */
+        void invalidate(bool keepCurrent);
+
+        /*!
+          @brief Cut the current motion and come to a halt with maximum acceleration.
+        */
+        void stop();
+
+        /*!
+          @brief Advance the planner by a time slice.
+          @param dt length of the time slice in [s]
+          @return pointer to the move which started during this slice or NULL
+        */
+        const plannerBlock *nextSlice(float dt);
+
+        //! Position at the end of the last slice in [steps]
+        float getPosition() { return _position; }
+
+        //! Signed velocity at the end of the last slice in [steps/s]
+        float getVelocity() { return _velocity; }
+
+        //! Target of the last move in the buffer in [steps]
+        float getEndPosition() { return (_count > 0) ? _at(_count - 1)->target : _startPosition; }
+
+        //! Number of moves in the buffer, including the executing one
+        unsigned int count() { return _count; }
+
+        //! True if the buffer is full
+        bool isFull() { return _count >= PLANNER_BUFFER_SIZE; }
+
+        //! True if there is no move left to execute
+        bool isIdle() { return _count == 0; }
+
+        //! Oldest move in the buffer, the executing one if it is locked. NULL if idle.
+        const plannerBlock *current() { return (_count > 0) ? &_block[_head] : NULL; }
+
+        //! Time until all buffered moves are executed in [s]
+        float bufferedTime();
+
+    protected:
+        plannerBlock _block[PLANNER_BUFFER_SIZE];
+        unsigned int _head = 0;
+        unsigned int _count = 0;
+        float _time = 0.0;              // Time into the executing move
+        float _startPosition = 0.0;     // Position at the start of the oldest move
+        float _startVelocity = 0.0;     // Signed velocity at the start of the oldest move
+        float _position = 0.0;
+        float _velocity = 0.0;
+        float _maxSpeed = 1.0;
+        float _maxAcceleration = 1.0;
+        float _retargetTime = 0.0;
+        float _minPosition = -INFINITY;
+        float _maxPosition = INFINITY;
+        plannerBlock *_at(unsigned int i) { return &_block[(_head + i) % PLANNER_BUFFER_SIZE]; }
+        plannerBlock *_append();
+        float _addStop(float start, float velocity, int index, float acceleration, float jerk);
+        void _truncate();
+        void _plan();
+        void _calculateProfile(plannerBlock *block);
+        float _rampTime(float deltaSpeed, float acceleration, float jerk);
+        float _rampDistance(float fromSpeed, float toSpeed, float acceleration, float jerk);
+        float _reachableSpeed(float speed, float distance, float acceleration, float jerk);
+        int _rampPhases(float fromSpeed, float toSpeed, float acceleration, float jerk, float *duration, float *startAcceleration, float *phaseJerk);
+        void _evaluate(const plannerBlock *block, float time, float *position, float *velocity);
+};
@@ -0,0 +1,443 @@
+#include <PatternVM.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_FLOAT,
+    OPERAND_INTEGER,
+    OPERAND_READ,
+    OPERAND_WRITE,
+    OPERAND_ADDRESS
+} operandType;
+
+typedef struct {
+    const char *mnemonic;
+    operandType operand;
+    uint8_t pops;
+    uint8_t pushes;
+} instructionInfo;
+
+// Indexed by PatternVMOpcode
+static const instructionInfo instructions[VM_OPCODES] = {
+    {"end", OPERAND_NONE, 0, 0},
+    {"push", OPERAND_FLOAT, 0, 1},
+    {"pushi", OPERAND_INTEGER, 0, 1},
+    {"load", OPERAND_READ, 0, 1},
+    {"store", OPERAND_WRITE, 1, 0},
+    {"jmp", OPERAND_ADDRESS, 0, 0},
+    {"jz", OPERAND_ADDRESS, 1, 0},
+    {"dup", OPERAND_NONE, 1, 2},
+    {"drop", OPERAND_NONE, 1, 0},
+    {"swap", OPERAND_NONE, 2, 2},
+    {"add", OPERAND_NONE, 2, 1},
+    {"sub", OPERAND_NONE, 2, 1},
+    {"mul", OPERAND_NONE, 2, 1},
+    {"div", OPERAND_NONE, 2, 1},
+    {"mod", OPERAND_NONE, 2, 1},
+    {"min", OPERAND_NONE, 2, 1},
+    {"max", OPERAND_NONE, 2, 1},
+    {"lt", OPERAND_NONE, 2, 1},
+    {"le", OPERAND_NONE, 2, 1},
+    {"eq", OPERAND_NONE, 2, 1},
+    {"not", OPERAND_NONE, 1, 1},
+    {"neg", OPERAND_NONE, 1, 1},
+    {"abs", OPERAND_NONE, 1, 1},
+    {"floor", OPERAND_NONE, 1, 1},
+    {"sqrt", OPERAND_NONE, 1, 1}
+};
+
+// Indexed by PatternVMRegister, variables are v0 - v15
+static const char *registerNames[VM_REG_VARIABLE] = {
+    "index", "stroke", "depth", "time_of_stroke", "sensation", "max_speed", "max_acceleration",
+    "steps_per_mm", "time", "position", "speed", "acceleration", "skip"
+};
+
+// In & out take half the time of stroke each, 1/3 accelerating, 1/3 coasting, 1/3 braking
+const char patternVMSimpleStroke[] =
+    "load time_of_stroke\n"
+    "push 0.5\n"
+    "mul\n"
+    "store v0               # time of a move\n"
+    "push 1.5\n"
+    "load stroke\n"
+    "mul\n"
+    "load v0\n"
+    "div\n"
+    "floor\n"
+    "dup\n"
+    "store speed\n"
+    "push 3\n"
+    "mul\n"
+    "load v0\n"
+    "div\n"
+    "store acceleration\n"
+    "load depth\n"
+    "load index\n"
+    "push 2\n"
+    "mod\n"
+    "jz in                  # even moves go in to the depth\n"
+    "load stroke\n"
+    "sub\n"
+    "in:\n"
+    "store position\n"
+    "end\n";
+
+#define VM_LABELS               32      // Labels an assembly may define
+#define VM_TOKEN_LENGTH         24      // Longest mnemonic, register or label
+
+static size_t operandLength(operandType operand) {
+    if (operand == OPERAND_NONE) {
+        return 0;
+    }
+    return (operand == OPERAND_FLOAT) ? 4 : 1;
+}
+
+int PatternVM::validate(const uint8_t *code, size_t length) {
+    if ((length == 0) || (length > VM_CODE_SIZE)) {
+        return 0;
+    }
+
+    // First pass marks where instructions start, jumps may only go there
+    uint8_t starts[VM_CODE_SIZE / 8] = {};
+    size_t address = 0;
+    while (address < length) {
+        uint8_t opcode = code[address];
+        if (opcode >= VM_OPCODES) {
+            return address;
+        }
+        const instructionInfo *info = &instructions[opcode];
+        if (address + 1 + operandLength(info->operand) > length) {
+            return address;
+        }
+        if ((info->operand == OPERAND_READ) && (code[address + 1] >= VM_REGISTERS)) {
+            return address;
+        }
+        if ((info->operand == OPERAND_WRITE) && ((code[address + 1] >= VM_REGISTERS) || (code[address + 1] < VM_REG_POSITION))) {
+            return address;
+        }
+        starts[address / 8] |= 1 << (address % 8);
+        address += 1 + operandLength(info->operand);
+    }
+
+    for (address = 0; address < length; address += 1 + operandLength(instructions[code[address]].operand)) {
+        if (instructions[code[address]].operand == OPERAND_ADDRESS) {
+            uint8_t target = code[address + 1];
+            if ((target >= length) || ((starts[target / 8] & (1 << (target % 8))) == 0)) {
+                return address;
+            }
+        }
+    }
+    return -1;
+}
+
+static int nextToken(const char **c, char *token) {
+    // Tokens are separated by whitespace, a comment runs until the end of the line
+    while ((**c == ' ') || (**c == '\t') || (**c == '\r')) {
+        (*c)++;
+    }
+    if (**c == '#') {
+        while ((**c != '\n') && (**c != '\0')) {
+            (*c)++;
+        }
+    }
+    size_t length = 0;
+    while ((**c != '\0') && (isspace((unsigned char)**c) == 0) && (**c != '#')) {
+        if (length + 1 >= VM_TOKEN_LENGTH) {
+            return -1;
+        }
+        token[length++] = tolower((unsigned char)**c);
+        (*c)++;
+    }
+    token[length] = '\0';
+    return (length > 0) ? 1 : 0;
+}
+
+static int findRegister(const char *token) {
+    for (int i = 0; i < VM_REG_VARIABLE; i++) {
+        if (strcmp(token, registerNames[i]) == 0) {
+            return i;
+        }
+    }
+    if (token[0] == 'v') {
+        char *end;
+        long variable = strtol(&token[1], &end, 10);
+        if ((end != &token[1]) && (*end == '\0') && (variable >= 0) && (variable < VM_VARIABLES)) {
+            return VM_REG_VARIABLE + variable;
+        }
+    }
+    return -1;
+}
+
+int PatternVM::assemble(const char *source, uint8_t *code, size_t maxLength, size_t *length) {
+    char labels[VM_LABELS][VM_TOKEN_LENGTH];
+    int addresses[VM_LABELS];
+    unsigned int labelCount = 0;
+    size_t total = 0;
+    *length = 0;
+
+    // Sizes don't depend on labels, so the first pass finds the addresses of the labels and the second emits the code
+    for (int pass = 0; pass < 2; pass++) {
+        const char *c = source;
+        size_t address = 0;
+        int line = 1;
+        while (*c != '\0') {
+            char token[VM_TOKEN_LENGTH];
+            char operand[VM_TOKEN_LENGTH];
+            int found = nextToken(&c, token);
+            if (found < 0) {
+                return line;
+            }
+            if (found > 0) {
+                size_t tokenLength = strlen(token);
+                if (token[tokenLength - 1] == ':') {
+                    // Label, defined on its own line
+                    token[tokenLength - 1] = '\0';
+                    if (pass == 0) {
+                        for (unsigned int i = 0; i < labelCount; i++) {
+                            if (strcmp(labels[i], token) == 0) {
+                                return line;
+                            }
+                        }
+                        if ((tokenLength < 2) || (labelCount >= VM_LABELS)) {
+                            return line;
+                        }
+                        strcpy(labels[labelCount], token);
+                        addresses[labelCount++] = address;
+                    }
+                } else {
+                    int opcode = 0;
+                    while ((opcode < VM_OPCODES) && (strcmp(token, instructions[opcode].mnemonic) != 0)) {
+                        opcode++;
+                    }
+                    if (opcode == VM_OPCODES) {
+                        return line;
+                    }
+                    operandType type = instructions[opcode].operand;
+                    if ((type != OPERAND_NONE) && (nextToken(&c, operand) <= 0)) {
+                        return line;
+                    }
+
+                    // Integer constants fit into a byte
+                    float value = 0.0;
+                    if ((type == OPERAND_FLOAT) || (type == OPERAND_INTEGER)) {
+                        char *end;
+                        value = strtof(operand, &end);
+                        if ((end == operand) || (*end != '\0')) {
+                            return line;
+                        }
+                        if ((value == floorf(value)) && (value >= -128.0) && (value <= 127.0)) {
+                            opcode = VM_PUSHI;
+                            type = OPERAND_INTEGER;
+                        } else if (type == OPERAND_INTEGER) {
+                            return line;
+                        }
+                    }
+
+                    size_t size = 1 + operandLength(type);
+                    if (address + size > maxLength) {
+                        return line;
+                    }
+                    if (pass == 1) {
+                        code[address] = opcode;
+                        if (type == OPERAND_FLOAT) {
+                            memcpy(&code[address + 1], &value, 4);
+                        } else if (type == OPERAND_INTEGER) {
+                            code[address + 1] = (uint8_t)(int8_t)value;
+                        } else if ((type == OPERAND_READ) || (type == OPERAND_WRITE)) {
+                            int reg = findRegister(operand);
+                            if ((reg < 0) || ((type == OPERAND_WRITE) && (reg < VM_REG_POSITION))) {
+                                return line;
+                            }
+                            code[address + 1] = reg;
+                        } else if (type == OPERAND_ADDRESS) {
+                            // A label behind the last instruction is no valid target
+                            unsigned int i = 0;
+                            while ((i < labelCount) && (strcmp(labels[i], operand) != 0)) {
+                                i++;
+                            }
+                            if ((i == labelCount) || (addresses[i] >= (int)total)) {
+                                return line;
+                            }
+                            code[address + 1] = addresses[i];
+                        }
+                    }
+                    address += size;
+                }
+
+                // One instruction or label per line
+                if (nextToken(&c, token) != 0) {
+                    return line;
+                }
+            }
+            if (*c == '\n') {
+                c++;
+                line++;
+            }
+        }
+        if (address == 0) {
+            return line;
+        }
+        total = address;
+    }
+    *length = total;
+    return -1;
+}
+
+bool PatternVM::load(const uint8_t *code, size_t length) {
+    if (validate(code, length) >= 0) {
+        return false;
+    }
+    memcpy(_code, code, length);
+    _length = length;
+    for (int i = 0; i < VM_REGISTERS; i++) {
+        _registers[i] = 0.0;
+    }
+    _instructions = 0;
+    _statistics = {0, 0, 0, VM_FAULT_NONE};
+    return true;
+}
+
+bool PatternVM::run() {
+    float stack[VM_STACK_DEPTH];
+    unsigned int top = 0;
+    size_t pc = 0;
+    _statistics.calls++;
+    _instructions = 0;
+    if (_length == 0) {
+        return _fault(VM_FAULT_NO_CODE);
+    }
+
+    // Moves start where nothing is said otherwise
+    _registers[VM_REG_SKIP] = 0.0;
+
+    while (true) {
+        if (pc >= _length) {
+            return _fault(VM_FAULT_END_OF_CODE);
+        }
+        if (_instructions >= VM_BUDGET) {
+            return _fault(VM_FAULT_BUDGET);
+        }
+        _instructions++;
+
+        // Validation guarantees the operands, the stack is checked once for all instructions
+        uint8_t opcode = _code[pc];
+        const instructionInfo *info = &instructions[opcode];
+        if ((top < info->pops) || (top - info->pops + info->pushes > VM_STACK_DEPTH)) {
+            return _fault(VM_FAULT_STACK);
+        }
+        uint8_t operand = (info->operand != OPERAND_NONE) ? _code[pc + 1] : 0;
+        pc += 1 + operandLength(info->operand);
+        float *a = (top > 1) ? &stack[top - 2] : stack;
+        float b = (top > 0) ? stack[top - 1] : 0.0;
+
+        switch (opcode) {
+            case VM_END:
+                if ((isfinite(_registers[VM_REG_POSITION]) == false) || (isfinite(_registers[VM_REG_SPEED]) == false)
+                    || (isfinite(_registers[VM_REG_ACCELERATION]) == false)) {
+                    return _fault(VM_FAULT_OUTPUT);
+                }
+                if (_instructions > _statistics.maxInstructions) {
+                    _statistics.maxInstructions = _instructions;
+                }
+                return true;
+            case VM_PUSH:
+                memcpy(&stack[top++], &_code[pc - 4], 4);
+                break;
+            case VM_PUSHI:
+                stack[top++] = (int8_t)operand;
+                break;
+            case VM_LOAD:
+                stack[top++] = _registers[operand];
+                break;
+            case VM_STORE:
+                _registers[operand] = stack[--top];
+                break;
+            case VM_JMP:
+                pc = operand;
+                break;
+            case VM_JZ:
+                if (stack[--top] == 0.0) {
+                    pc = operand;
+                }
+                break;
+            case VM_DUP:
+                stack[top] = b;
+                top++;
+                break;
+            case VM_DROP:
+                top--;
+                break;
+            case VM_SWAP:
+                stack[top - 1] = *a;
+                *a = b;
+                break;
+            case VM_ADD:
+                *a += b;
+                top--;
+                break;
+            case VM_SUB:
+                *a -= b;
+                top--;
+                break;
+            case VM_MUL:
+                *a *= b;
+                top--;
+                break;
+            case VM_DIV:
+                *a /= b;
+                top--;
+                break;
+            case VM_MOD:
+                *a = fmodf(*a, b);
+                top--;
+                break;
+            case VM_MIN:
+                *a = (b < *a) ? b : *a;
+                top--;
+                break;
+            case VM_MAX:
+                *a = (b > *a) ? b : *a;
+                top--;
+                break;
+            case VM_LT:
+                *a = (*a < b) ? 1.0 : 0.0;
+                top--;
+                break;
+            case VM_LE:
+                *a = (*a <= b) ? 1.0 : 0.0;
+                top--;
+                break;
+            case VM_EQ:
+                *a = (*a == b) ? 1.0 : 0.0;
+                top--;
+                break;
+            case VM_NOT:
+                stack[top - 1] = (b == 0.0) ? 1.0 : 0.0;
+                break;
+            case VM_NEG:
+                stack[top - 1] = -b;
+                break;
+            case VM_ABS:
+                stack[top - 1] = fabsf(b);
+                break;
+            case VM_FLOOR:
+                stack[top - 1] = floorf(b);
+                break;
+            case VM_SQRT:
+                stack[top - 1] = sqrtf(b);
+                break;
+        }
+    }
+}
+
+bool PatternVM::_fault(PatternVMFault fault) {
+    if (_instructions > _statistics.maxInstructions) {
+        _statistics.maxInstructions = _instructions;
+    }
+    _statistics.faults++;
+    _statistics.lastFault = fault;
+    return false;
+}
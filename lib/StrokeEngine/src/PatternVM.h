@@ -0,0 +1,209 @@
+/**
+ *   Pattern VM of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ *   Interpreter for patterns defined at runtime as bytecode. Free of any
+ *   Arduino dependency, so tools/PatternBenchmark assembles and runs the
+ *   very same code on the PC.
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VM_CODE_SIZE            256     // Longest program in bytes, jump addresses are a byte
+#define VM_STACK_DEPTH          16      // Values on the stack at most
+#define VM_VARIABLES            16      // Variables v0 - v15 keep their value between calls
+#define VM_BUDGET               256     // Instructions a call of run() may execute at most
+
+/**************************************************************************/
+/*!
+  @brief  Instructions of the PatternVM. Each is an opcode byte followed by
+  its operand, if any. Binary operations pop b, then a and push a op b.
+  Comparisons push 1 if true and 0 if false.
+*/
+/**************************************************************************/
+typedef enum {
+  VM_END,             //!< Stop and hand the outputs to the StrokeEngine
+  VM_PUSH,            //!< Push the float of the operand, 4 bytes little-endian IEEE 754
+  VM_PUSHI,           //!< Push the integer of the operand, a signed byte
+  VM_LOAD,            //!< Push the register of the operand
+  VM_STORE,           //!< Pop into the register of the operand, inputs are read-only
+  VM_JMP,             //!< Continue at the address of the operand
+  VM_JZ,              //!< Pop and continue at the address of the operand if it is 0
+  VM_DUP,             //!< Push the top value again
+  VM_DROP,            //!< Pop and discard
+  VM_SWAP,            //!< Swap the two top values
+  VM_ADD,             //!< a + b
+  VM_SUB,             //!< a - b
+  VM_MUL,             //!< a * b
+  VM_DIV,             //!< a / b
+  VM_MOD,             //!< Remainder of a / b with the sign of a
+  VM_MIN,             //!< Smaller of a and b
+  VM_MAX,             //!< Larger of a and b
+  VM_LT,              //!< a < b
+  VM_LE,              //!< a <= b
+  VM_EQ,              //!< a == b
+  VM_NOT,             //!< 1 if the value is 0, else 0
+  VM_NEG,             //!< -a
+  VM_ABS,             //!< |a|
+  VM_FLOOR,           //!< Largest integer not greater than a
+  VM_SQRT,            //!< Square root of a
+  VM_OPCODES          //!< Number of opcodes, not an instruction
+} PatternVMOpcode;
+
+/**************************************************************************/
+/*!
+  @brief  Registers a program loads and stores by index. Inputs are set by
+  the pattern before each call, outputs are read after VM_END. Variables
+  keep their value between calls and are cleared when code is loaded.
+*/
+/**************************************************************************/
+typedef enum {
+  VM_REG_INDEX,           //!< Input: Index of the move, even moves in, odd moves out
+  VM_REG_STROKE,          //!< Input: Stroke in steps
+  VM_REG_DEPTH,           //!< Input: Depth in steps
+  VM_REG_TIME_OF_STROKE,  //!< Input: Time of a full stroke in s
+  VM_REG_SENSATION,       //!< Input: Sensation from -100 to 100
+  VM_REG_MAX_SPEED,       //!< Input: Maximum speed in steps/s
+  VM_REG_MAX_ACCELERATION,//!< Input: Maximum acceleration in steps/s²
+  VM_REG_STEPS_PER_MM,    //!< Input: Steps per mm
+  VM_REG_TIME,            //!< Input: Planned start of the move in s since the move of index 0
+  VM_REG_POSITION,        //!< Output: Target of the move in steps
+  VM_REG_SPEED,           //!< Output: Speed of the move in steps/s
+  VM_REG_ACCELERATION,    //!< Output: Acceleration of the move in steps/s²
+  VM_REG_SKIP,            //!< Output: Not 0 to pause instead of moving
+  VM_REG_VARIABLE,        //!< First of the VM_VARIABLES variables
+  VM_REGISTERS = VM_REG_VARIABLE + VM_VARIABLES
+} PatternVMRegister;
+
+/**************************************************************************/
+/*!
+  @brief  Reason the last call of run() failed.
+*/
+/**************************************************************************/
+typedef enum {
+  VM_FAULT_NONE,          //!< No fault
+  VM_FAULT_NO_CODE,       //!< No code loaded
+  VM_FAULT_BUDGET,        //!< More than VM_BUDGET instructions
+  VM_FAULT_STACK,         //!< Stack underflow or overflow
+  VM_FAULT_END_OF_CODE,   //!< Ran past the end of the code without VM_END
+  VM_FAULT_OUTPUT         //!< An output is not a finite number
+} PatternVMFault;
+
+/**************************************************************************/
+/*!
+  @brief  Statistics of the calls of run() since code was loaded.
+*/
+/**************************************************************************/
+typedef struct {
+  unsigned long calls;            /*> Calls of run() */
+  unsigned long faults;           /*> Calls which failed */
+  unsigned int maxInstructions;   /*> Most instructions a call executed */
+  PatternVMFault lastFault;       /*> Reason of the last failed call */
+} patternVMStatistics;
+
+//! Assembly of Simple Stroke, the code of a BytecodePattern until other code is loaded
+extern const char patternVMSimpleStroke[];
+
+/**************************************************************************/
+/*!
+  @brief  Stack machine running the bytecode of a pattern. Each call of
+  run() computes one move: it starts at address 0 with an empty stack and
+  ends at VM_END, after at most VM_BUDGET instructions. So a program can
+  loop, but never stall the stroking task. Code is validated when loaded:
+  every opcode, operand, register and jump target must be valid. Stack
+  depth and budget are checked while running, a fault ends the call.
+
+  Programs are written in a line based assembly and translated with
+  assemble(), on the PC or the ESP32:
+
+  ```
+  # comment
+  load time_of_stroke     # mnemonics are the opcodes without VM_
+  push 0.5
+  mul
+  store v0
+  load index
+  pushi 2
+  mod
+  jz in                   # labels end with a colon where defined
+  ...
+  in:
+  store position
+  end
+  ```
+
+  Registers are named like PatternVMRegister without VM_REG_ in lower case,
+  variables v0 - v15. `push` of an integer from -128 to 127 is assembled as
+  VM_PUSHI.
+*/
+/**************************************************************************/
+class PatternVM {
+    public:
+        /*!
+          @brief Check code for invalid opcodes, operands, registers and jump targets.
+          @param code bytecode
+          @param length of the code in bytes
+          @return -1 if valid, otherwise the address of the first invalid instruction
+        */
+        static int validate(const uint8_t *code, size_t length);
+
+        /*!
+          @brief Translate assembly into bytecode.
+          @param source assembly, terminated by 0
+          @param code buffer for the bytecode
+          @param maxLength size of the buffer
+          @param length bytes of bytecode written
+          @return -1 on success, otherwise the line of the first error, starting with 1.
+          An empty source fails at its last line.
+        */
+        static int assemble(const char *source, uint8_t *code, size_t maxLength, size_t *length);
+
+        /*!
+          @brief Load code after validating it. Variables and statistics are cleared.
+          @param code bytecode, copied
+          @param length of the code in bytes
+          @return false if the code is invalid, the former code stays loaded
+        */
+        bool load(const uint8_t *code, size_t length);
+
+        /*!
+          @brief Run the code once. Set the inputs before and read the outputs after.
+          @return false on a fault, the outputs are undefined then
+        */
+        bool run();
+
+        //! Set an input register
+        void setRegister(PatternVMRegister reg, float value) { _registers[reg] = value; }
+
+        //! Read a register, e.g. an output
+        float getRegister(PatternVMRegister reg) { return _registers[reg]; }
+
+        //! Loaded code
+        const uint8_t *getCode() { return _code; }
+
+        //! Length of the loaded code in bytes, 0 if none
+        size_t getLength() { return _length; }
+
+        //! Instructions the last call of run() executed
+        unsigned int getInstructions() { return _instructions; }
+
+        //! Statistics since the code was loaded
+        patternVMStatistics getStatistics() { return _statistics; }
+
+    protected:
+        uint8_t _code[VM_CODE_SIZE];
+        size_t _length = 0;
+        float _registers[VM_REGISTERS] = {};
+        unsigned int _instructions = 0;
+        patternVMStatistics _statistics = {0, 0, 0, VM_FAULT_NONE};
+        bool _fault(PatternVMFault fault);
+};
@@ -0,0 +1,159 @@
+#include <Arduino.h>
+#include <PositionSampler.h>
+
+void PositionSampler::start(FastAccelStepper *stepper, float rate) {
+    if (_timer == NULL) {
+        esp_timer_create_args_t samplerTimerArgs = {
+            .callback = &_samplerTimerImpl,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "Sampler"
+        };
+        esp_timer_create(&samplerTimerArgs, &_timer);
+    }
+    esp_timer_stop(_timer);
+
+    // Start over with an empty ring
+    _stepper = stepper;
+    _period = uint32_t(1.0e6 / constrain(rate, SAMPLER_MIN_RATE, SAMPLER_MAX_RATE));
+    _head = 0;
+    _block[0].count = 0;
+    _samples = 0;
+    _busyMicros = 0;
+    _maximumMicros = 0;
+    _windowSamples = 0;
+    _windowMicros = 0;
+    _load = 0.0;
+    _paused = false;
+    _running = true;
+
+    esp_timer_start_periodic(_timer, _period);
+}
+
+void PositionSampler::stop() {
+    if (_timer != NULL) {
+        esp_timer_stop(_timer);
+    }
+    _running = false;
+}
+
+void PositionSampler::dump(float stepsPerMillimeter) {
+    // Freeze the ring and give a sample in progress time to complete
+    _paused = true;
+    __sync_synchronize();
+    vTaskDelay(1);
+
+    // The oldest slot is the one which gets overwritten next
+    uint32_t head = _head;
+    uint32_t first = (head >= SAMPLER_BLOCKS - 1) ? head - (SAMPLER_BLOCKS - 1) : 0;
+    bool partial = (_block[head % SAMPLER_BLOCKS].count > 0);
+
+    sampleDumpHeader header;
+    header.magic = SAMPLER_DUMP_MAGIC;
+    header.blockSize = sizeof(sampleBlock);
+    header.blocks = head - first + (partial ? 1 : 0);
+    header.stepsPerMillimeter = stepsPerMillimeter;
+    Serial.write((const uint8_t *)&header, sizeof(header));
+
+    for (uint32_t i = first; i < head; i++) {
+        Serial.write((const uint8_t *)&_block[i % SAMPLER_BLOCKS], sizeof(sampleBlock));
+    }
+    if (partial == true) {
+        Serial.write((const uint8_t *)&_block[head % SAMPLER_BLOCKS], sizeof(sampleBlock));
+
+        // Samples taken after the pause must not be chained to the ones before
+        _closeBlock();
+    }
+    Serial.flush();
+
+    __sync_synchronize();
+    _paused = false;
+}
+
+samplerStatistics PositionSampler::getStatistics() {
+    samplerStatistics statistics;
+    statistics.rate = _running ? 1.0e6 / _period : 0.0;
+    statistics.samples = _samples;
+    statistics.averageMicros = (_samples > 0) ? float(_busyMicros) / _samples : 0.0;
+    statistics.maximumMicros = _maximumMicros;
+    statistics.load = _load;
+    return statistics;
+}
+
+void PositionSampler::_sample() {
+    if ((_paused == true) || (_stepper == NULL)) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int32_t position = _stepper->getCurrentPosition();
+    int32_t speed = _stepper->getCurrentSpeedInMilliHz() / 1000;
+
+    // Chain the sample to the block while the differences fit into 16 bit
+    sampleBlock *block = &_block[_head % SAMPLER_BLOCKS];
+    if (block->count > 0) {
+        int32_t positionDelta = position - _lastPosition;
+        int32_t speedDelta = speed - _lastSpeed;
+        if ((positionDelta >= INT16_MIN) && (positionDelta <= INT16_MAX)
+            && (speedDelta >= INT16_MIN) && (speedDelta <= INT16_MAX)) {
+            block->positionDelta[block->count - 1] = positionDelta;
+            block->speedDelta[block->count - 1] = speedDelta;
+            block->count++;
+        } else {
+            _closeBlock();
+            block = &_block[_head % SAMPLER_BLOCKS];
+        }
+    }
+
+    // First sample of a block is absolute
+    if (block->count == 0) {
+        block->timestamp = now;
+        block->position = position;
+        block->speed = speed;
+        block->period = _period;
+        block->count = 1;
+    }
+    _lastPosition = position;
+    _lastSpeed = speed;
+
+    if (block->count == SAMPLER_BLOCK_SAMPLES) {
+        _closeBlock();
+    }
+
+    // Account the CPU time of this sample
+    unsigned long busy = esp_timer_get_time() - now;
+    _samples++;
+    _busyMicros += busy;
+    _maximumMicros = max(_maximumMicros, busy);
+    _windowSamples++;
+    _windowMicros += busy;
+
+    // Evaluate the load about once a second and back off if it is too high
+    if (_windowSamples * _period >= 1000000) {
+        _load = 100.0 * _windowMicros / (_windowSamples * _period);
+        _windowSamples = 0;
+        _windowMicros = 0;
+        if ((_load > SAMPLER_MAX_LOAD) && (_period * 2 <= 1000000 / SAMPLER_MIN_RATE)) {
+            _period *= 2;
+            esp_timer_stop(_timer);
+            esp_timer_start_periodic(_timer, _period);
+
+            // The period is stored per block
+            if (_block[_head % SAMPLER_BLOCKS].count > 0) {
+                _closeBlock();
+            }
+#ifdef DEBUG_TALKATIVE
+            Serial.println("Sampler load " + String(_load, 2) + "%, rate reduced to " + String(1.0e6 / _period, 0) + " Hz");
+#endif
+        }
+    }
+}
+
+void PositionSampler::_closeBlock() {
+    uint32_t next = _head + 1;
+
+    // Empty the oldest slot before it becomes the one being filled
+    _block[next % SAMPLER_BLOCKS].count = 0;
+    __sync_synchronize();
+    _head = next;
+}
@@ -0,0 +1,118 @@
+/**
+ *   Position Sampler of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <FastAccelStepper.h>
+
+#define SAMPLER_MIN_RATE            500     // Lowest sample rate in Hz
+#define SAMPLER_MAX_RATE            2000    // Highest sample rate in Hz
+#define SAMPLER_BLOCK_SAMPLES       32      // Samples per block, the first one absolute, the others delta-encoded
+#define SAMPLER_BLOCKS              64      // Blocks in the ring, 2048 samples are about 2 s at 1 kHz
+#define SAMPLER_MAX_LOAD            1.0     // CPU load in % above which the sample rate gets halved
+#define SAMPLER_DUMP_MAGIC          0x4C504D53  // "SMPL" in little endian, starts a binary dump
+
+/**************************************************************************/
+/*!
+  @brief  Block of consecutive samples. The first sample is stored absolute,
+  each further one as difference to its predecessor. A block is closed early
+  if a difference doesn't fit into 16 bit. Layout is little endian without
+  padding, as it is dumped over Serial as is.
+*/
+/**************************************************************************/
+typedef struct {
+  int64_t timestamp;          /*> Time of the first sample in µs of esp_timer_get_time() */
+  int32_t position;           /*> Actual position of the first sample in steps */
+  int32_t speed;              /*> Actual step rate of the first sample in steps/s, negative when moving backwards */
+  uint16_t period;            /*> Time between two samples in µs */
+  uint16_t count;             /*> Number of samples in this block */
+  int16_t positionDelta[SAMPLER_BLOCK_SAMPLES - 1];  /*> Position difference to the previous sample in steps */
+  int16_t speedDelta[SAMPLER_BLOCK_SAMPLES - 1];     /*> Step rate difference to the previous sample in steps/s */
+} sampleBlock;
+
+/**************************************************************************/
+/*!
+  @brief  Header preceding the blocks of a binary dump.
+*/
+/**************************************************************************/
+typedef struct {
+  uint32_t magic;             /*> SAMPLER_DUMP_MAGIC */
+  uint16_t blockSize;         /*> sizeof(sampleBlock) in bytes */
+  uint16_t blocks;            /*> Number of blocks following, oldest first */
+  float stepsPerMillimeter;   /*> Scale of positions and step rates */
+} sampleDumpHeader;
+
+/**************************************************************************/
+/*!
+  @brief  Statistics about the sampler and the CPU time it takes.
+*/
+/**************************************************************************/
+typedef struct {
+  float rate;                 /*> Current sample rate in Hz */
+  unsigned long samples;      /*> Samples taken since start */
+  float averageMicros;        /*> CPU time per sample in µs */
+  unsigned long maximumMicros; /*> Longest time a sample took in µs */
+  float load;                 /*> CPU load of the sampler in % */
+} samplerStatistics;
+
+/**************************************************************************/
+/*!
+  @brief  Samples the actual position and step rate of a stepper with a
+  periodic esp_timer into a ring of delta-encoded blocks. The oldest blocks
+  are overwritten, so the ring always holds the latest history, like a scope
+  in roll mode. The timer callback takes constant time and measures it. If
+  the load exceeds SAMPLER_MAX_LOAD the rate gets halved.
+*/
+/**************************************************************************/
+class PositionSampler {
+    public:
+        /*!
+          @brief Start sampling. Restarts with an empty ring if already running.
+          @param stepper stepper to sample
+          @param rate sample rate in Hz, constrained to SAMPLER_MIN_RATE - SAMPLER_MAX_RATE
+        */
+        void start(FastAccelStepper *stepper, float rate);
+
+        //! Stop sampling. The samples stay available for dump().
+        void stop();
+
+        /*!
+          @brief Write all samples as binary dump to Serial: a sampleDumpHeader
+          followed by the blocks, oldest first. Sampling pauses meanwhile.
+          @param stepsPerMillimeter written into the header for the decoder
+        */
+        void dump(float stepsPerMillimeter);
+
+        //! Statistics about samples and CPU time
+        samplerStatistics getStatistics();
+
+    protected:
+        FastAccelStepper *_stepper = NULL;
+        esp_timer_handle_t _timer = NULL;
+        sampleBlock _block[SAMPLER_BLOCKS];
+        volatile uint32_t _head = 0;        // Blocks completed, the block at _head is being filled
+        volatile bool _running = false;
+        volatile bool _paused = false;
+        uint32_t _period = 1000;
+        int32_t _lastPosition = 0;
+        int32_t _lastSpeed = 0;
+        unsigned long _samples = 0;
+        unsigned long _busyMicros = 0;
+        unsigned long _maximumMicros = 0;
+        unsigned long _windowSamples = 0;
+        unsigned long _windowMicros = 0;
+        float _load = 0.0;
+        static void _samplerTimerImpl(void* _this) { static_cast<PositionSampler*>(_this)->_sample(); }
+        void _sample();
+        void _closeBlock();
+};
@@ -0,0 +1,51 @@
+#include <StrokeClock.h>
+#include <math.h>
+
+StrokeClock::StrokeClock() {
+    _mutex = xSemaphoreCreateMutex();
+}
+
+void StrokeClock::restart() {
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    _epoch = esp_timer_get_time();
+    xSemaphoreGive(_mutex);
+}
+
+int64_t StrokeClock::nextBeat(int64_t micros, float period) {
+    int64_t epoch = _getEpoch(micros);
+    if ((period <= 0.0) || (micros <= epoch)) {
+        return max(micros, epoch);
+    }
+
+    // Position within the current period
+    double phase = fmod(double(micros - epoch), double(period));
+    if (phase <= CLOCK_TOLERANCE * period) {
+        return micros;
+    }
+    return micros + int64_t(period - phase + 0.5);
+}
+
+float StrokeClock::phaseError(int64_t micros, float period) {
+    int64_t epoch = _getEpoch(micros);
+    if (period <= 0.0) {
+        return 0.0;
+    }
+
+    // Wrapped into half a period around the beat
+    double phase = fmod(double(micros - epoch), double(period));
+    if (phase < 0.0) {
+        phase += period;
+    }
+    return (phase > period / 2) ? phase - period : phase;
+}
+
+int64_t StrokeClock::_getEpoch(int64_t micros) {
+    // 64 bit aren't written atomically on the ESP32
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    if (_epoch < 0) {
+        _epoch = micros;
+    }
+    int64_t epoch = _epoch;
+    xSemaphoreGive(_mutex);
+    return epoch;
+}
@@ -0,0 +1,57 @@
+/**
+ *   Stroke Clock of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#define CLOCK_TOLERANCE         0.25    // Fraction of a period a stroke may start late instead of waiting for the next beat
+
+/**************************************************************************/
+/*!
+  @brief  Time base shared by several StrokeEngines, e.g. a stroking axis 
+  and a twist axis. The beats of a period are the multiples of the period 
+  since the epoch of the clock. Every axis attached with setTimeBase() 
+  starts each full stroke on a beat of its own time of stroke. Axes with 
+  the same speed move in phase, an axis with twice the speed strokes 
+  exactly twice per stroke of the other one. 
+*/
+/**************************************************************************/
+class StrokeClock {
+    public:
+        StrokeClock();
+
+        //! Start counting beats now. Running axes move onto the new beats with their next stroke.
+        void restart();
+
+        /*!
+          @brief Time a full stroke should start at.
+          @param micros earliest start of the stroke in µs of esp_timer_get_time()
+          @param period time of a full stroke in µs
+          @return the first beat not before micros, or micros itself if it is
+                  late by less than CLOCK_TOLERANCE of a period
+        */
+        int64_t nextBeat(int64_t micros, float period);
+
+        /*!
+          @brief Deviation of a time from the nearest beat.
+          @param micros time in µs of esp_timer_get_time()
+          @param period time of a full stroke in µs
+          @return deviation in µs, negative if early
+        */
+        float phaseError(int64_t micros, float period);
+
+    protected:
+        SemaphoreHandle_t _mutex;
+        int64_t _epoch = -1;                // Starts with the first stroke asking for a beat
+        int64_t _getEpoch(int64_t micros);
+};
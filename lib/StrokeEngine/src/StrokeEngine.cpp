@@ -1,22 +1,79 @@
 #include <Arduino.h>
+#include <esp_system.h>
 #include <StrokeEngine.h>
 #include <FastAccelStepper.h>
 #include <pattern.h>
 
-FastAccelStepperEngine engine = FastAccelStepperEngine();
-FastAccelStepper *servo = NULL;
+// One engine generates the steps of all axes
+static FastAccelStepperEngine engine = FastAccelStepperEngine();
+static bool engineStarted = false;
+
+// Survives a reset of the ESP32, holds garbage after power-on
+RTC_NOINIT_ATTR retainedHome retained[HOME_RETAIN_AXES];
+
+unsigned int StrokeEngine::_axes = 0;
+
+// Value of a rampable parameter in the unit of its ramp
+static float rampedValue(const strokeParameter *parameter, int ramp) {
+    switch (ramp) {
+        case RAMP_SPEED: return 60.0 / parameter->timeOfStroke;
+        case RAMP_DEPTH: return parameter->depth;
+        case RAMP_STROKE: return parameter->stroke;
+        default: return parameter->sensation;
+    }
+}
+
+static void setRampedValue(strokeParameter *parameter, int ramp, float value) {
+    switch (ramp) {
+        case RAMP_SPEED: parameter->timeOfStroke = 60.0 / value; break;
+        case RAMP_DEPTH: parameter->depth = lroundf(value); break;
+        case RAMP_STROKE: parameter->stroke = lroundf(value); break;
+        default: parameter->sensation = value; break;
+    }
+}
+
+static uint32_t fnv1a(const void *data, size_t length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+StrokeEngine::StrokeEngine() {
+    // Patterns keep state, every axis needs its own
+    for (unsigned int i = 0; i < patternTableSize; i++) {
+        _pattern[i] = patternTable[i].create(patternTable[i].name);
+    }
+
+    // The order of creation tells the axes apart across a reset
+    _axis = _axes++;
+    _retained = (_axis < HOME_RETAIN_AXES) ? &retained[_axis] : NULL;
+    if (_axis == 0) {
+        snprintf(_nvsNamespace, sizeof(_nvsNamespace), "%s", HOMING_NVS_NAMESPACE);
+    } else {
+        snprintf(_nvsNamespace, sizeof(_nvsNamespace), "%s%d", HOMING_NVS_NAMESPACE, _axis);
+    }
+}
 
 void StrokeEngine::begin(machineGeometry *physics, motorProperties *motor) {
     // store the machine geometry and motor properties pointer
     _physics = physics;
     _motor = motor;
 
+    // Patterns and the stroking task log through the deferred logger
+    Logger.begin();
+
     // Derived Machine Geometry & Motor Limits in steps:
     _travel = (_physics->physicalTravel - (2 * _physics->keepoutBoundary));
     _minStep = 0;
     _maxStep = int(0.5 + _travel * _motor->stepsPerMillimeter);
     _maxStepPerSecond = int(0.5 + _motor->maxSpeed * _motor->stepsPerMillimeter);
     _maxStepAcceleration = int(0.5 + _motor->maxAcceleration * _motor->stepsPerMillimeter);
+    _maxStepJerk = int(0.5 + _motor->maxJerk * _motor->stepsPerMillimeter);
+    _planner.setLimits(_maxStepPerSecond, _maxStepAcceleration);
+    _planner.setTravel(_minStep, _maxStep);
           
     // Initialize with default values
     _state = UNDEFINED;
@@ -29,18 +86,56 @@ void StrokeEngine::begin(machineGeometry *physics, motorProperties *motor) {
     _previousStroke = _maxStep / 3;
     _timeOfStroke = 1.0;
     _sensation = 0.0;
+    _publishParameter(false, true);
+
+    // No stroke rate correction learned yet
+    for (unsigned int i = 0; i < patternTableSize; i++) {
+        _rateState[i] = {false, 1.0, 0.0, 0};
+    }
 
-    // Setup FastAccelStepper 
-    engine.init();
-    servo = engine.stepperConnectToPin(_motor->stepPin);
-    if (servo) {
-        servo->setDirectionPin(_motor->directionPin, _motor->invertDirection);
-        servo->setEnablePin(_motor->enablePin, _motor->enableActiveLow);
-        servo->setAutoEnable(false);
-        servo->disableOutputs(); 
+    // Setup FastAccelStepper, the engine is shared by all axes
+    if (engineStarted == false) {
+        engine.init();
+        engineStarted = true;
+    }
+    if (_servo == NULL) {
+        _servo = engine.stepperConnectToPin(_motor->stepPin);
+    }
+    if (_servo) {
+        _servo->setDirectionPin(_motor->directionPin, _motor->invertDirection);
+        _servo->setEnablePin(_motor->enablePin, _motor->enableActiveLow);
+        _servo->setAutoEnable(false);
+
+        // setEnablePin() drives the servo disabled, after a soft reset enable it again right away
+        if (_resumeHome() == false) {
+            _servo->disableOutputs(); 
+        }
     }
     Serial.println("Servo initialized");
 
+    // One-shot timer waking up the stroking task before the step queue runs empty
+    if (_strokeTimer == NULL) {
+        esp_timer_create_args_t strokeTimerArgs = {
+            .callback = &_strokeTimerImpl,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "Stroking"
+        };
+        esp_timer_create(&strokeTimerArgs, &_strokeTimer);
+    }
+
+    // Keep the homed position in RTC memory up to date
+    if (_retainTimer == NULL) {
+        esp_timer_create_args_t retainTimerArgs = {
+            .callback = &_retainTimerImpl,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "RetainHome"
+        };
+        esp_timer_create(&retainTimerArgs, &_retainTimer);
+        esp_timer_start_periodic(_retainTimer, HOME_RETAIN_MS * 1000);
+    }
+
 #ifdef DEBUG_TALKATIVE
     Serial.println("Stroke Engine State: " + verboseState[_state]);
 #endif
@@ -49,62 +144,69 @@ void StrokeEngine::begin(machineGeometry *physics, motorProperties *motor) {
 void StrokeEngine::setSpeed(float speed, bool applyNow = false) {
 
     // Update pattern with new speed, will be used with the next stroke or on update request
-    if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
 
         // Convert FPM into seconds to complete a full stroke
         // Constrain stroke time between 10ms and 120 seconds
         _timeOfStroke = constrain(60.0 / speed, 0.01, 120.0);
 
-        patternTable[_patternIndex]->setTimeOfStroke(_timeOfStroke);
-
 #ifdef DEBUG_TALKATIVE
     Serial.println("setTimeOfStroke: " + String(_timeOfStroke, 2));
 #endif
 
-        // When running a pattern and immediate update requested: 
-        if ((_state == PATTERN) && (applyNow == true)) {
-            // set flag to apply update from stroking thread
-            _applyUpdate = true;
+        // Hand the new parameters over to the stroking task
+        _valueRequests[RAMP_SPEED]++;
+        _publishParameter(applyNow, false);
+
+        // give back mutex
+        xSemaphoreGive(_parameterMutex);
+    }
 
+    // Wake up stroking task to apply the update right away
+    if ((_state == PATTERN) && (applyNow == true)) {
 #ifdef DEBUG_TALKATIVE
         Serial.println("Apply New Settings Now");
 #endif
-        }
-
-        // give back mutex
-        xSemaphoreGive(_patternMutex);
+        _wakeMotionTask();
     }
 }
 
 float StrokeEngine::getSpeed() {
+    strokeParameter target;
+
+    // A program step set by the stroking task counts until setSpeed() is called again
+    if ((_readTarget(&target) == true) && (target.valueRequests[RAMP_SPEED] == _valueRequests[RAMP_SPEED])) {
+        return 60.0 / target.timeOfStroke;
+    }
+
     // Convert speed into FPMs
     return 60.0 / _timeOfStroke;
 }
 
 void StrokeEngine::setDepth(float depth, bool applyNow = false) {
 
-    if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
         // Convert depth from mm into steps
         // Constrain depth between minStep and maxStep
         _depth = constrain(int(depth * _motor->stepsPerMillimeter), _minStep, _maxStep); 
 
-        patternTable[_patternIndex]->setDepth(_depth);
-
 #ifdef DEBUG_TALKATIVE
         Serial.println("setDepth: " + String(_depth));
 #endif
-        // When running a pattern and immediate update requested: 
-        if ((_state == PATTERN) && (applyNow == true)) {
-            // set flag to apply update from stroking thread
-            _applyUpdate = true;
+        // Hand the new parameters over to the stroking task
+        _valueRequests[RAMP_DEPTH]++;
+        _publishParameter(applyNow, false);
 
+        // give back mutex
+        xSemaphoreGive(_parameterMutex);
+    }
+
+    // Wake up stroking task to apply the update right away
+    if ((_state == PATTERN) && (applyNow == true)) {
 #ifdef DEBUG_TALKATIVE
         Serial.println("Apply New Settings Now");
 #endif
-        }
-
-        // give back mutex
-        xSemaphoreGive(_patternMutex);
+        _wakeMotionTask();
     }
 
     // if in state SETUPDEPTH then adjust
@@ -114,36 +216,43 @@ void StrokeEngine::setDepth(float depth, bool applyNow = false) {
 }
 
 float StrokeEngine::getDepth() {
+    strokeParameter target;
+    int depth = _depth;
+
+    if ((_readTarget(&target) == true) && (target.valueRequests[RAMP_DEPTH] == _valueRequests[RAMP_DEPTH])) {
+        depth = target.depth;
+    }
+
     // Convert depth from steps into mm
-    return _depth / _motor->stepsPerMillimeter;
+    return depth / _motor->stepsPerMillimeter;
 }
 
 void StrokeEngine::setStroke(float stroke, bool applyNow = false) {
     // Update pattern with new stroke, will be used with the next stroke or on update request
-    if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
 
         // Convert stroke from mm into steps
         // Constrain stroke between minStep and maxStep
         _stroke = constrain(int(stroke * _motor->stepsPerMillimeter), _minStep, _maxStep); 
 
-        patternTable[_patternIndex]->setStroke(_stroke);
-
 #ifdef DEBUG_TALKATIVE
         Serial.println("setStroke: " + String(_stroke));
 #endif
     
-        // When running a pattern and immediate update requested: 
-        if ((_state == PATTERN) && (applyNow == true)) {
-            // set flag to apply update from stroking thread
-            _applyUpdate = true;
+        // Hand the new parameters over to the stroking task
+        _valueRequests[RAMP_STROKE]++;
+        _publishParameter(applyNow, false);
 
+        // give back mutex
+        xSemaphoreGive(_parameterMutex);
+    }
+
+    // Wake up stroking task to apply the update right away
+    if ((_state == PATTERN) && (applyNow == true)) {
 #ifdef DEBUG_TALKATIVE
         Serial.println("Apply New Settings Now");
 #endif
-        }
-
-        // give back mutex
-        xSemaphoreGive(_patternMutex);
+        _wakeMotionTask();
     }
 
     // if in state SETUPDEPTH then adjust
@@ -153,36 +262,43 @@ void StrokeEngine::setStroke(float stroke, bool applyNow = false) {
 }
 
 float StrokeEngine::getStroke() {
+    strokeParameter target;
+    int stroke = _stroke;
+
+    if ((_readTarget(&target) == true) && (target.valueRequests[RAMP_STROKE] == _valueRequests[RAMP_STROKE])) {
+        stroke = target.stroke;
+    }
+
     // Convert stroke from steps into mm
-    return _stroke / _motor->stepsPerMillimeter;
+    return stroke / _motor->stepsPerMillimeter;
 }
 
 void StrokeEngine::setSensation(float sensation, bool applyNow = false) {
 
     // Update pattern with new sensation, will be used with the next stroke or on update request
-    if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
 
         // Constrain sensation between -100 and 100
         _sensation = constrain(sensation, -100, 100); 
 
-        patternTable[_patternIndex]->setSensation(_sensation);
-
 #ifdef DEBUG_TALKATIVE
         Serial.println("setSensation: " + String(_sensation));
 #endif
 
-        // When running a pattern and immediate update requested: 
-        if ((_state == PATTERN) && (applyNow == true)) {
-            // set flag to apply update from stroking thread
-            _applyUpdate = true;
+        // Hand the new parameters over to the stroking task
+        _valueRequests[RAMP_SENSATION]++;
+        _publishParameter(applyNow, false);
+
+        // give back mutex
+        xSemaphoreGive(_parameterMutex);
+    }
 
+    // Wake up stroking task to apply the update right away
+    if ((_state == PATTERN) && (applyNow == true)) {
 #ifdef DEBUG_TALKATIVE
         Serial.println("Apply New Settings Now");
 #endif
-        }
-
-        // give back mutex
-        xSemaphoreGive(_patternMutex);
+        _wakeMotionTask();
     }
     
     // if in state SETUPDEPTH then adjust
@@ -192,41 +308,270 @@ void StrokeEngine::setSensation(float sensation, bool applyNow = false) {
 }
 
 float StrokeEngine::getSensation() {
+    strokeParameter target;
+
+    if ((_readTarget(&target) == true) && (target.valueRequests[RAMP_SENSATION] == _valueRequests[RAMP_SENSATION])) {
+        return target.sensation;
+    }
     return _sensation;
 }
 
+bool StrokeEngine::setRamp(RampParameter parameter, float rate, bool perStroke) {
+    if ((parameter < 0) || (parameter >= RAMP_PARAMETERS)) {
+        return false;
+    }
+
+    // The stroking task picks the ramp up with the next stroke
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
+        _ramp[parameter].rate = max(rate, 0.0f);
+        _ramp[parameter].perStroke = perStroke;
+        _rampRequests[parameter]++;
+        _publishParameter(false, false);
+
+        // give back mutex
+        xSemaphoreGive(_parameterMutex);
+    }
+    return true;
+}
+
+parameterRamp StrokeEngine::getRamp(RampParameter parameter) {
+    parameterRamp ramp = {0.0, false};
+    if ((parameter >= 0) && (parameter < RAMP_PARAMETERS)) {
+        ramp = _ramp[parameter];
+    }
+    return ramp;
+}
+
+bool StrokeEngine::loadProgram(const programStep *steps, unsigned int count) {
+    if ((steps == NULL) || (count == 0) || (count > PROGRAM_MAX_STEPS)) {
+        return false;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        if ((steps[i].pattern < 0) || (steps[i].pattern >= (int)patternTableSize) 
+                || ((steps[i].strokes == 0) && (steps[i].duration <= 0.0))) {
+            return false;
+        }
+    }
+
+    stopProgram();
+    if (xSemaphoreTake(_programMutex, portMAX_DELAY) == pdTRUE) {
+        memcpy(_program, steps, count * sizeof(programStep));
+        _programLength = count;
+        xSemaphoreGive(_programMutex);
+    }
+    return true;
+}
+
+bool StrokeEngine::loadProgram(const char *text, size_t length, bool append) {
+    programStep step;
+    unsigned int count = 0;
+
+    if (text == NULL) {
+        return false;
+    }
+    if (append == false) {
+        stopProgram();
+    }
+
+    if (xSemaphoreTake(_programMutex, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    unsigned int first = (append == true) ? _programLength : 0;
+
+    // Check all steps first, a malformed one leaves the loaded program alone. Then store them.
+    for (int pass = 0; pass < 2; pass++) {
+        size_t start = 0;
+        count = 0;
+        while (start < length) {
+            size_t end = start;
+            while ((end < length) && (text[end] != ';') && (text[end] != '\n') && (text[end] != '\r')) {
+                end++;
+            }
+
+            // Blank lines don't count
+            size_t used = start;
+            while ((used < end) && ((text[used] == ' ') || (text[used] == '\t'))) {
+                used++;
+            }
+            if (used < end) {
+                if ((first + count >= PROGRAM_MAX_STEPS) || (_parseStep(&text[start], end - start, &step) == false)) {
+                    xSemaphoreGive(_programMutex);
+                    return false;
+                }
+                if (pass == 1) {
+                    _program[first + count] = step;
+                }
+                count++;
+            }
+            start = end + 1;
+        }
+    }
+
+    // A running program sees the appended steps from now on
+    _programLength = first + count;
+    xSemaphoreGive(_programMutex);
+    return (count > 0);
+}
+
+bool StrokeEngine::saveProgram() {
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, false) == false) {
+        return false;
+    }
+
+    bool stored = false;
+    if (xSemaphoreTake(_programMutex, portMAX_DELAY) == pdTRUE) {
+        size_t bytes = _programLength * sizeof(programStep);
+        if (bytes == 0) {
+            preferences.remove("program");
+            stored = true;
+        } else {
+            stored = (preferences.putBytes("program", _program, bytes) == bytes);
+        }
+        xSemaphoreGive(_programMutex);
+    }
+    preferences.end();
+    return stored;
+}
+
+bool StrokeEngine::restoreProgram() {
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, true) == false) {
+        return false;
+    }
+    size_t bytes = preferences.getBytesLength("program");
+    if ((bytes == 0) || (bytes % sizeof(programStep) != 0) || (bytes > sizeof(_program))) {
+        preferences.end();
+        return false;
+    }
+
+    stopProgram();
+    bool restored = false;
+    if (xSemaphoreTake(_programMutex, portMAX_DELAY) == pdTRUE) {
+        // Stored by an other firmware, the patterns may have changed
+        unsigned int count = preferences.getBytes("program", _program, sizeof(_program)) / sizeof(programStep);
+        restored = (count > 0);
+        for (unsigned int i = 0; i < count; i++) {
+            if ((_program[i].pattern < 0) || (_program[i].pattern >= (int)patternTableSize)) {
+                restored = false;
+            }
+        }
+        _programLength = (restored == true) ? count : 0;
+        xSemaphoreGive(_programMutex);
+    }
+    preferences.end();
+    return restored;
+}
+
+bool StrokeEngine::startProgram(bool loop) {
+    if (_programLength == 0) {
+        return false;
+    }
+    stopProgram();
+
+    // The first step goes through the setters like any other update, the stroking task plays the others itself
+    if (xSemaphoreTake(_programMutex, portMAX_DELAY) == pdTRUE) {
+        for (int i = 0; i < RAMP_PARAMETERS; i++) {
+            _programRamp[i] = getRamp((RampParameter)i);
+        }
+        _programLoop = loop;
+        _startProgramStep(0);
+        xSemaphoreGive(_programMutex);
+    }
+
+    if ((_state != PATTERN) && (startPattern() == false)) {
+        stopProgram();
+        return false;
+    }
+    return true;
+}
+
+void StrokeEngine::stopProgram() {
+    if (xSemaphoreTake(_programMutex, portMAX_DELAY) == pdTRUE) {
+        if (_programStep >= 0) {
+            _endProgram();
+        }
+        xSemaphoreGive(_programMutex);
+    }
+}
+
+int StrokeEngine::getProgramStep() {
+    return _programStep;
+}
+
+bool StrokeEngine::setPatternCode(const uint8_t *code, size_t length) {
+    if (PatternVM::validate(code, length) >= 0) {
+        return false;
+    }
+
+    // Every pattern running bytecode gets it, the others refuse
+    if (xSemaphoreTake(_codeMutex, portMAX_DELAY) == pdTRUE) {
+        for (unsigned int i = 0; i < patternTableSize; i++) {
+            _pattern[i]->loadCode(code, length);
+        }
+        memcpy(_patternCode, code, length);
+        _patternCodeLength = length;
+        xSemaphoreGive(_codeMutex);
+    }
+    return true;
+}
+
+bool StrokeEngine::savePatternCode() {
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, false) == false) {
+        return false;
+    }
+
+    bool stored = false;
+    if (xSemaphoreTake(_codeMutex, portMAX_DELAY) == pdTRUE) {
+        if (_patternCodeLength > 0) {
+            stored = (preferences.putBytes("code", _patternCode, _patternCodeLength) == _patternCodeLength);
+        }
+        xSemaphoreGive(_codeMutex);
+    }
+    preferences.end();
+    return stored;
+}
+
+bool StrokeEngine::restorePatternCode() {
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, true) == false) {
+        return false;
+    }
+    uint8_t code[VM_CODE_SIZE];
+    size_t length = 0;
+    if ((preferences.getBytesLength("code") > 0) && (preferences.getBytesLength("code") <= sizeof(code))) {
+        length = preferences.getBytes("code", code, sizeof(code));
+    }
+    preferences.end();
+
+    // Stored by an other firmware, the VM may have changed
+    return (length > 0) && setPatternCode(code, length);
+}
+
 bool StrokeEngine::setPattern(int patternIndex, bool applyNow = false) {
     // Check wether pattern Index is in range
-    if ((patternIndex < patternTableSize) && (patternIndex >= 0)) {
-        _patternIndex = patternIndex;
+    if ((patternIndex < (int)patternTableSize) && (patternIndex >= 0)) {
 
-        // Inject current motion parameters into new pattern
-        if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
-            patternTable[_patternIndex]->setSpeedLimit(_maxStepPerSecond, _maxStepAcceleration, _motor->stepsPerMillimeter);
-            patternTable[_patternIndex]->setTimeOfStroke(_timeOfStroke);
-            patternTable[_patternIndex]->setStroke(_stroke);
-            patternTable[_patternIndex]->setDepth(_depth);
-            patternTable[_patternIndex]->setSensation(_sensation);
+        // The stroking task injects the current motion parameters into the new pattern
+        if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
+            _patternIndex = patternIndex;
+            _publishParameter(applyNow, true);
 
-            // When running a pattern and immediate update requested: 
-            if ((_state == PATTERN) && (applyNow == true)) {
-                // set flag to apply update from stroking thread
-                _applyUpdate = true;
+            // give back mutex
+            xSemaphoreGive(_parameterMutex);
+        }
 
+        // Wake up stroking task to apply the update right away
+        if ((_state == PATTERN) && (applyNow == true)) {
 #ifdef DEBUG_TALKATIVE
             Serial.println("Apply New Settings Now");
 #endif
-            }
-
-            // give back mutex
-            xSemaphoreGive(_patternMutex);
+            _wakeMotionTask();
         }
 
-        // Reset index counter
-        _index = 0; 
-
 #ifdef DEBUG_TALKATIVE
-    Serial.println("setPattern: [" + String(_patternIndex) + "] " + patternTable[_patternIndex]->getName());
+    Serial.println("setPattern: [" + String(_patternIndex) + "] " + _pattern[_patternIndex]->getName());
     Serial.println("setTimeOfStroke: " + String(_timeOfStroke, 2));
     Serial.println("setDepth: " + String(_depth));
     Serial.println("setStroke: " + String(_stroke));
@@ -237,12 +582,17 @@ bool StrokeEngine::setPattern(int patternIndex, bool applyNow = false) {
 
     // Return false on no match
 #ifdef DEBUG_TALKATIVE
-    Serial.println("Failed to set pattern: " + String(_patternIndex));
+    Serial.println("Failed to set pattern: " + String(patternIndex));
 #endif
     return false;   
 }
 
 int StrokeEngine::getPattern() {
+    strokeParameter target;
+
+    if ((_readTarget(&target) == true) && (target.patternRequests == _parameter.patternRequests)) {
+        return target.patternIndex;
+    }
     return _patternIndex;
 }
 
@@ -251,27 +601,17 @@ bool StrokeEngine::startPattern() {
     if (_state == READY || _state == SETUPDEPTH) {
 
         // Stop current move, should one be pending (moveToMax or moveToMin)
-        if (servo->isRunning()) {
+        if (_servo->isRunning()) {
             // Stop servo motor as fast as legally allowed
-            servo->setAcceleration(_maxStepAcceleration);
-            servo->applySpeedAcceleration();
-            servo->stopMove();
+            _servo->setAcceleration(_maxStepAcceleration);
+            _servo->applySpeedAcceleration();
+            _servo->stopMove();
         }
 
-        // Set state to PATTERN
+        // Set state to PATTERN. The stroking task resets stroke and motion 
+        // parameters when it takes over the step queue.
         _state = PATTERN;
 
-        // Reset Stroke and Motion parameters
-        _index = -1;
-        if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
-            patternTable[_patternIndex]->setSpeedLimit(_maxStepPerSecond, _maxStepAcceleration, _motor->stepsPerMillimeter);
-            patternTable[_patternIndex]->setTimeOfStroke(_timeOfStroke);
-            patternTable[_patternIndex]->setStroke(_stroke);
-            patternTable[_patternIndex]->setDepth(_depth);
-            patternTable[_patternIndex]->setSensation(_sensation);            
-            xSemaphoreGive(_patternMutex);
-        }
-
         
 #ifdef DEBUG_TALKATIVE
         Serial.print(" _timeOfStroke: " + String(_timeOfStroke));
@@ -314,27 +654,36 @@ bool StrokeEngine::startPattern() {
 }
 
 void StrokeEngine::stopMotion() {
+    // A program would start the next step
+    stopProgram();
+
     // only valid when 
-    if (_state == PATTERN || _state == SETUPDEPTH) {
+    if (_state == PATTERN || _state == SETUPDEPTH || _state == STREAMING) {
         // Set state
         _state = READY;
 
-        // Stop servo motor as fast as legally allowed
-        servo->setAcceleration(_maxStepAcceleration);
-        servo->applySpeedAcceleration();
-        servo->stopMove();
+        if (_queueActive == true) {
+            // Stroking task brings the motion in the step queue to a halt as fast as legally allowed
+            _wakeMotionTask();
+            while (_queueActive == true) {
+                vTaskDelay(1);
+            }
+        } else {
+            // Stop servo motor as fast as legally allowed
+            _servo->setAcceleration(_maxStepAcceleration);
+            _servo->applySpeedAcceleration();
+            _servo->stopMove();
+        }
 
 #ifdef DEBUG_TALKATIVE
         Serial.println("Motion stopped");
 #endif
 
         // Wait for servo stopped
-        while (servo->isRunning());
+        while (_servo->isRunning());
 
         // Send telemetry data
-        if (_callbackTelemetry != NULL) {
-            _callbackTelemetry(float(servo->getCurrentPosition() / _motor->stepsPerMillimeter), 0.0, false);
-        }
+        _sendTelemetry(esp_timer_get_time(), _servo->getCurrentPosition(), 0.0, 0.0, -1, false, 0.0);
     }
     
 #ifdef DEBUG_TALKATIVE
@@ -342,6 +691,155 @@ void StrokeEngine::stopMotion() {
 #endif
 }
 
+bool StrokeEngine::startStreaming() {
+    // Only valid if state is ready
+    if (_state == READY || _state == SETUPDEPTH) {
+
+        // Stop current move, should one be pending (moveToMax or moveToMin)
+        if (_servo->isRunning()) {
+            // Stop servo motor as fast as legally allowed
+            _servo->setAcceleration(_maxStepAcceleration);
+            _servo->applySpeedAcceleration();
+            _servo->stopMove();
+        }
+
+        // Start with an empty jitter buffer
+        if (xSemaphoreTake(_streamMutex, portMAX_DELAY) == pdTRUE) {
+            _streamHead = 0;
+            _streamCount = 0;
+            _streamHasPrevious = false;
+            _streamSynced = false;
+            _streamStarved = false;
+
+            // Set state to STREAMING
+            _state = STREAMING;
+            xSemaphoreGive(_streamMutex);
+        }
+
+        if (_taskStreamingHandle == NULL) {
+            // Create Streaming Task
+            xTaskCreatePinnedToCore(
+                this->_streamingImpl,   // Function that should be called
+                "Streaming",            // Name of the task (for debugging)
+                4096,                   // Stack size (bytes)
+                this,                   // Pass reference to this class instance
+                24,                     // Pretty high task priority
+                &_taskStreamingHandle,  // Task handle
+                1                       // Pin to application core
+            ); 
+        } else {
+            // Resume task, if it already exists
+            vTaskResume(_taskStreamingHandle);
+        }
+
+#ifdef DEBUG_TALKATIVE
+        Serial.println("Started streaming task");
+        Serial.println("Stroke Engine State: " + verboseState[_state]);
+#endif
+
+        return true;
+
+    } else {
+
+#ifdef DEBUG_TALKATIVE
+        Serial.println("Failed to start streaming");
+#endif
+        return false;
+
+    }
+}
+
+bool StrokeEngine::pushStreamPosition(unsigned long timestamp, float position) {
+    bool accepted = false;
+
+    // Only valid if streaming
+    if (_state != STREAMING) {
+        return false;
+    }
+
+    // Convert position from mm into steps and constrain it to the travel
+    float steps = constrain(position * _motor->stepsPerMillimeter, float(_minStep), float(_maxStep));
+
+    if (xSemaphoreTake(_streamMutex, portMAX_DELAY) == pdTRUE) {
+        int64_t now = esp_timer_get_time();
+
+        // Timestamps must increase
+        if ((_streamSynced == false) || (timestamp > _streamLastTimestamp)) {
+
+            // Map the time base of the sender onto ours. Re-sync if a setpoint is too late to be played in time.
+            int64_t micros = _streamOffsetMicros + int64_t(timestamp) * 1000;
+            if ((_streamSynced == false) || (micros < now)) {
+                _streamOffsetMicros = now + _streamLatencyMicros - int64_t(timestamp) * 1000;
+                micros = now + _streamLatencyMicros;
+                _streamSynced = true;
+
+#ifdef DEBUG_STREAMING
+                Serial.println("Stream synchronized to timestamp " + String(timestamp));
+#endif
+            }
+
+            // Stream ran dry: the next segment starts now, not at the setpoint already passed
+            if ((_streamCount == 1) && (_streamAt(0)->micros < now)) {
+                _streamAt(0)->micros = min(now, micros - 1);
+                _streamHasPrevious = false;
+            }
+
+            // Buffer full: drop the oldest setpoint
+            if (_streamCount >= STREAM_BUFFER_SIZE) {
+                _streamPrevious = *_streamAt(0);
+                _streamHasPrevious = true;
+                _streamHead = (_streamHead + 1) % STREAM_BUFFER_SIZE;
+                _streamCount--;
+                _streamOverruns++;
+            }
+
+            // A re-sync may move the setpoint in front of buffered ones
+            if ((_streamCount == 0) || (micros > _streamAt(_streamCount - 1)->micros)) {
+                streamPoint *point = _streamAt(_streamCount);
+                point->micros = micros;
+                point->position = steps;
+                _streamCount++;
+                _streamReceived++;
+                _streamLastTimestamp = timestamp;
+                accepted = true;
+            }
+        }
+
+        // give back mutex
+        xSemaphoreGive(_streamMutex);
+    }
+
+    return accepted;
+}
+
+void StrokeEngine::setStreamingLatency(float latency) {
+    // Constrain latency between 0 and STREAM_MAX_LATENCY
+    _streamLatencyMicros = int64_t(1000.0 * constrain(latency, 0.0, float(STREAM_MAX_LATENCY)));
+
+#ifdef DEBUG_TALKATIVE
+    Serial.println("setStreamingLatency: " + String(latency) + "ms");
+#endif
+}
+
+float StrokeEngine::getStreamingLatency() {
+    return _streamLatencyMicros / 1000.0;
+}
+
+streamingStatistics StrokeEngine::getStreamingStatistics() {
+    streamingStatistics statistics;
+    statistics.received = _streamReceived;
+    statistics.underruns = _streamUnderruns;
+    statistics.overruns = _streamOverruns;
+    statistics.buffered = _streamCount;
+    return statistics;
+}
+
+void StrokeEngine::resetStreamingStatistics() {
+    _streamReceived = 0;
+    _streamUnderruns = 0;
+    _streamOverruns = 0;
+}
+
 void StrokeEngine::enableAndHome(endstopProperties *endstop, void(*callBackHoming)(bool), float speed) {
     // Store callback
     _callBackHomeing = callBackHoming;
@@ -357,6 +855,8 @@ void StrokeEngine::enableAndHome(endstopProperties *endstop, float speed) {
     pinMode(_homeingPin, endstop->pinMode);
     _homeingActiveLow = endstop->activeLow;
     _homeingSpeed = speed * _motor->stepsPerMillimeter;
+    _homeingFastSpeed = endstop->fastSpeed * _motor->stepsPerMillimeter;
+    _homeingBackOff = (endstop->backOff > 0.0) ? endstop->backOff : 2 * _physics->keepoutBoundary;
 
     // set homing direction so sign can be multiplied
     if (endstop->homeToBack == true) {
@@ -369,7 +869,7 @@ void StrokeEngine::enableAndHome(endstopProperties *endstop, float speed) {
     stopMotion();
 
     // Enable Servo
-    servo->enableOutputs();
+    _servo->enableOutputs();
 
     // Create homing task
     xTaskCreatePinnedToCore(
@@ -398,9 +898,11 @@ void StrokeEngine::enableAndSensorlessHome(sensorlessHomeProperties *sensorless,
 void StrokeEngine::enableAndSensorlessHome(sensorlessHomeProperties *sensorless, float speed) {
     _sensorlessHomeing = true;
     _homeingSpeed = speed * _motor->stepsPerMillimeter;
+    _homeingFastSpeed = sensorless->fastSpeed * _motor->stepsPerMillimeter;
+    _homeingBackOff = (sensorless->backOff > 0.0) ? sensorless->backOff : 2 * _physics->keepoutBoundary;
     _sensorlessHomeingCurrentPin = sensorless->currentPin;
-    pinMode(_sensorlessHomeingCurrentPin, INPUT);
     _sensorlessHomeingCurrentLimit = sensorless->currentLimit;
+    _sensorlessHomeingRemember = sensorless->remember;
 
     // first stop current motion and delete stroke task
     stopMotion();
@@ -427,17 +929,18 @@ void StrokeEngine::thisIsHome(float speed) {
 
     if (_state == UNDEFINED) {
         // Enable Servo
-        servo->enableOutputs();
+        _servo->enableOutputs();
 
         // Stet current position as home
-        servo->setCurrentPosition(-_motor->stepsPerMillimeter * _physics->keepoutBoundary);
+        _servo->setCurrentPosition(-_motor->stepsPerMillimeter * _physics->keepoutBoundary);
 
         // Set feedrate for homing
-        servo->setSpeedInHz(_homeingSpeed);       
-        servo->setAcceleration(_maxStepAcceleration / 10);
+        _servo->setSpeedInHz(_homeingSpeed);       
+        _servo->setAcceleration(_maxStepAcceleration / 10);
 
         // drive free of switch and set axis to 0
-        servo->moveTo(_minStep);
+        _retainMoving();
+        _servo->moveTo(_minStep);
         
         // Change state
         _isHomed = true;
@@ -468,14 +971,13 @@ bool StrokeEngine::moveToMax(float speed) {
 
         // Set feedrate for safe move 
         // Constrain speed between 1 step/sec and _maxStepPerSecond
-        servo->setSpeedInHz(constrain(speed * _motor->stepsPerMillimeter, 1, _maxStepPerSecond));
-        servo->setAcceleration(_maxStepAcceleration / 10);
-        servo->moveTo(_maxStep);
+        _servo->setSpeedInHz(constrain(speed * _motor->stepsPerMillimeter, 1, _maxStepPerSecond));
+        _servo->setAcceleration(_maxStepAcceleration / 10);
+        _retainMoving();
+        _servo->moveTo(_maxStep);
 
         // Send telemetry data
-        if (_callbackTelemetry != NULL) {
-            _callbackTelemetry(float(_maxStep / _motor->stepsPerMillimeter), speed, false);
-        } 
+        _sendTelemetry(esp_timer_get_time(), _maxStep, speed * _motor->stepsPerMillimeter, _maxStepAcceleration / 10, -1, false, 0.0);
 
 #ifdef DEBUG_TALKATIVE
         Serial.println("Stroke Engine State: " + verboseState[_state]);
@@ -502,14 +1004,13 @@ bool StrokeEngine::moveToMin(float speed) {
 
         // Set feedrate for safe move 
         // Constrain speed between 1 step/sec and _maxStepPerSecond
-        servo->setSpeedInHz(constrain(speed * _motor->stepsPerMillimeter, 1, _maxStepPerSecond));
-        servo->setAcceleration(_maxStepAcceleration / 10);
-        servo->moveTo(_minStep);
+        _servo->setSpeedInHz(constrain(speed * _motor->stepsPerMillimeter, 1, _maxStepPerSecond));
+        _servo->setAcceleration(_maxStepAcceleration / 10);
+        _retainMoving();
+        _servo->moveTo(_minStep);
 
         // Send telemetry data
-        if (_callbackTelemetry != NULL) {
-            _callbackTelemetry(float(_minStep / _motor->stepsPerMillimeter), speed, false);
-        } 
+        _sendTelemetry(esp_timer_get_time(), _minStep, speed * _motor->stepsPerMillimeter, _maxStepAcceleration / 10, -1, false, 0.0);
 
 #ifdef DEBUG_TALKATIVE
     Serial.println("Stroke Engine State: " + verboseState[_state]);
@@ -541,8 +1042,8 @@ bool StrokeEngine::setupDepth(float speed, bool fancy) {
 
         // Set feedrate for safe move 
         // Constrain speed between 1 step/sec and _maxStepPerSecond
-        servo->setSpeedInHz(constrain(speed * _motor->stepsPerMillimeter, 1, _maxStepPerSecond));
-        servo->setAcceleration(_maxStepAcceleration / 10);
+        _servo->setSpeedInHz(constrain(speed * _motor->stepsPerMillimeter, 1, _maxStepPerSecond));
+        _servo->setAcceleration(_maxStepAcceleration / 10);
 
         // Set new state
         _state = SETUPDEPTH;
@@ -559,6 +1060,25 @@ bool StrokeEngine::setupDepth(float speed, bool fancy) {
     return allowed;
 }
 
+unsigned long StrokeEngine::getHomingDuration() {
+    return _homingDuration;
+}
+
+bool StrokeEngine::wasResumed() {
+    return _resumed;
+}
+
+void StrokeEngine::forgetRail() {
+    // The program stored in the same namespace stays
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, false) == true) {
+        preferences.remove("travel");
+        preferences.remove("offset");
+        preferences.remove("fingerprint");
+        preferences.end();
+    }
+}
+
 ServoState StrokeEngine::getState() {
     return _state;
 }
@@ -573,11 +1093,20 @@ void StrokeEngine::disable() {
 
     _state = UNDEFINED;
     _isHomed = false;
+    _resumed = false;
+    _retainMoving();
+    stopProgram();
 
     // Disable servo motor
-    servo->disableOutputs();
+    _servo->disableOutputs();
 
-#ifdef DEBUG_TALKATIVE
+    // Wait for the stroking task to drop the step queue
+    _wakeMotionTask();
+    while (_queueActive == true) {
+        vTaskDelay(1);
+    }
+
+#ifdef DEBUG_TALKATIVE
     Serial.println("Servo disabled. Call home to continue.");
     Serial.println("Stroke Engine State: " + verboseState[_state]);
 #endif
@@ -585,21 +1114,117 @@ void StrokeEngine::disable() {
 }
 
 String StrokeEngine::getPatternName(int index) {
-    if (index >= 0 && index <= patternTableSize) {
-        return String(patternTable[index]->getName());
+    if (index >= 0 && index < (int)patternTableSize) {
+        return String(patternTable[index].name);
     } else {
         return String("Invalid");
     }
     
 }
 
+bool StrokeEngine::setMotionProfile(int patternIndex, MotionProfile profile) {
+    // Check wether pattern Index is in range
+    if ((patternIndex < (int)patternTableSize) && (patternIndex >= 0)) {
+        // A single word, the stroking task picks it up with the next move
+        _pattern[patternIndex]->setMotionProfile(profile);
+
+#ifdef DEBUG_TALKATIVE
+        Serial.println("setMotionProfile: [" + String(patternIndex) + "] " + ((profile == SCURVE) ? "S-Curve" : "Trapezoidal"));
+#endif
+        return true;
+    }
+    return false;
+}
+
+MotionProfile StrokeEngine::getMotionProfile(int patternIndex) {
+    if ((patternIndex < (int)patternTableSize) && (patternIndex >= 0)) {
+        return _pattern[patternIndex]->getMotionProfile();
+    }
+    return TRAPEZOIDAL;
+}
+
+bool StrokeEngine::setRateCompensation(int patternIndex, bool enable) {
+    // Check wether pattern Index is in range
+    if ((patternIndex < (int)patternTableSize) && (patternIndex >= 0)) {
+        // Single words, the stroking task picks them up with the next stroke
+        if (enable == false) {
+            _rateState[patternIndex].correction = 1.0;
+            _rateState[patternIndex].error = 0.0;
+            _rateState[patternIndex].strokes = 0;
+        }
+        _pattern[patternIndex]->setRateCompensation(enable);
+
+#ifdef DEBUG_TALKATIVE
+        Serial.println("setRateCompensation: [" + String(patternIndex) + "] " + ((enable == true) ? "On" : "Off"));
+#endif
+        return true;
+    }
+    return false;
+}
+
+rateCompensation StrokeEngine::getRateCompensation(int patternIndex) {
+    rateCompensation rate = {false, 0.0, 0.0, 0};
+    if ((patternIndex < (int)patternTableSize) && (patternIndex >= 0)) {
+        rate = _rateState[patternIndex];
+        rate.enabled = _pattern[patternIndex]->getRateCompensation();
+    }
+    return rate;
+}
+
+float StrokeEngine::getMaxStrokeRate() {
+    float rate = 0.0;
+
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
+        // Only ask the pattern again if one of the inputs has changed
+        if ((_maxRatePattern != _patternIndex) || (_maxRateStroke != _stroke) || (_maxRateDepth != _depth) 
+            || (_maxRateSensation != _sensation) || (_maxRateSpeed != _maxStepPerSecond) 
+            || (_maxRateAcceleration != _maxStepAcceleration)) {
+            _maxRatePattern = _patternIndex;
+            _maxRateStroke = _stroke;
+            _maxRateDepth = _depth;
+            _maxRateSensation = _sensation;
+            _maxRateSpeed = _maxStepPerSecond;
+            _maxRateAcceleration = _maxStepAcceleration;
+
+            // Same bounds as setSpeed()
+            float timeOfStroke = _pattern[_patternIndex]->getMinTimeOfStroke(_stroke, _depth, _sensation, 
+                _maxStepPerSecond, _maxStepAcceleration, _motor->stepsPerMillimeter);
+            _maxRate = 60.0 / constrain(timeOfStroke, 0.01, 120.0);
+
+#ifdef DEBUG_TALKATIVE
+            Serial.println("getMaxStrokeRate: " + String(_maxRate, 1) + " SPM");
+#endif
+        }
+        rate = _maxRate;
+        xSemaphoreGive(_parameterMutex);
+    }
+    return rate;
+}
+
+void StrokeEngine::setUpdateLatency(float latency) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
+        // Committed motion can't be changed anymore
+        _updateLatency = constrain(latency, STROKE_COMMIT_US / 1000.0, float(STROKE_MAX_UPDATE_LATENCY));
+
+#ifdef DEBUG_TALKATIVE
+        Serial.println("setUpdateLatency: " + String(_updateLatency) + "ms");
+#endif
+        _publishParameter(false, false);
+        xSemaphoreGive(_parameterMutex);
+    }
+}
+
+float StrokeEngine::getUpdateLatency() {
+    return _updateLatency;
+}
+
 void StrokeEngine::setMaxSpeed(float maxSpeed){
     // Update pattern with new speed limits
-    if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
         // Convert speed into steps
         _maxStepPerSecond = int(0.5 + _motor->maxSpeed * _motor->stepsPerMillimeter);
-        patternTable[_patternIndex]->setSpeedLimit(_maxStepPerSecond, _maxStepAcceleration, _motor->stepsPerMillimeter);
-        xSemaphoreGive(_patternMutex);
+        _publishParameter(false, false);
+        xSemaphoreGive(_parameterMutex);
     }
 }
 
@@ -610,11 +1235,11 @@ float StrokeEngine::getMaxSpeed() {
 void StrokeEngine::setMaxAcceleration(float maxAcceleration) {
 
     // Update pattern with new speed limits
-    if (xSemaphoreTake(_patternMutex, portMAX_DELAY) == pdTRUE) {
+    if (xSemaphoreTake(_parameterMutex, portMAX_DELAY) == pdTRUE) {
         // Convert acceleration into steps
         _maxStepAcceleration = int(0.5 + _motor->maxAcceleration * _motor->stepsPerMillimeter);
-        patternTable[_patternIndex]->setSpeedLimit(_maxStepPerSecond, _maxStepAcceleration, _motor->stepsPerMillimeter);
-        xSemaphoreGive(_patternMutex);
+        _publishParameter(false, false);
+        xSemaphoreGive(_parameterMutex);
     }    
 }
 
@@ -624,26 +1249,86 @@ float StrokeEngine::getMaxAcceleration() {
 
 void StrokeEngine::registerTelemetryCallback(void(*callbackTelemetry)(float, float, bool)) {
     _callbackTelemetry = callbackTelemetry;
+    _startTelemetryTask();
+}
+
+void StrokeEngine::registerTelemetryCallback(void(*callbackTelemetry)(float, float, bool, float)) {
+    _callbackTelemetryDeficit = callbackTelemetry;
+    _startTelemetryTask();
+}
+
+unsigned int StrokeEngine::readTelemetry(telemetryRecord *records, unsigned int maxRecords) {
+    // The telemetry task is the only consumer once a callback is registered
+    if (_taskTelemetryHandle != NULL) {
+        return 0;
+    }
+    return _telemetry.pop(records, maxRecords);
+}
+
+unsigned int StrokeEngine::getTelemetryOverflows() {
+    return _telemetry.getOverflows();
+}
+
+void StrokeEngine::_sendTelemetry(int64_t timestamp, float target, float speed, float acceleration, int index, bool clipping, float deficit) {
+    telemetryRecord record;
+    record.timestamp = timestamp;
+    record.target = target / _motor->stepsPerMillimeter;
+    record.speed = speed / _motor->stepsPerMillimeter;
+    record.acceleration = acceleration / _motor->stepsPerMillimeter;
+    record.deficit = deficit;
+    record.index = index;
+    record.pattern = (index >= 0) ? _activeParameter.patternIndex : -1;
+    record.clipping = clipping;
+
+    // Never waits, a full ring drops the record
+    _telemetry.push(&record);
+}
+
+void StrokeEngine::_startTelemetryTask() {
+    if (_taskTelemetryHandle == NULL) {
+        xTaskCreatePinnedToCore(
+            this->_telemetryImpl,       // Function that should be called
+            "Telemetry",                // Name of the task (for debugging)
+            2048,                       // Stack size (bytes)
+            this,                       // Pass reference to this class instance
+            1,                          // Low priority, must never delay motion
+            &_taskTelemetryHandle,      // Task handle
+            0                           // Keep it off the application core
+        ); 
+    }
 }
 
-float StrokeEngine::_getAnalogAveragePercent(int pinNumber, int samples) {
-    float sum = 0;
-    float average = 0;
-    float percentage = 0;
-    for (int i = 0; i < samples; i++)
-    {
-        // TODO: Possibly use fancier filters?
-        sum += analogRead(pinNumber);
+void StrokeEngine::_telemetryTask() {
+    telemetryRecord records[TELEMETRY_BATCH];
+
+    while (true) {
+        // Drain the ring in batches and hand each record to the callbacks
+        unsigned int count = _telemetry.pop(records, TELEMETRY_BATCH);
+        for (unsigned int i = 0; i < count; i++) {
+            if (_callbackTelemetry != NULL) {
+                _callbackTelemetry(records[i].target, records[i].speed, records[i].clipping);
+            }
+            if (_callbackTelemetryDeficit != NULL) {
+                _callbackTelemetryDeficit(records[i].target, records[i].speed, records[i].clipping, records[i].deficit);
+            }
+        }
+
+        // Sleep only if the ring is drained
+        if (count < TELEMETRY_BATCH) {
+            vTaskDelay(TELEMETRY_POLL_MS / portTICK_PERIOD_MS);
+        }
     }
-    average = sum / samples;
-    // TODO: Might want to add a deadband
-    percentage = 100.0 * average / 4096.0; // 12 bit resolution
-    return percentage;
 }
 
 void StrokeEngine::_homingProcedure() {
+    _homingStart = esp_timer_get_time();
+    _resumed = false;
+
     if(_sensorlessHomeing) {
         _sensorlessHomingProcedure();
+
+        // ADC1 is free for analogRead() again
+        _currentSensor.stop();
     } else {
         _sensorHomingProcedure();
     }
@@ -656,89 +1341,84 @@ void StrokeEngine::_sensorlessHomingProcedure() {
 #ifdef DEBUG_TALKATIVE
     Serial.println("Finding Home Sensorless");
 #endif
-    float currentSensorOffset = (_getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 1000));
-    float current = _getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 200) - currentSensorOffset;
-    long lastMillisMessage = 0;
+    if (_currentSensor.start(_sensorlessHomeingCurrentPin) == false) {
+        Logger.log(LOG_LEVEL_ERROR, "Current sensor on pin %d can't be sampled by DMA, use an ADC1 pin", _sensorlessHomeingCurrentPin);
+        _servo->disableOutputs();
+        _state = UNDEFINED;
+        if (_callBackHomeing != NULL) {
+            _callBackHomeing(false);
+        }
+        return;
+    }
+    float currentSensorOffset = _currentSensor.calibrate();
+    Logger.log(LOG_LEVEL_DEBUG, "Current sensor offset %.2f%%", currentSensorOffset);
+    float storedTravel = _sensorlessHomeingRemember ? _recallRail(currentSensorOffset) : 0.0;
 
     // Set feedrate for homing
-    servo->setSpeedInHz(_homeingSpeed);
-    servo->setAcceleration(_maxStepAcceleration / 10);
+    _servo->setSpeedInHz(_homeingSpeed);
+    _servo->setAcceleration(_maxStepAcceleration / 10);
 
     // disable motor briefly in case we are against a hard stop.
-    servo->disableOutputs();
+    _servo->disableOutputs();
     vTaskDelay(600 / portTICK_PERIOD_MS);
     if(_abortHoming) return;
-    servo->enableOutputs();
+    _servo->enableOutputs();
     vTaskDelay(100 / portTICK_PERIOD_MS);
     if(_abortHoming) return;
 
 #ifdef DEBUG_TALKATIVE
-    Serial.print(_getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 500) - currentSensorOffset);
+    Serial.print(_currentSensor.getCurrent());
     Serial.print(",");
-    Serial.println(servo->getCurrentPosition() / _motor->stepsPerMillimeter);
+    Serial.println(_servo->getCurrentPosition() / _motor->stepsPerMillimeter);
 
     Serial.println("Sensorless homing move");
 #endif
-    servo->runForward();
-
-    current = _getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 200) - currentSensorOffset;
-    while (current < _sensorlessHomeingCurrentLimit)
-    {
-        if(_abortHoming) return;
-        current = _getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 25) - currentSensorOffset;
-#ifdef DEBUG_TALKATIVE
-        if(millis() - lastMillisMessage > 200) {
-            Serial.print(current);
-            Serial.print(",");
-            Serial.println(servo->getCurrentPosition());
-            lastMillisMessage = millis();
+    bool measured = false;
+    if (storedTravel > 0.0) {
+        // Touch the rear hard stop only, from anywhere on the rail it is found within the stored length
+        if (_approachHardStop(-1, storedTravel + HOMING_RAIL_TOLERANCE) == true) {
+            _physics->physicalTravel = storedTravel;
+        } else if (_abortHoming) {
+            return;
+        } else {
+            Logger.log(LOG_LEVEL_WARNING, "No hard stop within the stored rail of %.1f mm, measuring it again", storedTravel);
+            storedTravel = 0.0;
         }
-#endif
-
-        // Let other tasks run
-        vTaskDelay(0);
     }
 
-    servo->forceStopAndNewPosition(0);
-#ifdef DEBUG_TALKATIVE
-    Serial.println("Sensorless found max");
-#endif
-
-    servo->runBackward();
+    if (storedTravel <= 0.0) {
+        if (_approachHardStop(1) == false) return;
 
-    vTaskDelay(300 / portTICK_PERIOD_MS);
-
-    current = _getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 200) - currentSensorOffset;
-    while (current < _sensorlessHomeingCurrentLimit)
-    {
-        if(_abortHoming) return;
-        current = _getAnalogAveragePercent(_sensorlessHomeingCurrentPin, 25) - currentSensorOffset;
+        _servo->forceStopAndNewPosition(0);
 #ifdef DEBUG_TALKATIVE
-        if(millis() - lastMillisMessage > 200) {
-            Serial.print(current);
-            Serial.print(",");
-            Serial.println(servo->getCurrentPosition());
-            lastMillisMessage = millis();
-        }
+        Serial.println("Sensorless found max");
 #endif
-        // Let other tasks run
-        vTaskDelay(0);
-    }
 
-    if(_abortHoming) return;
+        // Traverse to the far end
+        if (_approachHardStop(-1) == false) return;
 
-    _physics->physicalTravel = abs(servo->getCurrentPosition()) / _motor->stepsPerMillimeter;
+        _physics->physicalTravel = abs(_servo->getCurrentPosition()) / _motor->stepsPerMillimeter;
+        measured = true;
+    }
     _travel = (_physics->physicalTravel - (2 * _physics->keepoutBoundary));
-    servo->forceStopAndNewPosition(-_motor->stepsPerMillimeter * _physics->keepoutBoundary);
+    _servo->forceStopAndNewPosition(-_motor->stepsPerMillimeter * _physics->keepoutBoundary);
     
 #ifdef DEBUG_TALKATIVE
     Serial.printf("Found rail length: %f\n", _physics->physicalTravel);
 #endif
 
-    servo->moveTo(0);
+    _retainMoving();
+    _servo->moveTo(0);
+
+    if (measured && _sensorlessHomeingRemember) {
+        _rememberRail(currentSensorOffset);
+    }
 
     _isHomed = true;
     _state = READY;
+    _homingDuration = (esp_timer_get_time() - _homingStart) / 1000;
+    Logger.log(LOG_LEVEL_INFO, "Homed in %lu ms, rail length %.1f mm%s", _homingDuration, _physics->physicalTravel,
+        measured ? "" : " as stored");
 
 #ifdef DEBUG_TALKATIVE
         Serial.println("Homing succeeded");
@@ -750,42 +1430,175 @@ void StrokeEngine::_sensorlessHomingProcedure() {
     }
 
     // Set first point for telemetry
-    if (_callbackTelemetry != NULL) {
-        _callbackTelemetry(0.0, 0.0, false);
-    }
+    _sendTelemetry(esp_timer_get_time(), 0.0, 0.0, 0.0, -1, false, 0.0);
 
 #ifdef DEBUG_TALKATIVE
     Serial.println("Stroke Engine State: " + verboseState[_state]);
 #endif
 }
 
+bool StrokeEngine::_approachHardStop(int direction, float maxDistance) {
+    bool fast = (_homeingFastSpeed > _homeingSpeed);
+
+    // Rush into the hard stop first, back off and find it again with the homing speed
+    for (int phase = fast ? 0 : 1; phase < 2; phase++) {
+        int speed = (phase == 0) ? _homeingFastSpeed : _homeingSpeed;
+        _servo->setSpeedInHz(speed);
+        _retainMoving();
+        if (maxDistance > 0.0) {
+            // The hard stop must show up within the distance, the slow approach only needs to cover the back off
+            float distance = ((phase == 1) && fast) ? 2 * _homeingBackOff : maxDistance;
+            _servo->move(direction * _motor->stepsPerMillimeter * distance);
+        } else if (direction > 0) {
+            _servo->runForward();
+        } else {
+            _servo->runBackward();
+        }
+
+        // The current is higher while accelerating and while still pushing against the other hard stop
+        unsigned long blanking = 1.0e6 * speed / (_maxStepAcceleration / 10);
+        if ((direction < 0) && (phase == (fast ? 0 : 1))) {
+            blanking = max(blanking, (unsigned long)HOMING_BACKOFF_MS * 1000);
+        }
+        if (_waitForHardStop(blanking) == false) return false;
+
+        if (phase == 0) {
+            _servo->forceStop();
+            _retainMoving();
+            _servo->move(-direction * _motor->stepsPerMillimeter * _homeingBackOff);
+            while (_servo->isRunning()) {
+                if(_abortHoming) return false;
+                vTaskDelay(10 / portTICK_PERIOD_MS);
+            }
+        }
+    }
+    return true;
+}
+
+bool StrokeEngine::_waitForHardStop(unsigned long blankingMicros) {
+    _currentSensor.arm(_sensorlessHomeingCurrentLimit, blankingMicros);
+
+    // The current sensor notifies this task the moment it detects the hard stop
+    while (ulTaskNotifyTake(pdTRUE, HOMING_CURRENT_POLL_MS / portTICK_PERIOD_MS) == 0) {
+        // A move limited in distance may end without a hard stop
+        if(_abortHoming || (_servo->isRunning() == false)) {
+            _currentSensor.disarm();
+            return false;
+        }
+#ifdef DEBUG_TALKATIVE
+        Serial.print(_currentSensor.getCurrent());
+        Serial.print(",");
+        Serial.println(_servo->getCurrentPosition());
+#endif
+    }
+
+    currentSensorStatistics statistics = _currentSensor.getStatistics();
+    Logger.log(LOG_LEVEL_DEBUG, "Hard stop at %d steps, current %.2f%%, latency %u us%s", _servo->getCurrentPosition(),
+        statistics.current, statistics.latencyMicros, statistics.early ? ", early by slope" : "");
+    return true;
+}
+
+uint32_t StrokeEngine::_railFingerprint() {
+    // Everything that moves the hard stops in steps or where they are detected
+    float machine[] = {
+        _motor->stepsPerMillimeter,
+        _motor->invertDirection ? 1.0f : 0.0f,
+        float(_sensorlessHomeingCurrentPin),
+        _sensorlessHomeingCurrentLimit,
+        float(_homeingSpeed)
+    };
+    return fnv1a(machine, sizeof(machine));
+}
+
+float StrokeEngine::_recallRail(float currentSensorOffset) {
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, true) == false) {
+        return 0.0;
+    }
+    float travel = preferences.getFloat("travel", 0.0);
+    float offset = preferences.getFloat("offset", -100.0);
+    uint32_t fingerprint = preferences.getUInt("fingerprint", 0);
+    preferences.end();
+
+    // Only a rail measured on this very machine is plausible
+    if (travel <= 2 * _physics->keepoutBoundary) {
+        return 0.0;
+    }
+    if (fingerprint != _railFingerprint()) {
+        Logger.log(LOG_LEVEL_INFO, "Machine changed since the rail was stored, measuring it again");
+        return 0.0;
+    }
+    if (fabs(currentSensorOffset - offset) > HOMING_OFFSET_TOLERANCE) {
+        Logger.log(LOG_LEVEL_INFO, "Current sensor offset %.2f%% instead of %.2f%%, measuring the rail again",
+            currentSensorOffset, offset);
+        return 0.0;
+    }
+    return travel;
+}
+
+void StrokeEngine::_rememberRail(float currentSensorOffset) {
+    Preferences preferences;
+    if (preferences.begin(_nvsNamespace, false) == false) {
+        Logger.log(LOG_LEVEL_WARNING, "Can't store the rail in NVS");
+        return;
+    }
+    preferences.putFloat("travel", _physics->physicalTravel);
+    preferences.putFloat("offset", currentSensorOffset);
+    preferences.putUInt("fingerprint", _railFingerprint());
+    preferences.end();
+}
+
 void StrokeEngine::_sensorHomingProcedure() {
     // Set feedrate for homing
-    servo->setSpeedInHz(_homeingSpeed);       
-    servo->setAcceleration(_maxStepAcceleration / 10);    
+    _servo->setSpeedInHz(_homeingSpeed);       
+    _servo->setAcceleration(_maxStepAcceleration / 10);    
 
     // Check if we are already at the homing switch
-    if (digitalRead(_homeingPin) == !_homeingActiveLow) {
-        //back off 5 mm from switch
-        servo->move(_motor->stepsPerMillimeter * 2 * _physics->keepoutBoundary * _homeingToBack);
+    bool atSwitch = (digitalRead(_homeingPin) == !_homeingActiveLow);
+    bool fastApproach = (atSwitch == false) && (_homeingFastSpeed > _homeingSpeed);
+
+    // Rush towards the switch, it is found precisely with the homing speed afterwards
+    if (fastApproach == true) {
+        _servo->setSpeedInHz(_homeingFastSpeed);
+        _retainMoving();
+        _servo->move(-_motor->stepsPerMillimeter * _physics->physicalTravel * _homeingToBack);
+        while (_servo->isRunning()) {
+            if(_abortHoming) return;
+            if (digitalRead(_homeingPin) == !_homeingActiveLow) {
+                _servo->forceStop();
+                atSwitch = true;
+                break;
+            }
+            // Poll fast, the carriage covers ground quickly
+            vTaskDelay(HOMING_FAST_POLL_MS / portTICK_PERIOD_MS);
+        }
+    }
+
+    if (atSwitch == true) {
+        //back off from switch
+        _retainMoving();
+        _servo->move(_motor->stepsPerMillimeter * _homeingBackOff * _homeingToBack);
 
         // wait for move to complete
-        while (servo->isRunning()) {
+        while (_servo->isRunning()) {
             if(_abortHoming) return;
             // Pause the task for 100ms while waiting for move to complete
             vTaskDelay(100 / portTICK_PERIOD_MS);
         }
 
         // move back towards endstop
-        servo->move(-_motor->stepsPerMillimeter * 4 * _physics->keepoutBoundary * _homeingToBack);
+        _servo->setSpeedInHz(_homeingSpeed);
+        _retainMoving();
+        _servo->move(-_motor->stepsPerMillimeter * 2 * _homeingBackOff * _homeingToBack);
 
-    } else {
+    } else if (fastApproach == false) {
         // Move MAX_TRAVEL towards the homing switch
-        servo->move(-_motor->stepsPerMillimeter * _physics->physicalTravel * _homeingToBack);
+        _retainMoving();
+        _servo->move(-_motor->stepsPerMillimeter * _physics->physicalTravel * _homeingToBack);
     }
 
     // Poll homing switch
-    while (servo->isRunning()) {
+    while (_servo->isRunning()) {
         if(_abortHoming) return;
         // Switch is active low
         if (digitalRead(_homeingPin) == !_homeingActiveLow) {
@@ -793,21 +1606,24 @@ void StrokeEngine::_sensorHomingProcedure() {
             // Set home position
             if (_homeingToBack == 1) {
                 //Switch is at -KEEPOUT_BOUNDARY
-                servo->forceStopAndNewPosition(-_motor->stepsPerMillimeter * _physics->keepoutBoundary);
+                _servo->forceStopAndNewPosition(-_motor->stepsPerMillimeter * _physics->keepoutBoundary);
 
                 // drive free of switch and set axis to lower end
-                servo->moveTo(_minStep);
+                _retainMoving();
+                _servo->moveTo(_minStep);
 
             } else {
-                servo->forceStopAndNewPosition(_motor->stepsPerMillimeter * (_physics->physicalTravel - _physics->keepoutBoundary));
+                _servo->forceStopAndNewPosition(_motor->stepsPerMillimeter * (_physics->physicalTravel - _physics->keepoutBoundary));
 
                 // drive free of switch and set axis to front end
-                servo->moveTo(_maxStep);
+                _retainMoving();
+                _servo->moveTo(_maxStep);
             }
             _isHomed = true;
 
             // drive free of switch and set axis to 0
-            servo->moveTo(0);
+            _retainMoving();
+            _servo->moveTo(0);
             
             // Break loop, home was found
             break;
@@ -819,7 +1635,7 @@ void StrokeEngine::_sensorHomingProcedure() {
     
     // disable Servo if homing has not found the homing switch
     if (!_isHomed) {
-        servo->disableOutputs();
+        _servo->disableOutputs();
         _state = UNDEFINED;
 
 #ifdef DEBUG_TALKATIVE
@@ -829,6 +1645,8 @@ void StrokeEngine::_sensorHomingProcedure() {
     } else {
         // Set state to ready
         _state = READY;
+        _homingDuration = (esp_timer_get_time() - _homingStart) / 1000;
+        Logger.log(LOG_LEVEL_INFO, "Homed in %lu ms", _homingDuration);
 
 #ifdef DEBUG_TALKATIVE
         Serial.println("Homing succeeded");
@@ -841,9 +1659,7 @@ void StrokeEngine::_sensorHomingProcedure() {
     }
 
     // Set first point for telemetry
-    if (_callbackTelemetry != NULL) {
-        _callbackTelemetry(0.0, 0.0, false);
-    }
+    _sendTelemetry(esp_timer_get_time(), 0.0, 0.0, 0.0, -1, false, 0.0);
 
 #ifdef DEBUG_TALKATIVE
     Serial.println("Stroke Engine State: " + verboseState[_state]);
@@ -851,137 +1667,1206 @@ void StrokeEngine::_sensorHomingProcedure() {
 }
 
 void StrokeEngine::_stroking() {
-    motionParameter currentMotion;
+    int64_t now;
+    int64_t nextWakeUp;
 
     while(1) { // infinite loop
 
-        // Suspend task, if not in PATTERN state
-        if (_state != PATTERN) {
+        // Suspend task, if not in PATTERN state and all motion has come to a halt
+        if ((_state != PATTERN) && (_queueActive == false)) {
+            esp_timer_stop(_strokeTimer);
             vTaskSuspend(_taskStrokingHandle);
         }
 
-        // Take mutex to ensure no interference / race condition with communication threat on other core
-        if (xSemaphoreTake(_patternMutex, 0) == pdTRUE) {
+        // Poll again soon, should the step queue still be busy with a move of the ramp generator
+        nextWakeUp = STROKE_POLL_US;
 
-            if (_applyUpdate == true) {
-                // Ask pattern for update on motion parameters
-                currentMotion = patternTable[_patternIndex]->nextTarget(_index);
-            
-                // Increase deceleration if required to avoid crash
-                if (servo->getAcceleration() > currentMotion.acceleration) {
-#ifdef DEBUG_CLIPPING
-                    Serial.print("Crash avoidance! Set Acceleration from " + String(currentMotion.acceleration));
-                    Serial.println(" to " + String(servo->getAcceleration()));
-#endif
-                    currentMotion.acceleration = servo->getAcceleration();
+        now = esp_timer_get_time();
+
+        // Take over the step queue once a pending move of the ramp generator has finished
+        if ((_queueActive == false) && (_state == PATTERN) && (_servo->isRunning() == false)) {
+            _planner.reset(_servo->getCurrentPosition());
+            _queuedPosition = _servo->getCurrentPosition();
+            _queueEndMicros = 0;
+            _queueTickCarry = 0;
+            _slicePending = false;
+            _queueStopping = false;
+            _queueActive = true;
+
+            // Start the pattern from scratch with the current parameters
+            _updateParameter(true);
+        }
+
+        if (_queueActive == true) {
+            if (_state == PATTERN) {
+                // Replan pre-planned moves if a setter published new parameters. Never blocks.
+                _updateParameter(false);
+
+                // Query the pattern for the next moves
+                _fillLookahead();
+
+            } else if (_state == UNDEFINED) {
+                // Servo was disabled: drop everything
+                _servo->forceStopAndNewPosition(_servo->getCurrentPosition());
+                _planner.reset(_servo->getCurrentPosition());
+                _queueEndMicros = 0;
+                _slicePending = false;
+
+            } else if (_queueStopping == false) {
+                // Come to a halt as fast as legally allowed
+                _planner.stop();
+                _queueStopping = true;
+            }
+
+            // Sample the planned motion into the step queue. Planning may have taken a while, the queue ran on meanwhile.
+            int64_t queued = esp_timer_get_time();
+            _fillQueue(queued);
+
+            if (_planner.isIdle() == true) {
+                // Hand the servo back once the step queue has run empty
+                if ((_state != PATTERN) && (_servo->isRunning() == false)) {
+                    _queueActive = false;
                 }
+                nextWakeUp = _queueEndMicros - queued;
+            } else {
+                // Refill when half of the committed motion is executed
+                nextWakeUp = _queueEndMicros - queued - STROKE_COMMIT_US / 2;
+            }
+        }
+
+        // CPU time of this axis
+        unsigned long busy = esp_timer_get_time() - now;
+        _cpuWakeups++;
+        _cpuBusyMicros += busy;
+        _cpuMaxMicros = max(_cpuMaxMicros, busy);
+
+        // Sleep until the step queue needs a refill or a setter requests an update
+        esp_timer_stop(_strokeTimer);
+        esp_timer_start_once(_strokeTimer, max(nextWakeUp, (int64_t)STROKE_POLL_US));
+        ulTaskNotifyTake(pdTRUE, STROKE_WATCHDOG_MS / portTICK_PERIOD_MS);
+    }
+}
+
+uint32_t StrokeEngine::_machineFingerprint() {
+    // A position in steps only means the same with the same motor and boundaries
+    float machine[] = {
+        _motor->stepsPerMillimeter,
+        _motor->invertDirection ? 1.0f : 0.0f,
+        float(_motor->stepPin),
+        _physics->keepoutBoundary
+    };
+    return fnv1a(machine, sizeof(machine));
+}
+
+void StrokeEngine::_retainMoving() {
+    // Invalidate before the first step, the timer only validates again once the servo stands still
+    _motionSequence++;
+    if (_retained != NULL) {
+        _retained->magic = 0;
+    }
+    __sync_synchronize();
+}
+
+void StrokeEngine::_retainHome() {
+    if ((_servo == NULL) || (_retained == NULL)) {
+        return;
+    }
+    uint32_t sequence = _motionSequence;
+    __sync_synchronize();
+    int32_t position = _servo->getCurrentPosition();
+    bool standing = (_isHomed == true) && (_servo->isRunning() == false) && (position == _retainPosition);
+    _retainPosition = position;
+
+    if (standing == false) {
+        _retained->magic = 0;
+    } else if ((_retained->magic != HOME_RETAIN_MAGIC) || (_retained->position != position)) {
+        _retained->magic = 0;
+        _retained->position = position;
+        _retained->physicalTravel = _physics->physicalTravel;
+        _retained->machine = _machineFingerprint();
+        _retained->checksum = fnv1a(&_retained->position, offsetof(retainedHome, checksum) - offsetof(retainedHome, position));
+        _retained->magic = HOME_RETAIN_MAGIC;
+    }
+
+    // A motion command in between makes the record stale
+    __sync_synchronize();
+    if (_motionSequence != sequence) {
+        _retained->magic = 0;
+    }
+}
+
+bool StrokeEngine::_resumeHome() {
+    _resumed = false;
+
+    // A reset of the ESP32 alone leaves the servo powered and in place
+    if (_retained == NULL) {
+        return false;
+    }
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool soft = (reason == ESP_RST_SW) || (reason == ESP_RST_PANIC) || (reason == ESP_RST_INT_WDT) ||
+        (reason == ESP_RST_TASK_WDT) || (reason == ESP_RST_WDT);
+    bool valid = (_retained->magic == HOME_RETAIN_MAGIC) && (_retained->machine == _machineFingerprint()) &&
+        (_retained->checksum == fnv1a(&_retained->position, offsetof(retainedHome, checksum) - offsetof(retainedHome, position)));
+    _retained->magic = 0;
+    if ((soft == false) || (valid == false)) {
+        return false;
+    }
+
+    _servo->enableOutputs();
+    _servo->setCurrentPosition(_retained->position);
+    _retainPosition = _retained->position;
+    _physics->physicalTravel = _retained->physicalTravel;
+    _travel = (_physics->physicalTravel - (2 * _physics->keepoutBoundary));
+    _isHomed = true;
+    _state = READY;
+    _resumed = true;
+    Logger.log(LOG_LEVEL_INFO, "Resumed at %d steps after reset %d", _retained->position, (int)reason);
+    return true;
+}
+
+void StrokeEngine::_wakeMotionTask() {
+    // Only one of both tasks feeds the step queue at a time, the other one is suspended
+    if (_taskStrokingHandle != NULL) {
+        xTaskNotifyGive(_taskStrokingHandle);
+    }
+    if (_taskStreamingHandle != NULL) {
+        xTaskNotifyGive(_taskStreamingHandle);
+    }
+}
+
+void StrokeEngine::_publishParameter(bool applyNow, bool newPattern) {
+    // Seqlock: The sequence is odd while the parameters are written. Caller holds _parameterMutex.
+    _parameterSequence++;
+    __sync_synchronize();
+
+    _parameter.patternIndex = _patternIndex;
+    _parameter.timeOfStroke = _timeOfStroke;
+    _parameter.depth = _depth;
+    _parameter.stroke = _stroke;
+    _parameter.sensation = _sensation;
+    _parameter.maxStepPerSecond = _maxStepPerSecond;
+    _parameter.maxStepAcceleration = _maxStepAcceleration;
+    _parameter.retargetTime = (_updateLatency - STROKE_COMMIT_US / 1000.0) / 1000.0;
+    for (int i = 0; i < RAMP_PARAMETERS; i++) {
+        // Depth and stroke ramp in steps
+        _parameter.ramp[i] = _ramp[i];
+        if ((i == RAMP_DEPTH) || (i == RAMP_STROKE)) {
+            _parameter.ramp[i].rate *= _motor->stepsPerMillimeter;
+        }
+        _parameter.valueRequests[i] = _valueRequests[i];
+        _parameter.rampRequests[i] = _rampRequests[i];
+    }
+    if (newPattern == true) {
+        _parameter.patternRequests++;
+    }
+    if (applyNow == true) {
+        _parameter.applyRequests++;
+    }
 
-                // Apply new trapezoidal motion profile to servo
-                _applyMotionProfile(&currentMotion);
+    __sync_synchronize();
+    _parameterSequence++;
+}
+
+bool StrokeEngine::_readParameter(strokeParameter *snapshot, uint32_t *sequence) {
+    unsigned int retries = 0;
+
+    while (retries <= PARAMETER_MAX_RETRIES) {
+        uint32_t before = _parameterSequence;
+        __sync_synchronize();
+        *snapshot = _parameter;
+        __sync_synchronize();
+
+        // Snapshot is consistent if no setter was writing before or during the copy
+        if (((before & 1) == 0) && (before == _parameterSequence)) {
+            _parameterReads++;
+            _parameterRetries += retries;
+            _parameterMaxRetries = max(_parameterMaxRetries, retries);
+            *sequence = before;
+            return true;
+        }
+        retries++;
+    }
+
+    // Don't spin any longer, the next cycle will try again
+    _parameterRetries += retries;
+    _parameterDeferred++;
+    return false;
+}
+
+void StrokeEngine::_publishTarget() {
+    // Seqlock like _publishParameter(), the stroking task is the only writer
+    _targetSequence++;
+    __sync_synchronize();
+    _target = _rampTarget;
+    __sync_synchronize();
+    _targetSequence++;
+}
+
+bool StrokeEngine::_readTarget(strokeParameter *target) {
+    for (unsigned int retries = 0; retries <= PARAMETER_MAX_RETRIES; retries++) {
+        uint32_t before = _targetSequence;
+        __sync_synchronize();
+        *target = _target;
+        __sync_synchronize();
+
+        // Nothing published before the stroking task ran for the first time
+        if (((before & 1) == 0) && (before == _targetSequence)) {
+            return (before > 0);
+        }
+    }
+    return false;
+}
+
+void StrokeEngine::_updateParameter(bool restart, bool replan) {
+    strokeParameter parameter;
+    uint32_t sequence;
 
-                // clear update flag
-                _applyUpdate = false;
+    // Nothing new since the last snapshot
+    if ((restart == false) && (_parameterSequence == _activeSequence)) {
+        return;
+    }
+
+    if (_readParameter(&parameter, &sequence) == false) {
+        if (restart == false) {
+            return;
+        }
+        // Starting a pattern can't wait: fall back to the last consistent snapshot, the targets of the ramps
+        parameter = _rampTarget;
+        sequence = _activeSequence;
+    }
+
+    // A step of a program set its values in the stroking task, they stay until a setter changes them again
+    if (_targetSequence > 0) {
+        if (parameter.patternRequests == _rampTarget.patternRequests) {
+            parameter.patternIndex = _rampTarget.patternIndex;
+        }
+        if (parameter.valueRequests[RAMP_SPEED] == _rampTarget.valueRequests[RAMP_SPEED]) {
+            parameter.timeOfStroke = _rampTarget.timeOfStroke;
+        }
+        if (parameter.valueRequests[RAMP_DEPTH] == _rampTarget.valueRequests[RAMP_DEPTH]) {
+            parameter.depth = _rampTarget.depth;
+        }
+        if (parameter.valueRequests[RAMP_STROKE] == _rampTarget.valueRequests[RAMP_STROKE]) {
+            parameter.stroke = _rampTarget.stroke;
+        }
+        if (parameter.valueRequests[RAMP_SENSATION] == _rampTarget.valueRequests[RAMP_SENSATION]) {
+            parameter.sensation = _rampTarget.sensation;
+        }
+        for (int i = 0; i < RAMP_PARAMETERS; i++) {
+            if (parameter.rampRequests[i] == _rampTarget.rampRequests[i]) {
+                parameter.ramp[i] = _rampTarget.ramp[i];
             }
+        }
+    }
+
+    bool newPattern = (restart == true) || (parameter.patternRequests != _activeParameter.patternRequests);
+    bool applyNow = (parameter.applyRequests != _activeParameter.applyRequests);
 
-            // If motor has stopped issue moveTo command to next position
-            else if (servo->isRunning() == false) {
+    // Ramped parameters keep their value and glide towards the new target stroke by stroke
+    _rampTarget = parameter;
+    _publishTarget();
+    if (restart == true) {
+        for (int i = 0; i < RAMP_PARAMETERS; i++) {
+            _rampValue[i] = rampedValue(&parameter, i);
+        }
+        _rampMicros = -1;
+    } else {
+        _holdRamps(&parameter);
+    }
+
+    // Re-published or ramped values don't change the plan
+    bool changed = (newPattern == true) 
+        || (parameter.timeOfStroke != _activeParameter.timeOfStroke) 
+        || (parameter.depth != _activeParameter.depth) 
+        || (parameter.stroke != _activeParameter.stroke) 
+        || (parameter.sensation != _activeParameter.sensation) 
+        || (parameter.maxStepPerSecond != _activeParameter.maxStepPerSecond) 
+        || (parameter.maxStepAcceleration != _activeParameter.maxStepAcceleration) 
+        || (parameter.retargetTime != _activeParameter.retargetTime);
+
+    _applyParameter(&parameter, newPattern);
+
+    // Moves pre-planned with the old parameters are outdated now
+    if ((restart == false) && (replan == true) && ((changed == true) || (applyNow == true))) {
+        _invalidateLookahead(applyNow == false);
+    }
+
+    // Reset index counter
+    if (newPattern == true) {
+        _index = -1;
+        _stretchStroke = -1;
+        _beatIndex = -1;
+        _beatStarted = -1;
+        _rampIndex = -1;
+    }
+
+    _activeParameter = parameter;
+    _activeSequence = sequence;
+}
+
+void StrokeEngine::_applyParameter(const strokeParameter *parameter, bool newPattern) {
+    Pattern *pattern = _pattern[parameter->patternIndex];
+
+    // Inject the parameters which have changed into the pattern
+    _planner.setLimits(parameter->maxStepPerSecond, parameter->maxStepAcceleration);
+    _planner.setRetargetTime(parameter->retargetTime);
+    if ((newPattern == true) 
+            || (parameter->maxStepPerSecond != _activeParameter.maxStepPerSecond) 
+            || (parameter->maxStepAcceleration != _activeParameter.maxStepAcceleration)) {
+        pattern->setSpeedLimit(parameter->maxStepPerSecond, parameter->maxStepAcceleration, _motor->stepsPerMillimeter);
+    }
+    if ((newPattern == true) || (parameter->timeOfStroke != _activeParameter.timeOfStroke)) {
+        _rateApplied = _rateFactor(parameter->patternIndex);
+        pattern->setTimeOfStroke(parameter->timeOfStroke * _rateApplied);
+    }
+    if ((newPattern == true) || (parameter->stroke != _activeParameter.stroke)) {
+        pattern->setStroke(parameter->stroke);
+    }
+    if ((newPattern == true) || (parameter->depth != _activeParameter.depth)) {
+        pattern->setDepth(parameter->depth);
+    }
+    if ((newPattern == true) || (parameter->sensation != _activeParameter.sensation)) {
+        pattern->setSensation(parameter->sensation);
+    }
 
-                // Increment index for pattern
-                _index++;
+    // A stroke spanning a change of the timing or the geometry can't be compared
+    if ((newPattern == true) 
+            || (parameter->timeOfStroke != _activeParameter.timeOfStroke) 
+            || (parameter->stroke != _activeParameter.stroke) 
+            || (parameter->depth != _activeParameter.depth)) {
+        _resetRateMeasurement();
+    }
+}
+
+void StrokeEngine::_setTarget(const strokeParameter *target, bool newPattern) {
+    // Same as a snapshot read by _updateParameter(), but for targets the stroking task set itself
+    strokeParameter parameter = *target;
+    _rampTarget = parameter;
+    _publishTarget();
+    _holdRamps(&parameter);
+    _applyParameter(&parameter, newPattern);
 
-                // Querey new set of pattern parameters
-                currentMotion = patternTable[_patternIndex]->nextTarget(_index);
+    // Reset index counter
+    if (newPattern == true) {
+        _index = -1;
+        _stretchStroke = -1;
+        _beatIndex = -1;
+        _beatStarted = -1;
+        _rampIndex = -1;
+    }
+    _activeParameter = parameter;
+}
 
-                // Pattern may introduce pauses between strokes
-                if (currentMotion.skip == false) {
+void StrokeEngine::_holdRamps(strokeParameter *parameter) {
+    for (int i = 0; i < RAMP_PARAMETERS; i++) {
+        if (parameter->ramp[i].rate > 0.0) {
+            setRampedValue(parameter, i, _rampValue[i]);
+        } else {
+            // Without a ramp the target applies right away
+            _rampValue[i] = rampedValue(parameter, i);
+        }
+    }
+}
+
+void StrokeEngine::_stepRamps(int64_t plannedMicros) {
+    // Time since the ramps were evaluated for the previous stroke, pauses included
+    float elapsed = (_rampMicros >= 0) ? max(0.0f, (plannedMicros - _rampMicros) / 1.0e6f) : 0.0f;
+    _rampMicros = plannedMicros;
+    _rampIndex = _index + 1;
+
+    strokeParameter parameter = _activeParameter;
+    for (int i = 0; i < RAMP_PARAMETERS; i++) {
+        const parameterRamp *ramp = &_rampTarget.ramp[i];
+        if (ramp->rate <= 0.0) {
+            continue;
+        }
+        float target = rampedValue(&_rampTarget, i);
+        float step = (ramp->perStroke == true) ? ramp->rate : ramp->rate * elapsed;
+        _rampValue[i] = (_rampValue[i] < target) ? min(_rampValue[i] + step, target) : max(_rampValue[i] - step, target);
+        setRampedValue(&parameter, i, _rampValue[i]);
+    }
+
+    // The stroke about to be planned runs with the new values
+    _applyParameter(&parameter, false);
+    _activeParameter = parameter;
+}
+
+bool StrokeEngine::_parseStep(const char *text, size_t length, programStep *step) {
+    char buffer[PROGRAM_STEP_LENGTH + 1];
+    char transition[8] = "jump";
+    char unit = 0;
+    float amount = 0.0;
+
+    if (length > PROGRAM_STEP_LENGTH) {
+        return false;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+
+    // pattern,length,speed,depth,stroke,sensation[,transition]
+    int fields = sscanf(buffer, " %d , %f %c , %f , %f , %f , %f , %7[a-zA-Z]", &step->pattern, &amount, &unit, 
+        &step->speed, &step->depth, &step->stroke, &step->sensation, transition);
+    if ((fields < 7) || (step->pattern < 0) || (step->pattern >= (int)patternTableSize) || (amount <= 0.0)) {
+        return false;
+    }
+    if (unit == 's') {
+        step->duration = amount;
+        step->strokes = 0;
+    } else if ((unit == 'x') && (amount >= 1.0)) {
+        step->duration = 0.0;
+        step->strokes = (unsigned int)lroundf(amount);
+    } else {
+        return false;
+    }
+    if (strcasecmp(transition, "jump") == 0) {
+        step->transition = JUMP;
+    } else if (strcasecmp(transition, "glide") == 0) {
+        step->transition = GLIDE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void StrokeEngine::_programTarget(int index, strokeParameter *target) {
+    // Same conversions and bounds as the setters
+    const programStep *step = &_program[index];
+    target->patternIndex = step->pattern;
+    target->timeOfStroke = constrain(60.0 / step->speed, 0.01, 120.0);
+    target->depth = constrain(int(step->depth * _motor->stepsPerMillimeter), _minStep, _maxStep);
+    target->stroke = constrain(int(step->stroke * _motor->stepsPerMillimeter), _minStep, _maxStep);
+    target->sensation = constrain(step->sensation, -100, 100);
+}
+
+void StrokeEngine::_startProgramStep(int index) {
+    // Control side only, the setters take _parameterMutex. Caller holds _programMutex.
+    const programStep *step = &_program[index];
+    float length = (step->strokes > 0) ? step->strokes : step->duration;
+    bool perStroke = (step->strokes > 0);
+    bool glide = (step->transition == GLIDE);
+
+    // A glide spans the whole step and starts from the targets of the previous one, a jump has no ramp
+    setRamp(RAMP_SPEED, glide ? fabs(step->speed - getSpeed()) / length : 0.0, perStroke);
+    setRamp(RAMP_DEPTH, glide ? fabs(step->depth - getDepth()) / length : 0.0, perStroke);
+    setRamp(RAMP_STROKE, glide ? fabs(step->stroke - getStroke()) / length : 0.0, perStroke);
+    setRamp(RAMP_SENSATION, glide ? fabs(step->sensation - getSensation()) / length : 0.0, perStroke);
+
+    // The pattern only starts over if it changes
+    if (step->pattern != getPattern()) {
+        setPattern(step->pattern, false);
+    }
+    setSpeed(step->speed, false);
+    setDepth(step->depth, false);
+    setStroke(step->stroke, false);
+    setSensation(step->sensation, false);
+
+    _programStep = index;
+    _programStrokes = -1;
+}
+
+void StrokeEngine::_playProgramStep(int index) {
+    // Runs in the stroking task, which must not wait for _parameterMutex. Caller holds _programMutex.
+    const programStep *step = &_program[index];
+    float length = (step->strokes > 0) ? step->strokes : step->duration;
+    strokeParameter target = _rampTarget;
+    _programTarget(index, &target);
+
+    // A glide spans the whole step and starts from the targets of the previous one, a jump has no ramp
+    for (int i = 0; i < RAMP_PARAMETERS; i++) {
+        target.ramp[i].rate = (step->transition == GLIDE) 
+            ? fabs(rampedValue(&target, i) - rampedValue(&_rampTarget, i)) / length : 0.0;
+        target.ramp[i].perStroke = (step->strokes > 0);
+    }
+
+    // The pattern only starts over if it changes. The getters see the step through _publishTarget().
+    _setTarget(&target, target.patternIndex != _rampTarget.patternIndex);
+    _programStep = index;
+}
+
+void StrokeEngine::_stepProgram(int64_t plannedMicros) {
+    // Never wait for a caller of the program functions, try again with the next stroke
+    if ((_programStep < 0) || (xSemaphoreTake(_programMutex, 0) != pdTRUE)) {
+        return;
+    }
+
+    if (_programStep >= 0) {
+        if (_programStrokes < 0) {
+            // First stroke of a step started by startProgram()
+            _programStart = plannedMicros;
+            _programStrokes = 0;
+        } else {
+            const programStep *step = &_program[_programStep];
+            _programStrokes++;
+            bool done = (step->strokes > 0) 
+                ? (_programStrokes >= (int)step->strokes) 
+                : (plannedMicros - _programStart >= int64_t(1.0e6 * step->duration));
+
+            if (done == true) {
+                int next = _programStep + 1;
+                if (next >= (int)_programLength) {
+                    next = (_programLoop == true) ? 0 : -1;
+                }
+                if (next < 0) {
+                    // The ramps of setRamp() apply again, the values of the last step stay
+                    strokeParameter target = _rampTarget;
+                    for (int i = 0; i < RAMP_PARAMETERS; i++) {
+                        target.ramp[i] = _programRamp[i];
+                        if ((i == RAMP_DEPTH) || (i == RAMP_STROKE)) {
+                            target.ramp[i].rate *= _motor->stepsPerMillimeter;
+                        }
+                    }
+                    _setTarget(&target, false);
+                    _programStep = -1;
+                } else {
+                    // This stroke runs with the new step, the moves planned before stay as they are
+                    _playProgramStep(next);
+                    _programStart = plannedMicros;
+                    _programStrokes = 0;
+                }
+            }
+        }
+    }
+    xSemaphoreGive(_programMutex);
+}
+
+void StrokeEngine::_endProgram() {
+    // The ramps of setRamp() apply again. Caller holds _programMutex, never called by the stroking task.
+    _programStep = -1;
+    for (int i = 0; i < RAMP_PARAMETERS; i++) {
+        setRamp((RampParameter)i, _programRamp[i].rate, _programRamp[i].perStroke);
+    }
+}
+
+void StrokeEngine::_invalidateLookahead(bool keepCurrent) {
+    const plannerBlock *current = _planner.current();
+
+    if (current == NULL) {
+        return;
+    }
+
+    // Stroke index the executing move belongs to. A pause keeps the index of the previous stroke.
+    int currentIndex = current->index;
+    bool dwell = current->dwell;
+
+    _planner.invalidate(keepCurrent);
+
+    // A dwell waiting for a beat may be gone, align the next stroke again
+    _beatIndex = -1;
+
+    // Continue after the executing move if it was kept, otherwise ask the pattern again for it
+    if ((_planner.isIdle() == false) || (dwell == true)) {
+        _index = currentIndex;
+    } else {
+        _index = currentIndex - 1;
+    }
+}
+
+void StrokeEngine::_fillLookahead() {
+    motionParameter currentMotion;
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; (i < PLANNER_LOOKAHEAD_DEPTH) && (_planner.count() < PLANNER_LOOKAHEAD_DEPTH); i++) {
+        // Ask the pattern whether the next move starts a full stroke before anything changes its parameters
+        bool strokeStart = _pattern[_activeParameter.patternIndex]->isStrokeStart(_index + 1);
+
+        // The program and the ramps take a step once per full stroke, a replanned stroke keeps its values
+        if ((strokeStart == true) && (_index + 1 > _rampIndex)) {
+            int64_t plannedMicros = max(now, _queueEndMicros) + int64_t(1.0e6 * _planner.bufferedTime());
+            _stepProgram(plannedMicros);
+            _stepRamps(plannedMicros);
+        }
+
+        // A full stroke starts on a beat of the time base, wait for it once
+        if ((_clock != NULL) && (strokeStart == true) && (_index + 1 != _beatIndex)) {
+            int64_t wait = _alignToBeat(max(now, _queueEndMicros) + int64_t(1.0e6 * _planner.bufferedTime()));
+            if (wait > 0) {
+                _planner.addDwell(wait / 1.0e6, _index);
+                continue;
+            }
+        }
+
+        // Tell the pattern when the move it is asked for will start
+        unsigned long plannedMillis = millis() + (unsigned long)(max((int64_t)0, _queueEndMicros - now) / 1000)
+            + (unsigned long)(1000.0 * _planner.bufferedTime());
+        _pattern[_activeParameter.patternIndex]->setPlannedTime(plannedMillis);
+
+        // Increment index for pattern
+        _index++;
+        _markStrokeStart(_index, strokeStart);
+
+        // Querey new set of pattern parameters
+        currentMotion = _pattern[_activeParameter.patternIndex]->nextTarget(_index);
+
+        // Pattern may introduce pauses between strokes
+        if (currentMotion.skip == false) {
 
 #ifdef DEBUG_STROKE
-                    Serial.println("Stroking Index: " + String(_index));
+            Serial.println("Stroking Index: " + String(_index));
 #endif
-                    // Apply new trapezoidal motion profile to servo
-                    _applyMotionProfile(&currentMotion);
+            // Append trapezoidal motion profile to the lookahead buffer
+            _applyMotionProfile(&currentMotion);
 
-                } else {
-                    // decrement _index so that it stays the same until the next valid stroke parameters are delivered
-                    _index--;
+        } else {
+            // decrement _index so that it stays the same until the next valid stroke parameters are delivered
+            _index--;
+            _planner.addDwell(STROKE_PAUSE_US / 1.0e6, _index);
+
+            // Ask again once the pause is executed
+            break;
+        }
+    }
+}
+
+int64_t StrokeEngine::_alignToBeat(int64_t plannedMicros) {
+    // The beats follow the nominal time of stroke, rate compensation makes the pattern keep it
+    _beatIndex = _index + 1;
+    _beatPeriod = 1.0e6 * _activeParameter.timeOfStroke;
+    return _clock->nextBeat(plannedMicros, _beatPeriod) - plannedMicros;
+}
+
+void StrokeEngine::_markStrokeStart(int index, bool strokeStart) {
+    // Only a few moves are planned ahead, 32 bits hold all of them that didn't start yet
+    if (strokeStart == true) {
+        _strokeStarts |= (1UL << (index & 31));
+        _strokeIndex = index;
+    } else {
+        _strokeStarts &= ~(1UL << (index & 31));
+    }
+}
+
+void StrokeEngine::_fillQueue(int64_t now) {
+    // Step queue ran empty: Restart the time base and account the gap as dead time
+    if (_servo->isRunning() == false) {
+        if ((_queueEndMicros > 0) && (_planner.isIdle() == false) && (now > _queueEndMicros)) {
+            unsigned long deadTime = (unsigned long)(now - _queueEndMicros);
+            _deadTimeSumMicros += deadTime;
+            if (deadTime > _deadTimeMaxMicros) {
+                _deadTimeMaxMicros = deadTime;
+            }
+#ifdef DEBUG_STROKE
+            Serial.println("Step queue underrun: " + String(deadTime) + "µs");
+#endif
+        }
+        _queueEndMicros = now;
+        _queueTickCarry = 0;
+    }
+
+    // Commit the planned motion to the step queue in time slices
+    while ((_queueEndMicros - now < STROKE_COMMIT_US) && ((_planner.isIdle() == false) || (_slicePending == true))) {
+        // A slice the step queue had no room for is queued again before the planner moves on
+        if (_slicePending == false) {
+            const plannerBlock *started = _planner.nextSlice(STROKE_SLICE_US / 1.0e6);
+
+            // Report moves of the pattern as they start
+            if ((started != NULL) && (started->dwell == false) && (started->index >= 0)) {
+                if ((_clock != NULL) && (_isStrokeStart(started->index) == true) && (started->index != _beatStarted)) {
+                    // How far the full stroke starting now is off its beat
+                    float phase = fabs(_clock->phaseError(_queueEndMicros, _beatPeriod));
+                    _phaseSumMicros += phase;
+                    _phaseMaxMicros = max(_phaseMaxMicros, phase);
+                    _beats++;
+                    _beatStarted = started->index;
                 }
+                _deadTimeMoves++;
+                _measureStrokeRate(started, _queueEndMicros);
+                _sendTelemetry(_queueEndMicros, started->target, started->speed, 
+                    started->acceleration, started->index, started->clipping, started->deficit);
             }
+        }
 
-            // give back mutex
-            xSemaphoreGive(_patternMutex);
+        // Step queue is full: the timeline stays where it is until the slice made it in
+        if (_queueSlice(int(floorf(_planner.getPosition() + 0.5)) - _queuedPosition, STROKE_SLICE_US * (TICKS_PER_S / 1000000)) == false) {
+            break;
         }
-        
-        // Delay 10ms 
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        _queueEndMicros += STROKE_SLICE_US;
+    }
+}
+
+bool StrokeEngine::_queueSlice(int steps, uint32_t ticks) {
+    struct stepper_command_s command;
+    _retainMoving();
+
+    // A new slice takes the rounding error of the previous one. A retried slice continues with the ticks it has left.
+    if (_slicePending == false) {
+        _sliceTicks = ticks + _queueTickCarry;
+        _queueTickCarry = 0;
+        _slicePending = true;
+    }
+
+    // Standing still: a pause keeping the direction
+    if (steps == 0) {
+        command.ticks = _sliceTicks;
+        command.steps = 0;
+        command.count_up = _queueCountUp;
+        if (_servo->addQueueEntry(&command) != AQE_OK) {
+            return false;
+        }
+        _slicePending = false;
+        return true;
     }
+
+    _queueCountUp = (steps > 0);
+    unsigned int count = abs(steps);
+
+    // Spread the steps evenly over the slice. The rounding error is carried over to the next slice.
+    uint32_t period = constrain(_sliceTicks / count, (uint32_t)MIN_DELTA_TICKS, (uint32_t)0xFFFF);
+
+    // A queue entry holds at most 255 steps
+    for (unsigned int entries = (count + 254) / 255; entries > 0; entries--) {
+        command.ticks = period;
+        command.steps = count / entries;
+        command.count_up = _queueCountUp;
+        if (_servo->addQueueEntry(&command) != AQE_OK) {
+            // The steps queued so far count, the rest is retried over the ticks left
+            return false;
+        }
+        _queuedPosition += _queueCountUp ? command.steps : -command.steps;
+        _sliceTicks -= min(_sliceTicks, period * command.steps);
+        count -= command.steps;
+    }
+    _queueTickCarry = _sliceTicks;
+    _slicePending = false;
+    return true;
+}
+
+deadTimeStatistics StrokeEngine::getDeadTimeStatistics() {
+    deadTimeStatistics statistics;
+    statistics.moves = _deadTimeMoves;
+    statistics.averageMicros = (_deadTimeMoves > 0) ? float(_deadTimeSumMicros) / _deadTimeMoves : 0.0;
+    statistics.maximumMicros = _deadTimeMaxMicros;
+    return statistics;
+}
+
+void StrokeEngine::resetDeadTimeStatistics() {
+    _deadTimeMoves = 0;
+    _deadTimeSumMicros = 0;
+    _deadTimeMaxMicros = 0;
+}
+
+Pattern *StrokeEngine::getPatternInstance(int patternIndex) {
+    if ((patternIndex < (int)patternTableSize) && (patternIndex >= 0)) {
+        return _pattern[patternIndex];
+    }
+    return NULL;
+}
+
+void StrokeEngine::setTimeBase(StrokeClock *clock) {
+    _clock = clock;
+    _beatIndex = -1;
+}
+
+axisStatistics StrokeEngine::getAxisStatistics() {
+    axisStatistics statistics;
+    int64_t elapsed = esp_timer_get_time() - _cpuSince;
+    statistics.wakeups = _cpuWakeups;
+    statistics.averageMicros = (_cpuWakeups > 0) ? float(_cpuBusyMicros) / _cpuWakeups : 0.0;
+    statistics.maximumMicros = _cpuMaxMicros;
+    statistics.load = (elapsed > 0) ? 100.0 * _cpuBusyMicros / elapsed : 0.0;
+    statistics.beats = _beats;
+    statistics.averagePhaseMicros = (_beats > 0) ? _phaseSumMicros / _beats : 0.0;
+    statistics.maximumPhaseMicros = _phaseMaxMicros;
+    return statistics;
+}
+
+void StrokeEngine::resetAxisStatistics() {
+    _cpuWakeups = 0;
+    _cpuBusyMicros = 0;
+    _cpuMaxMicros = 0;
+    _cpuSince = esp_timer_get_time();
+    _beats = 0;
+    _phaseSumMicros = 0.0;
+    _phaseMaxMicros = 0.0;
+}
+
+void StrokeEngine::startSampler(float rate) {
+    if (_servo == NULL) {
+        return;
+    }
+    _sampler.start(_servo, rate);
+
+#ifdef DEBUG_TALKATIVE
+    Serial.println("Sampling actual position with " + String(_sampler.getStatistics().rate, 0) + " Hz");
+#endif
+}
+
+void StrokeEngine::stopSampler() {
+    _sampler.stop();
+}
+
+void StrokeEngine::dumpSamples() {
+    _sampler.dump((_motor != NULL) ? _motor->stepsPerMillimeter : 0.0);
+}
+
+samplerStatistics StrokeEngine::getSamplerStatistics() {
+    return _sampler.getStatistics();
+}
+
+currentSensorStatistics StrokeEngine::getCurrentSensorStatistics() {
+    return _currentSensor.getStatistics();
+}
+
+void StrokeEngine::printCurrentTrace() {
+    _currentSensor.printTrace();
+}
+
+parameterStatistics StrokeEngine::getParameterStatistics() {
+    parameterStatistics statistics;
+    statistics.reads = _parameterReads;
+    statistics.retries = _parameterRetries;
+    statistics.maximumRetries = _parameterMaxRetries;
+    statistics.deferred = _parameterDeferred;
+    return statistics;
+}
+
+void StrokeEngine::resetParameterStatistics() {
+    _parameterReads = 0;
+    _parameterRetries = 0;
+    _parameterMaxRetries = 0;
+    _parameterDeferred = 0;
 }
 
 void StrokeEngine::_streaming() {
+    int64_t now;
+    int64_t nextWakeUp;
+    float reference;
+    float referenceVelocity;
+    float dt = STROKE_SLICE_US / 1.0e6;
 
     while(1) { // infinite loop
 
-        // Suspend task, if not in STREAMING state
-        if (_state != STREAMING) {
+        // Suspend task, if not in STREAMING state and all motion has come to a halt
+        if ((_state != STREAMING) && (_queueActive == false)) {
+            esp_timer_stop(_strokeTimer);
             vTaskSuspend(_taskStreamingHandle);
         }
-        
-        // Delay 10ms 
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+
+        // Retry soon, should the mutex be taken by pushStreamPosition() right now
+        nextWakeUp = STROKE_POLL_US;
+
+        if (xSemaphoreTake(_streamMutex, 0) == pdTRUE) {
+            now = esp_timer_get_time();
+
+            // Take over the step queue once a pending move of the ramp generator has finished
+            if ((_queueActive == false) && (_state == STREAMING) && (_servo->isRunning() == false)) {
+                _streamPosition = _servo->getCurrentPosition();
+                _streamReference = _streamPosition;
+                _streamVelocity = 0.0;
+                _queuedPosition = _servo->getCurrentPosition();
+                _queueEndMicros = 0;
+                _queueTickCarry = 0;
+                _slicePending = false;
+                _queueActive = true;
+            }
+
+            if (_queueActive == true) {
+                if (_state == UNDEFINED) {
+                    // Servo was disabled: drop everything
+                    _servo->forceStopAndNewPosition(_servo->getCurrentPosition());
+                    _streamPosition = _servo->getCurrentPosition();
+                    _queuedPosition = _servo->getCurrentPosition();
+                    _streamVelocity = 0.0;
+                    _queueEndMicros = now;
+                    _slicePending = false;
+                }
+
+                // Step queue ran empty: Restart the time base
+                if (_servo->isRunning() == false) {
+                    _queueEndMicros = now;
+                    _queueTickCarry = 0;
+                }
+
+                // Commit the tracked motion to the step queue in time slices
+                while ((_queueEndMicros - now < STROKE_COMMIT_US) 
+                        && ((_state == STREAMING) || (_streamVelocity != 0.0) || (_slicePending == true))) {
+                    // A slice the step queue had no room for is queued again before the tracker moves on
+                    if (_slicePending == false) {
+                        if (_state == STREAMING) {
+                            _interpolateStream(_queueEndMicros + STROKE_SLICE_US, &reference, &referenceVelocity);
+                            _trackStream(reference, referenceVelocity, dt);
+                        } else {
+                            // Come to a halt as fast as legally allowed
+                            _trackStream(_streamPosition, 0.0, dt);
+                        }
+                    }
+                    if (_queueSlice(int(floorf(_streamPosition + 0.5)) - _queuedPosition, STROKE_SLICE_US * (TICKS_PER_S / 1000000)) == false) {
+                        break;
+                    }
+                    _queueEndMicros += STROKE_SLICE_US;
+                }
+
+                if (_state == STREAMING) {
+                    // Refill when half of the committed motion is executed
+                    nextWakeUp = _queueEndMicros - now - STROKE_COMMIT_US / 2;
+                } else {
+                    // Hand the servo back once the step queue has run empty
+                    if (_servo->isRunning() == false) {
+                        _queueActive = false;
+                    }
+                    nextWakeUp = _queueEndMicros - now;
+                }
+            }
+
+            // give back mutex
+            xSemaphoreGive(_streamMutex);
+        }
+
+        // Sleep until the step queue needs a refill
+        esp_timer_stop(_strokeTimer);
+        esp_timer_start_once(_strokeTimer, max(nextWakeUp, (int64_t)STROKE_POLL_US));
+        ulTaskNotifyTake(pdTRUE, STROKE_WATCHDOG_MS / portTICK_PERIOD_MS);
     }
 }
 
-void StrokeEngine::_applyMotionProfile(motionParameter* motion) {
+void StrokeEngine::_interpolateStream(int64_t micros, float *position, float *velocity) {
+    // Forget all setpoints which have been passed, but keep the start of the current segment
+    while ((_streamCount >= 2) && (_streamAt(1)->micros <= micros)) {
+        _streamPrevious = *_streamAt(0);
+        _streamHasPrevious = true;
+        _streamHead = (_streamHead + 1) % STREAM_BUFFER_SIZE;
+        _streamCount--;
+    }
 
-    bool clipping = false;
-    float speed = 0.0;
-    float position = 0.0;
+    *velocity = 0.0;
 
-    // Apply new trapezoidal motion profile to servo if pattern does not skip
-    if (motion->skip == false) {
+    // Nothing to play yet: hold the last reference
+    if ((_streamCount == 0) || (micros < _streamAt(0)->micros)) {
+        *position = _streamReference;
+        return;
+    }
 
-        // Constrain speed to below _maxStepPerSecond
-        if (motion->speed > _maxStepPerSecond) {
-#ifdef DEBUG_CLIPPING
-        Serial.println("Max Speed Exceeded: " + String(float(motion->speed / _motor->stepsPerMillimeter), 2)
-                + "mm/s --> Limit: " + String(float(_maxStepPerSecond / _motor->stepsPerMillimeter), 2) + "mm/s");
+    // Last setpoint passed without a successor: hold it and wait for the stream to catch up
+    if (_streamCount == 1) {
+        if (_streamStarved == false) {
+            _streamStarved = true;
+            _streamUnderruns++;
+#ifdef DEBUG_STREAMING
+            Serial.println("Stream underrun");
 #endif
-            motion->speed = _maxStepPerSecond;
-            clipping = true;
-        } 
+        }
+        _streamReference = _streamAt(0)->position;
+        *position = _streamReference;
+        return;
+    }
+    _streamStarved = false;
+
+    // Cubic Hermite spline through the setpoints. Tangents are taken from the neighbouring setpoints.
+    const streamPoint *p0 = _streamAt(0);
+    const streamPoint *p1 = _streamAt(1);
+    float h = (p1->micros - p0->micros) / 1.0e6;
+    float s = (micros - p0->micros) / 1.0e6 / h;
+    float m0 = (p1->position - p0->position) / h;
+    float m1 = m0;
+    if (_streamHasPrevious == true) {
+        m0 = (p1->position - _streamPrevious.position) / ((p1->micros - _streamPrevious.micros) / 1.0e6);
+    }
+    if (_streamCount >= 3) {
+        const streamPoint *p2 = _streamAt(2);
+        m1 = (p2->position - p0->position) / ((p2->micros - p0->micros) / 1.0e6);
+    }
 
-        // Constrain acceleration between 1 step/sec^2 and _maxStepAcceleration
-        if (motion->acceleration > _maxStepAcceleration) {
-#ifdef DEBUG_CLIPPING
-        Serial.println("Max Acceleration Exceeded: " + String(float(motion->acceleration / _motor->stepsPerMillimeter), 2)
-                + "mm/s² --> Limit: " + String(float(_maxStepAcceleration / _motor->stepsPerMillimeter), 2) + "mm/s²");
-#endif
-            motion->acceleration = _maxStepAcceleration;
-            clipping = true;
-        } 
+    float s2 = s * s;
+    float s3 = s2 * s;
+    *position = (2.0 * s3 - 3.0 * s2 + 1.0) * p0->position + (s3 - 2.0 * s2 + s) * h * m0
+        + (-2.0 * s3 + 3.0 * s2) * p1->position + (s3 - s2) * h * m1;
+    *velocity = (6.0 * s2 - 6.0 * s) * p0->position / h + (3.0 * s2 - 4.0 * s + 1.0) * m0
+        + (-6.0 * s2 + 6.0 * s) * p1->position / h + (3.0 * s2 - 2.0 * s) * m1;
+
+    // The spline may overshoot the setpoints slightly
+    *position = constrain(*position, float(_minStep), float(_maxStep));
+    _streamReference = *position;
+}
+
+void StrokeEngine::_trackStream(float reference, float referenceVelocity, float dt) {
+    // Deviation from where following the reference velocity would lead
+    float error = reference - (_streamPosition + referenceVelocity * dt);
+
+    // Fastest approach that can still brake in time, settling small errors smoothly
+    float correction = min(sqrtf(2.0 * _maxStepAcceleration * abs(error)), abs(error) / (STREAM_TRACKING_MS / 1000.0f));
+    float velocity = referenceVelocity + ((error >= 0.0) ? correction : -correction);
+    velocity = constrain(velocity, -float(_maxStepPerSecond), float(_maxStepPerSecond));
+
+    // Velocity changes continuously within the acceleration limit
+    velocity = constrain(velocity, _streamVelocity - _maxStepAcceleration * dt, _streamVelocity + _maxStepAcceleration * dt);
+
+    _streamPosition += 0.5 * (_streamVelocity + velocity) * dt;
+    _streamPosition = constrain(_streamPosition, float(_minStep), float(_maxStep));
+    _streamVelocity = velocity;
+}
+
+void StrokeEngine::_applyMotionProfile(motionParameter* motion) {
+
+    bool clipping = false;
+    float deficit = 0.0;
+
+    // Append new trapezoidal motion profile to the lookahead buffer if pattern does not skip
+    if (motion->skip == false) {
 
         // Constrain stroke to motion envelope
         int pos = constrain((motion->stroke), _minStep, _maxStep);
+        float distance = abs(pos - _planner.getEndPosition());
+        float speed = motion->speed;
+        float acceleration = motion->acceleration;
+
+        // The moves of a stroke share the stretch of their timing
+        if (_strokeIndex != _stretchStroke) {
+            _stretchStroke = _strokeIndex;
+            _stretch = 1.0;
+        }
+
+        if ((distance >= 0.5) && (speed > 0) && (acceleration > 0)) {
+            float requested = _moveTime(distance, speed, acceleration);
+
+            // Keep the proportions of a stroke another move had to stretch already. A move asking for
+            // the limits of the machine, like a vibration, has no timing to keep and runs as fast as it can.
+            float stretch = _stretch;
+            if ((motion->speed == _activeParameter.maxStepPerSecond) && (motion->acceleration == _activeParameter.maxStepAcceleration)) {
+                stretch = 1.0;
+            }
+            speed /= stretch;
+            acceleration /= stretch * stretch;
+            float duration = requested * stretch;
 
-        // write values to servo
-        servo->setSpeedInHz(motion->speed);
-        servo->setAcceleration(motion->acceleration);
-        servo->moveTo(pos);
+            if ((speed > _activeParameter.maxStepPerSecond) || (acceleration > _activeParameter.maxStepAcceleration)) {
+                float fastest = _moveTime(distance, _activeParameter.maxStepPerSecond, _activeParameter.maxStepAcceleration);
+                clipping = true;
 
-        // Compile speed telemetry data
-        speed = float(motion->speed / _motor->stepsPerMillimeter);
-        position = float(pos / _motor->stepsPerMillimeter);
+                if (duration >= fastest) {
+                    // Reshape the move within the limits, but keep its duration
+                    _fitMoveTime(distance, duration, &speed, &acceleration);
+                } else {
+                    // Not even the time optimal profile is fast enough. Stretch the other
+                    // moves of the stroke by the same factor, so the pattern keeps its character.
+                    speed = _activeParameter.maxStepPerSecond;
+                    acceleration = _activeParameter.maxStepAcceleration;
+                    _planner.stretch(_strokeIndex, _index, fastest / duration);
+                    _stretch = fastest / requested;
+                    duration = fastest;
+                }
+                Logger.log(LOG_LEVEL_DEBUG, "Limits Exceeded: %.2fmm/s, %.2fmm/s² --> %.2fmm/s, %.2fmm/s² Stretch: %.3f",
+                    motion->speed / _motor->stepsPerMillimeter, motion->acceleration / _motor->stepsPerMillimeter,
+                    speed / _motor->stepsPerMillimeter, acceleration / _motor->stepsPerMillimeter, _stretch);
+            }
+            deficit = duration - requested;
+        }
+
+        // Append the move to the lookahead buffer. A move without distance becomes a short pause.
+        if ((distance < 0.5) || (speed <= 0) || (acceleration <= 0)) {
+            _planner.addDwell(STROKE_PAUSE_US / 1.0e6, _index);
+        } else {
+            // Limit the jerk, if the pattern asks for S-curves and the machine has a jerk limit
+            int jerk = 0;
+            if ((_pattern[_activeParameter.patternIndex]->getMotionProfile() == SCURVE) && (_maxStepJerk > 0)) {
+                jerk = _maxStepJerk;
+            }
+            _planner.addMove(pos, speed, acceleration, jerk, _index, clipping, deficit);
+        }
 
 #ifdef DEBUG_STROKE
-    Serial.println("motion.stroke: " + String(position, 2) + "mm");
-    Serial.println("motion.speed: " + String(speed, 2) + "mm/s");
-    Serial.println("motion.acceleration: " + String(float(motion->acceleration / _motor->stepsPerMillimeter), 2) + "mm/s²");
+    Serial.println("motion.stroke: " + String(float(pos / _motor->stepsPerMillimeter), 2) + "mm");
+    Serial.println("motion.speed: " + String(float(speed / _motor->stepsPerMillimeter), 2) + "mm/s");
+    Serial.println("motion.acceleration: " + String(float(acceleration / _motor->stepsPerMillimeter), 2) + "mm/s²");
 #endif
+    }
+}
 
-        // Send telemetry data
-        if (_callbackTelemetry != NULL) {
-            _callbackTelemetry(position, speed, clipping);
+float StrokeEngine::_moveTime(float distance, float speed, float acceleration) {
+    // Triangular profile, if the move is too short to reach its speed
+    if (speed * speed >= acceleration * distance) {
+        return 2.0 * sqrtf(distance / acceleration);
+    }
+    return distance / speed + speed / acceleration;
+}
+
+void StrokeEngine::_fitMoveTime(float distance, float duration, float *speed, float *acceleration) {
+    // Too much acceleration: accelerate within the limit and coast faster instead
+    if (*acceleration > _activeParameter.maxStepAcceleration) {
+        *acceleration = _activeParameter.maxStepAcceleration;
+        *speed = 0.5 * (*acceleration * duration 
+            - sqrtf(max(0.0f, *acceleration * (*acceleration * duration * duration - 4.0f * distance))));
+    }
+
+    // Too fast: coast at the limit and accelerate harder instead
+    if (*speed > _activeParameter.maxStepPerSecond) {
+        *speed = _activeParameter.maxStepPerSecond;
+        if (*speed * duration >= 2.0 * distance) {
+            // Triangular profile staying below the speed limit
+            *acceleration = 4.0 * distance / (duration * duration);
+        } else {
+            *acceleration = *speed * *speed / (*speed * duration - distance);
         }
+        *acceleration = min(*acceleration, float(_activeParameter.maxStepAcceleration));
+    }
+}
+
+float StrokeEngine::_rateFactor(int patternIndex) {
+    if (_pattern[patternIndex]->getRateCompensation() == false) {
+        return 1.0;
     }
+    return _rateState[patternIndex].correction;
+}
+
+void StrokeEngine::_resetRateMeasurement() {
+    _rateLastMicros = -1;
+    _rateArmed = false;
+    _rateClipped = false;
+}
+
+void StrokeEngine::_measureStrokeRate(const plannerBlock *started, int64_t micros) {
+    int patternIndex = _activeParameter.patternIndex;
+    Pattern *pattern = _pattern[patternIndex];
+    rateCompensation *rate = &_rateState[patternIndex];
+    float timeOfStroke = _activeParameter.timeOfStroke;
+
+    // Targets are constrained to the travel inside _applyMotionProfile()
+    int front = constrain(_activeParameter.depth, _minStep, _maxStep);
+    int rear = constrain(_activeParameter.depth - _activeParameter.stroke, _minStep, _maxStep);
+    float tolerance = _motor->stepsPerMillimeter;
+
+    // Compensation was switched on or off meanwhile
+    if (_rateFactor(patternIndex) != _rateApplied) {
+        _rateApplied = _rateFactor(patternIndex);
+        pattern->setTimeOfStroke(timeOfStroke * _rateApplied);
+        _resetRateMeasurement();
+    }
+    if ((pattern->getRateCompensation() == false) || (front - rear < 2 * tolerance)) {
+        return;
+    }
+
+    // A stroke with clipped moves is slow for reasons the correction can't fix
+    if (started->clipping == true) {
+        _rateClipped = true;
+    }
+
+    // A stroke is completed when a move heads for the rear end after the 
+    // carriage went all the way to the front. Vibrations in between don't
+    // reach both ends.
+    if (started->target >= front - tolerance) {
+        _rateArmed = true;
+    }
+    if ((_rateArmed == false) || (started->target > rear + tolerance)) {
+        return;
+    }
+    _rateArmed = false;
+
+    if ((_rateLastMicros >= 0) && (_rateClipped == false)) {
+        float period = (micros - _rateLastMicros) / 1.0e6;
+        rate->error = 100.0 * (period - timeOfStroke) / timeOfStroke;
+        rate->strokes++;
+
+        // Correct a part of the error, limited in slew rate and range
+        float step = constrain(powf(timeOfStroke / period, RATE_COMPENSATION_GAIN), 
+            1.0 - RATE_COMPENSATION_SLEW, 1.0 + RATE_COMPENSATION_SLEW);
+        rate->correction = constrain(rate->correction * step, RATE_COMPENSATION_MIN, RATE_COMPENSATION_MAX);
+        _rateApplied = rate->correction;
+        pattern->setTimeOfStroke(timeOfStroke * _rateApplied);
+
+#ifdef DEBUG_STROKE
+        Serial.println("Stroke period: " + String(period, 3) + "s Error: " + String(rate->error, 1) 
+            + "% Correction: " + String(rate->correction, 3));
+#endif
+    }
+    _rateLastMicros = micros;
+    _rateClipped = false;
 }
 
 void StrokeEngine::_setupDepths() {
@@ -1002,14 +2887,12 @@ void StrokeEngine::_setupDepths() {
     } 
 
     // move servo to desired position
-    servo->moveTo(depth);
+    _retainMoving();
+    _servo->moveTo(depth);
 
     // Send telemetry data
-    if (_callbackTelemetry != NULL) {
-        _callbackTelemetry(float(depth / _motor->stepsPerMillimeter), 
-            float(servo->getSpeedInMilliHz() * 1000 / _motor->stepsPerMillimeter), 
-            false);
-    } 
+    _sendTelemetry(esp_timer_get_time(), depth, _servo->getSpeedInMilliHz() / 1000.0, 
+        _servo->getAcceleration(), -1, false, 0.0);
 
 #ifdef DEBUG_TALKATIVE
     Serial.println("setup new depth: " + String(depth));
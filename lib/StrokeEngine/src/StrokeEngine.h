@@ -12,13 +12,67 @@
 #pragma once
 
 #include <Arduino.h>
+#include <esp_timer.h>
+#include <Preferences.h>
+#include <FastAccelStepper.h>
 #include <pattern.h>
+#include <MotionPlanner.h>
+#include <TelemetryBuffer.h>
+#include <PositionSampler.h>
+#include <CurrentSensor.h>
+#include <DeferredLog.h>
+#include <StrokeClock.h>
 
 // Debug Levels
 //#define DEBUG_TALKATIVE             // Show debug messages from the StrokeEngine on Serial
 //#define DEBUG_STROKE                // Show debug messaged for each individual stroke on Serial
-#define DEBUG_CLIPPING              // Show debug messages when motions violating the machine 
-                                    // physics are commanded
+//#define DEBUG_STREAMING             // Show debug messages about the position stream on Serial
+
+// Timing of the stroking task
+#define STROKE_SLICE_US         2000    // Duration of a time slice written into the step queue in µs
+#define STROKE_COMMIT_US        16000   // Motion committed to the step queue ahead of time in µs
+#define STROKE_PAUSE_US         10000   // Pause in µs if a pattern skips a stroke or a move has no distance
+#define STROKE_POLL_US          200     // Shortest sleep of the stroking task in µs
+#define STROKE_WATCHDOG_MS      100     // Stroking task wakes up at least this often, even without notification
+#define STROKE_UPDATE_LATENCY   150     // Default bound in ms for an applyNow update to take effect
+#define STROKE_MAX_UPDATE_LATENCY 1000  // Longest bound in ms for an applyNow update to take effect
+
+// Streaming of timestamped positions
+#define STREAM_BUFFER_SIZE      32      // Number of setpoints the jitter buffer holds
+#define STREAM_DEFAULT_LATENCY  50      // Default latency of the stream in ms
+#define STREAM_MAX_LATENCY      1000    // Longest latency of the stream in ms
+#define STREAM_TRACKING_MS      10      // Time constant to settle small position errors in ms
+
+// Sensorless homing
+#define HOMING_CURRENT_POLL_MS  200     // Homing task checks for an abort this often while waiting for a hard stop
+#define HOMING_BACKOFF_MS       300     // Time to get off the hard stop before the detection is armed again
+#define HOMING_FAST_POLL_MS     1       // Homing switch is polled this often during the fast approach
+#define HOMING_NVS_NAMESPACE    "StrokeEngine"  // NVS namespace the rail measured by sensorless homing and the program are kept in, at most 13 characters
+#define HOMING_RAIL_TOLERANCE   5.0     // mm the rear hard stop may lie beyond the stored rail length
+#define HOMING_OFFSET_TOLERANCE 1.0     // % of full scale the current sensor offset may drift from the stored one
+
+// Homed position retained in RTC memory across soft resets
+#define HOME_RETAIN_MS          10      // Period the position is refreshed while the servo stands still
+#define HOME_RETAIN_MAGIC       0x484F4D45  // "HOME", marks a retained position
+#define HOME_RETAIN_AXES        4       // StrokeEngines with a record in RTC memory, further ones always home
+
+// Telemetry
+#define TELEMETRY_BATCH         16      // Records the telemetry task hands to the callbacks at once
+#define TELEMETRY_POLL_MS       20      // Telemetry task checks for new records this often
+
+// Handover of motion parameters to the stroking task
+#define PARAMETER_MAX_RETRIES   4       // Torn snapshots read again before retrying in the next cycle
+#define RAMP_PARAMETERS         4       // Parameters which can glide towards their target, see RampParameter
+
+// Sequencer
+#define PROGRAM_MAX_STEPS       32      // Steps a program can hold
+#define PROGRAM_STEP_LENGTH     64      // Longest step of a program in text form in characters
+
+// Closed-loop compensation of the stroke rate
+#define RATE_COMPENSATION_MIN   0.2     // Smallest factor applied to the time of stroke
+#define RATE_COMPENSATION_MAX   2.0     // Largest factor applied to the time of stroke
+#define RATE_COMPENSATION_GAIN  0.5     // Share of the measured error corrected after each stroke
+#define RATE_COMPENSATION_SLEW  0.1     // Largest relative change of the factor per stroke
 
 /**************************************************************************/
 /*!
@@ -43,6 +97,7 @@ typedef struct {
 typedef struct {
   float maxSpeed;             /*> What is the maximum speed in mm/s */
   float maxAcceleration;      /*> Maximum acceleration in mm/s^2 */
+  float maxJerk;              /*> Maximum jerk in mm/s^3 of S-curve motion profiles */
   float stepsPerMillimeter;   /*> Number of steps per millimeter */
   bool invertDirection;       /*> Set to true to invert the direction signal
                                *  The firmware expects the home switch to be located at the 
@@ -57,7 +112,9 @@ typedef struct {
 /**************************************************************************/
 /*!
   @brief  Struct defining the endstop properties like pin, pinmode, polarity 
-  and homing direction.
+  and homing direction. With a fastSpeed above the homing speed the switch
+  is approached fast, then the carriage backs off by backOff and finds the
+  switch again with the homing speed.
 */
 /**************************************************************************/
 typedef struct {
@@ -66,13 +123,199 @@ typedef struct {
   bool activeLow;             /*> Polarity of the homing signal. True for active low. */
   int endstopPin;             /*> Pin connected to home switch */
   uint8_t pinMode;            /*> Pinmode of the switch INPUT, INPUT_PULLUP, INPUT_PULLDOWN */
+  float fastSpeed;            /*> Speed in mm/s of the fast approach, 0 searches with the homing speed only */
+  float backOff;              /*> Distance in mm to back off before the slow approach, 0 for 2 * keepoutBoundary */
 } endstopProperties;
 
+/**************************************************************************/
+/*!
+  @brief  Struct defining the current sensor for sensorless homing. With a 
+  fastSpeed above the homing speed each hard stop is approached fast, then 
+  the carriage backs off by backOff and finds it again with the homing speed.
+  The current while moving with fastSpeed must stay below currentLimit.
+  With remember the measured rail is stored in NVS and later homings only
+  touch the rear hard stop, as long as the machine and the offset of the 
+  current sensor didn't change.
+*/
+/**************************************************************************/
 typedef struct {
-  int currentPin; /*> Pin connected to current sensor */
-  float currentLimit; /*> Current limit */
+  int currentPin; /*> Pin connected to current sensor, must be an ADC1 pin (32 - 39) */
+  float currentLimit; /*> Current limit in % of full scale above the offset */
+  float fastSpeed; /*> Speed in mm/s of the fast approach, 0 searches with the homing speed only */
+  float backOff; /*> Distance in mm to back off before the slow approach, 0 for 2 * keepoutBoundary */
+  bool remember; /*> Store the measured rail in NVS and touch only the rear hard stop next time */
 } sensorlessHomeProperties;
 
+/**************************************************************************/
+/*!
+  @brief  Homed position kept in RTC memory, which survives a reset of the 
+  ESP32 but not a loss of power. Only valid while the servo stands still,
+  any motion invalidates it before the first step.
+*/
+/**************************************************************************/
+typedef struct {
+  uint32_t magic;             /*> HOME_RETAIN_MAGIC if the record is valid */
+  int32_t position;           /*> Position of the servo in steps */
+  float physicalTravel;       /*> Rail length in mm, as measured by sensorless homing */
+  uint32_t machine;           /*> Fingerprint of the motor and the geometry */
+  uint32_t checksum;          /*> FNV-1a over the fields above */
+} retainedHome;
+
+/**************************************************************************/
+/*!
+  @brief  Setpoint of a position stream inside the jitter buffer.
+*/
+/**************************************************************************/
+typedef struct {
+  int64_t micros;             /*> Local time the position is due in µs */
+  float position;             /*> Position in steps */
+} streamPoint;
+
+/**************************************************************************/
+/*!
+  @brief  Struct holding statistics about a position stream.
+*/
+/**************************************************************************/
+typedef struct {
+  unsigned int received;      /*> Number of setpoints accepted */
+  unsigned int underruns;     /*> Times the jitter buffer ran empty */
+  unsigned int overruns;      /*> Setpoints dropped because the jitter buffer was full */
+  unsigned int buffered;      /*> Setpoints currently waiting in the jitter buffer */
+} streamingStatistics;
+
+/**************************************************************************/
+/*!
+  @brief  Struct holding statistics about the dead time of a running pattern.
+  Moves are chained inside the step queue, so the servo only stands still 
+  unplanned if the stroking task could not refill the step queue in time. 
+*/
+/**************************************************************************/
+typedef struct {
+  unsigned int moves;         /*> Number of moves started */
+  float averageMicros;        /*> Dead time per move in µs */
+  unsigned long maximumMicros; /*> Longest gap in µs while the step queue ran empty */
+} deadTimeStatistics;
+
+/**************************************************************************/
+/*!
+  @brief  Struct holding statistics about the CPU time the stroking task of
+  an axis takes and how closely its strokes follow the beats of a shared 
+  StrokeClock.
+*/
+/**************************************************************************/
+typedef struct {
+  unsigned long wakeups;      /*> Times the stroking task ran */
+  float averageMicros;        /*> CPU time per wakeup in µs */
+  unsigned long maximumMicros; /*> Longest wakeup in µs */
+  float load;                 /*> Share of the CPU in % */
+  unsigned int beats;         /*> Strokes started with a time base attached */
+  float averagePhaseMicros;   /*> Average deviation of the stroke starts from the beats in µs */
+  float maximumPhaseMicros;   /*> Largest deviation of a stroke start from its beat in µs */
+} axisStatistics;
+
+/**************************************************************************/
+/*!
+  @brief  Enum of the motion parameters which can glide towards a new 
+  target with setRamp().
+*/
+/**************************************************************************/
+typedef enum {
+  RAMP_SPEED,         //!< Speed, ramped in SPM
+  RAMP_DEPTH,         //!< Depth, ramped in mm
+  RAMP_STROKE,        //!< Stroke, ramped in mm
+  RAMP_SENSATION      //!< Sensation, ramped in a.u.
+} RampParameter;
+
+/**************************************************************************/
+/*!
+  @brief  Struct defining how fast a motion parameter follows its target. 
+  The ramp is evaluated once per stroke, each full stroke runs with a 
+  single value.
+*/
+/**************************************************************************/
+typedef struct {
+  float rate;                 /*> Change per second or per stroke, 0 jumps to the target */
+  bool perStroke;             /*> rate is an increment per stroke instead of per second */
+} parameterRamp;
+
+/**************************************************************************/
+/*!
+  @brief  Enum of the ways the parameters change into a step of a program.
+*/
+/**************************************************************************/
+typedef enum {
+  JUMP,               //!< Parameters change with the first stroke of the step
+  GLIDE               //!< Parameters glide from the previous step over the whole step
+} StepTransition;
+
+/**************************************************************************/
+/*!
+  @brief  Struct defining a step of a program played by the sequencer. A 
+  step lasts for a time or for a number of full strokes.
+*/
+/**************************************************************************/
+typedef struct {
+  int pattern;                /*> Index of the pattern */
+  float duration;             /*> Length of the step in s, used if strokes is 0 */
+  unsigned int strokes;       /*> Length of the step in full strokes */
+  float speed;                /*> Speed in SPM */
+  float depth;                /*> Depth in mm */
+  float stroke;               /*> Stroke in mm */
+  float sensation;            /*> Sensation from -100 to 100 */
+  StepTransition transition;  /*> How the parameters change into this step */
+} programStep;
+
+/**************************************************************************/
+/*!
+  @brief  Snapshot of the motion parameters handed from the setters to the 
+  stroking task. Values are in steps and seconds like inside the pattern.
+*/
+/**************************************************************************/
+typedef struct {
+  int patternIndex;           /*> Index of the selected pattern */
+  float timeOfStroke;         /*> Time of a full stroke in s */
+  int depth;                  /*> Depth in steps */
+  int stroke;                 /*> Stroke in steps */
+  float sensation;            /*> Sensation from -100 to 100 */
+  int maxStepPerSecond;       /*> Speed limit in steps/s */
+  int maxStepAcceleration;    /*> Acceleration limit in steps/s² */
+  float retargetTime;         /*> Time a running move may take to turn around after an applyNow update in s */
+  parameterRamp ramp[RAMP_PARAMETERS]; /*> Ramps towards the targets, in SPM, steps and a.u. */
+  unsigned int patternRequests; /*> Counts setPattern() calls, restarts the pattern */
+  unsigned int valueRequests[RAMP_PARAMETERS]; /*> Counts setSpeed(), setDepth(), setStroke() and setSensation() calls */
+  unsigned int rampRequests[RAMP_PARAMETERS]; /*> Counts setRamp() calls */
+  unsigned int applyRequests; /*> Counts updates which must be applied immediately */
+} strokeParameter;
+
+/**************************************************************************/
+/*!
+  @brief  Struct holding statistics about the parameter snapshots taken by
+  the stroking task. A snapshot is torn and read again, if a setter wrote 
+  the parameters while the stroking task was copying them.
+*/
+/**************************************************************************/
+typedef struct {
+  unsigned int reads;         /*> Number of snapshots taken */
+  unsigned int retries;       /*> Torn snapshots which had to be read again */
+  unsigned int maximumRetries; /*> Most retries needed for a single snapshot */
+  unsigned int deferred;      /*> Snapshots postponed to the next cycle after PARAMETER_MAX_RETRIES */
+} parameterStatistics;
+
+/**************************************************************************/
+/*!
+  @brief  Struct holding the state of the stroke rate compensation of a 
+  pattern. The period between two strokes reaching the rear end is compared 
+  with the time of stroke from setSpeed() and the time of stroke handed to 
+  the pattern is corrected until both match.
+*/
+/**************************************************************************/
+typedef struct {
+  bool enabled;               /*> Compensation is active for this pattern */
+  float correction;           /*> Factor applied to the time of stroke handed to the pattern */
+  float error;                /*> Deviation of the last measured stroke period from the commanded one in % */
+  unsigned int strokes;       /*> Number of strokes measured */
+} rateCompensation;
+
 /**************************************************************************/
 /*!
   @brief  Enum containing the states of the state machine
@@ -83,7 +326,7 @@ typedef enum {
   READY,             //!< Servo is energized and knows it position. Not running.
   PATTERN,           //!< Stroke Engine is running and servo is moving according to defined pattern.
   SETUPDEPTH,        //!< Interactive adjustment mode to setup depth and stroke
-  STREAMING          //!< Tracks the depth-position whenever depth is updated.
+  STREAMING          //!< Follows a stream of timestamped positions.
 } ServoState;
 
 // Verbose strings of states for debugging purposes
@@ -107,6 +350,16 @@ static String verboseState[] = {
 class StrokeEngine {
     public:
 
+        /**************************************************************************/
+        /*!
+          @brief  Creates the instances of all patterns for this axis. Several 
+          StrokeEngines can run at once, each with its own motor, e.g. a twist 
+          axis besides the stroking axis. Only one of them can home sensorless
+          at a time, as the current sensor needs I2S0.
+        */
+        /**************************************************************************/
+        StrokeEngine();
+
         /**************************************************************************/
         /*!
           @brief  Initializes FastAccelStepper and configures all pins and outputs
@@ -193,6 +446,151 @@ class StrokeEngine {
         /**************************************************************************/
         float getSensation();
 
+        /**************************************************************************/
+        /*!
+          @brief  Let a motion parameter glide towards the value of its setter 
+          instead of jumping to it. The ramp is evaluated at the start of each
+          full stroke, so a remote can send a single target and the motion 
+          follows stroke by stroke without applyNow updates. applyNow doesn't
+          hurry a ramped parameter. A pattern starts with the targets.
+          @param parameter  Parameter to ramp
+          @param rate Change in [SPM], [mm] or [a.u.] per second, or per stroke
+                        if perStroke is set. 0 disables the ramp.
+          @param perStroke Set to true if rate is an increment per stroke
+          @return TRUE on success, FALSE if parameter is invalid
+        */
+        /**************************************************************************/
+        bool setRamp(RampParameter parameter, float rate, bool perStroke = false);
+
+        /**************************************************************************/
+        /*!
+          @brief  Get the ramp of a motion parameter.
+          @param parameter  Parameter to query
+          @return parameterRamp struct, a rate of 0 if it isn't ramped
+        */
+        /**************************************************************************/
+        parameterRamp getRamp(RampParameter parameter);
+
+        /**************************************************************************/
+        /*!
+          @brief  Load a program for the sequencer. A running program is 
+          stopped.
+          @param steps  Array of steps, copied
+          @param count  Number of steps, at most PROGRAM_MAX_STEPS
+          @return TRUE on success, FALSE if a step is invalid or there are too
+                        many. The loaded program is kept then.
+        */
+        /**************************************************************************/
+        bool loadProgram(const programStep *steps, unsigned int count);
+
+        /**************************************************************************/
+        /*!
+          @brief  Load a program in text form, e.g. received over Serial. Steps
+          are separated by a newline or ';', each one reads
+          `pattern,length,speed,depth,stroke,sensation[,transition]`. The 
+          length is a time like `30s` or a number of full strokes like `20x`,
+          the transition `jump` (default) or `glide`. Speed is in SPM, depth
+          and stroke in mm.
+          @param text  Steps, need not be terminated
+          @param length  Characters of text
+          @param append  Set to true to add the steps to the loaded program 
+                        instead of replacing it. Works while it runs.
+          @return TRUE on success, FALSE if a step is malformed or there are 
+                        too many. The loaded program is kept then.
+        */
+        /**************************************************************************/
+        bool loadProgram(const char *text, size_t length, bool append = false);
+
+        /**************************************************************************/
+        /*!
+          @brief  Store the loaded program in NVS.
+          @return TRUE on success
+        */
+        /**************************************************************************/
+        bool saveProgram();
+
+        /**************************************************************************/
+        /*!
+          @brief  Load the program stored in NVS by saveProgram().
+          @return TRUE on success, FALSE if there is none
+        */
+        /**************************************************************************/
+        bool restoreProgram();
+
+        /**************************************************************************/
+        /*!
+          @brief  Play the loaded program. The first step is applied through the
+          setters right away and the pattern is started if necessary. The 
+          following steps are taken by the stroking task at the start of a full
+          stroke, a pattern switch doesn't stop the machine. While a program 
+          runs it owns the ramps, the ones set with setRamp() apply again after 
+          the program. Any setter may still override the program until the 
+          next step.
+          @param loop  Set to true to start over after the last step
+          @return TRUE on success, FALSE if no program is loaded or the 
+                        pattern can't be started.
+        */
+        /**************************************************************************/
+        bool startProgram(bool loop = false);
+
+        /**************************************************************************/
+        /*!
+          @brief  Stop the program. The pattern keeps running with the last 
+          parameters, stopMotion() stops both.
+        */
+        /**************************************************************************/
+        void stopProgram();
+
+        /**************************************************************************/
+        /*!
+          @brief  Step of the program which is playing. The stroking task plans 
+          ahead, a step begins up to the lookahead before its first stroke is
+          executed.
+          @return Index of the step, -1 if no program runs
+        */
+        /**************************************************************************/
+        int getProgramStep();
+
+        /**************************************************************************/
+        /*!
+          @brief  Number of steps of the loaded program.
+          @return Number of steps, 0 if none is loaded
+        */
+        /**************************************************************************/
+        unsigned int getProgramLength() {
+          return _programLength; 
+        };
+
+        /**************************************************************************/
+        /*!
+          @brief  Load bytecode into the patterns defined at runtime, like 
+          "Custom". A running pattern takes the code over with its next move.
+          Write the code in the assembly of PatternVM and translate it with 
+          PatternVM::assemble(), e.g. with tools/PatternBenchmark on the PC.
+          @param code  Bytecode, copied
+          @param length  Bytes of code, at most VM_CODE_SIZE
+          @return TRUE on success, FALSE if the code is invalid. The loaded 
+                        code is kept then.
+        */
+        /**************************************************************************/
+        bool setPatternCode(const uint8_t *code, size_t length);
+
+        /**************************************************************************/
+        /*!
+          @brief  Store the code loaded with setPatternCode() in NVS.
+          @return TRUE on success, FALSE if no code was loaded
+        */
+        /**************************************************************************/
+        bool savePatternCode();
+
+        /**************************************************************************/
+        /*!
+          @brief  Load the code stored in NVS by savePatternCode().
+          @return TRUE on success, FALSE if there is none or it is invalid
+        */
+        /**************************************************************************/
+        bool restorePatternCode();
+
         /**************************************************************************/
         /*!
           @brief  Choose a pattern for the StrokeEngine. Settings take effect with 
@@ -231,6 +629,66 @@ class StrokeEngine {
         /**************************************************************************/
         void stopMotion();
 
+        /**************************************************************************/
+        /*!
+          @brief  Creates a FreeRTOS task to follow a stream of timestamped positions
+          given with pushStreamPosition(). Only valid in state READY or SETUPDEPTH. 
+          If the task is running, state is STREAMING. Stop it with stopMotion().
+          @return TRUE when task was created, FALSE on failure.
+        */
+        /**************************************************************************/
+        bool startStreaming();
+
+        /**************************************************************************/
+        /*!
+          @brief  Adds a setpoint to the jitter buffer of the position stream. The 
+          first setpoint is played back after the latency has passed, all others 
+          relative to it according to their timestamps. A setpoint arriving too late
+          shifts the playback of the stream. Moves between the setpoints are 
+          interpolated and kept within the speed and acceleration limits.
+          @param timestamp time of the setpoint in ms in the time base of the sender.
+                        Must increase with every setpoint.
+          @param position position in mm. Is constrained to the travel.
+          @return TRUE if accepted, FALSE if not STREAMING or timestamp out of order.
+        */
+        /**************************************************************************/
+        bool pushStreamPosition(unsigned long timestamp, float position);
+
+        /**************************************************************************/
+        /*!
+          @brief  Sets the latency of the position stream. It must cover the jitter 
+          of the incoming setpoints plus the time between two setpoints. Takes effect
+          when the stream is (re-)synchronized.
+          @param latency latency in ms. Is constrained from 0 to STREAM_MAX_LATENCY.
+        */
+        /**************************************************************************/
+        void setStreamingLatency(float latency);
+
+        /**************************************************************************/
+        /*!
+          @brief  Gets the latency of the position stream.
+          @return latency in ms
+        */
+        /**************************************************************************/
+        float getStreamingLatency();
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the statistics of the position stream since the last 
+          call of resetStreamingStatistics().
+          @return streamingStatistics struct with received setpoints, underruns,
+                        overruns and buffered setpoints.
+        */
+        /**************************************************************************/
+        streamingStatistics getStreamingStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Clears the statistics of the position stream.
+        */
+        /**************************************************************************/
+        void resetStreamingStatistics();
+
         /**************************************************************************/
         /*!
           @brief  Enable the servo/stepper and do the homing procedure. Drives towards
@@ -251,6 +709,22 @@ class StrokeEngine {
         void enableAndHome(endstopProperties *endstop, float speed = 5.0);
         void enableAndHome(endstopProperties *endstop, void(*callBackHoming)(bool), float speed = 5.0);
 
+        /**************************************************************************/
+        /*!
+          @brief  Enable the servo/stepper and home without a switch. Drives into
+          both hard stops with HOMING_SPEED, which are detected by the current of
+          the motor. The CurrentSensor samples it with DMA while homing, so a hard
+          stop is detected within a DMA buffer. Function is non-blocking and backed 
+          by a task. Homing fails if the current sensor isn't on an ADC1 pin.
+          @param sensorless Pointer to a sensorlessHomeProperties struct defining
+                        the pin of the current sensor and the current limit.
+          @param speed  Speed in mm/s used for finding the hard stops. 
+                        Defaults to 5.0 mm/s
+          @param callBackHoming Callback function is called after homing is done. 
+                        Function parametere holds a bool containing the success (TRUE)
+                        or failure (FALSE) of homing.
+        */
+        /**************************************************************************/
         void enableAndSensorlessHome(sensorlessHomeProperties *sensorless, float speed = 5.0);
         void enableAndSensorlessHome(sensorlessHomeProperties *sensorless, void(*callBackHoming)(bool), float speed = 5.0);
 
@@ -265,6 +739,36 @@ class StrokeEngine {
         /**************************************************************************/
         void thisIsHome(float speed = 5.0);
 
+        /**************************************************************************/
+        /*!
+          @brief  Time the last successful homing took, from the start of the 
+          homing task until READY.
+          @return duration in ms, 0 if never homed
+        */
+        /**************************************************************************/
+        unsigned long getHomingDuration();
+
+        /**************************************************************************/
+        /*!
+          @brief  Forget the rail stored by sensorless homing with remember. The 
+          next homing measures the rail between both hard stops again, e.g. after
+          mechanical changes the fingerprint of the machine can't tell.
+        */
+        /**************************************************************************/
+        void forgetRail();
+
+        /**************************************************************************/
+        /*!
+          @brief  begin() resumes in state READY without homing after a software 
+          reset, a panic or a watchdog reset, if the servo was enabled, homed and
+          standing still at that moment. Position and rail length come from RTC
+          memory. A power-on, a brown-out or anything else invalidates them.
+          The enable line of the servo must stay active while the ESP32 resets.
+          @return TRUE if begin() resumed the homed position, home otherwise.
+        */
+        /**************************************************************************/
+        bool wasResumed();
+
         /**************************************************************************/
         /*!
           @brief  In state PATTERN, SETUPDEPTH and READY this 
@@ -333,6 +837,88 @@ class StrokeEngine {
         /**************************************************************************/
         String getPatternName(int index);
 
+        /**************************************************************************/
+        /*!
+          @brief  Selects the motion profile the moves of a pattern are executed 
+          with. S-curve profiles limit the jerk to motorProperties.maxJerk. Takes 
+          effect with the next move.
+          @param patternIndex index of a pattern.
+          @param profile TRAPEZOIDAL or SCURVE
+          @return TRUE on success, FALSE if patternIndex is invalid.
+        */
+        /**************************************************************************/
+        bool setMotionProfile(int patternIndex, MotionProfile profile);
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the motion profile of a pattern.
+          @param patternIndex index of a pattern.
+          @return TRAPEZOIDAL or SCURVE. TRAPEZOIDAL if patternIndex is invalid.
+        */
+        /**************************************************************************/
+        MotionProfile getMotionProfile(int patternIndex);
+
+        /**************************************************************************/
+        /*!
+          @brief  Enables the closed-loop compensation of the stroke rate for a 
+          pattern. The engine measures the period of the strokes and adapts the 
+          time of stroke handed to the pattern in small steps until the rate from 
+          setSpeed() is met. Meant for patterns whose timing is only approximated, 
+          like the vibrating ones, which have it enabled by default. Disabling 
+          drops the learned correction.
+          @param patternIndex index of a pattern.
+          @param enable TRUE to enable, FALSE to disable
+          @return TRUE on success, FALSE if patternIndex is invalid.
+        */
+        /**************************************************************************/
+        bool setRateCompensation(int patternIndex, bool enable);
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the state of the stroke rate compensation of a pattern.
+          @param patternIndex index of a pattern.
+          @return rateCompensation struct with enable flag, correction factor, 
+                        remaining error of the last stroke and number of 
+                        measured strokes. All zero if patternIndex is invalid.
+        */
+        /**************************************************************************/
+        rateCompensation getRateCompensation(int patternIndex);
+
+        /**************************************************************************/
+        /*!
+          @brief  Calculates the highest speed the current pattern can run at with 
+          the current depth, stroke and sensation without exceeding the maximum 
+          speed and acceleration of the machine. Each pattern knows its own timing, 
+          see Pattern::getMinTimeOfStroke(). The result is cached and only 
+          recalculated if one of the inputs has changed, so it is cheap to poll. 
+          Remotes can use it to cap their speed range.
+          @return Strokes per Minute, constrained from 0.5 to 6000 like setSpeed()
+        */
+        /**************************************************************************/
+        float getMaxStrokeRate();
+
+        /**************************************************************************/
+        /*!
+          @brief  Sets the bound for an update with applyNow = true to take effect. 
+          Motion committed to the step queue runs first, then the current move is 
+          cut with continuous velocity. If the new target lies behind or in the 
+          opposite direction, the carriage brakes with the acceleration of the new 
+          move and only as much harder as needed to turn around within the bound. 
+          A short bound feels responsive, a long one smooth.
+          @param latency latency in ms. Is constrained from STROKE_COMMIT_US to 
+                        STROKE_MAX_UPDATE_LATENCY.
+        */
+        /**************************************************************************/
+        void setUpdateLatency(float latency);
+
+        /**************************************************************************/
+        /*!
+          @brief  Gets the bound for an update with applyNow = true to take effect.
+          @return latency in ms
+        */
+        /**************************************************************************/
+        float getUpdateLatency();
+
         /**************************************************************************/
         /*!
           @brief  Makes the pattern list available for the main program to retreive 
@@ -344,6 +930,44 @@ class StrokeEngine {
           return patternTableSize; 
         };
 
+        /**************************************************************************/
+        /*!
+          @brief  The instance of a pattern this StrokeEngine runs, e.g. to call 
+          nextTarget() with the parameters it ran with last. Don't call into it 
+          while a pattern runs.
+          @param patternIndex index of a pattern
+          @return pointer to the pattern, NULL if the index is out of range
+        */
+        /**************************************************************************/
+        Pattern *getPatternInstance(int patternIndex);
+
+        /**************************************************************************/
+        /*!
+          @brief  Lock the strokes of this axis onto the beats of a time base 
+          shared with other axes. Each full stroke starts on a beat, a stroke
+          ending early waits for it. Takes effect with the next stroke.
+          @param clock StrokeClock shared by the axes, NULL to run freely
+        */
+        /**************************************************************************/
+        void setTimeBase(StrokeClock *clock);
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the CPU time the stroking task of this axis took and
+          the deviation of its strokes from the beats since the last call of 
+          resetAxisStatistics().
+          @return axisStatistics struct
+        */
+        /**************************************************************************/
+        axisStatistics getAxisStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Clears the axis statistics.
+        */
+        /**************************************************************************/
+        void resetAxisStatistics();
+
         /**************************************************************************/
         /*!
           @brief  Updates the maximum speed number of StrokeEngine. This value is 
@@ -384,12 +1008,140 @@ class StrokeEngine {
           about StrokeEngine. The provided function will be called whenever a motion 
           is executed by a manual command or by a pattern. The returned values are the
           target position of this move, its top speed and wether clipping occurred. 
+          The callback runs in a low priority task shortly after the move started.
           @param callbackTelemetry Function must be of type: 
           void callbackTelemetry(float position, float speed, bool clipping)
         */
         /**************************************************************************/
         void registerTelemetryCallback(void(*callbackTelemetry)(float, float, bool));
 
+        /**************************************************************************/
+        /*!
+          @brief  Register a callback function that will update telemetry information
+          about StrokeEngine. Like above, but additionally reports the time deficit
+          of a move. Moves violating the speed or acceleration limits are replanned 
+          with the same duration if the machine allows it. Otherwise the stroke is 
+          stretched in time as a whole and the deficit tells by how much. 
+          @param callbackTelemetry Function must be of type: 
+          void callbackTelemetry(float position, float speed, bool clipping, float deficit)
+          with the deficit in [s]
+        */
+        /**************************************************************************/
+        void registerTelemetryCallback(void(*callbackTelemetry)(float, float, bool, float));
+
+        /**************************************************************************/
+        /*!
+          @brief  Read telemetry records without a callback. Motion code writes them 
+          wait-free into a ring buffer, which must be drained frequently from a low 
+          priority task. Unavailable once a telemetry callback is registered, as the 
+          callbacks are served by a task draining the same ring.
+          @param records array receiving the oldest records
+          @param maxRecords size of the array
+          @return number of records read
+        */
+        /**************************************************************************/
+        unsigned int readTelemetry(telemetryRecord *records, unsigned int maxRecords);
+
+        /**************************************************************************/
+        /*!
+          @brief  Number of telemetry records dropped since start because nobody
+          drained the ring buffer in time.
+          @return dropped records
+        */
+        /**************************************************************************/
+        unsigned int getTelemetryOverflows();
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the statistics about the dead time between moves 
+          since the last call of resetDeadTimeStatistics(). This is the time 
+          the servo stands still unplanned while a pattern is running.
+          @return deadTimeStatistics struct with number of moves, average and 
+                        maximum dead time in µs.
+        */
+        /**************************************************************************/
+        deadTimeStatistics getDeadTimeStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Clears the dead time statistics.
+        */
+        /**************************************************************************/
+        void resetDeadTimeStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Sample the actual position and step rate of the servo with a high 
+          rate, independent of the moves the StrokeEngine commands. Shows the real 
+          trajectory including reversal dead time and overshoot. The latest samples 
+          are kept in a delta-encoded ring buffer of SAMPLER_BLOCKS blocks. 
+          @param rate sample rate in Hz from 500 to 2000. Gets halved automatically
+                        if sampling takes more than SAMPLER_MAX_LOAD % of the CPU.
+        */
+        /**************************************************************************/
+        void startSampler(float rate);
+
+        /**************************************************************************/
+        /*!
+          @brief  Stops sampling. The samples taken so far can still be dumped.
+        */
+        /**************************************************************************/
+        void stopSampler();
+
+        /**************************************************************************/
+        /*!
+          @brief  Writes the samples as binary dump to Serial. The dump is a 
+          sampleDumpHeader followed by the sampleBlock structs, oldest first. 
+          Sampling pauses while the dump is written.
+        */
+        /**************************************************************************/
+        void dumpSamples();
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the statistics of the sampler.
+          @return samplerStatistics struct with rate, number of samples and the
+                        CPU time the sampler takes.
+        */
+        /**************************************************************************/
+        samplerStatistics getSamplerStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the statistics of the current sensor used for 
+          sensorless homing.
+          @return currentSensorStatistics struct with offset, filtered current and
+                        the latency of the last hard stop detected.
+        */
+        /**************************************************************************/
+        currentSensorStatistics getCurrentSensorStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Prints the raw current samples around the last hard stop detected
+          by sensorless homing as CSV to Serial. tools/CurrentReplay replays them
+          to tune the detection.
+        */
+        /**************************************************************************/
+        void printCurrentTrace();
+
+        /**************************************************************************/
+        /*!
+          @brief  Retrieves the statistics about the parameter snapshots the 
+          stroking task took since the last call of resetParameterStatistics().
+          @return parameterStatistics struct with number of snapshots, torn
+                        reads and deferred snapshots.
+        */
+        /**************************************************************************/
+        parameterStatistics getParameterStatistics();
+
+        /**************************************************************************/
+        /*!
+          @brief  Clears the parameter snapshot statistics.
+        */
+        /**************************************************************************/
+        void resetParameterStatistics();
+
     protected:
         ServoState _state = UNDEFINED;
         motorProperties *_motor;
@@ -399,6 +1151,7 @@ class StrokeEngine {
         int _maxStep;
         int _maxStepPerSecond;
         int _maxStepAcceleration;
+        int _maxStepJerk;
         int _patternIndex = 0;
         bool _isHomed = false;
         int _index = 0;
@@ -408,7 +1161,9 @@ class StrokeEngine {
         int _previousStroke;
         float _timeOfStroke;
         float _sensation;
-        bool _applyUpdate = false;
+        parameterRamp _ramp[RAMP_PARAMETERS] = {};
+        unsigned int _valueRequests[RAMP_PARAMETERS] = {};
+        unsigned int _rampRequests[RAMP_PARAMETERS] = {};
         bool _abortHoming = false;
         static void _homingProcedureImpl(void* _this) { static_cast<StrokeEngine*>(_this)->_homingProcedure(); }
         void _homingProcedure();
@@ -421,18 +1176,166 @@ class StrokeEngine {
         TaskHandle_t _taskStrokingHandle = NULL;
         TaskHandle_t _taskHomingHandle = NULL;
         TaskHandle_t _taskStreamingHandle = NULL;
-        SemaphoreHandle_t _patternMutex = xSemaphoreCreateMutex();
+        SemaphoreHandle_t _parameterMutex = xSemaphoreCreateMutex();
+        strokeParameter _parameter = {};
+        volatile uint32_t _parameterSequence = 0;
+        strokeParameter _activeParameter = {};
+        uint32_t _activeSequence = 0;
+        unsigned int _parameterReads = 0;
+        unsigned int _parameterRetries = 0;
+        unsigned int _parameterMaxRetries = 0;
+        unsigned int _parameterDeferred = 0;
+        void _publishParameter(bool applyNow, bool newPattern);
+        bool _readParameter(strokeParameter *snapshot, uint32_t *sequence);
+        void _updateParameter(bool restart, bool replan = true);
+        void _applyParameter(const strokeParameter *parameter, bool newPattern);
+        void _setTarget(const strokeParameter *target, bool newPattern);
+        strokeParameter _rampTarget = {};       // Snapshot the ramps glide towards
+        strokeParameter _target = {};           // Copy of _rampTarget for the getters, written by the stroking task only
+        volatile uint32_t _targetSequence = 0;
+        void _publishTarget();
+        bool _readTarget(strokeParameter *target);
+        float _rampValue[RAMP_PARAMETERS];      // Value of each ramped parameter, in the unit of its ramp
+        int _rampIndex = -1;                    // Stroke the ramps were evaluated for last
+        int64_t _rampMicros = -1;               // Planned start of that stroke
+        void _holdRamps(strokeParameter *parameter);
+        void _stepRamps(int64_t plannedMicros);
+        SemaphoreHandle_t _programMutex = xSemaphoreCreateMutex();
+        programStep _program[PROGRAM_MAX_STEPS];
+        volatile unsigned int _programLength = 0;
+        volatile int _programStep = -1;         // Step playing, -1 if no program runs
+        bool _programLoop = false;
+        int _programStrokes = -1;               // Full strokes of the step so far, -1 until its first stroke is planned
+        int64_t _programStart = 0;              // Planned start of the step
+        parameterRamp _programRamp[RAMP_PARAMETERS]; // Ramps of setRamp(), restored after the program
+        bool _parseStep(const char *text, size_t length, programStep *step);
+        void _programTarget(int index, strokeParameter *target);
+        void _startProgramStep(int index);
+        void _playProgramStep(int index);
+        void _stepProgram(int64_t plannedMicros);
+        void _endProgram();
+        SemaphoreHandle_t _codeMutex = xSemaphoreCreateMutex();
+        uint8_t _patternCode[VM_CODE_SIZE];     // Code of the patterns defined at runtime, kept for savePatternCode()
+        size_t _patternCodeLength = 0;
         void _applyMotionProfile(motionParameter* motion);
+        float _stretch = 1.0;
+        int _stretchStroke = -1;
+        float _moveTime(float distance, float speed, float acceleration);
+        void _fitMoveTime(float distance, float duration, float *speed, float *acceleration);
+        rateCompensation _rateState[patternTableSize];
+        float _rateApplied = 1.0;
+        int64_t _rateLastMicros = -1;
+        bool _rateArmed = false;
+        bool _rateClipped = false;
+        float _rateFactor(int patternIndex);
+        void _resetRateMeasurement();
+        void _measureStrokeRate(const plannerBlock *started, int64_t micros);
+        float _updateLatency = STROKE_UPDATE_LATENCY;
+        float _maxRate = 0.0;
+        int _maxRatePattern = -1;
+        int _maxRateStroke = -1;
+        int _maxRateDepth = -1;
+        float _maxRateSensation = 0.0;
+        int _maxRateSpeed = -1;
+        int _maxRateAcceleration = -1;
+        esp_timer_handle_t _strokeTimer = NULL;
+        static void _strokeTimerImpl(void* _this) { static_cast<StrokeEngine*>(_this)->_wakeMotionTask(); }
+        void _wakeMotionTask();
+        FastAccelStepper *_servo = NULL;
+        Pattern *_pattern[patternTableSize];
+        static unsigned int _axes;              // StrokeEngines created so far
+        int _axis = 0;                          // Index of this StrokeEngine
+        retainedHome *_retained = NULL;         // Record in RTC memory, NULL if there are too many axes
+        char _nvsNamespace[16];                 // NVS namespace of the rail and the program, axes after the first get their index appended
+        StrokeClock *_clock = NULL;
+        int _beatIndex = -1;                    // Stroke which was aligned to a beat last
+        int _beatStarted = -1;                  // Stroke whose start was measured against its beat last
+        float _beatPeriod = 0.0;
+        unsigned int _beats = 0;
+        double _phaseSumMicros = 0.0;
+        float _phaseMaxMicros = 0.0;
+        unsigned long _cpuWakeups = 0;
+        uint64_t _cpuBusyMicros = 0;
+        unsigned long _cpuMaxMicros = 0;
+        int64_t _cpuSince = 0;
+        int64_t _alignToBeat(int64_t plannedMicros);
+        uint32_t _strokeStarts = 0;             // Bit index % 32 is set if the planned move with this index starts a full stroke
+        int _strokeIndex = 0;                   // Index of the move the full stroke planned last started with
+        void _markStrokeStart(int index, bool strokeStart);
+        bool _isStrokeStart(int index) { return ((_strokeStarts >> (index & 31)) & 1) != 0; }
+        esp_timer_handle_t _retainTimer = NULL;
+        static void _retainTimerImpl(void* _this) { static_cast<StrokeEngine*>(_this)->_retainHome(); }
+        void _retainHome();
+        void _retainMoving();
+        bool _resumeHome();
+        uint32_t _machineFingerprint();
+        volatile uint32_t _motionSequence = 0;   // Counts motion commands, the retained position must not miss one
+        int32_t _retainPosition = 0;
+        bool _resumed = false;
+        MotionPlanner _planner;
+        volatile bool _queueActive = false;
+        bool _queueStopping = false;
+        int _queuedPosition = 0;
+        int64_t _queueEndMicros = 0;
+        uint32_t _queueTickCarry = 0;
+        bool _queueCountUp = true;
+        bool _slicePending = false;             // Planned slice the step queue had no room for yet
+        uint32_t _sliceTicks = 0;               // Ticks of that slice not queued yet
+        void _invalidateLookahead(bool keepCurrent);
+        void _fillLookahead();
+        void _fillQueue(int64_t now);
+        bool _queueSlice(int steps, uint32_t ticks);
+        unsigned int _deadTimeMoves = 0;
+        uint64_t _deadTimeSumMicros = 0;
+        unsigned long _deadTimeMaxMicros = 0;
+        SemaphoreHandle_t _streamMutex = xSemaphoreCreateMutex();
+        streamPoint _streamBuffer[STREAM_BUFFER_SIZE];
+        unsigned int _streamHead = 0;
+        unsigned int _streamCount = 0;
+        streamPoint _streamPrevious;
+        bool _streamHasPrevious = false;
+        bool _streamSynced = false;
+        bool _streamStarved = false;
+        int64_t _streamOffsetMicros = 0;
+        unsigned long _streamLastTimestamp = 0;
+        int64_t _streamLatencyMicros = STREAM_DEFAULT_LATENCY * 1000;
+        float _streamReference = 0.0;
+        float _streamPosition = 0.0;
+        float _streamVelocity = 0.0;
+        unsigned int _streamReceived = 0;
+        unsigned int _streamUnderruns = 0;
+        unsigned int _streamOverruns = 0;
+        streamPoint *_streamAt(unsigned int i) { return &_streamBuffer[(_streamHead + i) % STREAM_BUFFER_SIZE]; }
+        void _interpolateStream(int64_t micros, float *position, float *velocity);
+        void _trackStream(float reference, float referenceVelocity, float dt);
         void(*_callBackHomeing)(bool) = NULL;
         void(*_callbackTelemetry)(float, float, bool) = NULL;
+        void(*_callbackTelemetryDeficit)(float, float, bool, float) = NULL;
+        TelemetryBuffer _telemetry;
+        PositionSampler _sampler;
+        CurrentSensor _currentSensor;
+        TaskHandle_t _taskTelemetryHandle = NULL;
+        void _sendTelemetry(int64_t timestamp, float target, float speed, float acceleration, int index, bool clipping, float deficit);
+        void _startTelemetryTask();
+        static void _telemetryImpl(void* _this) { static_cast<StrokeEngine*>(_this)->_telemetryTask(); }
+        void _telemetryTask();
         bool _sensorlessHomeing;
         int _homeingSpeed;
+        int _homeingFastSpeed = 0;
+        float _homeingBackOff = 0.0;
+        int64_t _homingStart = 0;
+        unsigned long _homingDuration = 0;
         int _homeingPin;
         int _sensorlessHomeingCurrentPin;
         float _sensorlessHomeingCurrentLimit;
+        bool _sensorlessHomeingRemember = false;
         int _homeingToBack;
         bool _homeingActiveLow;      /*> Polarity of the homing signal*/
         bool _fancyAdjustment;
         void _setupDepths();
-        float _getAnalogAveragePercent(int pinNumber, int samples);
+        bool _approachHardStop(int direction, float maxDistance = 0.0);
+        bool _waitForHardStop(unsigned long blankingMicros);
+        uint32_t _railFingerprint();
+        float _recallRail(float currentSensorOffset);
+        void _rememberRail(float currentSensorOffset);
 };
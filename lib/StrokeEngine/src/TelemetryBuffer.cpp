@@ -0,0 +1,32 @@
+#include <Arduino.h>
+#include <TelemetryBuffer.h>
+
+bool TelemetryBuffer::push(const telemetryRecord *record) {
+    uint32_t head = _head;
+
+    if (head - _tail >= TELEMETRY_BUFFER_SIZE) {
+        _overflows = _overflows + 1;
+        return false;
+    }
+
+    _record[head % TELEMETRY_BUFFER_SIZE] = *record;
+
+    // Publish the record only after it is completely written
+    __sync_synchronize();
+    _head = head + 1;
+    return true;
+}
+
+unsigned int TelemetryBuffer::pop(telemetryRecord *records, unsigned int maxRecords) {
+    uint32_t tail = _tail;
+    unsigned int count = min((unsigned int)(_head - tail), maxRecords);
+
+    // Read the records before handing their slots back to the producer
+    __sync_synchronize();
+    for (unsigned int i = 0; i < count; i++) {
+        records[i] = _record[(tail + i) % TELEMETRY_BUFFER_SIZE];
+    }
+    __sync_synchronize();
+    _tail = tail + count;
+    return count;
+}
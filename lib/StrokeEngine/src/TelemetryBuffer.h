@@ -0,0 +1,72 @@
+/**
+ *   Telemetry Buffer of the StrokeEngine
+ *   A library to create a variety of stroking motions with a stepper or servo motor on an ESP32.
+ *   https://github.com/theelims/StrokeEngine
+ *
+ * Copyright (C) 2022 theelims <elims@gmx.net>
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define TELEMETRY_BUFFER_SIZE       64      // Number of records the ring holds, must be a power of 2
+
+/**************************************************************************/
+/*!
+  @brief  Telemetry of a single move. Manual moves and stops have the stroke
+  index and the pattern set to -1.
+*/
+/**************************************************************************/
+typedef struct {
+  int64_t timestamp;          /*> Start of the move in µs of esp_timer_get_time() */
+  float target;               /*> Target position of the move in mm */
+  float speed;                /*> Maximum speed of the move in mm/s */
+  float acceleration;         /*> Acceleration of the move in mm/s² */
+  float deficit;              /*> Time the move takes longer than the pattern requested in s */
+  int32_t index;              /*> Stroke index of the pattern */
+  int8_t pattern;             /*> Index of the pattern */
+  bool clipping;              /*> Speed or acceleration had to be limited */
+} telemetryRecord;
+
+/**************************************************************************/
+/*!
+  @brief  Lock-free single producer, single consumer ring of telemetry 
+  records. The producer never waits: if the ring is full the record is 
+  dropped and counted as overflow. Head and tail are free running counters, 
+  each written by one side only.
+*/
+/**************************************************************************/
+class TelemetryBuffer {
+    public:
+        /*!
+          @brief Append a record. Wait-free, only to be called by the producer.
+          @param record record to copy into the ring
+          @return false if the ring was full and the record got dropped
+        */
+        bool push(const telemetryRecord *record);
+
+        /*!
+          @brief Take the oldest records out of the ring. Only to be called by 
+          the consumer.
+          @param records array receiving the records
+          @param maxRecords size of the array
+          @return number of records copied
+        */
+        unsigned int pop(telemetryRecord *records, unsigned int maxRecords);
+
+        //! Number of records waiting for the consumer
+        unsigned int available() { return _head - _tail; }
+
+        //! Number of records dropped because the ring was full
+        unsigned int getOverflows() { return _overflows; }
+
+    protected:
+        telemetryRecord _record[TELEMETRY_BUFFER_SIZE];
+        volatile uint32_t _head = 0;        // Records written, only changed by the producer
+        volatile uint32_t _tail = 0;        // Records read, only changed by the consumer
+        volatile uint32_t _overflows = 0;
+};
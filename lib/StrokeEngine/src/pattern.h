@@ -15,8 +15,9 @@
 #include <StrokeEngine.h>
 #include <math.h>
 #include "PatternMath.h"
+#include <DeferredLog.h>
+#include <PatternVM.h>
 
-#define DEBUG_PATTERN                 // Print some debug informations over Serial
 
 #ifndef STRING_LEN
   #define STRING_LEN           64     // Bytes used to initialize char array. No path, topic, name, etc. should exceed this value
@@ -35,6 +36,17 @@ typedef struct {
     bool skip;          //!< no valid stroke, skip this set an query for the next --> allows pauses between strokes
 } motionParameter;
 
+/**************************************************************************/
+/*!
+  @brief  Shape of the motion profile the StrokeEngine generates from the
+  motionParameter of a pattern.
+*/
+/**************************************************************************/
+typedef enum {
+  TRAPEZOIDAL,        //!< Constant acceleration. Fastest, but acceleration changes in steps.
+  SCURVE              //!< Jerk-limited acceleration. Gentle on belts, but strokes take slightly longer.
+} MotionProfile;
+
 
 /**************************************************************************/
 /*!
@@ -107,6 +119,78 @@ class Pattern {
         */
         virtual void setSpeedLimit(unsigned int maxSpeed, unsigned int maxAcceleration, unsigned int stepsPerMM) { _maxSpeed = maxSpeed; _maxAcceleration = maxAcceleration; _stepsPerMM = stepsPerMM; } 
 
+        //! Select the motion profile the moves of this pattern are executed with
+        /*! 
+          @param profile TRAPEZOIDAL or SCURVE 
+        */
+        void setMotionProfile(MotionProfile profile) { _motionProfile = profile; }
+
+        //! Retrives the motion profile of a pattern
+        /*! 
+          @return TRAPEZOIDAL or SCURVE 
+        */
+        MotionProfile getMotionProfile() { return _motionProfile; }
+
+        //! Enable the closed-loop compensation of the stroke rate for this pattern
+        /*! 
+          @param enable true if the StrokeEngine should correct the time of stroke until the rate is met 
+        */
+        void setRateCompensation(bool enable) { _rateCompensation = enable; }
+
+        //! Retrives whether the stroke rate of this pattern is compensated
+        /*! 
+          @return true if compensated 
+        */
+        bool getRateCompensation() { return _rateCompensation; }
+
+        //! Moves are planned ahead of time. Tells the pattern when the move of the next call to nextTarget() starts.
+        /*! 
+          @param plannedMillis time in millis() the next move will start 
+        */
+        void setPlannedTime(unsigned long plannedMillis) { _plannedMillis = plannedMillis; }
+
+        //! Shortest time of stroke this pattern can run without exceeding the limits of the machine
+        /*! 
+          Default assumes symmetric in & out moves with a 1/3 profile. Override if the timing of a 
+          pattern differs. Depends on the arguments only, as it is called from outside the stroking task.
+          @param stroke stroke distance in Steps 
+          @param depth depth in Steps 
+          @param sensation sensation from -100 to 100 
+          @param maxSpeed maximum speed in Steps/second 
+          @param maxAcceleration maximum acceleration in Steps/second² 
+          @param stepsPerMM 
+          @return time of a full stroke in [sec] as handed to setTimeOfStroke(), 0 if there is no limit 
+        */
+        virtual float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            return 2.0 * _minTimeOfMove(stroke, 1.5, 4.5, maxSpeed, maxAcceleration);
+        }
+
+        //! Moves a full stroke of this pattern is made of
+        /*!
+          Index 0, getMovesPerStroke(), 2 * getMovesPerStroke(), ... start a full stroke.
+          Patterns with a varying number of moves per stroke override isStrokeStart() instead.
+          @return moves per full stroke, at least 1. Default is 2: an in and an out move.
+        */
+        virtual unsigned int getMovesPerStroke() { return 2; }
+
+        //! Tells if the move of the next call to nextTarget() starts a full stroke
+        /*!
+          Called right before nextTarget() with the same index. Programs, ramps, beats 
+          and the stretch of clipped moves go by full strokes.
+          @param index index of the move nextTarget() is asked for next
+          @return true if the move starts a full stroke. Default counts getMovesPerStroke().
+        */
+        virtual bool isStrokeStart(unsigned int index) { return (index % max(1U, getMovesPerStroke())) == 0; }
+
+        //! Load the bytecode of a pattern defined at runtime, see PatternVM
+        /*! 
+          Only patterns running bytecode accept it. Called from outside the stroking task.
+          @param code bytecode 
+          @param length of the code in bytes 
+          @return true if the pattern takes the code 
+        */
+        virtual bool loadCode(const uint8_t *code, size_t length) { return false; }
+
     protected:
         int _stroke;
         int _depth;
@@ -115,18 +199,21 @@ class Pattern {
         int _index = -1;
         char _name[STRING_LEN]; 
         motionParameter _nextMove = {0, 0, 0, false};
-        int _startDelayMillis = 0;
+        unsigned long _startDelayMillis = 0;
         int _delayInMillis = 0;
+        unsigned long _plannedMillis = 0;
+        MotionProfile _motionProfile = TRAPEZOIDAL;
+        bool _rateCompensation = false;
         unsigned int _maxSpeed = 0;
         unsigned int _maxAcceleration = 0;
         unsigned int _stepsPerMM = 0;
 
         /*!
           @brief Start a delay timer which can be polled by calling _isStillDelayed(). 
-          Uses internally the millis()-function.
+          Uses the planned start time of the move instead of millis().
         */
         void _startDelay() {
-            _startDelayMillis = millis();
+            _startDelayMillis = _plannedMillis;
         } 
 
         /*! 
@@ -140,11 +227,41 @@ class Pattern {
 
         /*! 
           @brief Poll the state of a internal timer to create pauses between strokes. 
-          Uses internally the millis()-function.
+          Uses the planned start time of the move instead of millis().
           @return True, if the timer is running, false if it is expired.
         */
         bool _isStillDelayed() {
-            return (millis() > (_startDelayMillis + _delayInMillis)) ? false : true; 
+            return (_plannedMillis > (_startDelayMillis + _delayInMillis)) ? false : true; 
+        }
+
+        /*! 
+          @brief Shortest time of a move whose speed and acceleration are proportional to 
+          distance / time and distance / time². E.g. the 1/3 profile has a speed factor of 
+          1.5 and an acceleration factor of 4.5.
+          @param distance distance of the move in Steps
+          @param speedFactor speed = speedFactor * distance / time
+          @param accelerationFactor acceleration = accelerationFactor * distance / time²
+          @param maxSpeed maximum speed in Steps/second
+          @param maxAcceleration maximum acceleration in Steps/second²
+          @return time of the move in [sec]
+        */
+        static float _minTimeOfMove(float distance, float speedFactor, float accelerationFactor, float maxSpeed, float maxAcceleration) {
+            return max(speedFactor * distance / maxSpeed, sqrtf(accelerationFactor * distance / maxAcceleration));
+        }
+
+        /*! 
+          @brief Time of a move at maximum speed and acceleration.
+          @param distance distance of the move in Steps
+          @param maxSpeed maximum speed in Steps/second
+          @param maxAcceleration maximum acceleration in Steps/second²
+          @return time of the move in [sec]
+        */
+        static float _timeOfMove(float distance, float maxSpeed, float maxAcceleration) {
+            // Triangular profile, if the move is too short to reach the speed
+            if (maxSpeed * maxSpeed >= maxAcceleration * distance) {
+                return 2.0 * sqrtf(distance / maxAcceleration);
+            }
+            return distance / maxSpeed + maxSpeed / maxAcceleration;
         }
 
 };
@@ -198,6 +315,10 @@ class SimpleStroke : public Pattern {
 class TeasingPounding : public Pattern {
     public:
         TeasingPounding(const char *str) : Pattern(str) {}
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            // The fast move takes half the time of stroke divided by the speed ratio
+            return 2.0 * fscale(0.0, 100.0, 1.0, 5.0, abs(sensation), 0.0) * _minTimeOfMove(stroke, 1.5, 4.5, maxSpeed, maxAcceleration);
+        }
         void setSensation(float sensation) { 
             _sensation = sensation;
             _updateStrokeTiming();
@@ -244,10 +365,8 @@ class TeasingPounding : public Pattern {
                 _timeOfOutStroke = _timeOfFastStroke;
                 _timeOfInStroke = _timeOfStroke - _timeOfFastStroke;
             }
-#ifdef DEBUG_PATTERN
-            Serial.println("TimeOfInStroke: " + String(_timeOfInStroke));
-            Serial.println("TimeOfOutStroke: " + String(_timeOfOutStroke));
-#endif
+            Logger.log(LOG_LEVEL_DEBUG, "TimeOfInStroke: %.2f", _timeOfInStroke);
+            Logger.log(LOG_LEVEL_DEBUG, "TimeOfOutStroke: %.2f", _timeOfOutStroke);
         }
 };
 
@@ -271,15 +390,8 @@ class RoboStroke : public Pattern {
 
         void setSensation(float sensation = 0) { 
             _sensation = sensation;
-            // scale sensation into the range [0.05, 0.5] where 0 = 1/3
-            if (sensation >= 0 ) {
-              _x = fscale(0.0, 100.0, 1.0/3.0, 0.5, sensation, 0.0);
-            } else {
-              _x = fscale(0.0, 100.0, 1.0/3.0, 0.05, -sensation, 0.0);
-            }
-#ifdef DEBUG_PATTERN
-            Serial.println("Sensation:" + String(sensation,0) + " --> " + String(_x,6));
-#endif
+            _x = _accelerationShare(sensation);
+            Logger.log(LOG_LEVEL_DEBUG, "Sensation:%.0f --> %.6f", sensation, _x);
         }
 
         motionParameter nextTarget(unsigned int index) {
@@ -302,8 +414,20 @@ class RoboStroke : public Pattern {
             _index = index;
             return _nextMove;
         }
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            float x = _accelerationShare(sensation);
+            return 2.0 * _minTimeOfMove(stroke, 1.0 / (1 - x), 1.0 / (x * (1 - x)), maxSpeed, maxAcceleration);
+        }
     protected:
         float _x = 1.0/3.0;
+        static float _accelerationShare(float sensation) {
+            // scale sensation into the range [0.05, 0.5] where 0 = 1/3
+            if (sensation >= 0 ) {
+              return fscale(0.0, 100.0, 1.0/3.0, 0.5, sensation, 0.0);
+            } else {
+              return fscale(0.0, 100.0, 1.0/3.0, 0.05, -sensation, 0.0);
+            }
+        }
 };
 
 /**************************************************************************/
@@ -319,6 +443,10 @@ class RoboStroke : public Pattern {
 class HalfnHalf : public Pattern {
     public:
         HalfnHalf(const char *str) : Pattern(str) {}
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            // The fast move takes half the time of stroke divided by the speed ratio
+            return 2.0 * fscale(0.0, 100.0, 1.0, 5.0, abs(sensation), 0.0) * _minTimeOfMove(stroke, 1.5, 4.5, maxSpeed, maxAcceleration);
+        }
         void setSensation(float sensation) { 
             _sensation = sensation;
             _updateStrokeTiming();
@@ -381,10 +509,8 @@ class HalfnHalf : public Pattern {
                 _timeOfOutStroke = _timeOfFastStroke;
                 _timeOfInStroke = _timeOfStroke - _timeOfFastStroke;
             }
-#ifdef DEBUG_PATTERN
-            Serial.println("TimeOfInStroke: " + String(_timeOfInStroke));
-            Serial.println("TimeOfOutStroke: " + String(_timeOfOutStroke));
-#endif
+            Logger.log(LOG_LEVEL_DEBUG, "TimeOfInStroke: %.2f", _timeOfInStroke);
+            Logger.log(LOG_LEVEL_DEBUG, "TimeOfOutStroke: %.2f", _timeOfOutStroke);
         }
 };
 
@@ -413,9 +539,7 @@ class Deeper : public Pattern {
             } else {
                 _countStrokesForRamp = map(sensation, 0, 100, 11, 32);
             }
-#ifdef DEBUG_PATTERN
-            Serial.println("_countStrokesForRamp: " + String(_countStrokesForRamp));
-#endif
+            Logger.log(LOG_LEVEL_DEBUG, "_countStrokesForRamp: %d", _countStrokesForRamp);
         }
 
         motionParameter nextTarget(unsigned int index) {
@@ -432,10 +556,7 @@ class Deeper : public Pattern {
 
             // Amplitude is slope * cycleIndex
             int amplitude = slope * cycleIndex;
-#ifdef DEBUG_PATTERN
-            Serial.println("amplitude: " + String(amplitude)
-                         + " cycleIndex: " + String(cycleIndex));
-#endif
+            Logger.log(LOG_LEVEL_DEBUG, "amplitude: %d cycleIndex: %d", amplitude, cycleIndex);
 
             // maximum speed of the trapezoidal motion 
             _nextMove.speed = int(1.5 * amplitude/_timeOfStroke); 
@@ -582,6 +703,15 @@ class Insist : public Pattern {
             _updateStrokeTiming();
         }
 
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            // Acceleration grows as the fraction of the stroke shrinks. No move at all without a fraction.
+            float strokeFraction = (100 - abs(sensation))/100.0f;
+            if (strokeFraction <= 0.0) {
+                return 0.0;
+            }
+            return 2.0 * _minTimeOfMove(stroke, 1.5, 4.5 / strokeFraction, maxSpeed, maxAcceleration);
+        }
+
         motionParameter nextTarget(unsigned int index) {
 
             // acceleration & speed to meet the profile
@@ -625,7 +755,7 @@ class Insist : public Pattern {
             _speed = int(1.5 * _stroke/_timeOfStroke);
 
             // Acceleration to hold 1/3 profile with fractional strokes
-            _acceleration = int(3.0 * _nextMove.speed/(_timeOfStroke * _strokeFraction));
+            _acceleration = int(3.0 * _speed/(_timeOfStroke * _strokeFraction));
 
             // Calculate fractional stroke length
             _realStroke = int((float)_stroke * _strokeFraction);
@@ -642,7 +772,14 @@ class Insist : public Pattern {
 /**************************************************************************/
 class JackHammer : public Pattern {
     public:
-        JackHammer(const char *str) : Pattern(str) {}
+        // Timing of the vibrations neglects acceleration, let the StrokeEngine compensate the stroke rate
+        JackHammer(const char *str) : Pattern(str) { _rateCompensation = true; }
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            // At best the vibration only moves in and pulls out smoothly in one go
+            float distance = fscale(-100.0, 100.0, (float)(3.0*stepsPerMM), (float)(25.0*stepsPerMM), sensation, 0.0);
+            return ceilf(stroke / distance) * _timeOfMove(distance, maxSpeed, maxAcceleration) 
+                + _minTimeOfMove(stroke, 1.5, 4.5, maxSpeed, maxAcceleration);
+        }
         void setSensation(float sensation) { 
             _sensation = sensation;
             _updateVibrationParameters();
@@ -661,10 +798,18 @@ class JackHammer : public Pattern {
             _stepsPerMM = stepsPerMM;
             _updateVibrationParameters(); 
         }
+        // The stroke starts with the return to the rear end, the vibrations in count to it.
+        // Kept for the index, as the parameters may change until nextTarget() is called.
+        bool isStrokeStart(unsigned int index) { 
+            if ((index == 0) || (_nextMove.stroke >= _depth)) {
+                _strokeStartIndex = index;
+            }
+            return (index == _strokeStartIndex);
+        }
         motionParameter nextTarget(unsigned int index) {
 
             // revert position for the first move or if depth is exceeded
-            if (index == 0 || _nextMove.stroke >= _depth) {
+            if (isStrokeStart(index) == true) {
                 // Return strokes goes at regular speed without vibration back to 0
 
                 // maximum speed of the trapezoidal motion
@@ -679,7 +824,7 @@ class JackHammer : public Pattern {
 
             // only calculate new position, if index has incremented: no mid-stroke update, as vibration is sufficiently fast
             // except for return stroke if depth is exceeded.
-            if (index != _index) {
+            if ((int)index != _index) {
              
                 // Vibration happens at maximum speed and acceleration of the machine
                 _nextMove.speed = _maxSpeed;
@@ -698,6 +843,7 @@ class JackHammer : public Pattern {
             return _nextMove;
         }
     protected:
+        unsigned int _strokeStartIndex = 0;
         int _inVibrationDistance = 0;
         int _outVibrationDistance = 0;
         int _strokeInSpeed = 0;
@@ -712,12 +858,11 @@ class JackHammer : public Pattern {
                d_out = d_in * (v_vib - v_stroke) / (v_vib + v_stroke)
                Formula neglects acceleration. Real timing will be slower due to finite acceleration & deceleration
             */
-           _outVibrationDistance = _inVibrationDistance * (_maxSpeed - _strokeInSpeed) / (_maxSpeed + _strokeInSpeed);
+           // Signed arithmetic and no negative distance, if the stroke is faster than the vibration
+           _outVibrationDistance = _inVibrationDistance * (int(_maxSpeed) - min(_strokeInSpeed, int(_maxSpeed))) / (int(_maxSpeed) + _strokeInSpeed);
 
-#ifdef DEBUG_PATTERN
-            Serial.println("_maxSpeed: " + String(_maxSpeed) + " _strokeInSpeed: " + String(_strokeInSpeed)  + " _strokeOutSpeed: " + String(int(1.5 * _stroke/_timeOfStroke)));
-            Serial.println("inDist: " + String(_inVibrationDistance) + " outDist: " + String(_outVibrationDistance));
-#endif
+            Logger.log(LOG_LEVEL_DEBUG, "_maxSpeed: %u _strokeInSpeed: %d _strokeOutSpeed: %d", _maxSpeed, _strokeInSpeed, int(1.5 * _stroke/_timeOfStroke));
+            Logger.log(LOG_LEVEL_DEBUG, "inDist: %d outDist: %d", _inVibrationDistance, _outVibrationDistance);
             
         }
 };
@@ -730,7 +875,13 @@ class JackHammer : public Pattern {
 /**************************************************************************/
 class StrokeNibbler : public Pattern {
     public:
-        StrokeNibbler(const char *str) : Pattern(str) {}
+        // Timing of the vibrations neglects acceleration, let the StrokeEngine compensate the stroke rate
+        StrokeNibbler(const char *str) : Pattern(str) { _rateCompensation = true; }
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            // At best the vibration only moves forward, both on the way in and out
+            float distance = fscale(-100.0, 100.0, (float)(3.0*stepsPerMM), (float)(25.0*stepsPerMM), sensation, 0.0);
+            return 2.0 * ceilf(stroke / distance) * _timeOfMove(distance, maxSpeed, maxAcceleration);
+        }
         void setSensation(float sensation) { 
             _sensation = sensation;
             _updateVibrationParameters();
@@ -749,6 +900,15 @@ class StrokeNibbler : public Pattern {
             _stepsPerMM = stepsPerMM;
             _updateVibrationParameters(); 
         }
+        // The stroke starts with the move that returns to the rear end, an odd move on the way out.
+        // Kept for the index, as the parameters may change until nextTarget() is called.
+        bool isStrokeStart(unsigned int index) { 
+            if ((index == 0) || ((index % 2 == 1) && (_returning() == true) 
+                    && (_nextMove.stroke - _inVibrationDistance <= _depth - _stroke))) {
+                _strokeStartIndex = index;
+            }
+            return (index == _strokeStartIndex);
+        }
         motionParameter nextTarget(unsigned int index) {
 
             // revert position to start for the first stroke
@@ -762,6 +922,7 @@ class StrokeNibbler : public Pattern {
 
                 // store index and return
                 _index = index;
+                _strokeStartIndex = index;
                 return _nextMove;
             }
 
@@ -770,16 +931,15 @@ class StrokeNibbler : public Pattern {
             _nextMove.acceleration = _maxAcceleration;
 
             // check if we have reached one of the ends and reverse direction
-            if (_nextMove.stroke >= _depth) {
-                _returnStroke = true;
-            } 
-            if (_nextMove.stroke <= (_depth - _stroke)) {
-                _returnStroke = false;
-            }
+            _returnStroke = _returning();
 
             // only calculate new position, if index has incremented: no mid-stroke update, as vibration is sufficiently fast
-            if (index != _index) {
-                if (_returnStroke == true) {
+            if ((int)index != _index) {
+                if (index == _strokeStartIndex) {
+                    // a new stroke starts at the back position
+                    _nextMove.stroke = _depth - _stroke;
+
+                } else if (_returnStroke == true) {
                     // long vibration distance on way out
                     // odd stroke is shaking out
                     if (index % 2) {  
@@ -810,6 +970,16 @@ class StrokeNibbler : public Pattern {
         }
     protected:
         bool _returnStroke = false;
+        unsigned int _strokeStartIndex = 0;
+        bool _returning() {
+            if (_nextMove.stroke <= (_depth - _stroke)) {
+                return false;
+            }
+            if (_nextMove.stroke >= _depth) {
+                return true;
+            }
+            return _returnStroke;
+        }
         int _inVibrationDistance = 0;
         int _outVibrationDistance = 0;
         int _strokeSpeed = 0;
@@ -824,31 +994,448 @@ class StrokeNibbler : public Pattern {
                d_out = d_in * (v_vib - v_stroke) / (v_vib + v_stroke)
                Formula neglects acceleration. Real timing will be slower due to finite acceleration & deceleration
             */
-           _outVibrationDistance = _inVibrationDistance * (_maxSpeed - _strokeSpeed) / (_maxSpeed + _strokeSpeed);
+           // Signed arithmetic and no negative distance, if the stroke is faster than the vibration
+           _outVibrationDistance = _inVibrationDistance * (int(_maxSpeed) - min(_strokeSpeed, int(_maxSpeed))) / (int(_maxSpeed) + _strokeSpeed);
 
-#ifdef DEBUG_PATTERN
-            Serial.println("_maxSpeed: " + String(_maxSpeed) + " _strokeSpeed: " + String(_strokeSpeed));
-            Serial.println("inDist: " + String(_inVibrationDistance) + " outDist: " + String(_outVibrationDistance));
-#endif
+            Logger.log(LOG_LEVEL_DEBUG, "_maxSpeed: %u _strokeSpeed: %d", _maxSpeed, _strokeSpeed);
+            Logger.log(LOG_LEVEL_DEBUG, "inDist: %d outDist: %d", _inVibrationDistance, _outVibrationDistance);
             
         }
 };
 
+/**************************************************************************/
+/*!
+  @brief  Pattern defined at runtime by bytecode of the PatternVM, loaded
+  over Serial and kept in NVS instead of compiled into the firmware. Each
+  move runs the code once with index, stroke, depth, time of stroke, 
+  sensation and the limits of the machine as inputs. Until code is loaded
+  it runs patternVMSimpleStroke. A move whose code faults falls back to 
+  Simple Stroke, so the machine keeps moving within its envelope.
+*/
+/**************************************************************************/
+class BytecodePattern : public Pattern {
+    public:
+        BytecodePattern(const char *str) : Pattern(str) {
+            size_t length = 0;
+            PatternVM::assemble(patternVMSimpleStroke, _pending, sizeof(_pending), &length);
+            _vm.load(_pending, length);
+        }
+
+        bool loadCode(const uint8_t *code, size_t length) {
+            if (PatternVM::validate(code, length) >= 0) {
+                return false;
+            }
+
+            // The stroking task takes the code over with its next move
+            if (xSemaphoreTake(_codeMutex, portMAX_DELAY) == pdTRUE) {
+                memcpy(_pending, code, length);
+                _pendingLength = length;
+                xSemaphoreGive(_codeMutex);
+            }
+            return true;
+        }
+
+        motionParameter nextTarget(unsigned int index) {
+            // Never wait for the loader, the code is picked up with the next move then
+            if ((_pendingLength > 0) && (xSemaphoreTake(_codeMutex, 0) == pdTRUE)) {
+                _vm.load(_pending, _pendingLength);
+                _pendingLength = 0;
+                xSemaphoreGive(_codeMutex);
+            }
+            if (index == 0) {
+                _startMillis = _plannedMillis;
+            }
+
+            _vm.setRegister(VM_REG_INDEX, index);
+            _vm.setRegister(VM_REG_STROKE, _stroke);
+            _vm.setRegister(VM_REG_DEPTH, _depth);
+            _vm.setRegister(VM_REG_TIME_OF_STROKE, _timeOfStroke);
+            _vm.setRegister(VM_REG_SENSATION, _sensation);
+            _vm.setRegister(VM_REG_MAX_SPEED, _maxSpeed);
+            _vm.setRegister(VM_REG_MAX_ACCELERATION, _maxAcceleration);
+            _vm.setRegister(VM_REG_STEPS_PER_MM, _stepsPerMM);
+            _vm.setRegister(VM_REG_TIME, (_plannedMillis - _startMillis) / 1000.0);
+
+            if (_vm.run() == true) {
+                // The StrokeEngine constrains the move, the conversion to int must not overflow
+                _nextMove.stroke = int(constrain(_vm.getRegister(VM_REG_POSITION), -1.0e9, 1.0e9));
+                _nextMove.speed = int(constrain(_vm.getRegister(VM_REG_SPEED), 0.0, 1.0e9));
+                _nextMove.acceleration = int(constrain(_vm.getRegister(VM_REG_ACCELERATION), 0.0, 1.0e9));
+                _nextMove.skip = (_vm.getRegister(VM_REG_SKIP) != 0.0);
+            } else {
+                _nextMove.speed = int(3.0 * _stroke / _timeOfStroke);
+                _nextMove.acceleration = int(6.0 * _nextMove.speed / _timeOfStroke);
+                _nextMove.stroke = (index % 2) ? _depth - _stroke : _depth;
+                _nextMove.skip = false;
+            }
+
+            _index = index;
+            return _nextMove;
+        }
+
+        //! Statistics of the code since it was loaded, e.g. to check how close it gets to VM_BUDGET
+        patternVMStatistics getStatistics() { return _vm.getStatistics(); }
+
+    protected:
+        PatternVM _vm;
+        uint8_t _pending[VM_CODE_SIZE];
+        volatile size_t _pendingLength = 0;
+        unsigned long _startMillis = 0;
+        SemaphoreHandle_t _codeMutex = xSemaphoreCreateMutex();
+};
+
+#define SPLINE_KEYFRAMES            16      // Keyframes of a spline pattern at most
+#define SPLINE_SEGMENTS             24      // Moves a full stroke is cut into, a span gets its share but at least 1
+#define SPLINE_MAX_WARP             3.0     // Sensation of +/-100 makes the in or out spans this much faster
+#define SPLINE_ACCELERATION_MARGIN  1.5     // Acceleration of a segment above the one of the curve, the speed changes between segments
+
+/**************************************************************************/
+/*!
+  @brief  Keyframe of a spline pattern. Positions are scaled with stroke
+  and depth, times with the time of stroke.
+*/
+/**************************************************************************/
+typedef struct {
+  float time;         /*> Time from 0 to < 1 of the full stroke, ascending */
+  float position;     /*> Position from 0 at depth - stroke to 1 at depth */
+} splineKeyframe;
+
+/**************************************************************************/
+/*!
+  @brief  Curve a spline pattern draws through its keyframes.
+*/
+/**************************************************************************/
+typedef enum {
+  MONOTONE,           //!< Fritsch-Butland: never overshoots, holds and turns exactly at the keyframes
+  CATMULL_ROM         //!< Rounder, but may overshoot between keyframes. Positions are clamped to the stroke.
+} SplineInterpolation;
+
+/**************************************************************************/
+/*!
+  @brief  Base class of patterns defined by keyframes of normalized time and
+  position. A cubic Hermite spline through the keyframes repeats with every
+  full stroke, the last keyframe runs into the first one of the next stroke.
+  Each span between two keyframes is cut into moves of equal time, which
+  the lookahead of the StrokeEngine chains without stopping as long as they
+  keep their direction.
+
+  The spline is evaluated by forward differencing: a move costs three
+  additions, no matter how the curve is shaped. Only a jump of the index,
+  e.g. on start, replan or a change of the pattern, evaluates the span in
+  closed form. A move after such a jump approaches with at least the speed
+  of Simple Stroke, as the carriage may be anywhere. Segments without
+  distance hold the position in steps of the pause of the StrokeEngine.
+
+  Sensation makes the in spans faster and the out spans slower (> 0) or
+  the other way round (< 0), up to SPLINE_MAX_WARP. The time of a full
+  stroke stays the same.
+*/
+/**************************************************************************/
+class SplinePattern : public Pattern {
+    public:
+        // Segments neglect the time to change speed in between, let the StrokeEngine compensate the stroke rate
+        SplinePattern(const char *str) : Pattern(str) {
+            _rateCompensation = true;
+            _timeOfStroke = 1.0;
+        }
+        float getMinTimeOfStroke(int stroke, int depth, float sensation, float maxSpeed, float maxAcceleration, unsigned int stepsPerMM) {
+            float rise, fall;
+            _warp(sensation, _risingShare, _fallingShare, &rise, &fall);
+            float time = 0.0;
+            for (unsigned int k = 0; k < _spans; k++) {
+                float warp = _spanWarp(k, rise, fall);
+                time = max(time, _peakSpeed[k] * stroke / (warp * maxSpeed));
+                time = max(time, sqrtf(_peakAcceleration[k] * stroke / maxAcceleration) / warp);
+            }
+            return time;
+        }
+        unsigned int getMovesPerStroke() { return _moves; }
+        void setSensation(float sensation) {
+            _sensation = sensation;
+            _updateTiming();
+        }
+        void setTimeOfStroke(float speed = 0) {
+            _timeOfStroke = speed;
+            _updateTiming();
+        }
+        motionParameter nextTarget(unsigned int index) {
+            // The same index is asked again after a hold, it gets the same segment
+            bool approach = false;
+            if ((int)index != _index) {
+                if ((_index >= 0) && ((int)index == _index + 1)) {
+                    _advance();
+                } else {
+                    // A replan continues on the curve, if this pattern delivered the move before
+                    approach = ((int)index <= _runStart) || ((int)index > _index);
+                    if (approach == true) {
+                        _runStart = index;
+                    }
+                    _seek(index % _moves);
+                }
+                _holding = false;
+            }
+
+            // The last segment of a span ends exactly on its keyframe
+            float from = constrain(_position, 0.0, 1.0);
+            float to = (_step + 1 == _segments[_span]) ? _keyframe[(_span + 1) % _spans].position
+                : constrain(_position + _delta1, 0.0, 1.0);
+            float duration = _segmentTime[_span];
+            float distance = fabsf(to - from) * _stroke;
+            float speed = distance / duration;
+            // Enough to stop within the segment, so the lookahead joins the segments at speed
+            float acceleration = (0.5 * speed + SPLINE_ACCELERATION_MARGIN * fabsf(_delta2) * _stroke / duration) / duration;
+            _nextMove.stroke = _depth - _stroke + int(to * _stroke + 0.5);
+            _nextMove.skip = false;
+
+            if (approach == true) {
+                speed = max(speed, float(3.0 * _stroke / _timeOfStroke));
+                acceleration = max(acceleration, float(6.0 * speed / _timeOfStroke));
+            } else if (distance < 1.0) {
+                if (_holding == false) {
+                    _startDelay();
+                    _updateDelay(int(1000.0 * duration));
+                    _holding = true;
+                }
+                _nextMove.skip = _isStillDelayed();
+            }
+            _nextMove.speed = int(speed);
+            _nextMove.acceleration = int(acceleration);
+
+            _index = index;
+            return _nextMove;
+        }
+    protected:
+        splineKeyframe _keyframe[SPLINE_KEYFRAMES];
+        float _coefficient[SPLINE_KEYFRAMES][4];    // a, b, c, d of a span: p(u) = ((a * u + b) * u + c) * u + d, u from 0 to 1
+        float _share[SPLINE_KEYFRAMES];             // Share of a span in the time of stroke before the warp
+        float _peakSpeed[SPLINE_KEYFRAMES];         // Largest speed of a span in strokes per time of stroke
+        float _peakAcceleration[SPLINE_KEYFRAMES];  // Largest acceleration a move of a span asks for in strokes per time of stroke²
+        float _segmentTime[SPLINE_KEYFRAMES];       // Time of a move of a span in [sec]
+        unsigned int _segments[SPLINE_KEYFRAMES];   // Moves of a span
+        unsigned int _firstMove[SPLINE_KEYFRAMES];  // Move of the full stroke a span starts with
+        unsigned int _spans = 0;
+        unsigned int _moves = 1;
+        float _risingShare = 0.0;
+        float _fallingShare = 0.0;
+        unsigned int _span = 0;                     // Span and segment of the move of _index
+        unsigned int _step = 0;
+        float _position = 0.0;                      // Start of the segment and its forward differences
+        float _delta1 = 0.0;
+        float _delta2 = 0.0;
+        float _delta3 = 0.0;
+        int _runStart = 0;                          // First index of the moves delivered in a row
+        bool _holding = false;
+
+        /*!
+          @brief Set the keyframes, call it from the constructor of a pattern.
+          @param keyframe keyframes, copied. Times ascend from 0 to < 1.
+          @param count number of keyframes from 2 to SPLINE_KEYFRAMES
+          @param interpolation MONOTONE or CATMULL_ROM
+        */
+        void _setKeyframes(const splineKeyframe *keyframe, unsigned int count, SplineInterpolation interpolation) {
+            static const splineKeyframe fallback[] = {{0.0, 0.0}, {0.5, 1.0}};
+            if ((count < 2) || (count > SPLINE_KEYFRAMES)) {
+                keyframe = fallback;
+                count = 2;
+            }
+            _spans = count;
+            for (unsigned int k = 0; k < count; k++) {
+                _keyframe[k].time = constrain(keyframe[k].time, 0.0, 1.0);
+                _keyframe[k].position = constrain(keyframe[k].position, 0.0, 1.0);
+            }
+
+            // Slopes of the spans, the last one wraps around to the first keyframe
+            float slope[SPLINE_KEYFRAMES];
+            for (unsigned int k = 0; k < count; k++) {
+                unsigned int next = (k + 1) % count;
+                _share[k] = max(_keyframe[next].time - _keyframe[k].time + ((next == 0) ? 1.0f : 0.0f), 0.001f);
+                slope[k] = (_keyframe[next].position - _keyframe[k].position) / _share[k];
+            }
+
+            // Tangents at the keyframes
+            float tangent[SPLINE_KEYFRAMES];
+            for (unsigned int k = 0; k < count; k++) {
+                unsigned int prev = (k + count - 1) % count;
+                if (interpolation == CATMULL_ROM) {
+                    tangent[k] = (_keyframe[(k + 1) % count].position - _keyframe[prev].position) / (_share[prev] + _share[k]);
+                } else if (slope[prev] * slope[k] <= 0.0) {
+                    // Turning point or flat, Fritsch-Butland holds still there
+                    tangent[k] = 0.0;
+                } else {
+                    tangent[k] = 3.0 * (_share[prev] + _share[k]) / ((2.0 * _share[k] + _share[prev]) / slope[prev]
+                        + (_share[k] + 2.0 * _share[prev]) / slope[k]);
+                }
+            }
+
+            // Hermite coefficients, moves and peaks of each span
+            _moves = 0;
+            _risingShare = 0.0;
+            _fallingShare = 0.0;
+            for (unsigned int k = 0; k < count; k++) {
+                unsigned int next = (k + 1) % count;
+                float h = _share[k];
+                float p0 = _keyframe[k].position;
+                float p1 = _keyframe[next].position;
+                float a = 2.0 * (p0 - p1) + h * tangent[k] + h * tangent[next];
+                float b = 3.0 * (p1 - p0) - 2.0 * h * tangent[k] - h * tangent[next];
+                float c = h * tangent[k];
+                _coefficient[k][0] = a;
+                _coefficient[k][1] = b;
+                _coefficient[k][2] = c;
+                _coefficient[k][3] = p0;
+
+                _segments[k] = max(1, int(SPLINE_SEGMENTS * h + 0.5));
+                _firstMove[k] = _moves;
+                _moves += _segments[k];
+                if (p1 > p0) {
+                    _risingShare += h;
+                } else if (p1 < p0) {
+                    _fallingShare += h;
+                }
+
+                // p'(u) peaks at the ends or its vertex, p''(u) is linear and peaks at the ends
+                float speed = max(fabsf(c), fabsf(3.0f * a + 2.0f * b + c));
+                if ((a != 0.0) && (-b / (3.0 * a) > 0.0) && (-b / (3.0 * a) < 1.0)) {
+                    speed = max(speed, fabsf(c - b * b / (3.0f * a)));
+                }
+                _peakSpeed[k] = speed / h;
+                _peakAcceleration[k] = 0.5 * _peakSpeed[k] * _segments[k] / h
+                    + SPLINE_ACCELERATION_MARGIN * max(fabsf(2.0f * b), fabsf(6.0f * a + 2.0f * b)) / (h * h);
+            }
+
+            // Evaluate from scratch with the next move
+            _index = -1;
+            _updateTiming();
+        }
+
+        //! Start the segment of a span, the forward differences are evaluated in closed form
+        void _startSegment(unsigned int span, unsigned int step) {
+            float a = _coefficient[span][0];
+            float b = _coefficient[span][1];
+            float c = _coefficient[span][2];
+            float s = 1.0 / _segments[span];
+            float u = step * s;
+            _span = span;
+            _step = step;
+            _position = ((a * u + b) * u + c) * u + _coefficient[span][3];
+            _delta1 = a * s * (3.0 * u * u + 3.0 * u * s + s * s) + b * s * (2.0 * u + s) + c * s;
+            _delta2 = 6.0 * a * s * s * (u + s) + 2.0 * b * s * s;
+            _delta3 = 6.0 * a * s * s * s;
+        }
+
+        //! Step to the next segment, three additions within a span
+        void _advance() {
+            if (_step + 1 < _segments[_span]) {
+                _position += _delta1;
+                _delta1 += _delta2;
+                _delta2 += _delta3;
+                _step++;
+            } else {
+                _startSegment((_span + 1) % _spans, 0);
+            }
+        }
+
+        //! Start the segment of any move of the full stroke
+        void _seek(unsigned int move) {
+            unsigned int span = 0;
+            while ((span + 1 < _spans) && (move >= _firstMove[span + 1])) {
+                span++;
+            }
+            _startSegment(span, move - _firstMove[span]);
+        }
+
+        //! Time factors of the in and out spans for a sensation, the time of stroke stays the same
+        static void _warp(float sensation, float rising, float falling, float *rise, float *fall) {
+            float factor = fscale(0.0, 100.0, 1.0, SPLINE_MAX_WARP, abs(sensation), 0.0);
+            *rise = 1.0;
+            *fall = 1.0;
+            if ((rising <= 0.0) || (falling <= 0.0)) {
+                return;
+            }
+            // positive sensation, in is faster
+            if (sensation > 0.0) {
+                *rise = 1.0 / factor;
+                *fall = (falling + rising - rising / factor) / falling;
+            // negative sensation, out is faster
+            } else {
+                *fall = 1.0 / factor;
+                *rise = (rising + falling - falling / factor) / rising;
+            }
+        }
+
+        //! Time factor of a span, spans without distance keep their time
+        float _spanWarp(unsigned int span, float rise, float fall) {
+            float p0 = _keyframe[span].position;
+            float p1 = _keyframe[(span + 1) % _spans].position;
+            return (p1 > p0) ? rise : ((p1 < p0) ? fall : 1.0);
+        }
+
+        void _updateTiming() {
+            float rise, fall;
+            _warp(_sensation, _risingShare, _fallingShare, &rise, &fall);
+            for (unsigned int k = 0; k < _spans; k++) {
+                _segmentTime[k] = _share[k] * _timeOfStroke * _spanWarp(k, rise, fall) / _segments[k];
+            }
+        }
+};
+
+/**************************************************************************/
+/*!
+  @brief  Smooth wave through the full stroke, close to a sine. Catmull-Rom
+  through depth, the middle of the stroke and its rear end. Sensation
+  shifts the time between in and out.
+*/
+/**************************************************************************/
+class Wave : public SplinePattern {
+    public:
+        Wave(const char *str) : SplinePattern(str) {
+            static const splineKeyframe keyframes[] = {{0.0, 0.0}, {0.25, 0.5}, {0.5, 1.0}, {0.75, 0.5}};
+            _setKeyframes(keyframes, 4, CATMULL_ROM);
+        }
+};
+
+/**************************************************************************/
+/*!
+  @brief  Two taps at depth, then a long pull out. The second tap backs off
+  by a third of the stroke and holds at depth before pulling out. Sensation
+  shifts the time between in and out.
+*/
+/**************************************************************************/
+class DoubleTap : public SplinePattern {
+    public:
+        DoubleTap(const char *str) : SplinePattern(str) {
+            static const splineKeyframe keyframes[] = {{0.0, 0.0}, {0.25, 1.0}, {0.4, 0.65}, {0.55, 1.0}, {0.65, 1.0}};
+            _setKeyframes(keyframes, 5, MONOTONE);
+        }
+};
+
 /**************************************************************************/
 /*
   Array holding all different patterns. Please include any custom pattern here.
+  Patterns keep state between strokes, so each StrokeEngine creates its own
+  instances from this table.
 */
 /**************************************************************************/
-static Pattern *patternTable[] = { 
-  new SimpleStroke("Simple Stroke"),
-  new TeasingPounding("Teasing or Pounding"),
-  new RoboStroke("Robo Stroke"),
-  new HalfnHalf("Half'n'Half"),
-  new Deeper("Deeper"),
-  new StopNGo("Stop'n'Go"),
-  new Insist("Insist"),
-  new JackHammer("Jack Hammer"),
-  new StrokeNibbler("Stroke Nibbler")
+template <class P> Pattern *createPattern(const char *name) { return new P(name); }
+
+typedef struct {
+  const char *name;                         /*> Name of the pattern */
+  Pattern *(*create)(const char *name);     /*> Creates an instance of the pattern */
+} patternEntry;
+
+static const patternEntry patternTable[] = { 
+  {"Simple Stroke", createPattern<SimpleStroke>},
+  {"Teasing or Pounding", createPattern<TeasingPounding>},
+  {"Robo Stroke", createPattern<RoboStroke>},
+  {"Half'n'Half", createPattern<HalfnHalf>},
+  {"Deeper", createPattern<Deeper>},
+  {"Stop'n'Go", createPattern<StopNGo>},
+  {"Insist", createPattern<Insist>},
+  {"Jack Hammer", createPattern<JackHammer>},
+  {"Stroke Nibbler", createPattern<StrokeNibbler>},
+  {"Custom", createPattern<BytecodePattern>},
+  {"Wave", createPattern<Wave>},
+  {"Double Tap", createPattern<DoubleTap>}
   // <-- insert your new pattern class here!
  };
 
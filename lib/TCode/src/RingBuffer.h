@@ -0,0 +1,73 @@
+/**
+ *   Ring Buffer
+ *   Lock free ring buffer for exactly one producer and one consumer.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+/**************************************************************************/
+/*!
+  @brief  Fixed size ring buffer for one producer and one consumer, which may 
+  run in different tasks or on different cores. Neither side ever blocks or 
+  allocates memory. The producer only writes _head, the consumer only writes
+  _tail. One slot stays empty to tell a full from an empty buffer.
+  @tparam T type of the elements
+  @tparam SIZE number of slots
+*/
+/**************************************************************************/
+template <typename T, unsigned int SIZE>
+class RingBuffer {
+    public:
+        /*!
+          @brief Append an element. Must only be called by the producer.
+          @param element element to append
+          @return false if the buffer is full and the element was dropped
+        */
+        bool push(const T &element) {
+            unsigned int head = _head;
+            unsigned int next = (head + 1) % SIZE;
+            if (next == _tail) {
+                _dropped++;
+                return false;
+            }
+            _buffer[head] = element;
+            __sync_synchronize();
+            _head = next;
+            return true;
+        }
+
+        /*!
+          @brief Remove the oldest element. Must only be called by the consumer.
+          @param element receives the oldest element
+          @return false if the buffer is empty
+        */
+        bool pop(T &element) {
+            unsigned int tail = _tail;
+            if (tail == _head) {
+                return false;
+            }
+            __sync_synchronize();
+            element = _buffer[tail];
+            __sync_synchronize();
+            _tail = (tail + 1) % SIZE;
+            return true;
+        }
+
+        //! Number of elements waiting in the buffer
+        unsigned int available() { return (_head + SIZE - _tail) % SIZE; }
+
+        //! True if no further element fits into the buffer
+        bool isFull() { return ((_head + 1) % SIZE) == _tail; }
+
+        //! Number of elements dropped because the buffer was full
+        unsigned int getDropped() { return _dropped; }
+
+    protected:
+        T _buffer[SIZE];
+        volatile unsigned int _head = 0;
+        volatile unsigned int _tail = 0;
+        volatile unsigned int _dropped = 0;
+};
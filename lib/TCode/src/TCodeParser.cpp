@@ -0,0 +1,267 @@
+#include <string.h>
+#include <TCodeParser.h>
+
+static char _toUpper(char c) {
+    return ((c >= 'a') && (c <= 'z')) ? (c - 'a' + 'A') : c;
+}
+
+static bool _isDigit(char c) {
+    return (c >= '0') && (c <= '9');
+}
+
+static bool _isHex(char c) {
+    return _isDigit(c) || ((_toUpper(c) >= 'A') && (_toUpper(c) <= 'F'));
+}
+
+static bool _isSpace(char c) {
+    return (c == ' ') || (c == '\t');
+}
+
+static bool _isCommand(const char *token, unsigned int length, const char *command) {
+    // Case insensitive, the whole token must match
+    if (length != strlen(command)) {
+        return false;
+    }
+    for (unsigned int i = 0; i < length; i++) {
+        if (_toUpper(token[i]) != command[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TCodeParser::feed(char c) {
+    bool executed = false;
+
+    // A newline completes the command line
+    if ((c == '\n') || (c == '\r')) {
+        if (_overflow == true) {
+            _discarded++;
+        } else if (_length > 0) {
+            executed = _execute();
+        }
+        _length = 0;
+        _overflow = false;
+        return executed;
+    }
+
+    // Keep collecting, but forget lines which do not fit into the buffer
+    if (_length < TCODE_LINE_LENGTH) {
+        _line[_length++] = c;
+    } else {
+        _overflow = true;
+    }
+    return false;
+}
+
+bool TCodeParser::_execute() {
+    bool move = false;
+    bool stop = false;
+    unsigned int queries = 0;
+    float position = 0.0;
+    unsigned long interval = 0;
+    float speed = 0.0;
+    tcodePayload program = {0, 0, false};
+    tcodePayload code = {0, 0, false};
+    bool anyCommand = false;
+    unsigned int start = 0;
+
+    // Commands are separated by whitespace and executed together
+    while (start < _length) {
+        while ((start < _length) && _isSpace(_line[start])) {
+            start++;
+        }
+        unsigned int end = start;
+        while ((end < _length) && !_isSpace(_line[end])) {
+            end++;
+        }
+        if (end == start) {
+            break;
+        }
+
+        const char *token = &_line[start];
+        unsigned int length = end - start;
+        bool valid = false;
+        switch (_toUpper(token[0])) {
+            case 'D':
+                valid = _parseDevice(token, length, &stop, &queries, &program, &code);
+                break;
+            case 'L':
+            case 'R':
+            case 'V':
+            case 'A':
+                valid = _parseAxis(token, length, &move, &position, &interval, &speed);
+                break;
+            default:
+                break;
+        }
+
+        // One malformed command discards the whole line
+        if (valid == false) {
+            _discarded++;
+            return false;
+        }
+        anyCommand = true;
+        start = end;
+    }
+
+    if (anyCommand == false) {
+        return false;
+    }
+
+    if ((stop == true) && (_callbackStop != 0)) {
+        _callbackStop();
+    }
+    if ((program.text != 0) && (_callbackProgram != 0)) {
+        _callbackProgram(program.text, program.length, program.append);
+    }
+    if ((code.text != 0) && (_callbackCode != 0)) {
+        _callbackCode(code.text, code.length, code.append);
+    }
+    for (int query = TCODE_IDENTIFY; (query <= TCODE_CODE_SAVE) && (_callbackQuery != 0); query++) {
+        if (queries & (1 << query)) {
+            _callbackQuery((TCodeQuery)query);
+        }
+    }
+    if ((move == true) && (stop == false) && (_callbackMove != 0)) {
+        _callbackMove(position, interval, speed);
+    }
+
+    _executed++;
+    return true;
+}
+
+bool TCodeParser::_parseAxis(const char *token, unsigned int length, bool *move, float *position, unsigned long *interval, float *speed) {
+    unsigned long value = 0;
+    unsigned int digits = 0;
+
+    // Axis type and channel, followed by at least one digit of magnitude
+    if ((length < 3) || !_isDigit(token[1])) {
+        return false;
+    }
+    unsigned int consumed = _parseNumber(&token[2], length - 2, &value, &digits);
+    if (consumed == 0) {
+        return false;
+    }
+
+    // Digits are the fractional part of the position
+    float scale = 1.0;
+    for (unsigned int i = 0; i < digits; i++) {
+        scale *= 10.0;
+    }
+    float magnitude = value / scale;
+
+    // Optional interval or speed suffix
+    unsigned long suffixInterval = 0;
+    float suffixSpeed = 0.0;
+    unsigned int i = 2 + consumed;
+    while (i < length) {
+        char suffix = _toUpper(token[i]);
+        consumed = _parseNumber(&token[i + 1], length - i - 1, &value, &digits);
+        if (consumed == 0) {
+            return false;
+        }
+        if (suffix == 'I') {
+            suffixInterval = value;
+        } else if (suffix == 'S') {
+            // 1/10000 of the range per 100 ms into ranges per second
+            suffixSpeed = value / 1000.0;
+        } else {
+            return false;
+        }
+        i += 1 + consumed;
+    }
+
+    // Only the linear axis 0 moves the machine
+    if ((_toUpper(token[0]) == 'L') && (token[1] == '0')) {
+        *move = true;
+        *position = magnitude;
+        *interval = suffixInterval;
+        *speed = suffixSpeed;
+    }
+    return true;
+}
+
+bool TCodeParser::_parseDevice(const char *token, unsigned int length, bool *stop, unsigned int *queries, tcodePayload *program, tcodePayload *code) {
+    if (_isCommand(token, length, "DSTOP")) {
+        *stop = true;
+        return true;
+    }
+    if (_isCommand(token, length, "DSAMPLE")) {
+        *queries |= 1 << TCODE_SAMPLES;
+        return true;
+    }
+    if (_isCommand(token, length, "DCURRENT")) {
+        *queries |= 1 << TCODE_CURRENT;
+        return true;
+    }
+    if (_isCommand(token, length, "DPLOAD")) {
+        *queries |= 1 << TCODE_PROGRAM_LOAD;
+        return true;
+    }
+    if (_isCommand(token, length, "DPSAVE")) {
+        *queries |= 1 << TCODE_PROGRAM_SAVE;
+        return true;
+    }
+    if (_isCommand(token, length, "DPRUN")) {
+        *queries |= 1 << TCODE_PROGRAM_RUN;
+        return true;
+    }
+    if (_isCommand(token, length, "DPLOOP")) {
+        *queries |= 1 << TCODE_PROGRAM_LOOP;
+        return true;
+    }
+
+    if (_isCommand(token, length, "DVSET")) {
+        *queries |= 1 << TCODE_CODE_SET;
+        return true;
+    }
+    if (_isCommand(token, length, "DVSAVE")) {
+        *queries |= 1 << TCODE_CODE_SAVE;
+        return true;
+    }
+
+    // Steps of a program start with the pattern index, bytecode is all hex. Only one of each per line.
+    if ((length > 2) && ((_toUpper(token[1]) == 'P') || (_toUpper(token[1]) == 'V'))) {
+        tcodePayload *payload = (_toUpper(token[1]) == 'P') ? program : code;
+        bool plus = (token[2] == '+');
+        unsigned int start = plus ? 3 : 2;
+        if ((start >= length) || (payload->text != 0) || ((payload == program) && !_isDigit(token[start]))) {
+            return false;
+        }
+        for (unsigned int i = start; (payload == code) && (i < length); i++) {
+            if (!_isHex(token[i])) {
+                return false;
+            }
+        }
+        payload->text = &token[start];
+        payload->length = length - start;
+        payload->append = plus;
+        return true;
+    }
+
+    // Single digit queries, unknown ones are ignored
+    if ((length == 2) && _isDigit(token[1])) {
+        if (token[1] <= '0' + TCODE_AXES) {
+            *queries |= 1 << (token[1] - '0');
+        }
+        return true;
+    }
+    return false;
+}
+
+unsigned int TCodeParser::_parseNumber(const char *token, unsigned int length, unsigned long *value, unsigned int *digits) {
+    unsigned int i = 0;
+    *value = 0;
+    *digits = 0;
+
+    // Digits beyond TCODE_MAX_DIGITS are consumed, but ignored
+    while ((i < length) && _isDigit(token[i])) {
+        if (*digits < TCODE_MAX_DIGITS) {
+            *value = *value * 10 + (token[i] - '0');
+            (*digits)++;
+        }
+        i++;
+    }
+    return i;
+}
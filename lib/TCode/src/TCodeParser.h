@@ -0,0 +1,144 @@
+/**
+ *   T-Code Parser
+ *   Allocation free parser for T-Code commands of the linear stroke axis L0.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define TCODE_LINE_LENGTH       128     // Longest command line in characters, longer lines are discarded
+#define TCODE_MAX_DIGITS        9       // Digits of a magnitude taken into account, further digits are ignored
+
+/**************************************************************************/
+/*!
+  @brief  Device queries of T-Code. 
+*/
+/**************************************************************************/
+typedef enum {
+  TCODE_IDENTIFY = 0,       //!< D0: Identify the device
+  TCODE_VERSION = 1,        //!< D1: Version of T-Code
+  TCODE_AXES = 2,           //!< D2: List the available axes
+  TCODE_SAMPLES = 3,        //!< DSAMPLE: Binary dump of the actual position samples
+  TCODE_CURRENT = 4,        //!< DCURRENT: CSV trace of the current around the last hard stop of sensorless homing
+  TCODE_PROGRAM_LOAD = 5,   //!< DPLOAD: Load the program stored in NVS
+  TCODE_PROGRAM_SAVE = 6,   //!< DPSAVE: Store the loaded program in NVS
+  TCODE_PROGRAM_RUN = 7,    //!< DPRUN: Play the loaded program once
+  TCODE_PROGRAM_LOOP = 8,   //!< DPLOOP: Play the loaded program over and over
+  TCODE_CODE_SET = 9,       //!< DVSET: Hand the bytecode sent with DV to the pattern
+  TCODE_CODE_SAVE = 10      //!< DVSAVE: Store the bytecode of the pattern in NVS
+} TCodeQuery;
+
+/**************************************************************************/
+/*!
+  @brief  Text carried by a command, e.g. the steps of DP.
+*/
+/**************************************************************************/
+typedef struct {
+  const char *text;           /*> Points into the line buffer, not terminated. 0 if not sent */
+  unsigned int length;        /*> Characters of text */
+  bool append;                /*> Sent with + to append */
+} tcodePayload;
+
+/**************************************************************************/
+/*!
+  @class TCodeParser 
+  @brief  Parses T-Code from a stream of characters. Commands are collected 
+          until a newline and then executed together through callbacks. Only
+          the linear axis L0 is supported, commands for other axes are ignored.
+          The parser works on a fixed line buffer and never allocates memory.
+          
+          Supported commands:
+          - `L0<magnitude>`: Move to magnitude. The digits are the fractional 
+            part of the position, so `L05`, `L050` and `L0500` all mean 0.5. 
+          - `L0<magnitude>I<interval>`: Reach the position in interval ms.
+          - `L0<magnitude>S<speed>`: Move with speed in 1/10000 of the range 
+            per 100 ms.
+          - `DSTOP`: Stop all motion.
+          - `D0`, `D1`, `D2`: Device queries.
+          - `DSAMPLE`: Request a dump of the position samples.
+          - `DCURRENT`: Request the trace of the current sensor.
+          - `DP<steps>`: Load the steps of a program, `DP+<steps>` appends
+            them. The steps must not contain whitespace, see 
+            StrokeEngine::loadProgram().
+          - `DPLOAD`, `DPSAVE`, `DPRUN`, `DPLOOP`: Program queries.
+          - `DV<hex>`: Bytecode of a pattern as hex digits, `DV+<hex>` 
+            appends, see PatternVM.
+          - `DVSET`, `DVSAVE`: Bytecode queries.
+
+          Within a line DSTOP is executed first, then the program steps, the
+          bytecode, the queries and the move.
+*/
+/**************************************************************************/
+class TCodeParser {
+
+    public:
+        /*!
+          @brief Register a callback for moves of L0.
+          @param callbackMove function with the signature 
+                        `void callbackMove(float position, unsigned long interval, float speed)`. 
+                        position is from 0.0 to 1.0, interval in ms and speed in ranges per 
+                        second. interval and speed are 0 if not given.
+        */
+        void registerMoveCallback(void(*callbackMove)(float, unsigned long, float)) { _callbackMove = callbackMove; }
+
+        /*!
+          @brief Register a callback for DSTOP.
+          @param callbackStop function with the signature `void callbackStop()`
+        */
+        void registerStopCallback(void(*callbackStop)()) { _callbackStop = callbackStop; }
+
+        /*!
+          @brief Register a callback for the device queries D0, D1, D2, DSAMPLE, DCURRENT, the program & bytecode queries.
+          @param callbackQuery function with the signature `void callbackQuery(TCodeQuery query)`
+        */
+        void registerQueryCallback(void(*callbackQuery)(TCodeQuery)) { _callbackQuery = callbackQuery; }
+
+        /*!
+          @brief Register a callback for the steps of a program sent with DP.
+          @param callbackProgram function with the signature 
+                        `void callbackProgram(const char *steps, unsigned int length, bool append)`.
+                        steps points into the line buffer and is not terminated.
+        */
+        void registerProgramCallback(void(*callbackProgram)(const char *, unsigned int, bool)) { _callbackProgram = callbackProgram; }
+
+        /*!
+          @brief Register a callback for the bytecode sent with DV.
+          @param callbackCode function with the signature 
+                        `void callbackCode(const char *hex, unsigned int length, bool append)`.
+                        hex points into the line buffer and is not terminated.
+        */
+        void registerCodeCallback(void(*callbackCode)(const char *, unsigned int, bool)) { _callbackCode = callbackCode; }
+
+        /*!
+          @brief Feed one character into the parser. A newline executes the line.
+          @param c received character
+          @return true if a command line was executed with this character
+        */
+        bool feed(char c);
+
+        //! Number of command lines executed
+        unsigned long getExecuted() { return _executed; }
+
+        //! Number of command lines discarded because they were too long or malformed
+        unsigned long getDiscarded() { return _discarded; }
+
+    protected:
+        char _line[TCODE_LINE_LENGTH];
+        unsigned int _length = 0;
+        bool _overflow = false;
+        unsigned long _executed = 0;
+        unsigned long _discarded = 0;
+        void(*_callbackMove)(float, unsigned long, float) = 0;
+        void(*_callbackStop)() = 0;
+        void(*_callbackQuery)(TCodeQuery) = 0;
+        void(*_callbackProgram)(const char *, unsigned int, bool) = 0;
+        void(*_callbackCode)(const char *, unsigned int, bool) = 0;
+        bool _execute();
+        bool _parseAxis(const char *token, unsigned int length, bool *move, float *position, unsigned long *interval, float *speed);
+        bool _parseDevice(const char *token, unsigned int length, bool *stop, unsigned int *queries, tcodePayload *program, tcodePayload *code);
+        unsigned int _parseNumber(const char *token, unsigned int length, unsigned long *value, unsigned int *digits);
+};
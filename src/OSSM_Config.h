@@ -26,6 +26,7 @@ uint8_t Remote_Address[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 #define BELT_PITCH        2         // What is the timing belt pitch in mm
 #define MAX_RPM           3000.0    // Maximum RPM of motor
 #define MAX_ACCELERATION  10000     // Maximum linear acceleration in mm/s²
+#define MAX_JERK          500000    // Maximum linear jerk in mm/s³ of patterns running S-curve profiles
 
 // This is in millimeters, and is what's used to define how much of
 // your rail is usable.
@@ -38,10 +39,28 @@ uint8_t Remote_Address[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 #define STEP_PER_MM       STEP_PER_REV / (PULLEY_TEETH * BELT_PITCH)
 #define MAX_SPEED         (MAX_RPM / 60.0) * PULLEY_TEETH * BELT_PITCH
 
+// Homing approaches the switch or hard stop fast, backs off and finds it again slowly
+#define HOMING_FAST_SPEED 50.0 // Speed of the fast approach in mm/s, 0 disables it
+#define HOMING_BACKOFF 5.0 // Distance backed off before the slow approach in mm
+#define HOMING_REMEMBER_RAIL true // Sensorless homing stores the rail in NVS and touches only the rear hard stop next time
+
 #define DEPTH_RESULTION 5 // Depth Resultion in mm per encoder Klick
 #define STROKE_RESULTION 5 // STROKE Resultion in mm per encoder Klick
 #define ENCODER_RESULTION 36 // Klicks per turn
 #define USER_SPEEDLIMIT 900 // Speed in Cycles (in & out) per minute.
+#define SPEED_RAMP 120.0 // Speed glides towards a new setting of the pot or the remote with this many SPM per second, 0 jumps
+
+/*
+        T-Code over Serial
+*/
+#define TCODE_RX_BUFFER 512 // Bytes buffered between the Serial reader and the T-Code parser
+#define SAMPLE_RATE 1000 // Actual position is sampled with this rate in Hz (500 - 2000) and dumped by DSAMPLE
+
+/*
+        Binary log over Serial
+*/
+//#define BINARY_LOG 921600 // Replaces the debug text on Serial with binary records at this baud rate, decode with tools/BinaryLogDecoder
+#define BINARY_LOG_BATCH 16 // Telemetry records logged at once
 
 // The minimum value of the pot in percent
 // prevents noisy pots registering commands when turned down to zero by user
@@ -12,6 +12,11 @@
 #include <WiFi.h>
 #include "ModbusClientRTU.h"
 #include "OneButton.h"
+#include <TCodeParser.h>       // T-Code over Serial
+#include <RingBuffer.h>
+#ifdef BINARY_LOG
+#include <BinaryLog.h>        // Binary framed records over Serial
+#endif
 
 
 #define BTN_NONE   0
@@ -92,6 +97,10 @@ struct_message incomingcontrol;
 
 esp_now_peer_info_t peerInfo;
 ModbusClientRTU MB(Serial2);
+
+#ifdef BINARY_LOG
+BinaryLog BinLog;
+#endif
 uint32_t Token = 1111;
 
 
@@ -124,6 +133,7 @@ OssmUi g_ui(REMOTE_ADDRESS, REMOTE_SDA, REMOTE_CLK);
 static motorProperties servoMotor {
   .maxSpeed = MAX_SPEED,                // Maximum speed the system can go in mm/s
   .maxAcceleration = MAX_ACCELERATION,  // Maximum linear acceleration in mm/s²
+  .maxJerk = MAX_JERK,                  // Maximum linear jerk in mm/s³
   .stepsPerMillimeter = STEP_PER_MM,    // Steps per millimeter 
   .invertDirection = true,              // One of many ways to change the direction,  
                                         // should things move the wrong way
@@ -143,12 +153,17 @@ static endstopProperties endstop = {
   .homeToBack = true,                // Endstop sits at the rear of the machine
   .activeLow = true,                  // switch is wired active low
   .endstopPin = SERVO_ENDSTOP,        // Pin number
-  .pinMode = INPUT_PULLUP             // pinmode INPUT with external pull-up resistor
+  .pinMode = INPUT_PULLUP,            // pinmode INPUT with external pull-up resistor
+  .fastSpeed = HOMING_FAST_SPEED,     // Rush towards the switch
+  .backOff = HOMING_BACKOFF           // and find it again slowly
 };
 
 static sensorlessHomeProperties sensorless = {
   .currentPin = 36,
-  .currentLimit = 1.5f
+  .currentLimit = 1.5f,
+  .fastSpeed = HOMING_FAST_SPEED,
+  .backOff = HOMING_BACKOFF,
+  .remember = HOMING_REMEMBER_RAIL
 };
 
 StrokeEngine Stroker;
@@ -162,7 +177,8 @@ StrokeEngine Stroker;
 // Uncomment the following line if you wish to print DEBUG info
 #define DEBUG 
 
-#ifdef DEBUG
+// Text would only disturb the binary log
+#if defined(DEBUG) && !defined(BINARY_LOG)
 #define LogDebug(...) Serial.println(__VA_ARGS__)
 #define LogDebugFormatted(...) Serial.printf(__VA_ARGS__)
 #else
@@ -177,6 +193,17 @@ StrokeEngine Stroker;
 TaskHandle_t estop_T    = nullptr;  // Estop Taks for Emergency 
 TaskHandle_t CRemote_T  = nullptr;  // Cable Remote Task 
 TaskHandle_t eRemote_t  = nullptr;  // Esp Now Remote
+TaskHandle_t sReader_T  = nullptr;  // Serial Reader
+TaskHandle_t tCode_T    = nullptr;  // T-Code Parser
+TaskHandle_t binLog_T   = nullptr;  // Binary Log
+
+// T-Code received over Serial
+RingBuffer<char, TCODE_RX_BUFFER> serialRxBuffer;
+TCodeParser tcode;
+unsigned long tcodeTimestamp = 0;
+float tcodePosition = 0.0;
+uint8_t tcodeCodeBuffer[VM_CODE_SIZE];   // Bytecode collected from DV lines until DVSET
+size_t tcodeCodeLength = 0;
 
 #define BRIGHTNESS 170
 #define LED_TYPE WS2811
@@ -189,6 +216,9 @@ CRGB leds[NUM_LEDS];
 void emergencyStopTask(void *pvParameters); // Handels all Higher Emergency Stop Functions
 void CableRemoteTask(void *pvParameters);  // Handels all Functions from Cable Remote
 void espNowRemoteTask(void *pvParameters); // Handels the EspNow Remote
+void serialReaderTask(void *pvParameters); // Moves received Serial data into the ring buffer
+void tcodeTask(void *pvParameters);        // Parses T-Code from the ring buffer
+void binaryLogTask(void *pvParameters);    // Logs state and telemetry of the StrokeEngine as binary records
 void setLedRainbow(CRGB leds[]);
 void almclick();
 void pedclick();
@@ -202,7 +232,7 @@ const long Heartbeat_Interval = 15000;
 // Homing Feedback Serial
 void homingNotification(bool isHomed) {
   if (isHomed) {
-    LogDebug("Found home - Ready to rumble!");
+    LogDebugFormatted("Found home after %lu ms - Ready to rumble!\n", Stroker.getHomingDuration());
     g_ui.UpdateMessage("Homed - Ready to rumble!");
 
     outgoingcontrol.esp_connected = true;
@@ -218,40 +248,152 @@ void homingNotification(bool isHomed) {
   }
 }
 
+// T-Code L0 moves are streamed into the interval [depth-stroke, depth]
+void tcodeMove(float position, unsigned long interval, float speed) {
+  // Take over a machine that is ready, but leave running patterns alone
+  if (Stroker.getState() == READY) {
+    Stroker.startStreaming();
+  }
+  if (Stroker.getState() != STREAMING) {
+    return;
+  }
+
+  // Speed suffix: derive the interval from the distance to travel
+  if ((interval == 0) && (speed > 0.0)) {
+    interval = 1000.0 * abs(position - tcodePosition) / speed;
+  }
+  tcodePosition = position;
+
+  // Timestamps must increase, even if a new command cuts the last one short
+  tcodeTimestamp = max(millis() + interval, tcodeTimestamp + 1);
+  Stroker.pushStreamPosition(tcodeTimestamp, Stroker.getDepth() - Stroker.getStroke() + position * Stroker.getStroke());
+}
+
+void tcodeStop() {
+  Stroker.stopMotion();
+}
+
+// Text would corrupt the frames of the binary log, replies go into it as text records
+void tcodeReply(const char *reply) {
+#ifdef BINARY_LOG
+  BinLog.logText(reply);
+#else
+  Serial.println(reply);
+#endif
+}
+
+void tcodeQuery(TCodeQuery query) {
+  switch (query) {
+    case TCODE_IDENTIFY:
+      tcodeReply("OSSM");
+      break;
+    case TCODE_VERSION:
+      tcodeReply("TCode v0.3");
+      break;
+    case TCODE_AXES:
+      tcodeReply("L0 0 9999 Stroke");
+      break;
+    case TCODE_SAMPLES:
+    case TCODE_CURRENT:
+#ifdef BINARY_LOG
+      // The dumps don't fit into records and must not share the port with the binary log
+      tcodeReply("error");
+#else
+      if (query == TCODE_SAMPLES) {
+        Stroker.dumpSamples();
+      } else {
+        Stroker.printCurrentTrace();
+      }
+#endif
+      break;
+    case TCODE_PROGRAM_LOAD:
+      tcodeReply(Stroker.restoreProgram() ? "ok" : "error");
+      break;
+    case TCODE_PROGRAM_SAVE:
+      tcodeReply(Stroker.saveProgram() ? "ok" : "error");
+      break;
+    case TCODE_PROGRAM_RUN:
+    case TCODE_PROGRAM_LOOP:
+      tcodeReply(Stroker.startProgram(query == TCODE_PROGRAM_LOOP) ? "ok" : "error");
+      break;
+    case TCODE_CODE_SET:
+      tcodeReply(Stroker.setPatternCode(tcodeCodeBuffer, tcodeCodeLength) ? "ok" : "error");
+      break;
+    case TCODE_CODE_SAVE:
+      tcodeReply(Stroker.savePatternCode() ? "ok" : "error");
+      break;
+  }
+}
+
+// DV replaces the bytecode collected for the pattern Custom, DV+ appends to it. DVSET hands it over.
+void tcodeCode(const char *hex, unsigned int length, bool append) {
+  if (append == false) {
+    tcodeCodeLength = 0;
+  }
+  if ((length % 2 != 0) || (tcodeCodeLength + length / 2 > sizeof(tcodeCodeBuffer))) {
+    tcodeCodeLength = 0;
+    tcodeReply("error");
+    return;
+  }
+  for (unsigned int i = 0; i < length; i += 2) {
+    char byte[3] = {hex[i], hex[i + 1], '\0'};
+    tcodeCodeBuffer[tcodeCodeLength++] = strtoul(byte, NULL, 16);
+  }
+  tcodeReply("ok");
+}
+
+// DP replaces the program, DP+ appends steps to it, so a long program fits into several lines
+void tcodeProgram(const char *steps, unsigned int length, bool append) {
+  tcodeReply(Stroker.loadProgram(steps, length, append) ? "ok" : "error");
+}
+
 // Mobus for RS232
 void handleData(ModbusMessage msg, uint32_t token){
+#ifdef BINARY_LOG
+  BinLog.logModbus(token, msg.getServerID(), msg.getFunctionCode(), 0, msg.data(), msg.size());
+#else
   Serial.printf("Response: serverID=%d, FC=%d, Token=%08X, length=%d:\n", msg.getServerID(), msg.getFunctionCode(), token, msg.size());
   for (auto& byte : msg) {
     Serial.printf("%02X ", byte);
+  }
   Serial.println("");
-}
+#endif
 }
 
 void handleError(Error error, uint32_t token){
+#ifdef BINARY_LOG
+  BinLog.logModbus(token, 0, 0, error, NULL, 0);
+#else
   // ModbusError wraps the error code and provides a readable error message for it
   ModbusError me(error);
   Serial.printf("Error response: %02X - %s\n", error, (const char *)me);
+#endif
 }
 
 // Callback when data is sent
 void OnDataSent(const uint8_t *mac_addr, esp_now_send_status_t status) {
+#ifdef BINARY_LOG
+  BinLog.logEspNow(1, status, outgoingcontrol.esp_command, outgoingcontrol.esp_value, outgoingcontrol.esp_target);
+#endif
 }
 
 // Callback when data is received
 void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
   memcpy(&incomingcontrol, incomingData, sizeof(incomingcontrol));
+#ifdef BINARY_LOG
+  BinLog.logEspNow(0, 0, incomingcontrol.esp_command, incomingcontrol.esp_value, incomingcontrol.esp_target);
+#endif
   switch(incomingcontrol.esp_target)
   {
     case OSSM_ID:
     {
     if(m5_first_connect == true && m5_remotelost == false){
-    LogDebug(incomingcontrol.esp_command);
-    LogDebug(incomingcontrol.esp_value);
+    Logger.log(LOG_LEVEL_DEBUG, "ESP-NOW command %d value %.2f", incomingcontrol.esp_command, incomingcontrol.esp_value);
     switch(incomingcontrol.esp_command)
     {
       case ON:
       {
-      LogDebug("ON Got");
+      Logger.log(LOG_LEVEL_DEBUG, "ON Got");
       Stroker.startPattern();
       outgoingcontrol.esp_command = ON;
       esp_err_t result = esp_now_send(Broadcast_Address, (uint8_t *) &outgoingcontrol, sizeof(outgoingcontrol));
@@ -259,7 +401,7 @@ void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
       break;
       case OFF:
       {
-      LogDebug("OFF Got");
+      Logger.log(LOG_LEVEL_DEBUG, "OFF Got");
       Stroker.stopMotion();
       outgoingcontrol.esp_command = OFF;
       esp_err_t result = esp_now_send(Broadcast_Address, (uint8_t *) &outgoingcontrol, sizeof(outgoingcontrol));
@@ -267,8 +409,8 @@ void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
       break;
       case SPEED:
       {
-      speed = incomingcontrol.esp_value; 
-      Stroker.setSpeed(speed, true);
+      speed = min(incomingcontrol.esp_value, Stroker.getMaxStrokeRate()); 
+      Stroker.setSpeed(speed, SPEED_RAMP <= 0);
       }
       break;
       case DEPTH:
@@ -293,13 +435,13 @@ void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
       {
       int patter = incomingcontrol.esp_value;
       Stroker.setPattern(patter, true);
-      LogDebug(Stroker.getPatternName(patter));
+      Logger.log(LOG_LEVEL_DEBUG, "Pattern %d", patter);
       }
       break;
       case TORQE_F:
       {
         int torqe = incomingcontrol.esp_value * 10;
-        LogDebug(torqe);
+        Logger.log(LOG_LEVEL_DEBUG, "Torque %d", torqe);
         Error err = MB.addRequest(Token++, 1, WRITE_HOLD_REGISTER, 0x01FE, torqe);
         if (err!=SUCCESS) {
         ModbusError e(err);
@@ -310,7 +452,7 @@ void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
       case TORQE_R:
       {
         int torqe = 65535 - (incomingcontrol.esp_value * -10);
-        LogDebug(torqe);
+        Logger.log(LOG_LEVEL_DEBUG, "Torque %d", torqe);
         Error err = MB.addRequest(Token++, 1, WRITE_HOLD_REGISTER, 0x01FF, torqe);
         if (err!=SUCCESS) {
         ModbusError e(err);
@@ -331,15 +473,24 @@ void OnDataRecv(const uint8_t * mac, const uint8_t *incomingData, int len) {
     }
     } else if(m5_first_connect == false && m5_remotelost == false && incomingcontrol.esp_command == HEARTBEAT && incomingcontrol.esp_heartbeat == true){
         m5_first_connect = true;
-        Serial.printf("Got M5 connection, restarting homeing\n");
-        Stroker.disable();
-        if (hardwareVersion >= 20)
+        if (Stroker.wasResumed() == true)
         {
-          Stroker.enableAndSensorlessHome(&sensorless, homingNotification, 10);
+          // Still homed from before the reset, tell the remote
+          Logger.log(LOG_LEVEL_INFO, "Got M5 connection, resumed homing");
+          homingNotification(true);
         }
         else
         {
-          Stroker.enableAndHome(&endstop, homingNotification); // pointer to the homing config struct
+          Logger.log(LOG_LEVEL_INFO, "Got M5 connection, restarting homeing");
+          Stroker.disable();
+          if (hardwareVersion >= 20)
+          {
+            Stroker.enableAndSensorlessHome(&sensorless, homingNotification, 10);
+          }
+          else
+          {
+            Stroker.enableAndHome(&endstop, homingNotification); // pointer to the homing config struct
+          }
         }
     }
   }
@@ -367,7 +518,20 @@ void readEepromSettings() {
 }
 
 void setup() {
+#ifdef BINARY_LOG
+  Serial.begin(BINARY_LOG);     // Start Serial fast enough for the binary log.
+  BinLog.begin(&Serial);
+#else
   Serial.begin(115200);         // Start Serial.
+#endif
+
+  // Hot paths log through the deferred logger, text would only disturb the binary log
+#ifdef BINARY_LOG
+  Logger.setLevel(LOG_LEVEL_NONE);
+#elif defined(DEBUG)
+  Logger.setLevel(LOG_LEVEL_DEBUG);
+#endif
+  Logger.begin();
   Serial2.begin(57600, SERIAL_8E1, GPIO_NUM_16, GPIO_NUM_17);
   LogDebug("\n Starting");      // Start LogDebug
   delay(200);
@@ -410,7 +574,17 @@ void setup() {
   Serial.printf("useSensorlessHoming: %s\n", hardwareVersion >= 20 ? "yes" : "no");
 
   Stroker.begin(&strokingMachine, &servoMotor); // Setup Stroke Engine
-  if (hardwareVersion >= 20)
+  Stroker.startSampler(SAMPLE_RATE);            // Record the actual trajectory for DSAMPLE
+  Stroker.setRamp(RAMP_SPEED, SPEED_RAMP);      // The pot and the remote set a target, the speed follows stroke by stroke
+  Stroker.restoreProgram();                     // Program stored with DPSAVE, played with DPRUN
+  Stroker.restorePatternCode();                 // Bytecode of the pattern Custom stored with DVSAVE
+  if (Stroker.wasResumed() == true)
+  {
+    // Soft reset with the servo enabled and standing still, the homed position survived in RTC memory
+    LogDebug("Resumed homed position");
+    g_ui.UpdateMessage("Resumed - Ready to rumble!");
+  }
+  else if (hardwareVersion >= 20)
   {
     Stroker.enableAndSensorlessHome(&sensorless, homingNotification, 10);
   }
@@ -446,6 +620,39 @@ void setup() {
                             &eRemote_t,         /* Task handle to keep track of created task */
                             0);                 /* pin task to core 0 */
   delay(100);
+
+  tcode.registerMoveCallback(tcodeMove);
+  tcode.registerStopCallback(tcodeStop);
+  tcode.registerQueryCallback(tcodeQuery);
+  tcode.registerProgramCallback(tcodeProgram);
+  tcode.registerCodeCallback(tcodeCode);
+
+  xTaskCreatePinnedToCore(tcodeTask,            /* Task function. */
+                            "tcodeTask",        /* name of task. */
+                            4096,               /* Stack size of task */
+                            NULL,               /* parameter of the task */
+                            4,                  /* priority of the task */
+                            &tCode_T,           /* Task handle to keep track of created task */
+                            0);                 /* pin task to core 0 */
+
+  xTaskCreatePinnedToCore(serialReaderTask,     /* Task function. */
+                            "serialReaderTask", /* name of task. */
+                            2048,               /* Stack size of task */
+                            NULL,               /* parameter of the task */
+                            6,                  /* priority of the task */
+                            &sReader_T,         /* Task handle to keep track of created task */
+                            0);                 /* pin task to core 0 */
+  delay(100);
+
+#ifdef BINARY_LOG
+  xTaskCreatePinnedToCore(binaryLogTask,        /* Task function. */
+                            "binaryLogTask",    /* name of task. */
+                            2048,               /* Stack size of task */
+                            NULL,               /* parameter of the task */
+                            1,                  /* priority of the task */
+                            &binLog_T,          /* Task handle to keep track of created task */
+                            0);                 /* pin task to core 0 */
+#endif
   
 
   if(!g_ui.DisplayIsConnected()){
@@ -797,13 +1004,17 @@ void CableRemoteTask(void *pvParameters)
           }
           break;
     }
-     speed = getAnalogAverage(SPEED_POT_PIN, 200); // get average analog reading, function takes pin and # samples
-     g_ui.UpdateStateL(speed);
-     //LogDebug(speed);
-     speed = fscale(0.00, 99.98, 0.5, USER_SPEEDLIMIT, speed, -1);
-     //LogDebug(speed);
-     
-     Stroker.setSpeed(speed, true);
+     // Sensorless homing samples ADC1 with DMA, reading the pot meanwhile would disturb it
+     if (Stroker.getState() != UNDEFINED) {
+       speed = getAnalogAverage(SPEED_POT_PIN, 200); // get average analog reading, function takes pin and # samples
+       g_ui.UpdateStateL(speed);
+       //LogDebug(speed);
+       // Cap the range of the pot to what the pattern can do, so the engine doesn't have to clip
+       speed = fscale(0.00, 99.98, 0.5, min(float(USER_SPEEDLIMIT), Stroker.getMaxStrokeRate()), speed, -1);
+       //LogDebug(speed);
+       
+       Stroker.setSpeed(speed, SPEED_RAMP <= 0);
+     }
      vTaskDelay(100);
    }
 }
@@ -844,6 +1055,74 @@ void espNowRemoteTask(void *pvParameters)
     }
 }
 
+void serialReaderTask(void *pvParameters)
+{
+    for(;;)
+    {
+      // Drain the UART quickly, parsing happens in tcodeTask
+      bool received = false;
+      while (Serial.available() > 0 && !serialRxBuffer.isFull())
+      {
+        serialRxBuffer.push(Serial.read());
+        received = true;
+      }
+      if (received)
+      {
+        xTaskNotifyGive(tCode_T);
+      }
+      vTaskDelay(1);
+    }
+}
+
+void tcodeTask(void *pvParameters)
+{
+    char c;
+    for(;;)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      while (serialRxBuffer.pop(c))
+      {
+        tcode.feed(c);
+      }
+    }
+}
+
+#ifdef BINARY_LOG
+void binaryLogTask(void *pvParameters)
+{
+    telemetryRecord records[BINARY_LOG_BATCH];
+    ServoState lastState = UNDEFINED;
+    BinLog.logState(lastState);
+
+    for(;;)
+    {
+      ServoState state = Stroker.getState();
+      if (state != lastState)
+      {
+        BinLog.logState(state);
+        lastState = state;
+      }
+
+      // Drain the telemetry of the StrokeEngine
+      unsigned int count = Stroker.readTelemetry(records, BINARY_LOG_BATCH);
+      for (unsigned int i = 0; i < count; i++)
+      {
+        BinLog.logMotion(records[i].timestamp, records[i].target, records[i].speed, records[i].acceleration,
+          records[i].deficit, records[i].index, records[i].pattern, records[i].clipping);
+        if (records[i].clipping)
+        {
+          BinLog.logClipping(records[i].timestamp, records[i].speed, records[i].acceleration, records[i].deficit,
+            records[i].index, records[i].pattern);
+        }
+      }
+      if (count < BINARY_LOG_BATCH)
+      {
+        vTaskDelay(20);
+      }
+    }
+}
+#endif
+
 float getAnalogAverage(int pinNumber, int samples)
 {
     float sum = 0;
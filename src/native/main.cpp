@@ -0,0 +1,391 @@
+/*
+    StrokeEngine on the PC
+
+    Runs the StrokeEngine of the OSSM against the Simulator: a simulated
+    servo, homing switch and a virtual clock running faster than real time.
+    Homes the machine, runs every pattern for a while and reports the stroke
+    rate it achieved and how long a mid-stroke update takes to take effect.
+    With "sensorless" the machine homes against the hard stops by the
+    current sensor instead and the trace of the current around the last
+    hard stop is written to the given file for tools/CurrentReplay. It
+    homes a second time from the front end of the rail like after a warm
+    boot, which only touches the rear hard stop with the stored rail.
+    Finally the ESP32 restarts by software and the engine resumes the homed
+    position from RTC memory without homing. After all patterns the speed
+    is doubled once with a speed ramp and the stroke rate is reported as it
+    glides to the new speed. Then a program is stored in NVS, restored and
+    played by the sequencer, which reports when each step starts, while a
+    control task holds the parameter mutex most of the time. The step queue
+    must not run empty meanwhile.
+    With "twist" a second StrokeEngine drives a twist axis at the same
+    speed, both locked to a shared StrokeClock, and the CPU time and the
+    phase error of both axes are reported per pattern.
+
+    pio run -e native && .pio/build/native/program [speed in SPM] [seconds per pattern] [sensorless [trace.csv] | twist]
+*/
+
+#include <Arduino.h>
+#include <Simulator.h>
+#include <FastAccelStepper.h>
+#include <StrokeEngine.h>
+#include "../OSSM_Config.h"
+#include "../OSSM_PinDEF.h"
+
+#define SIM_SAMPLE_MS       1       // Sample period of the carriage position in ms
+#define SIM_SETTLE_MS       2000    // Time a pattern runs before the measurement starts in ms
+#define SIM_REVERSAL_MM     0.5     // Hysteresis to detect a stroke reversal in mm
+#define SIM_UPDATE_MM       20.0    // Depth change of the mid-stroke update in mm
+#define SIM_RAMP_SPM        10.0    // Speed ramp in SPM per second
+#define SIM_RAMP_WINDOW_MS  3000    // Stroke rate is measured over this window while ramping
+#define SIM_PROGRAM         "0,4x,60,150,100,0; 2,6s,90,150,80,0,glide; 1,5x,120,140,60,50; 0,4s,60,150,100,0,glide"
+#define SIM_HOLD_MS         50      // A control task holds the parameter mutex this long while the program plays
+#define SIM_TWIST_PULSE     25      // Pins of the twist axis, unused on the OSSM
+#define SIM_TWIST_DIR       33
+#define SIM_TWIST_ENABLE    32
+#define SIM_TWIST_ENDSTOP   13
+#define SIM_TWIST_TRAVEL    90.0    // Travel of the twist axis in mm of the belt
+
+static motorProperties servoMotor {
+  .maxSpeed = MAX_SPEED,
+  .maxAcceleration = MAX_ACCELERATION,
+  .maxJerk = MAX_JERK,
+  .stepsPerMillimeter = (STEP_PER_MM),
+  .invertDirection = true,
+  .enableActiveLow = true,
+  .stepPin = SERVO_PULSE,
+  .directionPin = SERVO_DIR,
+  .enablePin = SERVO_ENABLE
+};
+
+static machineGeometry strokingMachine = {
+  .physicalTravel = MAX_STROKEINMM,
+  .keepoutBoundary = STROKEBOUNDARY
+};
+
+static endstopProperties endstop = {
+  .homeToBack = true,
+  .activeLow = true,
+  .endstopPin = SERVO_ENDSTOP,
+  .pinMode = INPUT_PULLUP,
+  .fastSpeed = HOMING_FAST_SPEED,
+  .backOff = HOMING_BACKOFF
+};
+
+static sensorlessHomeProperties sensorless = {
+  .currentPin = 36,
+  .currentLimit = 1.5f,
+  .fastSpeed = HOMING_FAST_SPEED,
+  .backOff = HOMING_BACKOFF,
+  .remember = HOMING_REMEMBER_RAIL
+};
+
+// Rail of the OSSM with the carriage somewhere in the middle at power up
+static simulatedAxis rail = {
+  .stepPin = SERVO_PULSE,
+  .railLength = int32_t(MAX_STROKEINMM * (STEP_PER_MM)),
+  .startPosition = int32_t(MAX_STROKEINMM * (STEP_PER_MM) / 2),
+  .endstopPin = SERVO_ENDSTOP,
+  .endstopActiveLow = true,
+  .endstopAtFront = false,
+  .endstopTravel = int32_t(1.0 * (STEP_PER_MM)),
+  .currentPin = -1
+};
+
+static motorProperties twistMotor {
+  .maxSpeed = MAX_SPEED,
+  .maxAcceleration = MAX_ACCELERATION,
+  .maxJerk = MAX_JERK,
+  .stepsPerMillimeter = (STEP_PER_MM),
+  .invertDirection = true,
+  .enableActiveLow = true,
+  .stepPin = SIM_TWIST_PULSE,
+  .directionPin = SIM_TWIST_DIR,
+  .enablePin = SIM_TWIST_ENABLE
+};
+
+static machineGeometry twistMachine = {
+  .physicalTravel = SIM_TWIST_TRAVEL,
+  .keepoutBoundary = STROKEBOUNDARY
+};
+
+static endstopProperties twistEndstop = {
+  .homeToBack = true,
+  .activeLow = true,
+  .endstopPin = SIM_TWIST_ENDSTOP,
+  .pinMode = INPUT_PULLUP,
+  .fastSpeed = HOMING_FAST_SPEED,
+  .backOff = HOMING_BACKOFF
+};
+
+static simulatedAxis twistRail = {
+  .stepPin = SIM_TWIST_PULSE,
+  .railLength = int32_t(SIM_TWIST_TRAVEL * (STEP_PER_MM)),
+  .startPosition = int32_t(SIM_TWIST_TRAVEL * (STEP_PER_MM) / 3),
+  .endstopPin = SIM_TWIST_ENDSTOP,
+  .endstopActiveLow = true,
+  .endstopAtFront = false,
+  .endstopTravel = int32_t(1.0 * (STEP_PER_MM)),
+  .currentPin = -1
+};
+
+StrokeEngine Stroker;
+StrokeEngine Twist;
+StrokeClock Beat;
+
+static volatile bool holdParameters = false;
+
+// A control task losing the CPU inside each setter. The stroking task must never wait for it.
+static void holdParameterMutex(void *parameter) {
+  Simulator.setMutexHold(SIM_HOLD_MS * 1000);
+  while (holdParameters == true) {
+    Stroker.setUpdateLatency(Stroker.getUpdateLatency());
+    vTaskDelay(1);
+  }
+  Simulator.setMutexHold(0);
+  vTaskDelete(NULL);
+}
+
+static float measureStrokeRate(unsigned long duration) {
+  float lastExtreme = Stroker.getDepth();
+  float position;
+  int direction = 0;
+  unsigned int reversals = 0;
+  int64_t firstReversal = -1;
+  int64_t lastReversal = -1;
+  int64_t end = Simulator.getTime() + (int64_t)duration * 1000;
+
+  // Count stroke reversals with a little hysteresis against the step resolution
+  while (Simulator.getTime() < end) {
+    vTaskDelay(SIM_SAMPLE_MS / portTICK_PERIOD_MS);
+    position = Simulator.getPhysicalPosition(SERVO_PULSE) / float(STEP_PER_MM);
+
+    if ((direction >= 0) && (position > lastExtreme)) {
+      direction = 1;
+      lastExtreme = position;
+    } else if ((direction <= 0) && (position < lastExtreme)) {
+      direction = -1;
+      lastExtreme = position;
+    } else if (abs(position - lastExtreme) > SIM_REVERSAL_MM) {
+      direction = -direction;
+      lastExtreme = position;
+      reversals++;
+      lastReversal = Simulator.getTime();
+      if (firstReversal < 0) {
+        firstReversal = lastReversal;
+      }
+    }
+  }
+
+  // Two reversals per stroke
+  if (reversals < 3) {
+    return 0.0;
+  }
+  return 60.0e6 * (reversals - 1) / 2.0 / (lastReversal - firstReversal);
+}
+
+static float measureUpdateLatency() {
+  FastAccelStepper *stepper = Simulator.getStepper(SERVO_PULSE);
+  int64_t request = Simulator.getTime();
+
+  // Motion written to the step queue after the update reflects the new depth
+  Stroker.setDepth(Stroker.getDepth() - SIM_UPDATE_MM, true);
+  vTaskDelay(100 / portTICK_PERIOD_MS);
+  int64_t effective = stepper->getQueueStartAfter(request);
+  Stroker.setDepth(Stroker.getDepth() + SIM_UPDATE_MM, true);
+
+  return (effective >= 0) ? (effective - request) / 1000.0 : -1.0;
+}
+
+void setup() {
+  float speed = (Simulator.argc > 1) ? atof(Simulator.argv[1]) : 60.0;
+  unsigned long duration = (Simulator.argc > 2) ? atol(Simulator.argv[2]) * 1000 : 10000;
+  bool useSensorless = (Simulator.argc > 3) && (strcmp(Simulator.argv[3], "sensorless") == 0);
+  bool useTwist = (Simulator.argc > 3) && (strcmp(Simulator.argv[3], "twist") == 0);
+
+  Serial.begin(115200);
+  if (useSensorless == true) {
+    rail.endstopPin = -1;
+    rail.currentPin = sensorless.currentPin;
+  }
+  Simulator.attachAxis(&rail);
+
+  Stroker.begin(&strokingMachine, &servoMotor);
+  Stroker.startSampler(SAMPLE_RATE);
+  if (useSensorless == true) {
+    Stroker.enableAndSensorlessHome(&sensorless, 10);
+  } else {
+    Stroker.enableAndHome(&endstop);
+  }
+  while (Stroker.getState() == UNDEFINED) {
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+  }
+  if (Stroker.getState() != READY) {
+    Serial.println("Homing failed");
+    exit(1);
+  }
+  Serial.printf("Homed after %.2f s, homing took %lu ms\n", Simulator.getTime() / 1.0e6, Stroker.getHomingDuration());
+  if (useSensorless == true) {
+    currentSensorStatistics current = Stroker.getCurrentSensorStatistics();
+    Serial.printf("Current sensor detected %lu hard stops in %lu samples, offset %.2f %%, last one after %lu us%s\n",
+      current.events, current.samples, current.offset, current.latencyMicros, current.early ? " by slope" : "");
+    Serial.printf("Rail length %.1f mm, simulated %.1f mm\n", strokingMachine.physicalTravel, rail.railLength / float(STEP_PER_MM));
+
+    // Trace for tools/CurrentReplay
+    if (Simulator.argc > 4) {
+      FILE *trace = fopen(Simulator.argv[4], "w");
+      if (trace != NULL) {
+        Serial.setOutput(trace);
+        Stroker.printCurrentTrace();
+        Serial.setOutput(stdout);
+        fclose(trace);
+      }
+    }
+  }
+
+  if (useSensorless == true) {
+    // Warm boot with the carriage at the far end, the rail is known from NVS by now
+    Stroker.moveToMax(50.0);
+    vTaskDelay(5000 / portTICK_PERIOD_MS);
+    int64_t start = Simulator.getTime();
+    Stroker.disable();
+    Stroker.enableAndSensorlessHome(&sensorless, 10);
+    while (Stroker.getState() == UNDEFINED) {
+      vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    if (Stroker.getState() != READY) {
+      Serial.println("Warm homing failed");
+      exit(1);
+    }
+    Serial.printf("Warm homing after %.2f s, homing took %lu ms, rail length %.1f mm\n", (Simulator.getTime() - start) / 1.0e6,
+      Stroker.getHomingDuration(), strokingMachine.physicalTravel);
+  }
+
+  // Soft reset once the servo stands still, the position survives in RTC memory
+  vTaskDelay(3000 / portTICK_PERIOD_MS);
+  int64_t reset = Simulator.getTime();
+  Simulator.setResetReason(ESP_RST_SW);
+  Stroker.begin(&strokingMachine, &servoMotor);
+  Stroker.startSampler(SAMPLE_RATE);
+  if (Stroker.wasResumed() == false) {
+    Serial.println("Resume after soft reset failed");
+    exit(1);
+  }
+  Serial.printf("Resumed after soft reset in %.1f ms at %.2f mm, carriage at %.2f mm\n", (Simulator.getTime() - reset) / 1.0e3,
+    Simulator.getStepper(SERVO_PULSE)->getCurrentPosition() / float(STEP_PER_MM),
+    Simulator.getPhysicalPosition(SERVO_PULSE) / float(STEP_PER_MM) - STROKEBOUNDARY);
+
+  Stroker.setDepth(MAX_STROKEINMM - 2 * STROKEBOUNDARY, false);
+  Stroker.setStroke((MAX_STROKEINMM - 2 * STROKEBOUNDARY) / 2, false);
+  Stroker.setSpeed(speed, false);
+
+  if (useTwist == true) {
+    // Second axis on the same FastAccelStepperEngine, both strokes start on the beats of one clock
+    Simulator.attachAxis(&twistRail);
+    Twist.begin(&twistMachine, &twistMotor);
+    Twist.enableAndHome(&twistEndstop);
+    while (Twist.getState() == UNDEFINED) {
+      vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+    if (Twist.getState() != READY) {
+      Serial.println("Homing the twist axis failed");
+      exit(1);
+    }
+    Serial.printf("Twist axis homed, homing took %lu ms\n", Twist.getHomingDuration());
+    Twist.setDepth(SIM_TWIST_TRAVEL - 2 * STROKEBOUNDARY, false);
+    Twist.setStroke((SIM_TWIST_TRAVEL - 2 * STROKEBOUNDARY) / 2, false);
+    Twist.setSpeed(speed, false);
+    Twist.setPattern(0, false);
+    Stroker.setTimeBase(&Beat);
+    Twist.setTimeBase(&Beat);
+  }
+
+  Serial.println("Pattern, Commanded SPM, Achieved SPM, Update Latency ms, Dead Time us, Lost Steps");
+  for (unsigned int i = 0; i < Stroker.getNumberOfPattern(); i++) {
+    Stroker.setPattern(i, false);
+    Stroker.startPattern();
+    if (useTwist == true) {
+      Twist.startPattern();
+    }
+    vTaskDelay(SIM_SETTLE_MS / portTICK_PERIOD_MS);
+    Stroker.resetDeadTimeStatistics();
+    Stroker.resetAxisStatistics();
+    Twist.resetAxisStatistics();
+
+    float rate = measureStrokeRate(duration);
+    float latency = measureUpdateLatency();
+    deadTimeStatistics deadTime = Stroker.getDeadTimeStatistics();
+    Stroker.stopMotion();
+
+    Serial.printf("%s, %.1f, %.1f, %.1f, %.1f, %u\n", Stroker.getPatternName(i).c_str(), speed, rate, latency,
+      deadTime.averageMicros, Simulator.getLostSteps(SERVO_PULSE));
+    if (useTwist == true) {
+      axisStatistics stroke = Stroker.getAxisStatistics();
+      axisStatistics twist = Twist.getAxisStatistics();
+      Twist.stopMotion();
+      Serial.printf("  stroke axis %.1f us per wakeup, %.2f %% load, %u beats %.0f us off on average, %.0f us at most\n",
+        stroke.averageMicros, stroke.load, stroke.beats, stroke.averagePhaseMicros, stroke.maximumPhaseMicros);
+      Serial.printf("  twist axis %.1f us per wakeup, %.2f %% load, %u beats %.0f us off on average, %.0f us at most, %u lost steps\n",
+        twist.averageMicros, twist.load, twist.beats, twist.averagePhaseMicros, twist.maximumPhaseMicros,
+        Simulator.getLostSteps(SIM_TWIST_PULSE));
+    }
+  }
+
+  // A single target, the speed follows stroke by stroke
+  Stroker.setPattern(0, false);
+  Stroker.setSpeed(speed, false);
+  Stroker.startPattern();
+  vTaskDelay(SIM_SETTLE_MS / portTICK_PERIOD_MS);
+  Stroker.setRamp(RAMP_SPEED, SIM_RAMP_SPM);
+  Stroker.setSpeed(2 * speed, false);
+  Serial.printf("Speed ramp from %.1f to %.1f SPM at %.1f SPM/s:", speed, 2 * speed, SIM_RAMP_SPM);
+  for (unsigned int i = 0; i < 2 + speed / SIM_RAMP_SPM * 1000 / SIM_RAMP_WINDOW_MS; i++) {
+    Serial.printf(" %.1f", measureStrokeRate(SIM_RAMP_WINDOW_MS));
+  }
+  Serial.println(" SPM");
+  Stroker.stopMotion();
+  Stroker.setRamp(RAMP_SPEED, 0.0);
+
+  // Played by the stroking task, pattern switches at stroke boundaries don't stop the machine
+  if ((Stroker.loadProgram(SIM_PROGRAM, strlen(SIM_PROGRAM)) == false) || (Stroker.saveProgram() == false)) {
+    Serial.println("Loading the program failed");
+    exit(1);
+  }
+  Stroker.loadProgram(SIM_PROGRAM, 0);
+  if ((Stroker.restoreProgram() == false) || (Stroker.startProgram() == false)) {
+    Serial.println("Starting the program from NVS failed");
+    exit(1);
+  }
+  Stroker.resetDeadTimeStatistics();
+  holdParameters = true;
+  xTaskCreate(holdParameterMutex, "holdParameters", 2048, NULL, 1, NULL);
+  int64_t programStart = Simulator.getTime();
+  int step = -2;
+  while (Stroker.getProgramStep() >= 0) {
+    if (Stroker.getProgramStep() != step) {
+      step = Stroker.getProgramStep();
+      Serial.printf("Program step %d of %u at %.2f s: %s, %.1f SPM\n", step, Stroker.getProgramLength(), 
+        (Simulator.getTime() - programStart) / 1.0e6, Stroker.getPatternName(Stroker.getPattern()).c_str(), Stroker.getSpeed());
+    }
+    vTaskDelay(SIM_SAMPLE_MS / portTICK_PERIOD_MS);
+  }
+  deadTimeStatistics programDeadTime = Stroker.getDeadTimeStatistics();
+  Serial.printf("Program ended after %.2f s, %u moves, %lu us dead time at most\n", (Simulator.getTime() - programStart) / 1.0e6,
+    programDeadTime.moves, programDeadTime.maximumMicros);
+  holdParameters = false;
+  vTaskDelay(2 * SIM_HOLD_MS / portTICK_PERIOD_MS);
+  if (programDeadTime.maximumMicros > 0) {
+    Serial.printf("Step queue ran empty while the parameter mutex was held for %d ms\n", SIM_HOLD_MS);
+    exit(1);
+  }
+  Stroker.stopMotion();
+
+  samplerStatistics sampler = Stroker.getSamplerStatistics();
+  Serial.printf("Sampler at %.0f Hz took %lu samples, %.1f us each, %.2f %% load\n", sampler.rate, sampler.samples,
+    sampler.averageMicros, sampler.load);
+  Serial.printf("Simulated %.1f s\n", Simulator.getTime() / 1.0e6);
+  Serial.flush();
+  exit(0);
+}
+
+void loop() {
+}
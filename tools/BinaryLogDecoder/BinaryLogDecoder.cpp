@@ -0,0 +1,190 @@
+/**
+ *   Binary Log Decoder
+ *   Host side decoder of the binary log of the OSSM. Splits a capture of the
+ *   serial port into frames, checks their CRC and writes the records as CSV.
+ *   Text printed between the frames is skipped.
+ *
+ *   Build & run from the repository root:
+ *     g++ -O2 -Ilib/BinaryLog/src tools/BinaryLogDecoder/BinaryLogDecoder.cpp lib/BinaryLog/src/BinaryFrame.cpp -o binlog_decoder
+ *     ./binlog_decoder [capture.bin] [state|motion|clipping|modbus|espnow|text]
+ *
+ *   Without a file the capture is read from stdin, e.g. from a serial port
+ *   set up with stty. Without a record type all records are written with the
+ *   columns of all types, the ones which don't apply left empty. Timestamps
+ *   are unwrapped to µs relative to the first record. Statistics about the frames
+ *   go to stderr.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#include <BinaryFrame.h>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static const char *typeNames[] = {"", "state", "motion", "clipping", "modbus", "espnow", "text"};
+#define TYPE_COUNT  (sizeof(typeNames) / sizeof(typeNames[0]))
+
+static unsigned long frames = 0;
+static unsigned long crcErrors = 0;
+static unsigned long malformed = 0;
+static unsigned long lost = 0;
+static int filter = 0;
+static bool synced = false;
+static uint8_t lastSequence = 0;
+static uint32_t lastTimestamp = 0;
+static int64_t timestamp = 0;
+
+template <typename T> static bool payloadOf(const uint8_t *packet, size_t length, T *record, size_t minLength = sizeof(T)) {
+    size_t payload = length - sizeof(binlogHeader);
+    if ((payload < minLength) || (payload > sizeof(T))) {
+        return false;
+    }
+    memset(record, 0, sizeof(T));
+    memcpy(record, &packet[sizeof(binlogHeader)], payload);
+    return true;
+}
+
+static void printRecord(const uint8_t *packet, size_t length) {
+    binlogHeader header;
+    memcpy(&header, packet, sizeof(header));
+    if ((header.type == 0) || (header.type >= TYPE_COUNT)) {
+        malformed++;
+        return;
+    }
+
+    // Frames got lost on the way if the sequence jumps
+    if (synced == true) {
+        lost += (uint8_t)(header.sequence - lastSequence - 1);
+        // Records may be logged slightly out of order, moves are stamped with their planned start
+        timestamp += (int32_t)(header.timestamp - lastTimestamp);
+    }
+    synced = true;
+    lastSequence = header.sequence;
+    lastTimestamp = header.timestamp;
+    frames++;
+
+    if ((filter != 0) && (filter != header.type)) {
+        return;
+    }
+
+    // timestamp_us,record,sequence,state,target,speed,acceleration,deficit,index,pattern,clipping,
+    // token,server,function,error,length,data,direction,status,command,value,receiver,text
+    char line[512];
+    int n = snprintf(line, sizeof(line), "%lld,%s,%u,", (long long)timestamp, typeNames[header.type], header.sequence);
+    switch (header.type) {
+        case BINLOG_STATE: {
+            binlogState r;
+            if (!payloadOf(packet, length, &r)) { malformed++; return; }
+            snprintf(&line[n], sizeof(line) - n, "%u,,,,,,,,,,,,,,,,,,,", r.state);
+            break;
+        }
+        case BINLOG_MOTION: {
+            binlogMotion r;
+            if (!payloadOf(packet, length, &r)) { malformed++; return; }
+            snprintf(&line[n], sizeof(line) - n, ",%.3f,%.3f,%.1f,%.4f,%d,%d,%u,,,,,,,,,,,,", r.target, r.speed,
+                r.acceleration, r.deficit, r.index, r.pattern, r.clipping);
+            break;
+        }
+        case BINLOG_CLIPPING: {
+            binlogClipping r;
+            if (!payloadOf(packet, length, &r)) { malformed++; return; }
+            snprintf(&line[n], sizeof(line) - n, ",,%.3f,%.1f,%.4f,%d,%d,1,,,,,,,,,,,,", r.speed, r.acceleration,
+                r.deficit, r.index, r.pattern);
+            break;
+        }
+        case BINLOG_MODBUS: {
+            binlogModbus r;
+            if (!payloadOf(packet, length, &r, sizeof(r) - BINLOG_MODBUS_DATA)) { malformed++; return; }
+            size_t logged = length - sizeof(binlogHeader) - (sizeof(r) - BINLOG_MODBUS_DATA);
+            char data[3 * BINLOG_MODBUS_DATA + 1] = "";
+            size_t used = 0;
+            for (size_t i = 0; i < logged; i++) {
+                used += snprintf(&data[used], sizeof(data) - used, (i == 0) ? "%02X" : " %02X", r.data[i]);
+            }
+            snprintf(&line[n], sizeof(line) - n, ",,,,,,,,%u,%u,%u,%u,%u,%s,,,,,,", r.token, r.server, r.function,
+                r.error, r.length, data);
+            break;
+        }
+        case BINLOG_ESPNOW: {
+            binlogEspNow r;
+            if (!payloadOf(packet, length, &r)) { malformed++; return; }
+            snprintf(&line[n], sizeof(line) - n, ",,,,,,,,,,,,,,%u,%u,%d,%.3f,%d,", r.direction, r.status, r.command,
+                r.value, r.target);
+            break;
+        }
+        case BINLOG_TEXT: {
+            binlogText r;
+            if (!payloadOf(packet, length, &r, 0)) { malformed++; return; }
+            // Quoted for CSV, quotes inside are doubled
+            size_t used = n + snprintf(&line[n], sizeof(line) - n, ",,,,,,,,,,,,,,,,,,,\"");
+            for (size_t i = 0; i < length - sizeof(binlogHeader); i++) {
+                if (r.text[i] == '"') {
+                    line[used++] = '"';
+                }
+                line[used++] = r.text[i];
+            }
+            snprintf(&line[used], sizeof(line) - used, "\"");
+            break;
+        }
+    }
+    puts(line);
+}
+
+static void decodeFrame(const uint8_t *frame, size_t length) {
+    uint8_t packet[BINLOG_MAX_PACKET];
+
+    // Empty frames are just consecutive delimiters
+    if (length == 0) {
+        return;
+    }
+    size_t packetLength = (length <= BINLOG_MAX_FRAME) ? binlogDecode(frame, length, packet, sizeof(packet)) : 0;
+    if (packetLength < sizeof(binlogHeader) + 2) {
+        crcErrors++;
+        return;
+    }
+    uint16_t crc = packet[packetLength - 2] | (packet[packetLength - 1] << 8);
+    if (binlogCrc(packet, packetLength - 2) != crc) {
+        crcErrors++;
+        return;
+    }
+    printRecord(packet, packetLength - 2);
+}
+
+int main(int argc, char **argv) {
+    FILE *input = stdin;
+
+    for (int i = 1; i < argc; i++) {
+        int type = 0;
+        for (unsigned int t = 1; t < TYPE_COUNT; t++) {
+            if (strcmp(argv[i], typeNames[t]) == 0) {
+                type = t;
+            }
+        }
+        if (type != 0) {
+            filter = type;
+        } else if ((input = fopen(argv[i], "rb")) == NULL) {
+            fprintf(stderr, "Can't open %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    puts("timestamp_us,record,sequence,state,target,speed,acceleration,deficit,index,pattern,clipping,"
+        "token,server,function,error,length,data,direction,status,command,value,receiver,text");
+
+    // Everything up to a delimiter is one frame
+    std::vector<uint8_t> frame;
+    int c;
+    while ((c = fgetc(input)) != EOF) {
+        if (c == 0) {
+            decodeFrame(frame.data(), frame.size());
+            frame.clear();
+        } else if (frame.size() <= BINLOG_MAX_FRAME) {
+            frame.push_back(c);
+        }
+    }
+
+    fprintf(stderr, "frames: %lu, lost: %lu, crc errors or text: %lu, malformed: %lu\n", frames, lost, crcErrors, malformed);
+    return 0;
+}
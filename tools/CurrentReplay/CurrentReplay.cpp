@@ -0,0 +1,240 @@
+/**
+ *   Current Replay
+ *   Host side replay of current traces through the CurrentDetector of the
+ *   StrokeEngine. Measures how long after the onset of a hard stop the
+ *   detector fires, to tune the filters and the limit of sensorless homing
+ *   without crashing the machine into its hard stops again and again.
+ *
+ *   Build & run from the repository root:
+ *     g++ -O2 -Ilib/StrokeEngine/src tools/CurrentReplay/CurrentReplay.cpp lib/StrokeEngine/src/CurrentDetector.cpp -o current_replay
+ *     ./current_replay [trace.csv] [limit in %] [filtered]
+ *
+ *   A trace is what the T-Code query DCURRENT prints on the OSSM, or the
+ *   native simulation writes with "sensorless": a comment line with the
+ *   settings of the detector followed by the columns micros and raw. An
+ *   optional third column stall, 1 while the carriage pushes against the
+ *   hard stop, marks the true onset. Without it the onset is estimated as
+ *   the last sample before the detection which is within the noise of the
+ *   offset. Without a file the trace is read from stdin, without a limit
+ *   the one of the trace is used.
+ *
+ *   For each event a CSV line is written with the onset, the detection and
+ *   the time the filtered current alone would have reached the limit, all
+ *   in µs. On the device the detection waits for the DMA buffer to complete,
+ *   which adds up to a buffer of samples. With "filtered" the samples
+ *   are written with the filtered current instead, e.g. for plotting.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#include <CurrentDetector.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#define REPLAY_NOISE_SIGMAS     3.0     // Readings within this many standard deviations of the offset are noise
+#define REPLAY_MEDIAN_TAPS      5       // Centered median smoothing the trace for the onset estimate
+
+typedef struct {
+    long micros;
+    int raw;
+    int stall;                  // -1 if the trace has no ground truth
+} replaySample;
+
+static float rate = 20000.0;
+static float offset = -1.0;
+static float limit = -1.0;
+static long bufferSamples = 0;
+static long deviceTrigger = -1;
+
+static void parseSettings(const char *line) {
+    // "# rate 20000 buffer 32 offset 100.2 limit 61.4 trigger 50350", each pair is optional
+    char key[32];
+    double value;
+    int consumed;
+    line++;
+    while (sscanf(line, "%31s %lf%n", key, &value, &consumed) == 2) {
+        if (strcmp(key, "rate") == 0) {
+            rate = value;
+        } else if (strcmp(key, "buffer") == 0) {
+            bufferSamples = (long)value;
+        } else if (strcmp(key, "offset") == 0) {
+            offset = value;
+        } else if (strcmp(key, "limit") == 0) {
+            limit = value;
+        } else if (strcmp(key, "trigger") == 0) {
+            deviceTrigger = (long)value;
+        }
+        line += consumed;
+    }
+}
+
+static int smoothed(const std::vector<replaySample> &trace, size_t i) {
+    int window[REPLAY_MEDIAN_TAPS];
+    size_t count = 0;
+    for (long j = (long)i - REPLAY_MEDIAN_TAPS / 2; j <= (long)i + REPLAY_MEDIAN_TAPS / 2; j++) {
+        if ((j >= 0) && (j < (long)trace.size())) {
+            window[count++] = trace[j].raw;
+        }
+    }
+    for (size_t j = 1; j < count; j++) {
+        // Insertion sort, the window is only a handful
+        for (size_t k = j; (k > 0) && (window[k - 1] > window[k]); k--) {
+            std::swap(window[k - 1], window[k]);
+        }
+    }
+    return window[count / 2];
+}
+
+static long estimateOnset(const std::vector<replaySample> &trace, size_t from, size_t detected) {
+    // Noise of the readings before the event, robust against spikes
+    std::vector<float> deviation;
+    for (size_t i = from; i < from + (detected - from) / 2; i++) {
+        deviation.push_back(fabsf(trace[i].raw - offset));
+    }
+    float sigma = 1.0;
+    if (deviation.empty() == false) {
+        std::nth_element(deviation.begin(), deviation.begin() + deviation.size() / 2, deviation.end());
+        sigma = std::max(1.0f, deviation[deviation.size() / 2] * 1.4826f);
+    }
+
+    // Walk back from the detection until the current is within the noise
+    size_t i = detected;
+    while ((i > from) && (smoothed(trace, i) > offset + REPLAY_NOISE_SIGMAS * sigma)) {
+        i--;
+    }
+    return trace[i].micros;
+}
+
+int main(int argc, char **argv) {
+    FILE *input = stdin;
+    if ((argc > 1) && (strcmp(argv[1], "-") != 0)) {
+        input = fopen(argv[1], "r");
+        if (input == NULL) {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+    bool writeFiltered = (argc > 3) && (strcmp(argv[3], "filtered") == 0);
+
+    std::vector<replaySample> trace;
+    char line[256];
+    while (fgets(line, sizeof(line), input) != NULL) {
+        if (line[0] == '#') {
+            parseSettings(line);
+            continue;
+        }
+        replaySample sample = {0, 0, -1};
+        int fields = sscanf(line, "%ld,%d,%d", &sample.micros, &sample.raw, &sample.stall);
+        if (fields >= 2) {
+            if (fields == 2) {
+                sample.stall = -1;
+            }
+            trace.push_back(sample);
+        }
+    }
+    if (input != stdin) {
+        fclose(input);
+    }
+    if (trace.size() < 2) {
+        fprintf(stderr, "No samples\n");
+        return 1;
+    }
+
+    // Settings of the command line win over the ones of the trace
+    if (argc > 2) {
+        limit = atof(argv[2]) * CURRENT_FULL_SCALE / 100.0;
+    }
+    if (limit <= 0.0) {
+        fprintf(stderr, "No limit, give it in %% of full scale\n");
+        return 1;
+    }
+    if (offset < 0.0) {
+        // Without calibration the median of the start of the trace is taken as offset, spikes don't count
+        size_t count = std::min(trace.size() / 4, (size_t)(rate * 0.05) + 1);
+        std::vector<int> start;
+        for (size_t i = 0; i < count; i++) {
+            start.push_back(trace[i].raw);
+        }
+        std::nth_element(start.begin(), start.begin() + count / 2, start.end());
+        offset = start[count / 2];
+    }
+
+    CurrentDetector detector;
+    detector.setOffset(offset);
+    detector.begin(rate);
+    detector.arm(limit, 0);
+
+    if (writeFiltered == true) {
+        printf("micros,raw,current,event\n");
+    } else {
+        printf("event,onset,detected,latency,threshold,early\n");
+    }
+
+    unsigned int events = 0;
+    size_t from = 0;
+    long detected = -1;
+    size_t detectedIndex = 0;
+    double latencySum = 0.0;
+    long latencyMaximum = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        bool event = detector.add(trace[i].raw);
+        float current = detector.getCurrent();
+        if (writeFiltered == true) {
+            printf("%ld,%d,%.1f,%d\n", trace[i].micros, trace[i].raw, current, event ? 1 : 0);
+        }
+        if (event == true) {
+            detected = trace[i].micros;
+            detectedIndex = i;
+        }
+
+        // Wait for the filtered current alone to reach the limit, then report
+        if ((detected >= 0) && ((current >= limit) || (i == trace.size() - 1))) {
+            long threshold = (current >= limit) ? trace[i].micros : -1;
+            long onset = -1;
+            for (size_t j = from; j <= detectedIndex; j++) {
+                if ((trace[j].stall > 0) && ((j == 0) || (trace[j - 1].stall <= 0))) {
+                    onset = trace[j].micros;
+                }
+            }
+            if (onset < 0) {
+                onset = estimateOnset(trace, from, detectedIndex);
+            }
+            long latency = detected - onset;
+            events++;
+            latencySum += latency;
+            latencyMaximum = std::max(latencyMaximum, latency);
+            if (writeFiltered == false) {
+                printf("%u,%ld,%ld,%ld,%ld,%d\n", events, onset, detected, latency, threshold,
+                    detector.isEarly() ? 1 : 0);
+            }
+            detected = -1;
+            from = i;
+        }
+
+        // Arm again once the current dropped, a trace may hold several events
+        if ((detected < 0) && (detector.isTriggered() == true) && (current < CURRENT_EARLY_LEVEL * limit)) {
+            detector.arm(limit, 0);
+            from = i;
+        }
+    }
+
+    fprintf(stderr, "%zu samples at %.0f Hz, offset %.1f, limit %.1f counts\n", trace.size(), rate, offset, limit);
+    if (events > 0) {
+        fprintf(stderr, "%u events, latency %.0f us on average, %ld us at most", events, latencySum / events, latencyMaximum);
+        if (bufferSamples > 0) {
+            fprintf(stderr, ", plus up to %.0f us for the DMA buffer", 1.0e6 * bufferSamples / rate);
+        }
+        fprintf(stderr, "\n");
+    } else {
+        fprintf(stderr, "No event detected\n");
+    }
+    if (deviceTrigger >= 0) {
+        fprintf(stderr, "Device detected the last event at %ld us\n", deviceTrigger);
+    }
+    return 0;
+}
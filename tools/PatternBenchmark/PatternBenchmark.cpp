@@ -0,0 +1,527 @@
+/**
+ *   Pattern Benchmark
+ *   Host side benchmark running every pattern of the StrokeEngine across a
+ *   grid of speed, depth, stroke and sensation on the Simulator. Reports for
+ *   each point the achieved stroke rate against the commanded one, the share
+ *   of moves clipped to the machine limits, peak speed and acceleration of
+ *   the carriage, the CPU time of nextTarget(), the correction factor of
+ *   the stroke rate compensation and the highest stroke rate the pattern
+ *   claims to run at without clipping.
+ *
+ *   Build & run from the repository root:
+ *     g++ -std=gnu++17 -O2 -pthread -Ilib/Simulator/src -Ilib/StrokeEngine/src tools/PatternBenchmark/PatternBenchmark.cpp
+ *         $(find lib/Simulator/src lib/StrokeEngine/src -name '*.cpp') -o pattern_benchmark
+ *     ./pattern_benchmark [--json] [--seconds 4] [--pattern 7] [--speeds 30,60] [--depths 160] [--strokes 80] [--sensations 0]
+ *     ./pattern_benchmark --vm
+ *     ./pattern_benchmark --code pattern.asm [--pattern 9] ...
+ *
+ *   Speeds are in SPM, depths and strokes in mm. Results go to stdout as CSV,
+ *   or as JSON with --json. Strokes longer than the depth are skipped.
+ *
+ *   Achieved SPM counts full cycles of the carriage between the lower and the
+ *   upper quarter of the travel it covered, so small vibrations don't count
+ *   as strokes. Speed and acceleration are differentiated over BENCH_WINDOW_MS.
+ *   CPU time of nextTarget() is measured on the PC with the debug messages
+ *   of the patterns discarded by the log level, only its ratio between
+ *   patterns carries over to the ESP32.
+ *
+ *   --vm compares the native patterns Simple Stroke and Deeper with the same
+ *   patterns written in the bytecode of the PatternVM and run by the pattern
+ *   Custom: CPU time of nextTarget(), instructions, code size and the largest
+ *   deviation of a move in steps. The cost of a call exhausting VM_BUDGET
+ *   bounds what any code can take. --code assembles a file for Custom, prints
+ *   the T-Code lines uploading it to the OSSM and benchmarks it.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#include <Arduino.h>
+#include <Simulator.h>
+#include <StrokeEngine.h>
+#include <chrono>
+#include <vector>
+#include "../../src/OSSM_Config.h"
+#include "../../src/OSSM_PinDEF.h"
+
+#define BENCH_SETTLE_MS         1000    // Time a point runs before the measurement starts in ms
+#define BENCH_SECONDS           4       // Default duration of the measurement of each point in s
+#define BENCH_WINDOW_MS         8       // Half width of the window speed and acceleration are differentiated over in ms
+#define BENCH_MIN_TRAVEL_MM     1.0     // Less travel is considered standing still
+#define BENCH_NEXTTARGET_CALLS  1000    // Number of calls to nextTarget() timed per point
+#define BENCH_DV_BYTES          60      // Bytes of bytecode per DV line, a T-Code line holds 128 characters
+
+static motorProperties servoMotor {
+  .maxSpeed = MAX_SPEED,
+  .maxAcceleration = MAX_ACCELERATION,
+  .maxJerk = MAX_JERK,
+  .stepsPerMillimeter = (STEP_PER_MM),
+  .invertDirection = true,
+  .enableActiveLow = true,
+  .stepPin = SERVO_PULSE,
+  .directionPin = SERVO_DIR,
+  .enablePin = SERVO_ENABLE
+};
+
+static machineGeometry strokingMachine = {
+  .physicalTravel = MAX_STROKEINMM,
+  .keepoutBoundary = STROKEBOUNDARY
+};
+
+static endstopProperties endstop = {
+  .homeToBack = true,
+  .activeLow = true,
+  .endstopPin = SERVO_ENDSTOP,
+  .pinMode = INPUT_PULLUP
+};
+
+static simulatedAxis rail = {
+  .stepPin = SERVO_PULSE,
+  .railLength = int32_t(MAX_STROKEINMM * (STEP_PER_MM)),
+  .startPosition = int32_t(MAX_STROKEINMM * (STEP_PER_MM) / 2),
+  .endstopPin = SERVO_ENDSTOP,
+  .endstopActiveLow = true,
+  .endstopAtFront = false,
+  .endstopTravel = int32_t(1.0 * (STEP_PER_MM)),
+  .currentPin = -1
+};
+
+typedef struct {
+  int pattern;
+  float speed;
+  float depth;
+  float stroke;
+  float sensation;
+} benchmarkPoint;
+
+typedef struct {
+  float achievedSpm;          // Full cycles of the carriage per minute
+  unsigned int moves;         // Moves started by the pattern
+  float clippingRate;         // Share of moves clipped to the machine limits
+  float peakSpeed;            // mm/s
+  float peakAcceleration;     // mm/s²
+  float nextTargetMicros;     // Average CPU time of nextTarget() in µs
+  float nextTargetMaxMicros;  // Longest call of nextTarget() in µs
+  float rateCorrection;       // Factor the stroke rate compensation applies to the time of stroke
+  float maxSpm;               // Highest stroke rate without clipping according to getMaxStrokeRate()
+} benchmarkResult;
+
+// Deeper in the assembly of the PatternVM, sensation is mapped like Arduino's map() does
+static const char deeperSource[] =
+  "load sensation\n"
+  "abs\n"
+  "floor\n"
+  "store v1           # whole sensation without sign\n"
+  "load sensation\n"
+  "push 0\n"
+  "lt\n"
+  "jz positive\n"
+  "push 100\n"
+  "load v1\n"
+  "sub\n"
+  "push 9\n"
+  "mul\n"
+  "push 100\n"
+  "div\n"
+  "floor\n"
+  "push 2\n"
+  "add\n"
+  "jmp count\n"
+  "positive:\n"
+  "load v1\n"
+  "push 21\n"
+  "mul\n"
+  "push 100\n"
+  "div\n"
+  "floor\n"
+  "push 11\n"
+  "add\n"
+  "count:\n"
+  "store v2           # strokes of a ramp\n"
+  "load stroke\n"
+  "load v2\n"
+  "div\n"
+  "floor\n"
+  "store v3           # steps each stroke goes deeper\n"
+  "load index\n"
+  "push 2\n"
+  "div\n"
+  "floor\n"
+  "load v2\n"
+  "mod\n"
+  "push 1\n"
+  "add\n"
+  "load v3\n"
+  "mul\n"
+  "store v4           # amplitude\n"
+  "load time_of_stroke\n"
+  "push 0.5\n"
+  "mul\n"
+  "store v0\n"
+  "push 1.5\n"
+  "load v4\n"
+  "mul\n"
+  "load v0\n"
+  "div\n"
+  "floor\n"
+  "dup\n"
+  "store speed\n"
+  "push 3\n"
+  "mul\n"
+  "load v0\n"
+  "div\n"
+  "store acceleration\n"
+  "load depth\n"
+  "load stroke\n"
+  "sub\n"
+  "load index\n"
+  "push 2\n"
+  "mod\n"
+  "jz in\n"
+  "store position\n"
+  "end\n"
+  "in:\n"
+  "load v4\n"
+  "add\n"
+  "store position\n"
+  "end\n";
+
+// Spins until the budget is exhausted, the most a call of the VM can cost
+static const char spinSource[] =
+  "spin:\n"
+  "jmp spin\n";
+
+StrokeEngine Stroker;
+
+static unsigned int telemetryMoves = 0;
+static unsigned int telemetryClipped = 0;
+
+static void countMoves(float position, float speed, bool clipping) {
+  telemetryMoves++;
+  if (clipping == true) {
+    telemetryClipped++;
+  }
+}
+
+static std::vector<float> parseList(const char *list) {
+  std::vector<float> values;
+  const char *c = list;
+  while (*c != '\0') {
+    char *end;
+    values.push_back(strtof(c, &end));
+    if (end == c) {
+      break;
+    }
+    c = (*end == ',') ? end + 1 : end;
+  }
+  return values;
+}
+
+static float strokeRate(const std::vector<int32_t> &samples) {
+  int32_t low = *std::min_element(samples.begin(), samples.end());
+  int32_t high = *std::max_element(samples.begin(), samples.end());
+  if (high - low < BENCH_MIN_TRAVEL_MM * (STEP_PER_MM)) {
+    return 0.0;
+  }
+
+  // Schmitt trigger between the lower and the upper quarter of the travel
+  int32_t lowThreshold = low + (high - low) / 4;
+  int32_t highThreshold = high - (high - low) / 4;
+  bool up = (samples[0] > highThreshold);
+  unsigned int cycles = 0;
+  size_t first = 0;
+  size_t last = 0;
+  for (size_t i = 1; i < samples.size(); i++) {
+    if ((up == false) && (samples[i] > highThreshold)) {
+      up = true;
+      if (cycles++ == 0) {
+        first = i;
+      }
+      last = i;
+    } else if ((up == true) && (samples[i] < lowThreshold)) {
+      up = false;
+    }
+  }
+
+  if (cycles < 2) {
+    return 0.0;
+  }
+  return 60.0e3 * (cycles - 1) / float(last - first);
+}
+
+static void peaks(const std::vector<int32_t> &samples, float *speed, float *acceleration) {
+  const int w = BENCH_WINDOW_MS;
+  std::vector<float> velocity(samples.size(), 0.0);
+
+  // Central differences, samples are 1 ms apart
+  *speed = 0.0;
+  for (size_t i = w; i + w < samples.size(); i++) {
+    velocity[i] = (samples[i + w] - samples[i - w]) * 1.0e3 / (2 * w) / (STEP_PER_MM);
+    *speed = max(*speed, fabsf(velocity[i]));
+  }
+  *acceleration = 0.0;
+  for (size_t i = 2 * w; i + 2 * w < samples.size(); i++) {
+    *acceleration = max(*acceleration, fabsf((velocity[i + w] - velocity[i - w]) * 1.0e3f / (2 * w)));
+  }
+}
+
+static void timeNextTarget(int pattern, float *average, float *maximum) {
+  using clock = std::chrono::steady_clock;
+  double sum = 0.0;
+  *maximum = 0.0;
+
+  // The pattern still holds the parameters of the point it just ran
+  for (unsigned int i = 0; i < BENCH_NEXTTARGET_CALLS; i++) {
+    clock::time_point start = clock::now();
+    Stroker.getPatternInstance(pattern)->nextTarget(i);
+    float micros = std::chrono::duration<float, std::micro>(clock::now() - start).count();
+    sum += micros;
+    *maximum = max(*maximum, micros);
+  }
+  *average = sum / BENCH_NEXTTARGET_CALLS;
+}
+
+static bool assembleOrExit(const char *source, const char *name, uint8_t *code, size_t *length) {
+  int line = PatternVM::assemble(source, code, VM_CODE_SIZE, length);
+  if (line >= 0) {
+    fprintf(stderr, "%s: error in line %d\n", name, line);
+    exit(1);
+  }
+  return true;
+}
+
+static void printUpload(const uint8_t *code, size_t length) {
+  // DV starts over, DV+ appends, DVSET hands the code to the pattern and DVSAVE keeps it in NVS
+  for (size_t i = 0; i < length; i += BENCH_DV_BYTES) {
+    printf("%s", (i == 0) ? "DV" : "DV+");
+    for (size_t j = i; (j < length) && (j < i + BENCH_DV_BYTES); j++) {
+      printf("%02X", code[j]);
+    }
+    printf("\n");
+  }
+  printf("DVSET DVSAVE\n");
+}
+
+static void setupInstance(Pattern *pattern, float stroke, float depth, float sensation) {
+  // What the StrokeEngine injects at 60 SPM
+  pattern->setSpeedLimit((MAX_SPEED) * (STEP_PER_MM), MAX_ACCELERATION * (STEP_PER_MM), STEP_PER_MM);
+  pattern->setTimeOfStroke(1.0);
+  pattern->setStroke(stroke * (STEP_PER_MM));
+  pattern->setDepth(depth * (STEP_PER_MM));
+  pattern->setSensation(sensation);
+}
+
+static float timeCalls(Pattern *pattern) {
+  using clock = std::chrono::steady_clock;
+  clock::time_point start = clock::now();
+  for (unsigned int i = 0; i < BENCH_NEXTTARGET_CALLS; i++) {
+    pattern->nextTarget(i);
+  }
+  return std::chrono::duration<float, std::micro>(clock::now() - start).count() / BENCH_NEXTTARGET_CALLS;
+}
+
+static void compareBytecode() {
+  int custom = 0;
+  while ((custom < (int)Stroker.getNumberOfPattern() - 1) && (Stroker.getPatternName(custom) != "Custom")) {
+    custom++;
+  }
+  BytecodePattern *bytecode = static_cast<BytecodePattern *>(Stroker.getPatternInstance(custom));
+  float travel = MAX_STROKEINMM - 2 * STROKEBOUNDARY;
+  struct {
+    int native;
+    const char *source;
+  } pairs[] = {{0, patternVMSimpleStroke}, {4, deeperSource}, {-1, spinSource}};
+
+  printf("pattern,sensation,native_us,bytecode_us,ratio,max_instructions,code_bytes,max_deviation_steps,faults\n");
+  for (auto pair : pairs) {
+    uint8_t code[VM_CODE_SIZE];
+    size_t length;
+    assembleOrExit(pair.source, "builtin", code, &length);
+    for (float sensation : {-100.0f, 0.0f, 100.0f}) {
+      Pattern *native = (pair.native >= 0) ? Stroker.getPatternInstance(pair.native) : NULL;
+      bytecode->loadCode(code, length);
+      setupInstance(bytecode, travel / 2, travel, sensation);
+      bytecode->nextTarget(0);
+
+      // Moves of both must match, up to a step of rounding
+      int deviation = 0;
+      if (native != NULL) {
+        setupInstance(native, travel / 2, travel, sensation);
+        for (unsigned int i = 0; i < 200; i++) {
+          motionParameter a = native->nextTarget(i);
+          motionParameter b = bytecode->nextTarget(i);
+          deviation = max(deviation, abs(a.stroke - b.stroke));
+          deviation = max(deviation, abs(a.speed - b.speed));
+          deviation = max(deviation, abs(a.acceleration - b.acceleration));
+        }
+      }
+
+      float nativeMicros = (native != NULL) ? timeCalls(native) : 0.0;
+      float bytecodeMicros = timeCalls(bytecode);
+      patternVMStatistics statistics = bytecode->getStatistics();
+      printf("\"%s\",%.0f,%.3f,%.3f,%.1f,%u,%u,%d,%lu\n", (native != NULL) ? native->getName() : "Budget",
+        sensation, nativeMicros, bytecodeMicros, (nativeMicros > 0.0) ? bytecodeMicros / nativeMicros : 0.0,
+        statistics.maxInstructions, (unsigned int)length, deviation, statistics.faults);
+    }
+  }
+}
+
+static benchmarkResult runPoint(const benchmarkPoint *point, unsigned long seconds) {
+  benchmarkResult result = {};
+  std::vector<int32_t> samples;
+  samples.reserve(seconds * 1000);
+
+  Stroker.setPattern(point->pattern, false);
+  Stroker.setSpeed(point->speed, false);
+  Stroker.setDepth(point->depth, false);
+  Stroker.setStroke(point->stroke, false);
+  Stroker.setSensation(point->sensation, false);
+  result.maxSpm = Stroker.getMaxStrokeRate();
+  Stroker.startPattern();
+  vTaskDelay(BENCH_SETTLE_MS / portTICK_PERIOD_MS);
+
+  telemetryMoves = 0;
+  telemetryClipped = 0;
+  for (unsigned long i = 0; i < seconds * 1000; i++) {
+    vTaskDelay(1);
+    samples.push_back(Simulator.getPhysicalPosition(SERVO_PULSE));
+  }
+  result.moves = telemetryMoves;
+  result.rateCorrection = Stroker.getRateCompensation(point->pattern).correction;
+  result.clippingRate = (telemetryMoves > 0) ? float(telemetryClipped) / telemetryMoves : 0.0;
+  Stroker.stopMotion();
+
+  result.achievedSpm = strokeRate(samples);
+  peaks(samples, &result.peakSpeed, &result.peakAcceleration);
+  timeNextTarget(point->pattern, &result.nextTargetMicros, &result.nextTargetMaxMicros);
+  return result;
+}
+
+void setup() {
+  bool json = false;
+  bool vm = false;
+  const char *codeFile = NULL;
+  int onlyPattern = -1;
+  unsigned long seconds = BENCH_SECONDS;
+  float travel = MAX_STROKEINMM - 2 * STROKEBOUNDARY;
+  std::vector<float> speeds = {30.0, 60.0, 120.0, 240.0, 480.0};
+  std::vector<float> depths = {travel / 2, travel};
+  std::vector<float> strokes = {travel / 4, travel / 2, travel};
+  std::vector<float> sensations = {-100.0, -50.0, 0.0, 50.0, 100.0};
+
+  for (int i = 1; i < Simulator.argc; i++) {
+    String option = Simulator.argv[i];
+    const char *value = (i + 1 < Simulator.argc) ? Simulator.argv[i + 1] : "";
+    if (option == "--json") {
+      json = true;
+      continue;
+    } else if (option == "--vm") {
+      vm = true;
+      continue;
+    } else if (option == "--code") {
+      codeFile = value;
+    } else if (option == "--seconds") {
+      seconds = max(1L, atol(value));
+    } else if (option == "--pattern") {
+      onlyPattern = atoi(value);
+    } else if (option == "--speeds") {
+      speeds = parseList(value);
+    } else if (option == "--depths") {
+      depths = parseList(value);
+    } else if (option == "--strokes") {
+      strokes = parseList(value);
+    } else if (option == "--sensations") {
+      sensations = parseList(value);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", option.c_str());
+      exit(2);
+    }
+    i++;
+  }
+
+  // Debug output of StrokeEngine and the patterns would mix with the results
+  Serial.setOutput(NULL);
+  Simulator.attachAxis(&rail);
+  Stroker.begin(&strokingMachine, &servoMotor);
+  Stroker.registerTelemetryCallback(countMoves);
+  Stroker.enableAndHome(&endstop);
+  while (Stroker.getState() == UNDEFINED) {
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+  }
+  if (Stroker.getState() != READY) {
+    fprintf(stderr, "Homing failed\n");
+    exit(1);
+  }
+
+  if (vm == true) {
+    compareBytecode();
+    exit(0);
+  }
+  if (codeFile != NULL) {
+    FILE *file = fopen(codeFile, "r");
+    if (file == NULL) {
+      perror(codeFile);
+      exit(1);
+    }
+    std::vector<char> source(VM_CODE_SIZE * 64, '\0');
+    fread(source.data(), 1, source.size() - 1, file);
+    fclose(file);
+    uint8_t code[VM_CODE_SIZE];
+    size_t length;
+    assembleOrExit(source.data(), codeFile, code, &length);
+    Stroker.setPatternCode(code, length);
+    printUpload(code, length);
+  }
+
+  if (json == true) {
+    printf("[\n");
+  } else {
+    printf("pattern,speed_spm,depth_mm,stroke_mm,sensation,achieved_spm,moves,clipping_rate,"
+      "peak_speed_mm_s,peak_acceleration_mm_s2,next_target_us,next_target_max_us,rate_correction,max_spm\n");
+  }
+
+  bool firstPoint = true;
+  for (unsigned int p = 0; p < Stroker.getNumberOfPattern(); p++) {
+    if ((onlyPattern >= 0) && (int(p) != onlyPattern)) {
+      continue;
+    }
+    for (float speed : speeds) {
+      for (float depth : depths) {
+        for (float stroke : strokes) {
+          if (stroke > depth) {
+            continue;
+          }
+          for (float sensation : sensations) {
+            benchmarkPoint point = {int(p), speed, depth, stroke, sensation};
+            benchmarkResult result = runPoint(&point, seconds);
+
+            if (json == true) {
+              printf("%s  {\"pattern\": \"%s\", \"speed_spm\": %.1f, \"depth_mm\": %.1f, \"stroke_mm\": %.1f, "
+                "\"sensation\": %.1f, \"achieved_spm\": %.2f, \"moves\": %u, \"clipping_rate\": %.3f, "
+                "\"peak_speed_mm_s\": %.1f, \"peak_acceleration_mm_s2\": %.0f, \"next_target_us\": %.3f, "
+                "\"next_target_max_us\": %.3f, \"rate_correction\": %.3f, \"max_spm\": %.1f}", firstPoint ? "" : ",\n",
+                Stroker.getPatternName(p).c_str(), speed, depth, stroke, sensation, result.achievedSpm,
+                result.moves, result.clippingRate, result.peakSpeed, result.peakAcceleration,
+                result.nextTargetMicros, result.nextTargetMaxMicros, result.rateCorrection, result.maxSpm);
+            } else {
+              printf("\"%s\",%.1f,%.1f,%.1f,%.1f,%.2f,%u,%.3f,%.1f,%.0f,%.3f,%.3f,%.3f,%.1f\n",
+                Stroker.getPatternName(p).c_str(), speed, depth, stroke, sensation, result.achievedSpm,
+                result.moves, result.clippingRate, result.peakSpeed, result.peakAcceleration,
+                result.nextTargetMicros, result.nextTargetMaxMicros, result.rateCorrection, result.maxSpm);
+            }
+            firstPoint = false;
+            fflush(stdout);
+          }
+        }
+      }
+    }
+  }
+
+  if (json == true) {
+    printf("\n]\n");
+  }
+  exit(0);
+}
+
+void loop() {
+}
@@ -0,0 +1,123 @@
+/**
+ *   T-Code Replay
+ *   Host side benchmark replaying a command file through the T-Code parser of 
+ *   the OSSM. Reports the parsed commands per second and the maximum time it 
+ *   took to execute a single command line.
+ *
+ *   Build & run from the repository root:
+ *     g++ -O2 -Ilib/TCode/src tools/TCodeReplay/TCodeReplay.cpp lib/TCode/src/TCodeParser.cpp -o tcode_replay
+ *     ./tcode_replay [commands.txt]
+ *
+ *   Without a file a synthetic script of REPLAY_SYNTHETIC_LINES lines is replayed.
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.
+ */
+
+#include <TCodeParser.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#define REPLAY_SYNTHETIC_LINES  1000000     // Lines of the synthetic script
+
+static unsigned long moves = 0;
+static unsigned long stops = 0;
+static unsigned long queries = 0;
+static double positionSum = 0.0;
+
+static void replayMove(float position, unsigned long interval, float speed) {
+    moves++;
+    positionSum += position;
+}
+
+static void replayStop() {
+    stops++;
+}
+
+static void replayQuery(TCodeQuery query) {
+    queries++;
+}
+
+static bool loadFile(const char *path, std::vector<char> *script) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        script->insert(script->end(), chunk, chunk + count);
+    }
+    fclose(file);
+    return true;
+}
+
+static void synthesize(std::vector<char> *script) {
+    char line[64];
+    srand(1);
+    for (int i = 0; i < REPLAY_SYNTHETIC_LINES; i++) {
+        int length;
+        switch (i % 100) {
+            case 0:
+                length = snprintf(line, sizeof(line), "D0\n");
+                break;
+            case 50:
+                length = snprintf(line, sizeof(line), "L0%04dS%d R0%04d\r\n", rand() % 10000, 100 + rand() % 900, rand() % 10000);
+                break;
+            default:
+                length = snprintf(line, sizeof(line), "L0%04dI%d\n", rand() % 10000, 10 + rand() % 20);
+                break;
+        }
+        script->insert(script->end(), line, line + length);
+    }
+    const char stop[] = "DSTOP\n";
+    script->insert(script->end(), stop, stop + sizeof(stop) - 1);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<char> script;
+    TCodeParser parser;
+
+    if (argc > 1) {
+        if (loadFile(argv[1], &script) == false) {
+            fprintf(stderr, "Could not read %s\n", argv[1]);
+            return 1;
+        }
+    } else {
+        synthesize(&script);
+    }
+
+    parser.registerMoveCallback(replayMove);
+    parser.registerStopCallback(replayStop);
+    parser.registerQueryCallback(replayQuery);
+
+    // Time each newline separately, it executes the whole command line
+    double maximumMicros = 0.0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < script.size(); i++) {
+        char c = script[i];
+        if ((c == '\n') || (c == '\r')) {
+            auto start = std::chrono::steady_clock::now();
+            parser.feed(c);
+            double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            if (micros > maximumMicros) {
+                maximumMicros = micros;
+            }
+        } else {
+            parser.feed(c);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    printf("bytes:             %zu\n", script.size());
+    printf("lines executed:    %lu\n", parser.getExecuted());
+    printf("lines discarded:   %lu\n", parser.getDiscarded());
+    printf("moves / stops / queries: %lu / %lu / %lu\n", moves, stops, queries);
+    printf("mean position:     %.4f\n", moves > 0 ? positionSum / moves : 0.0);
+    printf("commands/second:   %.0f\n", parser.getExecuted() / seconds);
+    printf("max parse latency: %.2f us\n", maximumMicros);
+    return 0;
+}